@@ -92,9 +92,11 @@ typedef enum {
 
 typedef void (*external_logger)(pcp_loglvl_e, const char *);
 
+/* Logger function is process wide and may be called concurrently from
+ * threads driving different contexts, so it has to be reentrant. */
 void pcp_set_loggerfn(external_logger ext_log);
 
-// runtime level of logging
+// runtime level of logging, process wide
 extern pcp_loglvl_e pcp_log_level;
 
 typedef struct pcp_flow_s pcp_flow_t;
@@ -109,27 +111,133 @@ typedef struct pcp_socket_vt_s {
     int (*sock_close)(PCP_SOCKET sockfd);
 } pcp_socket_vt_t;
 
+/* one datagram of batched socket I/O, modeled after struct msghdr */
+typedef struct pcp_sock_msg_s {
+    void *buf;
+    size_t len;             //size of buf; set to datagram length by receive
+    struct sockaddr *addr;  //destination, or source filled by receive;
+                            //NULL on send through connected socket
+    socklen_t addrlen;      //receive: size of addr in, address length out
+    void *control;          //ancillary data (cmsg), may be NULL
+    size_t controllen;      //receive: size of control in, used length out
+    int flags;              //receive: msg_flags of the datagram (MSG_TRUNC)
+} pcp_sock_msg_t;
+
+#define PCP_SOCKET_VT_EXT_VERSION 1
+
+/*
+ * Extended socket virt. table, passed to pcp_init as &ext->base together with
+ * PCP_INIT_SOCKET_VT_EXT flag. Batch functions transfer up to cnt datagrams
+ * without blocking and return number of transferred datagrams, or negative
+ * pcp_errno (PCP_ERR_WOULDBLOCK if nothing could be transferred). NULL batch
+ * function is emulated by the matching base function, as for contexts given
+ * plain pcp_socket_vt_t. Members are only added at the end; version tells
+ * which of them are present.
+ */
+typedef struct pcp_socket_vt_ext_s {
+    pcp_socket_vt_t base;
+    uint32_t version;       //PCP_SOCKET_VT_EXT_VERSION the table is built for
+    int (*sock_sendmmsg)(PCP_SOCKET sockfd, pcp_sock_msg_t *msgs,
+            unsigned cnt, int flags);
+    int (*sock_recvmmsg)(PCP_SOCKET sockfd, pcp_sock_msg_t *msgs,
+            unsigned cnt, int flags);
+} pcp_socket_vt_ext_t;
+
 /*
  * Initialize library, optionally initiate auto-discovery of PCP servers
- *    autodiscovery  - enable/disable auto-discovery of PCP servers
+ *    autodiscovery  - enable/disable auto-discovery of PCP servers, can be
+ *                     OR-ed with PCP_INIT_* flags (bits of uint32_t)
  *    socket_vt      - optional - virt. table to override default socket functions.
  *                     Pointer has to be valid until pcp_terminate is called.
  *    return value   - pcp context used in other functions.
  */
 #define ENABLE_AUTODISCOVERY  1
 #define DISABLE_AUTODISCOVERY 0
-pcp_ctx_t *pcp_init(uint8_t autodiscovery, pcp_socket_vt_t *socket_vt);
+/*
+ * Start a dedicated I/O thread owning the socket and state machines of the
+ * context (needs library built with thread support). Flow API can be then
+ * called from any thread: pcp_new_flow, pcp_add_server, pcp_flow_get_info,
+ * pcp_eval_flow_state and pcp_set_flow_change_cb are executed by the I/O
+ * thread while caller waits (no network round trip involved), flow setters,
+ * pcp_close_flow and pcp_delete_flow are queued and return immediately.
+ * Results are reported by flow change callback called on the I/O thread,
+ * pcp_wait can be used from other threads. pcp_pulse and pcp_process must not
+ * be called by application.
+ */
+#define PCP_INIT_IO_THREAD    2
+/* socket_vt is base of pcp_socket_vt_ext_t */
+#define PCP_INIT_SOCKET_VT_EXT 4
+/*
+ * Each PCP server gets its own socket bound to server's source address and,
+ * on Linux, to interface owning that address (SO_BINDTODEVICE, which may need
+ * CAP_NET_RAW), so busy server doesn't fill receive queue of the others.
+ * Context socket is still used by servers whose socket can't be created.
+ * Custom socket virt. table creates server sockets by sock_create. Sockets
+ * are returned by pcp_get_pollfds.
+ */
+#define PCP_INIT_SOCKET_PER_SERVER 8
+/*
+ * As PCP_INIT_SOCKET_PER_SERVER, and server sockets are connected to their
+ * servers: requests are sent without address, so kernel doesn't look up
+ * route for each of them, and datagrams from other senders are dropped by
+ * kernel. Socket is reopened when server's source address changes, which is
+ * checked when sending to server fails, when not working server is pinged
+ * again and by pcp_routes_changed. Sockets of custom socket virt. table are
+ * not connected.
+ */
+#define PCP_INIT_SOCKET_CONNECTED 16
+/*
+ * Talk to IPv4 and IPv6 servers through separate AF_INET and IPv6 only
+ * sockets instead of one dual-stack socket. Done also when dual-stack socket
+ * can't be created (IPV6_V6ONLY can't be cleared) or library is built
+ * without PCP_USE_IPV6_SOCKET. If IPv6 socket can't be created, only IPv4
+ * servers can be added. pcp_get_socket returns AF_INET socket, both are
+ * returned by pcp_get_pollfds.
+ */
+#define PCP_INIT_SOCKET_SEPARATE_AF 32
+/*
+ * Linux: do socket I/O through io_uring - sockets keep multishot receives
+ * armed with buffers provided to kernel, requests are submitted in batches
+ * and completions of all sockets are read from one ring. pcp_get_socket and
+ * pcp_get_pollfds return ring fd, readable while completions wait, instead
+ * of the sockets. Silently falls back to plain socket calls if library is
+ * built without PCP_USE_IO_URING, kernel is older than 6.0 or io_uring is
+ * disabled. Ignored with custom socket virt. table.
+ */
+#define PCP_INIT_IO_URING 64
+/*
+ * No socket is created, application moves datagrams itself (see Sans-I/O
+ * below). Socket flags, PCP_INIT_IO_THREAD and socket_vt are ignored.
+ */
+#define PCP_INIT_SANS_IO 128
+pcp_ctx_t *pcp_init(uint32_t autodiscovery, pcp_socket_vt_t *socket_vt);
 
-//returns internal pcp server ID, -1 => error occurred
+/*
+ * Added (and autodiscovered) servers are probed by ANNOUNCE by the next
+ * pulse, all at once, so flows created later go out without waiting for
+ * server's response.
+ * returns internal pcp server ID, -1 => error occurred
+ */
 int pcp_add_server(pcp_ctx_t *ctx, struct sockaddr *pcp_server,
         uint8_t pcp_version);
 
 /*
  * Close socket fds and clean up all settings, frees all library buffers
  *      close_flows - signal end of flows to PCP servers
+ * If ctx has I/O thread, commands queued before are executed and the thread
+ * is stopped first. Must not be called from flow change callback then.
  */
 void pcp_terminate(pcp_ctx_t *ctx, int close_flows);
 
+/*
+ * Run fn(ctx, arg) on the I/O thread of ctx (see PCP_INIT_IO_THREAD) without
+ * waiting for its execution. Commands of one thread are executed in order of
+ * submission. fn is called directly if ctx doesn't have I/O thread, or if
+ * called from the I/O thread itself.
+ */
+typedef void (*pcp_io_cmd_fn)(pcp_ctx_t *ctx, void *arg);
+int pcp_io_submit(pcp_ctx_t *ctx, pcp_io_cmd_fn fn, void *arg);
+
 ////////////////////////////////////////////////////////////////////////////////
 //                          Flow API
 
@@ -143,7 +251,8 @@ void pcp_terminate(pcp_ctx_t *ctx, int close_flows);
  *  userdata    pointer to user data associated with a new flow
  *
  *  return value
- *  pcp_flow_t *used in other functions to reference this flow.
+ *  pcp_flow_t *used in other functions to reference this flow. Flows of
+ *  all servers are chained to it, the server with the lowest RTT first.
  */
 pcp_flow_t *pcp_new_flow(pcp_ctx_t *ctx, struct sockaddr *src_addr,
         struct sockaddr *dst_addr, struct sockaddr *ext_addr, uint8_t protocol,
@@ -235,6 +344,16 @@ typedef enum {
     pcp_state_failed
 } pcp_fstate_e;
 
+/*
+ * Options of pcp_flow_info_t.accepted_opts. Server has to echo options it
+ * processed; flow whose THIRD_PARTY, PREFER_FAILURE or FILTER option isn't
+ * echoed unchanged in success response fails with PCP_RES_UNSUPP_OPTION.
+ */
+#define PCP_OPT_THIRD_PARTY    0x01
+#define PCP_OPT_FLOW_PRIORITY  0x02
+#define PCP_OPT_PREFER_FAILURE 0x04
+#define PCP_OPT_FILTER         0x08
+
 typedef struct pcp_flow_info {
     pcp_fstate_e     result;
     struct in6_addr  pcp_server_ip;
@@ -249,6 +368,7 @@ typedef struct pcp_flow_info {
     uint16_t         dst_port;     //network byte order
     uint8_t          protocol;
     uint8_t          learned_dscp; //relevant only for flow created by pcp_learn_dscp
+    uint8_t          accepted_opts; //PCP_OPT_* echoed in last success response
 } pcp_flow_info_t;
 
 // Allocates info_buf by malloc, has to be freed by client when longer needed.
@@ -262,6 +382,29 @@ typedef void (*pcp_flow_change_notify)(pcp_flow_t *f, struct sockaddr *src_addr,
 void pcp_set_flow_change_cb(pcp_ctx_t *ctx, pcp_flow_change_notify cb_fun,
         void *cb_arg);
 
+/*
+ * Batched flow state notifications. When set, state changes are collected
+ * while pcp_pulse/pcp_process runs and delivered by single call after the
+ * processing is done, instead of calling pcp_flow_change_notify from
+ * within the state machine. Multiple changes of one flow are coalesced,
+ * only its latest state is reported. Array is valid only during the call.
+ * Flows deleted before delivery are not reported. If a change couldn't be
+ * queued (no memory), the callback is called once more with count 0 and
+ * changes NULL; states of flows have to be read by pcp_eval_flow_state then.
+ */
+typedef struct pcp_flow_change {
+    pcp_flow_t *flow;
+    pcp_fstate_e state;
+    void *user_data;
+} pcp_flow_change_t;
+
+typedef void (*pcp_flow_change_batch_notify)(pcp_ctx_t *ctx,
+        const pcp_flow_change_t *changes, size_t count, void *cb_arg);
+
+// NULL cb_fun switches back to pcp_flow_change_notify callback
+void pcp_set_flow_change_batch_cb(pcp_ctx_t *ctx,
+        pcp_flow_change_batch_notify cb_fun, void *cb_arg);
+
 /* evaluate flow state
  * params:
  *   flow (in)    - handle of the flow
@@ -286,7 +429,97 @@ int pcp_eval_flow_state(pcp_flow_t *flow, pcp_fstate_e *fstate);
 int pcp_pulse(pcp_ctx_t *ctx, struct timeval *next_timeout);
 
 /*
- * Get socket used to communicate with PCP server.
+ * pcp_pulse_budget - pcp_pulse doing limited amount of work. Server events
+ * touching all flows (sending of queued requests when server answers,
+ * server restart, timeout checks) stop once the budget is spent and
+ * continue by the next call from where they stopped. Unlike pcp_pulse,
+ * which reads one datagram, waiting responses are read until the budget is
+ * spent; each response read counts as one flow.
+ * params:
+ *   budget       - limits, NULL => no limits (same as pcp_pulse)
+ *   pending(out) - optional, set to nonzero if work was left for next call,
+ *                  which should be done soon; return value is 0 then
+ */
+typedef struct pcp_budget {
+    uint32_t max_flows; //responses read and flows visited by state
+                        //machines, 0 => no limit
+    uint32_t max_usec;  //time limit, 0 => no limit, at least one flow is
+                        //processed by call
+} pcp_budget_t;
+
+int pcp_pulse_budget(pcp_ctx_t *ctx, const pcp_budget_t *budget,
+        struct timeval *next_timeout, int *pending);
+
+/*
+ * Timing statistics of the context, in microseconds. Responses are stamped by
+ * kernel when they arrive (SO_TIMESTAMPNS), or when library reads them if the
+ * socket (virt. table) doesn't provide receive timestamps.
+ */
+typedef struct pcp_io_stats {
+    //round trip time to the server, sampled only from requests answered
+    //without retransmission
+    uint32_t rtt_samples;
+    uint32_t rtt_last_us;
+    uint32_t rtt_min_us;
+    uint32_t rtt_srtt_us;      //smoothed RTT as in RFC 6298
+    uint32_t rtt_var_us;       //RTT variation
+    //time received datagrams waited in socket queue, whole context
+    uint64_t rx_msgs;          //received datagrams
+    uint64_t rx_kernel_ts;     //of them with kernel or pcp_ctx_input timestamp
+    uint32_t queue_last_us;
+    uint32_t queue_max_us;
+    uint64_t queue_total_us;   //average is queue_total_us / rx_kernel_ts
+} pcp_io_stats_t;
+
+/*
+ * Get timing statistics of the context and RTT of server pcp_server (index
+ * returned by pcp_add_server), RTT fields are zero for negative pcp_server.
+ * Returns PCP_ERR_SUCCESS or PCP_ERR_BAD_ARGS if there is no such server.
+ */
+int pcp_get_io_stats(pcp_ctx_t *ctx, int pcp_server, pcp_io_stats_t *stats);
+
+/*
+ * Set receive buffer size (SO_RCVBUF) of socket of server pcp_server (see
+ * PCP_INIT_SOCKET_PER_SERVER), or of context sockets for negative pcp_server.
+ * Size is remembered and applied also to socket opened when the server is
+ * added again.
+ *    return value - PCP_ERR_SUCCESS, PCP_ERR_NOT_FOUND if server uses context
+ *                   socket, PCP_ERR_BAD_ARGS or PCP_ERR_UNKNOWN on error
+ */
+int pcp_set_rcvbuf(pcp_ctx_t *ctx, int pcp_server, int bytes);
+
+/*
+ * Tell library that routing has changed. Cached source addresses of
+ * destinations are dropped (without route monitor they are kept for 5
+ * seconds) and source addresses of servers are looked up again. Flows
+ * whose internal address was not given by application (NULL or unspecified
+ * src_addr of pcp_new_flow) and was taken from server whose address changed
+ * are mapped again from the new one; own sockets of such servers
+ * (PCP_INIT_SOCKET_PER_SERVER) are reopened.
+ *    return value - number of servers whose source address changed or whose
+ *                   socket was opened, negative value on error
+ */
+int pcp_routes_changed(pcp_ctx_t *ctx);
+
+/*
+ * Subscribe to routing and address changes of the system (Linux netlink),
+ * so pcp_routes_changed is done by library whenever they occur. With
+ * autodiscovery new default gateways are added as PCP servers, and those
+ * whose route was removed are handled as not responding servers (their
+ * flows are no longer succeeded); not working gateway whose route came back
+ * is pinged right away. Notification fd is returned by pcp_get_pollfds with
+ * PCP_EV_ROUTE, pcp_pulse and pcp_wait read it as well. It's closed by
+ * pcp_terminate. Shards of pcp_shards_init use
+ * pcp_shards_enable_route_monitor instead.
+ *    return value - PCP_ERR_SUCCESS, PCP_ERR_NOT_FOUND if not supported
+ *                   by platform, PCP_ERR_UNKNOWN on error
+ */
+int pcp_enable_route_monitor(pcp_ctx_t *ctx);
+
+/*
+ * Get socket used to communicate with PCP server. With
+ * PCP_INIT_SOCKET_PER_SERVER there are more of them, use pcp_get_pollfds.
+ * With PCP_INIT_IO_URING it's fd of the ring, to be used for waiting only.
  */
 PCP_SOCKET pcp_get_socket(pcp_ctx_t *ctx);
 
@@ -305,6 +538,119 @@ PCP_SOCKET pcp_get_socket(pcp_ctx_t *ctx);
  } while (1);
  */
 
+////////////////////////////////////////////////////////////////////////////////
+//                      Reactor integration
+/*
+ * Alternative to pcp_pulse for applications running their own event loop
+ * (epoll, libuv, libevent, ...). Library tracks its next deadline itself, so
+ * loop doesn't need to recalculate timeouts on every wakeup:
+ *  1. register fds returned by pcp_get_pollfds for reading,
+ *  2. when any of them becomes readable call pcp_process with events
+ *     of that fd (or PCP_EV_READ|PCP_EV_TIMER if unsure),
+ *  3. without a timer fd, call pcp_process(ctx, PCP_EV_TIMER) when the time
+ *     returned by the previous pcp_process call elapses.
+ */
+#define PCP_EV_READ  0x01 /* PCP socket is readable */
+#define PCP_EV_TIMER 0x02 /* timer fd is readable / deadline elapsed */
+#define PCP_EV_ROUTE 0x04 /* route notifications are readable */
+
+typedef struct pcp_pollfd {
+    PCP_SOCKET fd;
+    int events;    /* one of PCP_EV_* - pass to pcp_process */
+} pcp_pollfd_t;
+
+/*
+ * Create a timer fd (Linux timerfd), which is armed by library at its next
+ * deadline. It's returned by pcp_get_pollfds and closed by pcp_terminate.
+ *    return value - PCP_ERR_SUCCESS, PCP_ERR_NOT_FOUND if not supported
+ *                   by platform.
+ */
+int pcp_enable_timerfd(pcp_ctx_t *ctx);
+
+/*
+ * Fill fds by up to max_fds descriptors to be polled for reading: context
+ * socket (and IPv6 one, see PCP_INIT_SOCKET_SEPARATE_AF), own sockets of
+ * servers, timer fd and route notification fd (pcp_enable_route_monitor).
+ * Their set changes when servers are added.
+ *    return value - number of descriptors library uses (can be bigger than
+ *                   max_fds), negative value on error
+ */
+int pcp_get_pollfds(pcp_ctx_t *ctx, pcp_pollfd_t *fds, int max_fds);
+
+/*
+ * Get absolute time (gettimeofday based) of the next library deadline.
+ * deadline is zeroed if there is none.
+ *    return value - ms to the deadline, -1 if no deadline is pending
+ */
+int pcp_get_deadline(pcp_ctx_t *ctx, struct timeval *deadline);
+
+/*
+ * Process ready events only: drain socket if PCP_EV_READ is set, read route
+ * notifications if PCP_EV_ROUTE is set and handle timeouts of servers and
+ * flows whose deadline has elapsed.
+ *    return value - ms to the next deadline (usable as epoll_wait timeout),
+ *                   -1 if no deadline is pending
+ */
+int pcp_process(pcp_ctx_t *ctx, int events);
+
+//example of reactor interface use with epoll:
+/*
+ pcp_ctx_t *ctx=pcp_init(1, NULL);
+ pcp_pollfd_t pfds[2];
+ int i, n;
+
+ pcp_enable_timerfd(ctx);
+ n=pcp_get_pollfds(ctx, pfds, 2);
+ for (i=0; i < n; ++i) {
+   struct epoll_event ev={EPOLLIN, {.u32=pfds[i].events}};
+   epoll_ctl(epfd, EPOLL_CTL_ADD, pfds[i].fd, &ev);
+ }
+ pcp_flow_t f=pcp_new_flow(ctx,...);
+ do {
+   struct epoll_event evs[2];
+   int events=0;
+   n=epoll_wait(epfd, evs, 2, -1);
+   for (i=0; i < n; ++i) {
+     events|=evs[i].data.u32;
+   }
+   pcp_process(ctx, events);
+ } while (1);
+ */
+
+////////////////////////////////////////////////////////////////////////////////
+//                      Sans-I/O
+/*
+ * Context created with PCP_INIT_SANS_IO has no socket; application running
+ * its own packet I/O takes encoded requests by pcp_ctx_poll_transmit and
+ * passes received responses to pcp_ctx_input. Timeouts are driven by
+ * pcp_get_deadline and pcp_process(ctx, PCP_EV_TIMER). Requests are queued
+ * by any call running state machines (pcp_new_flow, pcp_process,
+ * pcp_ctx_input, ...), so transmit queue should be polled after each of
+ * them. Requests which don't fit the queue are dropped and retransmitted
+ * later. pcp_wait can't be used.
+ */
+
+/*
+ * Take up to cnt queued requests. For each of msgs set buf and len to
+ * buffer of at least 1100 bytes, addr and addrlen to space for destination
+ * address (sockaddr_storage), as for receive; they are set to the request
+ * and address of its PCP server.
+ *    return value - number of requests taken, PCP_ERR_MAX_SIZE if the first
+ *                   one doesn't fit buf, PCP_ERR_NOT_FOUND without
+ *                   PCP_INIT_SANS_IO
+ */
+int pcp_ctx_poll_transmit(pcp_ctx_t *ctx, pcp_sock_msg_t *msgs, unsigned cnt);
+
+/*
+ * Process a datagram received from PCP server from. ts is the time it
+ * arrived (e.g. NIC timestamp), NULL => now; time since then is accounted as
+ * queue delay of pcp_get_io_stats.
+ *    return value - ms to the next deadline as by pcp_process, negative
+ *                   pcp_errno if datagram is not accepted
+ */
+int pcp_ctx_input(pcp_ctx_t *ctx, const void *buf, size_t len,
+        const struct sockaddr *from, const struct timeval *ts);
+
 ////////////////////////////////////////////////////////////////////////////////
 // Blocking wait for flow reaching one of exit states or time-out(ms)
 // expiration.
@@ -326,6 +672,111 @@ pcp_fstate_e pcp_wait(pcp_flow_t *flow, int timeout, int exit_on_partial_res);
     pcp_wait(f, 500, 0);  // send PCP msg and wait for response for 500 ms
  */
 
+////////////////////////////////////////////////////////////////////////////////
+//                      Completion queue
+/*
+ * Per context queue of flow results, alternative to flow change callbacks,
+ * pcp_wait and polling of pcp_eval_flow_state. Library appends fixed size
+ * records while running state machines; any thread can take them by
+ * pcp_cq_reap, also several threads at once. On Linux the fd returned by
+ * pcp_cq_get_fd becomes readable when records are available. If the queue is
+ * full, new records are dropped and counted by pcp_cq_overflow.
+ */
+typedef enum {
+    pcp_cq_succeeded,       // flow got mapping, ext_ip/ext_port are valid
+    pcp_cq_failed,          // see result_code, short lifetime errors included
+    pcp_cq_renewed,         // lifetime of unchanged mapping was renewed
+    pcp_cq_mapping_changed  // server assigned different external address
+} pcp_cq_event_e;
+
+typedef struct pcp_completion {
+    pcp_flow_t      *flow;        //may be already deleted, don't dereference
+    void            *user_data;   //userdata of pcp_new_flow
+    pcp_cq_event_e  event;
+    uint8_t         result_code;  //PCP result code of last response
+    uint16_t        ext_port;     //network byte order
+    struct in6_addr ext_ip;
+    time_t          lifetime_end; //mapping expiration
+} pcp_completion_t;
+
+/*
+ * Enable completion queue of ctx.
+ *    entries      - capacity, rounded up to power of 2, 0 => default (1024)
+ *    return value - PCP_ERR_SUCCESS, PCP_ERR_BAD_ARGS if already enabled
+ */
+int pcp_cq_init(pcp_ctx_t *ctx, uint32_t entries);
+
+// fd to poll for reading, invalid socket if not supported by platform
+PCP_SOCKET pcp_cq_get_fd(pcp_ctx_t *ctx);
+
+// move up to max records to cqes, returns count of records taken
+size_t pcp_cq_reap(pcp_ctx_t *ctx, pcp_completion_t *cqes, size_t max);
+
+// number of records dropped because the queue was full
+uint64_t pcp_cq_overflow(pcp_ctx_t *ctx);
+
+////////////////////////////////////////////////////////////////////////////////
+//                      Sharded contexts
+/*
+ * Manager owning several contexts ("shards"), each with its own socket and
+ * I/O thread pinned to a CPU (needs library built with thread support).
+ * Flows are assigned to shards by hash of their key, returned flow handles
+ * are ordinary ones and can be used with any flow function. PCP servers are
+ * added to all shards; with autodiscovery only the first shard looks for
+ * gateways and others copy its servers. Gateways changed later are followed
+ * by all shards only with pcp_shards_enable_route_monitor.
+ */
+typedef struct pcp_shards_s pcp_shards_t;
+
+/*   pcp_shards_init
+ *     shards         - number of contexts, <=0 => one per online CPU
+ *     autodiscovery  - ENABLE_AUTODISCOVERY or DISABLE_AUTODISCOVERY, can be
+ *                      OR-ed with PCP_INIT_SOCKET_VT_EXT,
+ *                      PCP_INIT_SOCKET_PER_SERVER,
+ *                      PCP_INIT_SOCKET_CONNECTED,
+ *                      PCP_INIT_SOCKET_SEPARATE_AF and PCP_INIT_IO_URING
+ *     socket_vt      - optional socket virt. table, used for all shards
+ *     return value   - NULL if library is built without thread support or
+ *                      on error
+ */
+pcp_shards_t *pcp_shards_init(int shards, uint32_t autodiscovery,
+        pcp_socket_vt_t *socket_vt);
+
+int pcp_shards_count(pcp_shards_t *sh);
+
+pcp_ctx_t *pcp_shards_get_ctx(pcp_shards_t *sh, int shard);
+
+// add PCP server to all shards, returns server ID or error code
+int pcp_shards_add_server(pcp_shards_t *sh, struct sockaddr *pcp_server,
+        uint8_t pcp_version);
+
+/*
+ * pcp_enable_route_monitor for all shards. Each of them reads notifications
+ * itself; with autodiscovery all shards add new gateways and disable those
+ * whose route was removed. Route monitor of single shard (enabled by
+ * pcp_enable_route_monitor on context of pcp_shards_get_ctx) changes
+ * servers of that shard only.
+ *    return value - PCP_ERR_SUCCESS or first error of shards
+ */
+int pcp_shards_enable_route_monitor(pcp_shards_t *sh);
+
+// pcp_new_flow on shard selected by src/dst address and protocol
+pcp_flow_t *pcp_shards_new_flow(pcp_shards_t *sh, struct sockaddr *src_addr,
+        struct sockaddr *dst_addr, struct sockaddr *ext_addr, uint8_t protocol,
+        uint32_t lifetime, void *userdata);
+
+/*
+ * Flow change callback for flows of all shards. Calls are serialized, i.e.
+ * cb_fun is never run by two shard threads at once. It must not call
+ * functions waiting for other shards (pcp_shards_new_flow,
+ * pcp_shards_add_server, pcp_wait...); flow setters, pcp_close_flow and
+ * pcp_delete_flow are fine.
+ */
+void pcp_shards_set_flow_change_cb(pcp_shards_t *sh,
+        pcp_flow_change_notify cb_fun, void *cb_arg);
+
+void pcp_shards_terminate(pcp_shards_t *sh, int close_flows);
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
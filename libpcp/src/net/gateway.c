@@ -108,166 +108,511 @@
 #ifdef USE_NETLINK
 
 #define BUFSIZE 8192
+#define NL_MAX_NEXTHOPS 16
+#define NL_DUMP_TRIES 3
+#define NL_DUMP_BUFSIZE 32768 //kernel fills dump datagrams up to it
 
-static ssize_t readNlSock(int sockFd, char *bufPtr, unsigned seqNum,
-        unsigned pId)
+#ifndef NETLINK_GET_STRICT_CHK
+#define NETLINK_GET_STRICT_CHK 12
+#endif
+
+static void nl_fill_gateway(struct sockaddr_in6 *gw, struct rtattr *rtAttr,
+        int family, unsigned int scope_id)
 {
-    struct nlmsghdr *nlHdr;
-    ssize_t readLen=0, msgLen=0;
+    memset(gw, 0, sizeof(*gw));
+    memcpy(&gw->sin6_addr, RTA_DATA(rtAttr), RTA_PAYLOAD(rtAttr));
+    if (family == AF_INET) {
+        TO_IPV6MAPPED(&gw->sin6_addr);
+    }
+    gw->sin6_family=AF_INET6;
+    gw->sin6_scope_id=scope_id;
+    SET_SA_LEN(gw, sizeof(struct sockaddr_in6))
+}
 
-    do {
-        /* Receive response from the kernel */
-        readLen=recv(sockFd, bufPtr, BUFSIZE - msgLen, 0);
-        if (readLen == -1) {
-            char errmsg[128];
-            pcp_strerror(errno, errmsg, sizeof(errmsg));
-            PCP_LOG(PCP_LOGLVL_DEBUG, "SOCK READ: %s", errmsg);
-            return -1;
-        }
+/* gateways of default route in main table (more of them for multipath
+ * route), v4-mapped for IPv4; returns their count, 0 if the message is not
+ * such route */
+static int nl_route_gateways(struct nlmsghdr *nlMsg, struct sockaddr_in6 *gws,
+        int max)
+{
+    struct rtmsg *rtMsg;
+    struct rtattr *rtAttr;
+    struct rtattr *gwAttr=NULL, *mpAttr=NULL;
+    int rtLen;
+    unsigned int scope_id=0;
+    int cnt=0;
+
+    if (nlMsg->nlmsg_len < NLMSG_LENGTH(sizeof(struct rtmsg))) {
+        return 0;
+    }
+    rtMsg=(struct rtmsg *)NLMSG_DATA(nlMsg);
+
+    /* header is enough to skip routes of the rest of routing table, their
+       attributes are not parsed */
+    if (((rtMsg->rtm_family != AF_INET) && (rtMsg->rtm_family != AF_INET6))
+            || (rtMsg->rtm_table != RT_TABLE_MAIN)
+            || (rtMsg->rtm_dst_len != 0)) {
+        return 0;
+    }
 
-        nlHdr=(struct nlmsghdr *)bufPtr;
+    /* get the rtattr field */
+    rtAttr=(struct rtattr *)RTM_RTA(rtMsg);
+    rtLen=RTM_PAYLOAD(nlMsg);
+    for (; RTA_OK(rtAttr,rtLen); rtAttr=RTA_NEXT(rtAttr,rtLen)) {
+        size_t rtaLen=RTA_PAYLOAD(rtAttr);
 
-        /* Check if the header is valid */
-        if ((NLMSG_OK(nlHdr, (unsigned)readLen) == 0)
-                || (nlHdr->nlmsg_type == NLMSG_ERROR)) {
-            PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Error in received packet");
-            return -1;
+        if (rtAttr->rta_type == RTA_OIF) {
+            if (rtaLen == sizeof(unsigned int)) {
+                memcpy(&scope_id, RTA_DATA(rtAttr), sizeof(unsigned int));
+            }
+        } else if (rtAttr->rta_type == RTA_GATEWAY) {
+            if (rtaLen <= sizeof(struct in6_addr)) {
+                gwAttr=rtAttr;
+            }
+        } else if (rtAttr->rta_type == RTA_MULTIPATH) {
+            mpAttr=rtAttr;
         }
+    }
 
-        /* Check if the its the last message */
-        if (nlHdr->nlmsg_type == NLMSG_DONE) {
-            break;
-        } else {
-            /* Else move the pointer to buffer appropriately */
-            bufPtr+=readLen;
-            msgLen+=readLen;
+    if ((gwAttr) && (max > 0)) {
+        nl_fill_gateway(gws + cnt++, gwAttr, rtMsg->rtm_family, scope_id);
+    }
+    if (mpAttr) {
+        struct rtnexthop *nh=(struct rtnexthop *)RTA_DATA(mpAttr);
+        int mpLen=RTA_PAYLOAD(mpAttr);
+
+        for (; RTNH_OK(nh, mpLen) && (cnt < max);
+                mpLen-=NLMSG_ALIGN(nh->rtnh_len), nh=RTNH_NEXT(nh)) {
+            int nhLen=nh->rtnh_len - sizeof(*nh);
+
+            for (rtAttr=RTNH_DATA(nh); RTA_OK(rtAttr, nhLen);
+                    rtAttr=RTA_NEXT(rtAttr, nhLen)) {
+                if ((rtAttr->rta_type == RTA_GATEWAY)
+                        && (RTA_PAYLOAD(rtAttr) <= sizeof(struct in6_addr))) {
+                    nl_fill_gateway(gws + cnt++, rtAttr, rtMsg->rtm_family,
+                            nh->rtnh_ifindex);
+                    break;
+                }
+            }
         }
+    }
+
+    return cnt;
+}
+
+/* destination of route message, v4-mapped for IPv4; returns its prefix
+ * length in bits of IPv6 address, -1 if the message is not IP route */
+static int nl_route_dst(struct nlmsghdr *nlMsg, struct sockaddr_in6 *dst)
+{
+    struct rtmsg *rtMsg;
+    struct rtattr *rtAttr;
+    int rtLen;
+
+    if (nlMsg->nlmsg_len < NLMSG_LENGTH(sizeof(struct rtmsg))) {
+        return -1;
+    }
+    rtMsg=(struct rtmsg *)NLMSG_DATA(nlMsg);
+    if ((rtMsg->rtm_family != AF_INET) && (rtMsg->rtm_family != AF_INET6)) {
+        return -1;
+    }
 
-        /* Check if its a multi part message */
-        if ((nlHdr->nlmsg_flags & NLM_F_MULTI) == 0) {
-            /* return if its not */
+    memset(dst, 0, sizeof(*dst));
+    dst->sin6_family=AF_INET6;
+    SET_SA_LEN(dst, sizeof(struct sockaddr_in6))
+    rtAttr=(struct rtattr *)RTM_RTA(rtMsg);
+    rtLen=RTM_PAYLOAD(nlMsg);
+    for (; RTA_OK(rtAttr,rtLen); rtAttr=RTA_NEXT(rtAttr,rtLen)) {
+        if ((rtAttr->rta_type == RTA_DST)
+                && (RTA_PAYLOAD(rtAttr) <= sizeof(struct in6_addr))) {
+            memcpy(&dst->sin6_addr, RTA_DATA(rtAttr), RTA_PAYLOAD(rtAttr));
             break;
         }
-    } while ((nlHdr->nlmsg_seq != seqNum) || (nlHdr->nlmsg_pid != pId));
-    return msgLen;
+    }
+    if (rtMsg->rtm_family == AF_INET) {
+        TO_IPV6MAPPED(&dst->sin6_addr);
+        return rtMsg->rtm_dst_len + 96;
+    }
+
+    return rtMsg->rtm_dst_len;
 }
 
-int getgateways(struct sockaddr_in6 **gws)
+/* receives next datagram, one syscall per datagram. Truncated one is lost,
+ * so -1 with EMSGSIZE is returned and *size is set to its length, dump has
+ * to be repeated with bigger buffer */
+static ssize_t nl_recv(int sock, char *buf, size_t *size)
 {
-    struct nlmsghdr *nlMsg;
-    char msgBuf[BUFSIZE];
-
-    int sock, msgSeq=0;
+    struct iovec iov;
+    struct msghdr msg;
     ssize_t len;
-    int ret;
 
-    if (!gws) {
-        return PCP_ERR_BAD_ARGS;
+    do {
+        iov.iov_base=buf;
+        iov.iov_len=*size;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov=&iov;
+        msg.msg_iovlen=1;
+        // with MSG_TRUNC netlink returns real length of the datagram
+        len=recvmsg(sock, &msg, MSG_TRUNC);
+    } while ((len < 0) && (errno == EINTR));
+
+    if ((len >= 0) && (msg.msg_flags & MSG_TRUNC)) {
+        *size=len;
+        errno=EMSGSIZE;
+        return -1;
+    }
+    return len;
+}
+
+static int add_gateways(struct sockaddr_in6 **gws, int cnt,
+        struct sockaddr_in6 *gw, int gw_cnt)
+{
+    struct sockaddr_in6 *tmp_gws;
+
+    tmp_gws=(struct sockaddr_in6 *)realloc(*gws,
+            sizeof(struct sockaddr_in6) * (cnt + gw_cnt));
+    if (!tmp_gws) {
+        PCP_LOG(PCP_LOGLVL_ERR, "%s", "Error allocating memory");
+        return PCP_ERR_NO_MEM;
     }
+    *gws=tmp_gws;
+    memcpy(*gws + cnt, gw, sizeof(*gw) * gw_cnt);
+
+    return cnt + gw_cnt;
+}
+
+/* handler of route message of dump, negative pcp_errno stops the dump */
+typedef int (*nl_route_fn)(struct nlmsghdr *nlMsg, void *arg);
+
+/* dumps routing table of family (AF_UNSPEC for both), fn is called for
+ * every route; datagrams are parsed one by one as they come, so memory use
+ * doesn't depend on size of the table. With strict checking kernel skips
+ * routes of other tables than main one and non-unicast ones itself; it
+ * can't filter by prefix. *intr is set if routing changed during dump or
+ * datagram didn't fit *bufsize (it's raised then) - fn may miss some
+ * routes. Returns 0 or negative pcp_errno */
+static int nl_dump_routes(int family, int strict, int *intr,
+        size_t *bufsize, nl_route_fn fn, void *arg)
+{
+    struct {
+        struct nlmsghdr nh;
+        struct rtmsg rt;
+    } req;
+    char *buf=NULL;
+    size_t size=*bufsize;
+    int sock, done=0;
+    int ret=0;
 
     /* Create Socket */
-    sock=socket(PF_NETLINK, SOCK_DGRAM, NETLINK_ROUTE);
+    sock=socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
     if (sock < 0) {
         PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Netlink Socket Creation Failed...");
         return PCP_ERR_UNKNOWN;
     }
+    if ((strict) && (setsockopt(sock, SOL_NETLINK, NETLINK_GET_STRICT_CHK,
+            &strict, sizeof(strict)))) {
+        strict=0;
+    }
 
-    /* Initialize the buffer */
-    memset(msgBuf, 0, BUFSIZE);
-
-    /* point the header and the msg structure pointers into the buffer */
-    nlMsg=(struct nlmsghdr *)msgBuf;
-
-    /* Fill in the nlmsg header*/
-    nlMsg->nlmsg_len=NLMSG_LENGTH(sizeof(struct rtmsg)); // Length of message.
-    nlMsg->nlmsg_type=RTM_GETROUTE; // Get the routes from kernel routing table.
-
-    nlMsg->nlmsg_flags=NLM_F_DUMP | NLM_F_REQUEST; // The message is a request for dump.
-    nlMsg->nlmsg_seq=msgSeq++; // Sequence of the message packet.
-    nlMsg->nlmsg_pid=getpid(); // PID of process sending the request.
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len=NLMSG_LENGTH(sizeof(struct rtmsg));
+    req.nh.nlmsg_type=RTM_GETROUTE;
+    req.nh.nlmsg_flags=NLM_F_DUMP | NLM_F_REQUEST;
+    req.nh.nlmsg_seq=1;
+    req.rt.rtm_family=family;
+    if (strict) {
+        req.rt.rtm_table=RT_TABLE_MAIN;
+        req.rt.rtm_type=RTN_UNICAST;
+    }
 
     /* Send the request */
-    len=send(sock, nlMsg, nlMsg->nlmsg_len, 0);
-    if (len == -1) {
+    if (send(sock, &req, req.nh.nlmsg_len, 0) < 0) {
         PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Write To Netlink Socket Failed...");
         ret=PCP_ERR_SEND_FAILED;
         goto end;
     }
 
-    /* Read the response */
-    len=readNlSock(sock, msgBuf, msgSeq, getpid());
-    if (len < 0) {
-        PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Read From Netlink Socket Failed...");
-        ret=PCP_ERR_RECV_FAILED;
+    buf=(char *)malloc(size);
+    if (!buf) {
+        ret=PCP_ERR_NO_MEM;
         goto end;
     }
-    /* Parse and print the response */
-    ret=0;
-
-    for (; NLMSG_OK(nlMsg,(unsigned)len); nlMsg=NLMSG_NEXT(nlMsg,len)) {
-        struct rtmsg *rtMsg;
-        struct rtattr *rtAttr;
-        int rtLen;
-        unsigned int scope_id = 0;
-        struct in6_addr addr;
-        int found = 0;
-        rtMsg=(struct rtmsg *)NLMSG_DATA(nlMsg);
-
-        /* If the route is not for AF_INET(6) or does not belong to main
-           routing table then return. */
-        if (((rtMsg->rtm_family != AF_INET) && (rtMsg->rtm_family != AF_INET6))
-                || (rtMsg->rtm_table != RT_TABLE_MAIN)) {
-            continue;
+
+    while ((!done) && (ret >= 0)) {
+        struct nlmsghdr *nlMsg;
+        ssize_t len=nl_recv(sock, buf, &size);
+
+        if ((len < 0) && (errno == EMSGSIZE)) {
+            *bufsize=size;
+            *intr=1;
+            break;
+        }
+        if (len < 0) {
+            char errmsg[128];
+            pcp_strerror(errno, errmsg, sizeof(errmsg));
+            PCP_LOG(PCP_LOGLVL_DEBUG, "SOCK READ: %s", errmsg);
+            ret=PCP_ERR_RECV_FAILED;
+            break;
         }
 
-        /* get the rtattr field */
-        rtAttr=(struct rtattr *)RTM_RTA(rtMsg);
-        rtLen=RTM_PAYLOAD(nlMsg);
-        for (; RTA_OK(rtAttr,rtLen); rtAttr=RTA_NEXT(rtAttr,rtLen)) {
-            size_t rtaLen=RTA_PAYLOAD(rtAttr);
-            if (rtaLen > sizeof(struct in6_addr)) {
+        nlMsg=(struct nlmsghdr *)buf;
+        for (; NLMSG_OK(nlMsg,(unsigned)len); nlMsg=NLMSG_NEXT(nlMsg,len)) {
+            if (nlMsg->nlmsg_seq != req.nh.nlmsg_seq) {
                 continue;
             }
-            if (rtAttr->rta_type == RTA_OIF) {
-                memcpy(&scope_id, RTA_DATA(rtAttr), sizeof(unsigned int));
-            } else if (rtAttr->rta_type == RTA_GATEWAY) {
-                memset(&addr, 0, sizeof(struct in6_addr));
-                memcpy(&addr, RTA_DATA(rtAttr), rtaLen);
-                if (rtMsg->rtm_family == AF_INET) {
-                    TO_IPV6MAPPED(&addr);
-                }
-                found=1;
+            if (nlMsg->nlmsg_flags & NLM_F_DUMP_INTR) {
+                *intr=1;
             }
-        }
-        if (found) {
-            struct sockaddr_in6 *tmp_gws;
-            tmp_gws=(struct sockaddr_in6 *)realloc(*gws,
-                    sizeof(struct sockaddr_in6) * (ret + 1));
-            if (!tmp_gws) {
-                PCP_LOG(PCP_LOGLVL_ERR, "%s",
-                        "Error allocating memory");
-                if (*gws) {
-                    free(*gws);
-                    *gws=NULL;
-                }
-                ret=PCP_ERR_NO_MEM;
-                goto end;
+            if (nlMsg->nlmsg_type == NLMSG_DONE) {
+                done=1;
+                break;
+            }
+            if (nlMsg->nlmsg_type == NLMSG_ERROR) {
+                PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Error in received packet");
+                ret=PCP_ERR_RECV_FAILED;
+                break;
+            }
+            ret=fn(nlMsg, arg);
+            if (ret < 0) {
+                break;
             }
-            *gws=tmp_gws;
-            (*gws + ret)->sin6_family=AF_INET6;
-            memcpy(&((*gws + ret)->sin6_addr), &addr, sizeof(addr));
-            (*gws + ret)->sin6_scope_id=scope_id;
-            SET_SA_LEN(*gws + ret, sizeof(struct sockaddr_in6))
-            ret++;
         }
     }
+
 end:
+    free(buf);
     if (close(sock)) {
         PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Close socket error");
     }
     return ret;
 }
 
+struct nl_gateways {
+    struct sockaddr_in6 *gws;
+    int cnt;
+};
+
+static int collect_gateways(struct nlmsghdr *nlMsg, void *arg)
+{
+    struct nl_gateways *g=(struct nl_gateways *)arg;
+    struct sockaddr_in6 gw[NL_MAX_NEXTHOPS];
+    int cnt;
+
+    cnt=nl_route_gateways(nlMsg, gw, NL_MAX_NEXTHOPS);
+    if (cnt > 0) {
+        g->cnt=add_gateways(&g->gws, g->cnt, gw, cnt);
+    }
+    return g->cnt < 0 ? g->cnt : 0;
+}
+
+int getgateways(struct sockaddr_in6 **gws)
+{
+    size_t bufsize=NL_DUMP_BUFSIZE;
+    int strict=1;
+    int i, ret=PCP_ERR_UNKNOWN;
+
+    if (!gws) {
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    for (i=1; ; ++i) {
+        struct nl_gateways g={NULL, 0};
+        int intr=0;
+
+        ret=nl_dump_routes(AF_UNSPEC, strict, &intr, &bufsize,
+                collect_gateways, &g);
+        *gws=g.gws;
+        if (ret == 0) {
+            ret=g.cnt;
+        }
+        // kernel without strict checking may refuse filtered request
+        if ((ret == PCP_ERR_RECV_FAILED) && (strict)) {
+            strict=0;
+            free(*gws);
+            *gws=NULL;
+            continue;
+        }
+        // routes changed during dump, result may miss some of them; the
+        // last one is kept anyway
+        if ((ret < 0) || (!intr) || (i >= NL_DUMP_TRIES)) {
+            break;
+        }
+        free(*gws);
+        *gws=NULL;
+    }
+    if ((ret < 0) && (*gws)) {
+        free(*gws);
+        *gws=NULL;
+    }
+
+    return ret;
+}
+
+struct nl_routes {
+    struct in6_addr *dst;
+    uint8_t *dst_len;
+    int cnt;
+    int max;
+};
+
+static int collect_routes4(struct nlmsghdr *nlMsg, void *arg)
+{
+    struct nl_routes *r=(struct nl_routes *)arg;
+    struct sockaddr_in6 gw[2];
+    struct rtmsg *rtMsg;
+    int dst_len;
+
+    dst_len=nl_route_dst(nlMsg, gw);
+    if (dst_len < 0) {
+        return 0;
+    }
+    rtMsg=(struct rtmsg *)NLMSG_DATA(nlMsg);
+    if (rtMsg->rtm_dst_len == 0) {
+        // default route of other table may be chosen by policy rules,
+        // multipath one spreads destinations among its gateways
+        if ((rtMsg->rtm_table != RT_TABLE_MAIN)
+                || (nl_route_gateways(nlMsg, gw, 2) > 1)) {
+            return PCP_ERR_NOT_FOUND;
+        }
+        return 0;
+    }
+    if ((rtMsg->rtm_table != RT_TABLE_MAIN)
+            && (rtMsg->rtm_table != RT_TABLE_LOCAL)) {
+        return PCP_ERR_NOT_FOUND;
+    }
+    if (r->cnt >= r->max) {
+        return PCP_ERR_MAX_SIZE;
+    }
+    r->dst[r->cnt]=gw->sin6_addr;
+    r->dst_len[r->cnt++]=(uint8_t)dst_len;
+
+    return 0;
+}
+
+int getroutes4(struct in6_addr *dst, uint8_t *dst_len, int max)
+{
+    size_t bufsize=NL_DUMP_BUFSIZE;
+    int i, ret=PCP_ERR_UNKNOWN;
+
+    for (i=0; i < NL_DUMP_TRIES; ++i) {
+        struct nl_routes r={dst, dst_len, 0, max};
+        int intr=0;
+
+        // tables other than main one are needed, no strict checking
+        ret=nl_dump_routes(AF_INET, 0, &intr, &bufsize, collect_routes4, &r);
+        if (ret < 0) {
+            return ret;
+        }
+        if (!intr) {
+            return r.cnt;
+        }
+    }
+
+    // routes missed by changing routing would get entry of default route
+    return PCP_ERR_UNKNOWN;
+}
+
+int gw_monitor_open(void)
+{
+    struct sockaddr_nl sa;
+    int sock;
+
+    sock=socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            NETLINK_ROUTE);
+    if (sock < 0) {
+        PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Netlink Socket Creation Failed...");
+        return -1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family=AF_NETLINK;
+    sa.nl_groups=RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE | RTMGRP_IPV4_IFADDR
+            | RTMGRP_IPV6_IFADDR;
+    if (bind(sock, (struct sockaddr *)&sa, sizeof(sa))) {
+        PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Netlink Socket Bind Failed...");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+int gw_monitor_read(int fd, gw_event_cb cb, void *arg)
+{
+    char msgBuf[BUFSIZE];
+    int changes=0;
+
+    for (;;) {
+        struct nlmsghdr *nlMsg=(struct nlmsghdr *)msgBuf;
+        ssize_t len=recv(fd, msgBuf, sizeof(msgBuf), 0);
+
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // notifications were dropped, caller has to rescan
+            if (errno == ENOBUFS) {
+                return -1;
+            }
+            break;
+        }
+
+        for (; NLMSG_OK(nlMsg,(unsigned)len); nlMsg=NLMSG_NEXT(nlMsg,len)) {
+            struct sockaddr_in6 gw[NL_MAX_NEXTHOPS];
+            int i, cnt, dst_len;
+
+            switch (nlMsg->nlmsg_type) {
+                case RTM_NEWROUTE:
+                case RTM_DELROUTE:
+                    // only default routes bring or take away gateways,
+                    // others are left to the caller to judge
+                    dst_len=nl_route_dst(nlMsg, gw);
+                    if (dst_len < 0) {
+                        break;
+                    }
+                    cnt=nl_route_gateways(nlMsg, gw, NL_MAX_NEXTHOPS);
+                    if (cnt == 0) {
+                        if (cb) {
+                            cb(arg, gw_route, gw, dst_len);
+                        }
+                        break;
+                    }
+                    for (i=0; (cb) && (i < cnt); ++i) {
+                        cb(arg, nlMsg->nlmsg_type == RTM_NEWROUTE ?
+                                gw_added : gw_removed, gw + i, 0);
+                    }
+                    ++changes;
+                    break;
+                case RTM_NEWADDR:
+                case RTM_DELADDR:
+                    ++changes;
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    return changes;
+}
+
+#else /* #ifdef USE_NETLINK */
+
+int gw_monitor_open(void)
+{
+    return -1;
+}
+
+int gw_monitor_read(int fd UNUSED, gw_event_cb cb UNUSED, void *arg UNUSED)
+{
+    return 0;
+}
+
+int getroutes4(struct in6_addr *dst UNUSED, uint8_t *dst_len UNUSED,
+        int max UNUSED)
+{
+    return PCP_ERR_UNKNOWN;
+}
+
 #endif /* #ifdef USE_NETLINK */
 
 #if defined (USE_WIN32_CODE) && defined(WIN32)
@@ -355,7 +700,9 @@ int getgateways(struct sockaddr_in6 **gws)
     }
 
     for (ret=0, i=0; i < (int)ipf_table->dwNumEntries; i++) {
-        if (ipf_table->table[i].ForwardType == MIB_IPROUTE_TYPE_INDIRECT) {
+        if ((ipf_table->table[i].ForwardType == MIB_IPROUTE_TYPE_INDIRECT)
+                && (ipf_table->table[i].dwForwardDest == 0)
+                && (ipf_table->table[i].dwForwardMask == 0)) {
             (*gws)[ret].sin6_family = AF_INET6;
             S6_ADDR32(&(*gws)[ret].sin6_addr)[0]=
                 (uint32_t)ipf_table->table[i].dwForwardNextHop;
@@ -435,11 +782,44 @@ net_rt_dump(int type, int family, int flags, size_t *lenp)
     return (buf);
 }
 
-/* Performs a route table dump selecting only entries that have Gateways.
- This means that the return buffer will have many duplicate entries since
- certain gateways appear multiple times in the routing table.
+/* destination of the route is unspecified address with zero netmask;
+ netmask of default route may be left out or have zero sa_len */
+static int rt_is_default(struct sockaddr **rti_info)
+{
+    struct sockaddr *dst=rti_info[RTAX_DST];
+    struct sockaddr *mask=rti_info[RTAX_NETMASK];
+
+    if (dst->sa_family == AF_INET) {
+        if (((struct sockaddr_in *)dst)->sin_addr.s_addr != INADDR_ANY) {
+            return 0;
+        }
+    } else if (dst->sa_family == AF_INET6) {
+        struct sockaddr_in6 *dst6=(struct sockaddr_in6 *)dst;
+
+        if (!IN6_IS_ADDR_UNSPECIFIED(&dst6->sin6_addr)) {
+            return 0;
+        }
+    } else {
+        return 0;
+    }
+
+    if (mask) {
+        const unsigned char *b=(const unsigned char *)mask;
+        int i;
+
+        for (i=2; i < mask->sa_len; ++i) {
+            if (b[i]) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
 
- It is up to the caller to weed out duplicates
+/* Performs a route table dump selecting only entries that have Gateways,
+ gateways of default routes are taken from them. The same gateway may be
+ returned more times (default route of more interfaces), it is up to the
+ caller to weed out duplicates
  */
 int getgateways(struct sockaddr_in6 **gws)
 {
@@ -465,8 +845,8 @@ int getgateways(struct sockaddr_in6 **gws)
 
         if ((sa=rti_info[RTAX_GATEWAY]) != NULL)
 
-            if ((rtm->rtm_addrs & (RTA_DST | RTA_GATEWAY))
-                    == (RTA_DST | RTA_GATEWAY)) {
+            if (((rtm->rtm_addrs & (RTA_DST | RTA_GATEWAY))
+                    == (RTA_DST | RTA_GATEWAY)) && (rt_is_default(rti_info))) {
                 struct sockaddr_in6 *in6=*gws;
 
                 *gws=(struct sockaddr_in6 *)realloc(*gws,
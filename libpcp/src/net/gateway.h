@@ -27,7 +27,37 @@
 #define __GETGATEWAY_H__
 
 struct sockaddr_in6;
+struct in6_addr;
 
+/* gateways of default routes, v4-mapped for IPv4; *gws is allocated and
+ * has to be freed by caller; returns their count or negative pcp_errno */
 int getgateways(struct sockaddr_in6 **gws);
 
+typedef enum {
+    gw_added, gw_removed, gw_route
+} gw_event_e;
+
+/* gw_added, gw_removed - addr is gateway of default route in main table,
+ * gw_route - other route changed, addr/prefix_len is its destination;
+ * v4-mapped for IPv4 (prefix_len counts bits of the mapped address too) */
+typedef void (*gw_event_cb)(void *arg, gw_event_e ev,
+        struct sockaddr_in6 *addr, int prefix_len);
+
+/* nonblocking socket notified of route and address changes (netlink on
+ * Linux), -1 if not supported */
+int gw_monitor_open(void);
+
+/* handles all pending notifications, cb is called for every changed route;
+ * returns number of changes of default routes (main table) and addresses,
+ * -1 if notifications were lost and routing has to be read again */
+int gw_monitor_read(int fd, gw_event_cb cb, void *arg);
+
+/* destinations of IPv4 routes other than default ones (main and local
+ * table), v4-mapped, and their prefix lengths in bits of IPv6 address;
+ * returns their count or negative pcp_errno - PCP_ERR_MAX_SIZE if there
+ * are more than max, PCP_ERR_NOT_FOUND if source address may depend on more
+ * than the most specific route covering destination (policy routing
+ * tables, multipath default route) */
+int getroutes4(struct in6_addr *dst, uint8_t *dst_len, int max);
+
 #endif
@@ -0,0 +1,169 @@
+/*
+ Copyright (c) 2014 by Cisco Systems, Inc.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcp.h"
+#include "pcp_client_db.h"
+#include "pcp_io_thread.h"
+#include "pcp_sans_io.h"
+
+#define SIO_QUEUE_MIN 64
+#define SIO_QUEUE_MAX 4096  //power of 2, ~4.5 MB of requests
+
+struct pcp_sio_dgram {
+    size_t len;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+    char buf[PCP_MAX_LEN];
+};
+
+/* ring of requests, grows up to SIO_QUEUE_MAX */
+struct pcp_sio {
+    struct pcp_sio_dgram *q;
+    uint32_t size;  //power of 2
+    uint32_t head;  //index of the oldest request
+    uint32_t cnt;
+};
+
+struct pcp_sio *pcp_sio_create(void)
+{
+    struct pcp_sio *q=(struct pcp_sio *)calloc(1, sizeof(*q));
+
+    if (!q) {
+        return NULL;
+    }
+    q->q=(struct pcp_sio_dgram *)malloc(SIO_QUEUE_MIN * sizeof(*q->q));
+    if (!q->q) {
+        free(q);
+        return NULL;
+    }
+    q->size=SIO_QUEUE_MIN;
+
+    return q;
+}
+
+void pcp_sio_destroy(struct pcp_sio *q)
+{
+    if (q) {
+        free(q->q);
+        free(q);
+    }
+}
+
+static int sio_grow(struct pcp_sio *q)
+{
+    struct pcp_sio_dgram *nq;
+    uint32_t i;
+
+    if (q->size >= SIO_QUEUE_MAX) {
+        return 0;
+    }
+    nq=(struct pcp_sio_dgram *)malloc(2 * q->size * sizeof(*nq));
+    if (!nq) {
+        return 0;
+    }
+    for (i=0; i < q->cnt; ++i) {
+        memcpy(nq + i, q->q + ((q->head + i) & (q->size - 1)), sizeof(*nq));
+    }
+    free(q->q);
+    q->q=nq;
+    q->size*=2;
+    q->head=0;
+
+    return 1;
+}
+
+int pcp_sio_sendmmsg(struct pcp_sio *q, pcp_sock_msg_t *msgs, unsigned cnt)
+{
+    unsigned i;
+
+    for (i=0; i < cnt; ++i) {
+        struct pcp_sio_dgram *d;
+
+        if ((msgs[i].len > PCP_MAX_LEN) || (!msgs[i].addr)
+                || (msgs[i].addrlen > sizeof(d->addr))) {
+            return i > 0 ? (int)i : PCP_ERR_BAD_ARGS;
+        }
+        if ((q->cnt == q->size) && (!sio_grow(q))) {
+            return i > 0 ? (int)i : PCP_ERR_WOULDBLOCK;
+        }
+        d=q->q + ((q->head + q->cnt) & (q->size - 1));
+        memcpy(d->buf, msgs[i].buf, msgs[i].len);
+        d->len=msgs[i].len;
+        memcpy(&d->addr, msgs[i].addr, msgs[i].addrlen);
+        d->addrlen=msgs[i].addrlen;
+        ++q->cnt;
+    }
+
+    return (int)cnt;
+}
+
+int pcp_ctx_poll_transmit(pcp_ctx_t *ctx, pcp_sock_msg_t *msgs, unsigned cnt)
+{
+    struct pcp_sio *q;
+    unsigned i;
+
+    if ((!ctx) || ((!msgs) && (cnt > 0)) || (pcp_io_is_foreign(ctx))) {
+        return PCP_ERR_BAD_ARGS;
+    }
+    q=ctx->sio;
+    if (!q) {
+        return PCP_ERR_NOT_FOUND;
+    }
+
+    for (i=0; (i < cnt) && (q->cnt > 0); ++i) {
+        struct pcp_sio_dgram *d=q->q + q->head;
+        pcp_sock_msg_t *m=msgs + i;
+
+        if ((!m->buf) || (m->len < d->len)) {
+            if (i == 0) {
+                return PCP_ERR_MAX_SIZE;
+            }
+            break;
+        }
+        memcpy(m->buf, d->buf, d->len);
+        m->len=d->len;
+        if (m->addr) {
+            memcpy(m->addr, &d->addr,
+                    m->addrlen < d->addrlen ? m->addrlen : d->addrlen);
+        }
+        m->addrlen=d->addrlen;
+        m->controllen=0;
+        m->flags=0;
+
+        q->head=(q->head + 1) & (q->size - 1);
+        --q->cnt;
+    }
+
+    return (int)i;
+}
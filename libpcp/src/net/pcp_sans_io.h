@@ -0,0 +1,47 @@
+/*
+ Copyright (c) 2014 by Cisco Systems, Inc.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PCP_SANS_IO_H_
+#define PCP_SANS_IO_H_
+
+#include "pcp.h"
+
+/*
+ * Transmit queue of context without sockets (PCP_INIT_SANS_IO). Requests
+ * sent by state machines are copied here and taken by application through
+ * pcp_ctx_poll_transmit; responses come back through pcp_ctx_input.
+ */
+
+struct pcp_sio;
+
+struct pcp_sio *pcp_sio_create(void);
+
+void pcp_sio_destroy(struct pcp_sio *q);
+
+/* as sock_sendmmsg of pcp_socket_vt_ext_t; PCP_ERR_WOULDBLOCK if queue is
+ * full, so refused requests are left to retransmission */
+int pcp_sio_sendmmsg(struct pcp_sio *q, pcp_sock_msg_t *msgs, unsigned cnt);
+
+#endif /* PCP_SANS_IO_H_ */
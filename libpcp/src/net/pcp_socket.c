@@ -29,6 +29,12 @@
 #include "default_config.h"
 #endif
 
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE //sendmmsg, recvmmsg
+#endif
+#endif
+
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
@@ -41,25 +47,49 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#ifdef __linux__
+#include <net/if.h>
+#include <ifaddrs.h>
+#endif
 #endif //PCP_SOCKET_IS_VOIDPTR
 #endif //!WIN32
 #include "pcp.h"
 #include "unp.h"
 #include "pcp_utils.h"
 #include "pcp_socket.h"
+#include "pcp_uring.h"
+#include "pcp_sans_io.h"
 
 static PCP_SOCKET pcp_socket_create_impl(int domain, int type, int protocol);
+static PCP_SOCKET pcp_socket_create_bound(int domain, int type, int protocol,
+        struct sockaddr *src, int v6only);
 static ssize_t pcp_socket_recvfrom_impl(PCP_SOCKET sock, void *buf, size_t len,
         int flags, struct sockaddr *src_addr, socklen_t *addrlen);
 static ssize_t pcp_socket_sendto_impl(PCP_SOCKET sock, const void *buf,
         size_t len, int flags, struct sockaddr *dest_addr, socklen_t addrlen);
 static int pcp_socket_close_impl(PCP_SOCKET sock);
+#if !defined(WIN32) && !defined(PCP_SOCKET_IS_VOIDPTR)
+static int pcp_socket_sendmmsg_impl(PCP_SOCKET sock, pcp_sock_msg_t *msgs,
+        unsigned cnt, int flags);
+static int pcp_socket_recvmmsg_impl(PCP_SOCKET sock, pcp_sock_msg_t *msgs,
+        unsigned cnt, int flags);
+#define SENDMMSG_IMPL pcp_socket_sendmmsg_impl
+#define RECVMMSG_IMPL pcp_socket_recvmmsg_impl
+#else
+#define SENDMMSG_IMPL NULL
+#define RECVMMSG_IMPL NULL
+#endif
 
-pcp_socket_vt_t default_socket_vt={
-        pcp_socket_create_impl,
-        pcp_socket_recvfrom_impl,
-        pcp_socket_sendto_impl,
-        pcp_socket_close_impl
+pcp_socket_vt_ext_t default_socket_vt={
+        {
+            pcp_socket_create_impl,
+            pcp_socket_recvfrom_impl,
+            pcp_socket_sendto_impl,
+            pcp_socket_close_impl
+        },
+        PCP_SOCKET_VT_EXT_VERSION,
+        SENDMMSG_IMPL,
+        RECVMMSG_IMPL
 };
 
 #ifdef WIN32
@@ -187,12 +217,72 @@ static pcp_errno pcp_get_error()
 }
 #endif
 
+/* socket created after io_uring was set up is read through the ring */
+static PCP_SOCKET pcp_socket_add_uring(struct pcp_ctx_s *ctx, PCP_SOCKET s)
+{
+    if ((ctx->uring) && (s != PCP_INVALID_SOCKET)
+            && (pcp_uring_add_socket(ctx->uring, s) != PCP_ERR_SUCCESS)) {
+        ctx->virt_socket_tb->sock_close(s);
+        return PCP_INVALID_SOCKET;
+    }
+    return s;
+}
+
 PCP_SOCKET pcp_socket_create(struct pcp_ctx_s *ctx, int domain, int type,
         int protocol)
 {
     assert(ctx && ctx->virt_socket_tb && ctx->virt_socket_tb->sock_create);
 
-    return ctx->virt_socket_tb->sock_create(domain, type, protocol);
+    return pcp_socket_add_uring(ctx,
+            ctx->virt_socket_tb->sock_create(domain, type, protocol));
+}
+
+PCP_SOCKET pcp_socket_create_src(struct pcp_ctx_s *ctx, int domain, int type,
+        int protocol, struct sockaddr *src, int v6only)
+{
+    assert(ctx && ctx->virt_socket_tb && ctx->virt_socket_tb->sock_create);
+
+    if (ctx->virt_socket_tb != &default_socket_vt.base) {
+        return ctx->virt_socket_tb->sock_create(domain, type, protocol);
+    }
+
+    return pcp_socket_add_uring(ctx,
+            pcp_socket_create_bound(domain, type, protocol, src, v6only));
+}
+
+int pcp_socket_connect(struct pcp_ctx_s *ctx, PCP_SOCKET sock,
+        struct sockaddr *dst)
+{
+    assert(ctx && ctx->virt_socket_tb);
+
+    if (ctx->virt_socket_tb != &default_socket_vt.base) {
+        return PCP_ERR_NOT_FOUND;
+    }
+#ifndef PCP_SOCKET_IS_VOIDPTR
+    if (connect(sock, dst, SA_LEN(dst)) == PCP_SOCKET_ERROR) {
+        return PCP_ERR_UNKNOWN;
+    }
+    return PCP_ERR_SUCCESS;
+#else
+    OSDEP(sock);
+    OSDEP(dst);
+    return PCP_ERR_NOT_FOUND;
+#endif
+}
+
+int pcp_socket_set_rcvbuf(PCP_SOCKET sock, int bytes)
+{
+#ifndef PCP_SOCKET_IS_VOIDPTR
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char *)&bytes,
+            sizeof(bytes)) == PCP_SOCKET_ERROR) {
+        return PCP_ERR_UNKNOWN;
+    }
+    return PCP_ERR_SUCCESS;
+#else
+    OSDEP(sock);
+    OSDEP(bytes);
+    return PCP_ERR_NOT_FOUND;
+#endif
 }
 
 ssize_t pcp_socket_recvfrom(struct pcp_ctx_s *ctx, void *buf, size_t len,
@@ -213,16 +303,176 @@ ssize_t pcp_socket_sendto(struct pcp_ctx_s *ctx, const void *buf, size_t len,
             dest_addr, addrlen);
 }
 
-int pcp_socket_close(struct pcp_ctx_s *ctx)
+int pcp_socket_sendmmsg(struct pcp_ctx_s *ctx, PCP_SOCKET sock,
+        pcp_sock_msg_t *msgs, unsigned cnt)
+{
+    pcp_socket_vt_ext_t *ext;
+    unsigned i;
+
+    assert(ctx && ctx->virt_socket_tb);
+
+    if (ctx->sio) {
+        return pcp_sio_sendmmsg(ctx->sio, msgs, cnt);
+    }
+    if (ctx->uring) {
+        return pcp_uring_sendmmsg(ctx->uring, sock, msgs, cnt);
+    }
+    ext=ctx->virt_socket_ext;
+    if ((ext) && (ext->sock_sendmmsg)) {
+        return ext->sock_sendmmsg(sock, msgs, cnt, MSG_DONTWAIT);
+    }
+
+    for (i=0; i < cnt; ++i) {
+        ssize_t ret;
+
+        ret=ctx->virt_socket_tb->sock_sendto(sock, msgs[i].buf,
+                msgs[i].len, MSG_DONTWAIT, msgs[i].addr, msgs[i].addrlen);
+        if (ret < 0) {
+            return i > 0 ? (int)i : (int)ret;
+        }
+    }
+
+    return (int)cnt;
+}
+
+int pcp_socket_recvmmsg(struct pcp_ctx_s *ctx, PCP_SOCKET sock,
+        pcp_sock_msg_t *msgs, unsigned cnt)
+{
+    pcp_socket_vt_ext_t *ext;
+    unsigned i;
+
+    assert(ctx && ctx->virt_socket_tb);
+
+    // datagrams of all sockets come through the ring
+    if (ctx->uring) {
+        return pcp_uring_recvmmsg(ctx->uring, msgs, cnt);
+    }
+    ext=ctx->virt_socket_ext;
+    if ((ext) && (ext->sock_recvmmsg)) {
+        return ext->sock_recvmmsg(sock, msgs, cnt, MSG_DONTWAIT);
+    }
+
+    for (i=0; i < cnt; ++i) {
+        ssize_t ret;
+
+        ret=ctx->virt_socket_tb->sock_recvfrom(sock, msgs[i].buf,
+                msgs[i].len, MSG_DONTWAIT, msgs[i].addr, &msgs[i].addrlen);
+        if (ret < 0) {
+            return i > 0 ? (int)i : (int)ret;
+        }
+        msgs[i].len=(size_t)ret;
+        msgs[i].controllen=0;
+        msgs[i].flags=0;
+    }
+
+    return (int)cnt;
+}
+
+int pcp_sock_msg_timestamp(const pcp_sock_msg_t *m, struct timeval *tv)
+{
+#if !defined(WIN32) && !defined(PCP_SOCKET_IS_VOIDPTR)
+    struct msghdr h;
+    struct cmsghdr *c;
+
+    if ((!m->control) || (m->controllen == 0)) {
+        return 0;
+    }
+
+    memset(&h, 0, sizeof(h));
+    h.msg_control=m->control;
+    h.msg_controllen=m->controllen;
+    for (c=CMSG_FIRSTHDR(&h); c != NULL; c=CMSG_NXTHDR(&h, c)) {
+        if (c->cmsg_level != SOL_SOCKET) {
+            continue;
+        }
+#ifdef SCM_TIMESTAMPNS
+        if (c->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+
+            memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+            tv->tv_sec=ts.tv_sec;
+            tv->tv_usec=ts.tv_nsec / 1000;
+            return 1;
+        }
+#endif
+#ifdef SCM_TIMESTAMP
+        if (c->cmsg_type == SCM_TIMESTAMP) {
+            memcpy(tv, CMSG_DATA(c), sizeof(*tv));
+            return 1;
+        }
+#endif
+    }
+#else
+    OSDEP(m);
+    OSDEP(tv);
+#endif
+    return 0;
+}
+
+int pcp_socket_close(struct pcp_ctx_s *ctx, PCP_SOCKET sock)
 {
     assert(ctx && ctx->virt_socket_tb && ctx->virt_socket_tb->sock_close);
 
-    return ctx->virt_socket_tb->sock_close(ctx->socket);
+    if (ctx->uring) {
+        pcp_uring_remove_socket(ctx->uring, sock);
+    }
+    return ctx->virt_socket_tb->sock_close(sock);
 }
 
+/* AF_INET6 socket of default table is dual-stack */
 static PCP_SOCKET pcp_socket_create_impl(int domain, int type, int protocol)
+{
+    return pcp_socket_create_bound(domain, type, protocol, NULL, 0);
+}
+
+#if defined(__linux__) && defined(SO_BINDTODEVICE) \
+        && !defined(PCP_SOCKET_IS_VOIDPTR)
+/* binds socket to interface having address src; needs CAP_NET_RAW on
+ * kernels older than 5.7, socket stays bound to address only otherwise */
+static void pcp_socket_bind_device(PCP_SOCKET s, struct sockaddr *src)
+{
+    struct ifaddrs *ifa, *i;
+    struct in6_addr src_ip;
+
+    if (getifaddrs(&ifa)) {
+        return;
+    }
+
+    pcp_fill_in6_addr(&src_ip, NULL, src);
+    for (i=ifa; i != NULL; i=i->ifa_next) {
+        struct in6_addr if_ip;
+
+        if ((!i->ifa_addr) || ((i->ifa_addr->sa_family != AF_INET)
+                && (i->ifa_addr->sa_family != AF_INET6))) {
+            continue;
+        }
+        pcp_fill_in6_addr(&if_ip, NULL, i->ifa_addr);
+        if (IN6_ARE_ADDR_EQUAL(&if_ip, &src_ip)) {
+            if (setsockopt(s, SOL_SOCKET, SO_BINDTODEVICE, i->ifa_name,
+                    (socklen_t)strlen(i->ifa_name) + 1)) {
+                PCP_LOG(PCP_LOGLVL_DEBUG, "Cannot bind socket to interface "
+                        "%s.", i->ifa_name);
+            } else {
+                PCP_LOG(PCP_LOGLVL_DEBUG, "Socket bound to interface %s.",
+                        i->ifa_name);
+            }
+            break;
+        }
+    }
+    freeifaddrs(ifa);
+}
+#endif
+
+/* src - address to bind to, NULL => any; port is the first free one
+ * counting up from 5350
+ * v6only - IPV6_V6ONLY of AF_INET6 socket; if 0 and dual-stack sockets are
+ *          disabled, socket is not created */
+static PCP_SOCKET pcp_socket_create_bound(int domain, int type, int protocol,
+        struct sockaddr *src, int v6only)
 {
 #ifdef PCP_SOCKET_IS_VOIDPTR
+    OSDEP(src);
+    OSDEP(v6only);
     return PCP_INVALID_SOCKET;
 #else
     PCP_SOCKET s;
@@ -236,6 +486,9 @@ static PCP_SOCKET pcp_socket_create_impl(int domain, int type, int protocol)
     OSDEP(flg);
 
     memset(&sas, 0, sizeof(sas));
+    if ((src) && (src->sa_family == domain)) {
+        memcpy(&sas, src, SA_LEN(src));
+    }
     sas.ss_family=domain;
     if (domain == AF_INET) {
         sin->sin_port=htons(5350);
@@ -267,18 +520,38 @@ static PCP_SOCKET pcp_socket_create_impl(int domain, int type, int protocol)
         return PCP_INVALID_SOCKET;
     }
 #endif
-#ifdef PCP_USE_IPV6_SOCKET
-    flg=0;
-    if (PCP_SOCKET_ERROR
-            == setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&flg,
-                    sizeof(flg))) {
-        PCP_LOG(PCP_LOGLVL_ERR, "%s",
-                "Dual-stack sockets are not supported on this platform. "
-                "Recompile library with disabled IPv6 support.");
-        CLOSE(s);
-        return PCP_INVALID_SOCKET;
+#ifdef SO_TIMESTAMPNS
+    flg=1;
+    if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, (char *)&flg, sizeof(flg))) {
+        PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Kernel receive timestamps "
+                "are not available.");
+    }
+#elif defined(SO_TIMESTAMP)
+    flg=1;
+    if (setsockopt(s, SOL_SOCKET, SO_TIMESTAMP, (char *)&flg, sizeof(flg))) {
+        PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Kernel receive timestamps "
+                "are not available.");
+    }
+#endif
+    if (domain == AF_INET6) {
+        flg=v6only ? 1 : 0;
+        if (PCP_SOCKET_ERROR
+                == setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&flg,
+                        sizeof(flg))) {
+            if (!v6only) {
+                PCP_LOG(PCP_LOGLVL_INFO, "%s", "Dual-stack sockets are "
+                        "not supported on this platform.");
+                CLOSE(s);
+                return PCP_INVALID_SOCKET;
+            }
+            PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Cannot set IPV6_V6ONLY.");
+        }
     }
-#endif //PCP_USE_IPV6_SOCKET
+#if defined(__linux__) && defined(SO_BINDTODEVICE)
+    if (src) {
+        pcp_socket_bind_device(s, src);
+    }
+#endif
     while (bind(s, (struct sockaddr *)&sas,
             SA_LEN((struct sockaddr *)&sas)) == PCP_SOCKET_ERROR) {
         if (pcp_get_error() == PCP_ERR_ADDRINUSE) {
@@ -343,3 +616,131 @@ static int pcp_socket_close_impl(PCP_SOCKET sock)
     return PCP_SOCKET_ERROR;
 #endif
 }
+
+#if !defined(WIN32) && !defined(PCP_SOCKET_IS_VOIDPTR)
+// datagrams passed to kernel by one call, larger batches are cut
+#define PCP_SOCK_MMSG_MAX 64
+
+static void fill_msghdr(struct msghdr *h, struct iovec *iov,
+        pcp_sock_msg_t *m)
+{
+    iov->iov_base=m->buf;
+    iov->iov_len=m->len;
+    memset(h, 0, sizeof(*h));
+    h->msg_name=m->addr;
+    h->msg_namelen=m->addrlen;
+    h->msg_iov=iov;
+    h->msg_iovlen=1;
+    h->msg_control=m->control;
+    h->msg_controllen=m->control ? m->controllen : 0;
+}
+
+#ifdef __linux__
+static int pcp_socket_sendmmsg_impl(PCP_SOCKET sock, pcp_sock_msg_t *msgs,
+        unsigned cnt, int flags)
+{
+    struct mmsghdr hdrs[PCP_SOCK_MMSG_MAX];
+    struct iovec iovs[PCP_SOCK_MMSG_MAX];
+    unsigned i;
+    int ret;
+
+    if (cnt > PCP_SOCK_MMSG_MAX) {
+        cnt=PCP_SOCK_MMSG_MAX;
+    }
+    for (i=0; i < cnt; ++i) {
+        fill_msghdr(&hdrs[i].msg_hdr, &iovs[i], &msgs[i]);
+    }
+
+    ret=sendmmsg(sock, hdrs, cnt, flags);
+    if (ret < 0) {
+        return pcp_get_error() == PCP_ERR_WOULDBLOCK ? PCP_ERR_WOULDBLOCK :
+                PCP_ERR_SEND_FAILED;
+    }
+
+    return ret;
+}
+
+static int pcp_socket_recvmmsg_impl(PCP_SOCKET sock, pcp_sock_msg_t *msgs,
+        unsigned cnt, int flags)
+{
+    struct mmsghdr hdrs[PCP_SOCK_MMSG_MAX];
+    struct iovec iovs[PCP_SOCK_MMSG_MAX];
+    unsigned i;
+    int ret;
+
+    if (cnt > PCP_SOCK_MMSG_MAX) {
+        cnt=PCP_SOCK_MMSG_MAX;
+    }
+    for (i=0; i < cnt; ++i) {
+        fill_msghdr(&hdrs[i].msg_hdr, &iovs[i], &msgs[i]);
+    }
+
+    ret=recvmmsg(sock, hdrs, cnt, flags, NULL);
+    if (ret < 0) {
+        return pcp_get_error() == PCP_ERR_WOULDBLOCK ? PCP_ERR_WOULDBLOCK :
+                PCP_ERR_RECV_FAILED;
+    }
+
+    for (i=0; i < (unsigned)ret; ++i) {
+        msgs[i].len=hdrs[i].msg_len;
+        msgs[i].addrlen=hdrs[i].msg_hdr.msg_namelen;
+        msgs[i].controllen=hdrs[i].msg_hdr.msg_controllen;
+        msgs[i].flags=hdrs[i].msg_hdr.msg_flags;
+    }
+
+    return ret;
+}
+
+#else //__linux__
+
+static int pcp_socket_sendmmsg_impl(PCP_SOCKET sock, pcp_sock_msg_t *msgs,
+        unsigned cnt, int flags)
+{
+    unsigned i;
+
+    for (i=0; i < cnt; ++i) {
+        struct msghdr h;
+        struct iovec iov;
+
+        fill_msghdr(&h, &iov, &msgs[i]);
+        if (sendmsg(sock, &h, flags) < 0) {
+            if (i > 0) {
+                return (int)i;
+            }
+            return pcp_get_error() == PCP_ERR_WOULDBLOCK ?
+                    PCP_ERR_WOULDBLOCK : PCP_ERR_SEND_FAILED;
+        }
+    }
+
+    return (int)cnt;
+}
+
+static int pcp_socket_recvmmsg_impl(PCP_SOCKET sock, pcp_sock_msg_t *msgs,
+        unsigned cnt, int flags)
+{
+    unsigned i;
+
+    for (i=0; i < cnt; ++i) {
+        struct msghdr h;
+        struct iovec iov;
+        ssize_t ret;
+
+        fill_msghdr(&h, &iov, &msgs[i]);
+        ret=recvmsg(sock, &h, flags);
+        if (ret < 0) {
+            if (i > 0) {
+                return (int)i;
+            }
+            return pcp_get_error() == PCP_ERR_WOULDBLOCK ?
+                    PCP_ERR_WOULDBLOCK : PCP_ERR_RECV_FAILED;
+        }
+        msgs[i].len=(size_t)ret;
+        msgs[i].addrlen=h.msg_namelen;
+        msgs[i].controllen=h.msg_controllen;
+        msgs[i].flags=h.msg_flags;
+    }
+
+    return (int)cnt;
+}
+#endif //__linux__
+#endif //!WIN32 && !PCP_SOCKET_IS_VOIDPTR
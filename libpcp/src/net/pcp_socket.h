@@ -66,7 +66,7 @@ int pcp_win_sock_cleanup();
 
 struct pcp_ctx_s;
 
-extern pcp_socket_vt_t default_socket_vt;
+extern pcp_socket_vt_ext_t default_socket_vt;
 
 void pcp_fill_in6_addr(struct in6_addr *dst_ip6, uint16_t *dst_port,
         struct sockaddr *src);
@@ -77,13 +77,43 @@ void pcp_fill_sockaddr(struct sockaddr *dst, struct in6_addr *sip,
 PCP_SOCKET pcp_socket_create(struct pcp_ctx_s *ctx, int domain, int type,
         int protocol);
 
+/* socket of one PCP server, or IPv6 only socket of context (src NULL);
+ * default socket is bound to src address and, if permitted, to interface
+ * owning it; v6only - IPV6_V6ONLY of AF_INET6 socket; custom virt. table
+ * creates it by sock_create */
+PCP_SOCKET pcp_socket_create_src(struct pcp_ctx_s *ctx, int domain, int type,
+        int protocol, struct sockaddr *src, int v6only);
+
+/* connects default socket to dst, returns pcp_errno; PCP_ERR_NOT_FOUND for
+ * custom virt. table, whose sockets keep sending with address */
+int pcp_socket_connect(struct pcp_ctx_s *ctx, PCP_SOCKET sock,
+        struct sockaddr *dst);
+
+/* SO_RCVBUF of the socket, returns pcp_errno */
+int pcp_socket_set_rcvbuf(PCP_SOCKET sock, int bytes);
+
 ssize_t pcp_socket_recvfrom(struct pcp_ctx_s *ctx, void *buf, size_t len,
         int flags, struct sockaddr *src_addr, socklen_t *addrlen);
 
 ssize_t pcp_socket_sendto(struct pcp_ctx_s *ctx, const void *buf, size_t len,
         int flags, struct sockaddr *dest_addr, socklen_t addrlen);
 
-int pcp_socket_close(struct pcp_ctx_s *ctx);
+int pcp_socket_close(struct pcp_ctx_s *ctx, PCP_SOCKET sock);
+
+/* batched I/O on socket of the context or of a server; uses batch functions of extended
+ * virt. table if it has them, otherwise transfers datagrams one by one by
+ * sock_sendto/sock_recvfrom (ancillary data are not available then). With
+ * io_uring transport datagrams of all sockets are received regardless of sock.
+ * Return number of transferred datagrams or negative pcp_errno */
+int pcp_socket_sendmmsg(struct pcp_ctx_s *ctx, PCP_SOCKET sock,
+        pcp_sock_msg_t *msgs, unsigned cnt);
+
+int pcp_socket_recvmmsg(struct pcp_ctx_s *ctx, PCP_SOCKET sock,
+        pcp_sock_msg_t *msgs, unsigned cnt);
+
+/* receive timestamp from ancillary data of the datagram (SCM_TIMESTAMPNS or
+ * SCM_TIMESTAMP), returns 0 if there is none */
+int pcp_sock_msg_timestamp(const pcp_sock_msg_t *m, struct timeval *tv);
 
 /*In Visual Studio inline keyword only available in C++ */
 #if (defined(_MSC_VER) && !defined(inline))
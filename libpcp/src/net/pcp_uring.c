@@ -0,0 +1,748 @@
+/*
+ Copyright (c) 2014 by Cisco Systems, Inc.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#ifdef PCP_USE_IO_URING
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "pcp.h"
+#include "pcp_client_db.h"
+#include "pcp_logger.h"
+#include "pcp_utils.h"
+#include "pcp_socket.h"
+#include "pcp_uring.h"
+
+#define URING_LOAD(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define URING_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+#define URING_SQ_ENTRIES 128
+#define URING_CQ_ENTRIES 1024
+#define URING_RX_BUFS 256   //provided receive buffers, power of 2
+#define URING_TX_SLOTS 256  //datagrams handed to kernel and not completed
+#define URING_BGID 0
+
+// provided buffer holds io_uring_recvmsg_out, address, ancillary data and
+// datagram, in this order
+#define URING_NAME_LEN sizeof(struct sockaddr_storage)
+#define URING_CONTROL_LEN PCP_RX_CONTROL_LEN
+#define URING_RX_HDR_LEN (sizeof(struct io_uring_recvmsg_out) \
+        + URING_NAME_LEN + URING_CONTROL_LEN)
+#define URING_RX_BUF_LEN (URING_RX_HDR_LEN + PCP_MAX_LEN)
+
+// user_data of SQE: operation, index of socket or send slot, generation of
+// socket, so completions of closed socket are recognized
+enum uring_op {
+    uop_recv=1, uop_send, uop_cancel
+};
+#define UD_MAKE(op, idx, gen) \
+        (((uint64_t)(gen) << 32) | ((uint64_t)(idx) << 8) | (uint64_t)(op))
+#define UD_OP(ud)  ((uint32_t)(ud) & 0xff)
+#define UD_IDX(ud) ((uint32_t)(ud) >> 8)
+#define UD_GEN(ud) ((uint32_t)((ud) >> 32))
+
+struct uring_sock {
+    PCP_SOCKET fd;          //PCP_INVALID_SOCKET => unused entry
+    uint32_t gen;
+    int armed;              //multishot receive is active
+    int send_error;         //errno of failed send, until it's taken
+};
+
+struct uring_tx {
+    uint32_t sock;          //index and generation of sending socket
+    uint32_t gen;
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage addr;
+    char buf[PCP_MAX_LEN];
+};
+
+// receive completion waiting to be handed to caller
+struct uring_rx {
+    uint32_t sock;
+    uint32_t gen;
+    int32_t res;
+    uint32_t flags;
+};
+
+struct pcp_uring {
+    int fd;
+    void *ring_map;
+    size_t ring_map_len;
+    //submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail; //prepared SQEs, published by uring_submit
+    unsigned sq_pending;    //prepared SQEs not taken by kernel yet
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    //completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    //provided receive buffers
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    uint16_t br_tail;
+    char *rx_bufs;
+    struct msghdr rx_msg;   //lengths of address and ancillary data
+    struct uring_rx rx[URING_RX_BUFS];
+    uint32_t rx_head;
+    uint32_t rx_cnt;
+    int arm_failed;         //multishot receive refused by kernel
+    //sockets
+    struct uring_sock *socks;
+    size_t socks_len;
+    int need_arm;
+    //send slots
+    struct uring_tx *tx;
+    uint32_t tx_free[URING_TX_SLOTS];
+    uint32_t tx_free_cnt;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned op, void *arg, unsigned nr)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+/* hands prepared SQEs to kernel */
+static void uring_submit(struct pcp_uring *u)
+{
+    if (!u->sq_pending) {
+        return;
+    }
+
+    URING_STORE(u->sq_tail, u->sq_local_tail);
+    while (u->sq_pending) {
+        int ret=uring_enter(u->fd, u->sq_pending);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // EAGAIN/EBUSY - kernel is short of resources, SQEs stay in
+            // the queue and go with the next submit
+            PCP_LOG(PCP_LOGLVL_DEBUG, "io_uring_enter failed (%d).", errno);
+            return;
+        }
+        u->sq_pending-=(unsigned)ret < u->sq_pending ? (unsigned)ret :
+                u->sq_pending;
+        if (ret == 0) {
+            return;
+        }
+    }
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct pcp_uring *u)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if (u->sq_local_tail - URING_LOAD(u->sq_head) >= u->sq_entries) {
+        uring_submit(u);
+        if (u->sq_local_tail - URING_LOAD(u->sq_head) >= u->sq_entries) {
+            return NULL;
+        }
+    }
+
+    idx=u->sq_local_tail & u->sq_mask;
+    u->sq_array[idx]=idx;
+    sqe=u->sqes + idx;
+    memset(sqe, 0, sizeof(*sqe));
+    ++u->sq_local_tail;
+    ++u->sq_pending;
+
+    return sqe;
+}
+
+static void uring_buf_add(struct pcp_uring *u, uint16_t bid)
+{
+    struct io_uring_buf *b=&u->br->bufs[u->br_tail & (URING_RX_BUFS - 1)];
+
+    // only addr, len and bid - resv of the first one is tail of the ring
+    b->addr=(uint64_t)(uintptr_t)(u->rx_bufs + (size_t)bid * URING_RX_BUF_LEN);
+    b->len=URING_RX_BUF_LEN;
+    b->bid=bid;
+    ++u->br_tail;
+}
+
+static void uring_buf_publish(struct pcp_uring *u)
+{
+    URING_STORE(&u->br->tail, u->br_tail);
+}
+
+static int uring_arm(struct pcp_uring *u, size_t i)
+{
+    struct uring_sock *s=u->socks + i;
+    struct io_uring_sqe *sqe=uring_get_sqe(u);
+
+    if (!sqe) {
+        u->need_arm=1;
+        return 0;
+    }
+    sqe->opcode=IORING_OP_RECVMSG;
+    sqe->fd=s->fd;
+    sqe->addr=(uint64_t)(uintptr_t)&u->rx_msg;
+    sqe->len=1;
+    sqe->ioprio=IORING_RECV_MULTISHOT;
+    sqe->flags=IOSQE_BUFFER_SELECT;
+    sqe->buf_group=URING_BGID;
+    sqe->user_data=UD_MAKE(uop_recv, i, s->gen);
+    s->armed=1;
+
+    return 1;
+}
+
+static void uring_arm_all(struct pcp_uring *u)
+{
+    size_t i;
+
+    u->need_arm=0;
+    for (i=0; i < u->socks_len; ++i) {
+        if ((u->socks[i].fd != PCP_INVALID_SOCKET) && (!u->socks[i].armed)
+                && (!uring_arm(u, i))) {
+            return;
+        }
+    }
+}
+
+static int uring_sock_valid(struct pcp_uring *u, uint32_t idx, uint32_t gen)
+{
+    return (idx < u->socks_len) && (u->socks[idx].fd != PCP_INVALID_SOCKET)
+            && (u->socks[idx].gen == gen);
+}
+
+static void uring_handle_cqe(struct pcp_uring *u, struct io_uring_cqe *cqe)
+{
+    uint32_t idx=UD_IDX(cqe->user_data);
+    uint32_t gen=UD_GEN(cqe->user_data);
+    int valid;
+
+    switch (UD_OP(cqe->user_data)) {
+        case uop_send:
+            if (idx >= URING_TX_SLOTS) {
+                return;
+            }
+            if (cqe->res < 0) {
+                struct uring_tx *t=u->tx + idx;
+
+                PCP_LOG(PCP_LOGLVL_DEBUG, "Error (%d) occurred while sending "
+                        "PCP packet, left to retransmission.", -cqe->res);
+                if (uring_sock_valid(u, t->sock, t->gen)) {
+                    u->socks[t->sock].send_error=-cqe->res;
+                }
+            }
+            u->tx_free[u->tx_free_cnt++]=idx;
+            return;
+        case uop_recv:
+            break;
+        default:
+            return;
+    }
+
+    valid=uring_sock_valid(u, idx, gen);
+    if ((valid) && (!(cqe->flags & IORING_CQE_F_MORE))) {
+        // multishot receive ended (no buffers, socket error), armed again
+        // after received datagrams are handed over
+        u->socks[idx].armed=0;
+        u->need_arm=1;
+        if (cqe->res == -EINVAL) {
+            u->arm_failed=1;
+        }
+    }
+    if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+        if ((valid) && (cqe->res < 0) && (cqe->res != -ENOBUFS)) {
+            PCP_LOG(PCP_LOGLVL_DEBUG, "Error (%d) occurred while receiving "
+                    "PCP packet.", -cqe->res);
+        }
+        return;
+    }
+    if ((!valid) || (cqe->res < (int32_t)URING_RX_HDR_LEN)
+            || (u->rx_cnt == URING_RX_BUFS)) {
+        uring_buf_add(u, (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+        uring_buf_publish(u);
+        return;
+    }
+
+    {
+        struct uring_rx *r=u->rx + ((u->rx_head + u->rx_cnt)
+                & (URING_RX_BUFS - 1));
+
+        r->sock=idx;
+        r->gen=gen;
+        r->res=cqe->res;
+        r->flags=cqe->flags;
+        ++u->rx_cnt;
+    }
+}
+
+/* moves completions from CQ; received datagrams wait in u->rx */
+static void uring_reap(struct pcp_uring *u)
+{
+    unsigned head=*u->cq_head;
+    unsigned tail=URING_LOAD(u->cq_tail);
+
+    while (head != tail) {
+        uring_handle_cqe(u, u->cqes + (head & u->cq_mask));
+        ++head;
+    }
+    URING_STORE(u->cq_head, head);
+}
+
+static int uring_probe(int fd)
+{
+    static const uint8_t needed[]={IORING_OP_RECVMSG, IORING_OP_SENDMSG,
+            IORING_OP_ASYNC_CANCEL};
+    struct io_uring_probe *p;
+    size_t len=sizeof(*p) + 256 * sizeof(struct io_uring_probe_op);
+    int ok=1;
+    size_t i;
+
+    p=(struct io_uring_probe *)calloc(1, len);
+    if (!p) {
+        return 0;
+    }
+    if (uring_register(fd, IORING_REGISTER_PROBE, p, 256) < 0) {
+        free(p);
+        return 0;
+    }
+    for (i=0; i < sizeof(needed); ++i) {
+        if ((needed[i] > p->last_op)
+                || (!(p->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))) {
+            ok=0;
+        }
+    }
+    free(p);
+
+    return ok;
+}
+
+static int uring_map(struct pcp_uring *u, struct io_uring_params *p)
+{
+    size_t sq_len=p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    size_t cq_len=p->cq_off.cqes
+            + p->cq_entries * sizeof(struct io_uring_cqe);
+    char *ring;
+
+    // SQ and CQ rings share one mapping
+    if (!(p->features & IORING_FEAT_SINGLE_MMAP)) {
+        return 0;
+    }
+    u->ring_map_len=sq_len > cq_len ? sq_len : cq_len;
+    u->ring_map=mmap(NULL, u->ring_map_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->ring_map == MAP_FAILED) {
+        u->ring_map=NULL;
+        return 0;
+    }
+    u->sqes_len=p->sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes=(struct io_uring_sqe *)mmap(NULL, u->sqes_len,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+            IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes=NULL;
+        return 0;
+    }
+
+    ring=(char *)u->ring_map;
+    u->sq_head=(unsigned *)(ring + p->sq_off.head);
+    u->sq_tail=(unsigned *)(ring + p->sq_off.tail);
+    u->sq_array=(unsigned *)(ring + p->sq_off.array);
+    u->sq_mask=*(unsigned *)(ring + p->sq_off.ring_mask);
+    u->sq_entries=p->sq_entries;
+    u->sq_local_tail=*u->sq_tail;
+    u->cq_head=(unsigned *)(ring + p->cq_off.head);
+    u->cq_tail=(unsigned *)(ring + p->cq_off.tail);
+    u->cq_mask=*(unsigned *)(ring + p->cq_off.ring_mask);
+    u->cqes=(struct io_uring_cqe *)(ring + p->cq_off.cqes);
+
+    return 1;
+}
+
+static int uring_setup_bufs(struct pcp_uring *u)
+{
+    struct io_uring_buf_reg reg;
+    void *br;
+    uint16_t i;
+
+    u->br_len=URING_RX_BUFS * sizeof(struct io_uring_buf);
+    br=mmap(NULL, u->br_len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br == MAP_FAILED) {
+        return 0;
+    }
+    u->br=(struct io_uring_buf_ring *)br;
+    u->rx_bufs=(char *)malloc((size_t)URING_RX_BUFS * URING_RX_BUF_LEN);
+    if (!u->rx_bufs) {
+        return 0;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr=(uint64_t)(uintptr_t)u->br;
+    reg.ring_entries=URING_RX_BUFS;
+    reg.bgid=URING_BGID;
+    if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return 0;
+    }
+
+    u->br_tail=0;
+    for (i=0; i < URING_RX_BUFS; ++i) {
+        uring_buf_add(u, i);
+    }
+    uring_buf_publish(u);
+
+    memset(&u->rx_msg, 0, sizeof(u->rx_msg));
+    u->rx_msg.msg_namelen=URING_NAME_LEN;
+    u->rx_msg.msg_controllen=URING_CONTROL_LEN;
+
+    return 1;
+}
+
+static void uring_destroy(struct pcp_uring *u)
+{
+    if (u->fd >= 0) {
+        // kernel cancels requests still in flight
+        close(u->fd);
+    }
+    if (u->ring_map) {
+        munmap(u->ring_map, u->ring_map_len);
+    }
+    if (u->sqes) {
+        munmap(u->sqes, u->sqes_len);
+    }
+    if (u->br) {
+        munmap(u->br, u->br_len);
+    }
+    free(u->rx_bufs);
+    free(u->tx);
+    free(u->socks);
+    free(u);
+}
+
+pcp_errno pcp_uring_init(pcp_ctx_t *ctx)
+{
+    struct io_uring_params p;
+    struct pcp_uring *u;
+    uint32_t i;
+
+    if (ctx->uring) {
+        return PCP_ERR_SUCCESS;
+    }
+
+    u=(struct pcp_uring *)calloc(1, sizeof(*u));
+    if (!u) {
+        return PCP_ERR_NO_MEM;
+    }
+    memset(&p, 0, sizeof(p));
+    p.flags=IORING_SETUP_CQSIZE;
+    p.cq_entries=URING_CQ_ENTRIES;
+    u->fd=uring_setup(URING_SQ_ENTRIES, &p);
+    if ((u->fd < 0) || (!uring_probe(u->fd)) || (!uring_map(u, &p))
+            || (!uring_setup_bufs(u))) {
+        uring_destroy(u);
+        return PCP_ERR_NOT_FOUND;
+    }
+
+    u->tx=(struct uring_tx *)calloc(URING_TX_SLOTS, sizeof(*u->tx));
+    if (!u->tx) {
+        uring_destroy(u);
+        return PCP_ERR_NO_MEM;
+    }
+    for (i=0; i < URING_TX_SLOTS; ++i) {
+        u->tx_free[i]=URING_TX_SLOTS - 1 - i;
+    }
+    u->tx_free_cnt=URING_TX_SLOTS;
+
+    if ((pcp_uring_add_socket(u, ctx->socket) != PCP_ERR_SUCCESS)
+            || ((ctx->socket6 != PCP_INVALID_SOCKET) && (pcp_uring_add_socket(
+                    u, ctx->socket6) != PCP_ERR_SUCCESS))) {
+        uring_destroy(u);
+        return PCP_ERR_NO_MEM;
+    }
+
+    // kernel without multishot receive (Linux < 6.0) fails arming at once
+    uring_reap(u);
+    if (u->arm_failed) {
+        uring_destroy(u);
+        return PCP_ERR_NOT_FOUND;
+    }
+    ctx->uring=u;
+
+    return PCP_ERR_SUCCESS;
+}
+
+void pcp_uring_free(pcp_ctx_t *ctx)
+{
+    if (ctx->uring) {
+        uring_destroy(ctx->uring);
+        ctx->uring=NULL;
+    }
+}
+
+pcp_errno pcp_uring_add_socket(struct pcp_uring *u, PCP_SOCKET sock)
+{
+    size_t i;
+
+    for (i=0; i < u->socks_len; ++i) {
+        if (u->socks[i].fd == PCP_INVALID_SOCKET) {
+            break;
+        }
+    }
+    if (i == u->socks_len) {
+        struct uring_sock *socks=(struct uring_sock *)realloc(u->socks,
+                (u->socks_len + 1) * sizeof(*socks));
+
+        if (!socks) {
+            return PCP_ERR_NO_MEM;
+        }
+        u->socks=socks;
+        u->socks[i].gen=0;
+        ++u->socks_len;
+    }
+
+    u->socks[i].fd=sock;
+    ++u->socks[i].gen;
+    u->socks[i].armed=0;
+    u->socks[i].send_error=0;
+    uring_arm(u, i);
+    uring_submit(u);
+
+    return PCP_ERR_SUCCESS;
+}
+
+void pcp_uring_remove_socket(struct pcp_uring *u, PCP_SOCKET sock)
+{
+    size_t i;
+
+    for (i=0; i < u->socks_len; ++i) {
+        struct uring_sock *s=u->socks + i;
+
+        if (s->fd != sock) {
+            continue;
+        }
+        if (s->armed) {
+            struct io_uring_sqe *sqe=uring_get_sqe(u);
+
+            // ring holds reference to the socket until receive is cancelled
+            if (sqe) {
+                sqe->opcode=IORING_OP_ASYNC_CANCEL;
+                sqe->fd=-1;
+                sqe->addr=UD_MAKE(uop_recv, i, s->gen);
+                sqe->user_data=UD_MAKE(uop_cancel, 0, 0);
+                uring_submit(u);
+            }
+        }
+        s->fd=PCP_INVALID_SOCKET;
+        s->armed=0;
+        return;
+    }
+}
+
+static size_t uring_sock_index(struct pcp_uring *u, PCP_SOCKET sock)
+{
+    size_t i;
+
+    for (i=0; i < u->socks_len; ++i) {
+        if (u->socks[i].fd == sock) {
+            break;
+        }
+    }
+    return i;
+}
+
+int pcp_uring_sendmmsg(struct pcp_uring *u, PCP_SOCKET sock,
+        pcp_sock_msg_t *msgs, unsigned cnt)
+{
+    size_t si=uring_sock_index(u, sock);
+    unsigned i;
+
+    if (u->tx_free_cnt < cnt) {
+        uring_reap(u);
+    }
+
+    for (i=0; (i < cnt) && (u->tx_free_cnt); ++i) {
+        struct io_uring_sqe *sqe=uring_get_sqe(u);
+        struct uring_tx *t;
+        uint32_t slot;
+        size_t len=msgs[i].len;
+
+        if (!sqe) {
+            break;
+        }
+        slot=u->tx_free[--u->tx_free_cnt];
+        t=u->tx + slot;
+        t->sock=(uint32_t)si;
+        t->gen=si < u->socks_len ? u->socks[si].gen : 0;
+        if (len > sizeof(t->buf)) {
+            len=sizeof(t->buf);
+        }
+        memcpy(t->buf, msgs[i].buf, len);
+        t->iov.iov_base=t->buf;
+        t->iov.iov_len=len;
+        memset(&t->msg, 0, sizeof(t->msg));
+        t->msg.msg_iov=&t->iov;
+        t->msg.msg_iovlen=1;
+        if ((msgs[i].addr) && (msgs[i].addrlen)
+                && (msgs[i].addrlen <= sizeof(t->addr))) {
+            memcpy(&t->addr, msgs[i].addr, msgs[i].addrlen);
+            t->msg.msg_name=&t->addr;
+            t->msg.msg_namelen=msgs[i].addrlen;
+        }
+
+        sqe->opcode=IORING_OP_SENDMSG;
+        sqe->fd=sock;
+        sqe->addr=(uint64_t)(uintptr_t)&t->msg;
+        sqe->len=1;
+        sqe->user_data=UD_MAKE(uop_send, slot, 0);
+    }
+    uring_submit(u);
+
+    return i ? (int)i : PCP_ERR_WOULDBLOCK;
+}
+
+int pcp_uring_recvmmsg(struct pcp_uring *u, pcp_sock_msg_t *msgs,
+        unsigned cnt)
+{
+    unsigned n=0;
+    int returned=0;
+
+    uring_reap(u);
+
+    while ((n < cnt) && (u->rx_cnt)) {
+        struct uring_rx *r=u->rx + u->rx_head;
+        uint16_t bid=(uint16_t)(r->flags >> IORING_CQE_BUFFER_SHIFT);
+        char *b=u->rx_bufs + (size_t)bid * URING_RX_BUF_LEN;
+        struct io_uring_recvmsg_out *o=(struct io_uring_recvmsg_out *)b;
+        pcp_sock_msg_t *m=msgs + n;
+
+        u->rx_head=(u->rx_head + 1) & (URING_RX_BUFS - 1);
+        --u->rx_cnt;
+
+        // datagrams of sockets closed in the meantime are dropped
+        if (uring_sock_valid(u, r->sock, r->gen)) {
+            size_t len=o->payloadlen;
+            socklen_t namelen=o->namelen;
+            size_t controllen=o->controllen;
+
+            if (len > (size_t)r->res - URING_RX_HDR_LEN) {
+                len=(size_t)r->res - URING_RX_HDR_LEN; //truncated
+            }
+            if (len > m->len) {
+                len=m->len;
+            }
+            memcpy(m->buf, b + URING_RX_HDR_LEN, len);
+            m->len=len;
+            if (namelen > URING_NAME_LEN) {
+                namelen=URING_NAME_LEN;
+            }
+            if ((m->addr) && (namelen <= m->addrlen)) {
+                memcpy(m->addr, b + sizeof(*o), namelen);
+                m->addrlen=namelen;
+            }
+            if (controllen > URING_CONTROL_LEN) {
+                controllen=URING_CONTROL_LEN;
+            }
+            if ((m->control) && (controllen <= m->controllen)) {
+                memcpy(m->control, b + sizeof(*o) + URING_NAME_LEN,
+                        controllen);
+                m->controllen=controllen;
+            } else {
+                m->controllen=0;
+            }
+            m->flags=(int)o->flags;
+            ++n;
+        }
+        uring_buf_add(u, bid);
+        returned=1;
+    }
+    if (returned) {
+        uring_buf_publish(u);
+    }
+    if (u->need_arm) {
+        uring_arm_all(u);
+    }
+    uring_submit(u);
+
+    return n ? (int)n : PCP_ERR_WOULDBLOCK;
+}
+
+int pcp_uring_send_error(struct pcp_uring *u, PCP_SOCKET sock)
+{
+    size_t i;
+    int err;
+
+    if (!u) {
+        return 0;
+    }
+    i=uring_sock_index(u, sock);
+    if (i == u->socks_len) {
+        return 0;
+    }
+    err=u->socks[i].send_error;
+    u->socks[i].send_error=0;
+
+    return err;
+}
+
+int pcp_uring_pending(struct pcp_uring *u)
+{
+    return (u) && (u->rx_cnt);
+}
+
+PCP_SOCKET pcp_uring_fd(struct pcp_uring *u)
+{
+    return u->fd;
+}
+
+#endif //PCP_USE_IO_URING
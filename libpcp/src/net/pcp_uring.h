@@ -0,0 +1,128 @@
+/*
+ Copyright (c) 2014 by Cisco Systems, Inc.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PCP_URING_H_
+#define PCP_URING_H_
+
+#include "pcp_socket.h"
+
+/*
+ * io_uring transport of default sockets (PCP_INIT_IO_URING). Every socket
+ * of the context keeps multishot receive armed, datagrams land in buffers
+ * provided to kernel by buffer ring. Requests are submitted in batches,
+ * one io_uring_enter per batch. Completions of all sockets are read from
+ * one ring, whose fd is polled instead of the sockets.
+ */
+
+struct pcp_ctx_s;
+struct pcp_uring;
+
+#ifdef PCP_USE_IO_URING
+
+/* set up ring of ctx and arm context sockets; PCP_ERR_NOT_FOUND if kernel
+ * lacks io_uring or features it needs (Linux 6.0) */
+pcp_errno pcp_uring_init(struct pcp_ctx_s *ctx);
+
+/* after sockets of ctx were closed */
+void pcp_uring_free(struct pcp_ctx_s *ctx);
+
+/* start receiving on new socket / stop before socket is closed */
+pcp_errno pcp_uring_add_socket(struct pcp_uring *u, PCP_SOCKET sock);
+
+void pcp_uring_remove_socket(struct pcp_uring *u, PCP_SOCKET sock);
+
+/* as sock_sendmmsg of pcp_socket_vt_ext_t; datagrams are copied, so msgs
+ * can be reused right away, send errors come with completions later */
+int pcp_uring_sendmmsg(struct pcp_uring *u, PCP_SOCKET sock,
+        pcp_sock_msg_t *msgs, unsigned cnt);
+
+/* as sock_recvmmsg of pcp_socket_vt_ext_t, datagrams of any socket */
+int pcp_uring_recvmmsg(struct pcp_uring *u, pcp_sock_msg_t *msgs,
+        unsigned cnt);
+
+/* errno of the last failed send of sock completed since the previous call,
+ * 0 if none */
+int pcp_uring_send_error(struct pcp_uring *u, PCP_SOCKET sock);
+
+/* nonzero if received datagrams were put aside while sending, so they
+ * don't make ring fd readable */
+int pcp_uring_pending(struct pcp_uring *u);
+
+/* fd readable while completions wait in the ring */
+PCP_SOCKET pcp_uring_fd(struct pcp_uring *u);
+
+#else //PCP_USE_IO_URING
+
+#include "pcp_utils.h"
+
+static inline pcp_errno pcp_uring_init(struct pcp_ctx_s *ctx UNUSED)
+{
+    return PCP_ERR_NOT_FOUND;
+}
+
+static inline void pcp_uring_free(struct pcp_ctx_s *ctx UNUSED)
+{
+}
+
+static inline pcp_errno pcp_uring_add_socket(struct pcp_uring *u UNUSED,
+        PCP_SOCKET sock UNUSED)
+{
+    return PCP_ERR_NOT_FOUND;
+}
+
+static inline void pcp_uring_remove_socket(struct pcp_uring *u UNUSED,
+        PCP_SOCKET sock UNUSED)
+{
+}
+
+static inline int pcp_uring_sendmmsg(struct pcp_uring *u UNUSED,
+        PCP_SOCKET sock UNUSED, pcp_sock_msg_t *msgs UNUSED,
+        unsigned cnt UNUSED)
+{
+    return PCP_ERR_SEND_FAILED;
+}
+
+static inline int pcp_uring_recvmmsg(struct pcp_uring *u UNUSED,
+        pcp_sock_msg_t *msgs UNUSED, unsigned cnt UNUSED)
+{
+    return PCP_ERR_RECV_FAILED;
+}
+
+static inline int pcp_uring_send_error(struct pcp_uring *u UNUSED,
+        PCP_SOCKET sock UNUSED)
+{
+    return 0;
+}
+
+static inline int pcp_uring_pending(struct pcp_uring *u UNUSED)
+{
+    return 0;
+}
+
+#define pcp_uring_fd(u) PCP_INVALID_SOCKET
+
+#endif //PCP_USE_IO_URING
+
+#endif /* PCP_URING_H_ */
@@ -54,17 +54,223 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #include "pcp.h"
 #include "pcp_socket.h"
+#include "pcp_uring.h"
+#include "pcp_sans_io.h"
 #include "pcp_client_db.h"
 #include "pcp_logger.h"
 #include "pcp_event_handler.h"
 #include "pcp_utils.h"
 #include "pcp_server_discovery.h"
-#include "net/findsaddr.h"
+#include "net/gateway.h"
+#include "pcp_saddr_cache.h"
+#include "pcp_io_thread.h"
+#include "pcp_cq.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//          Calls from application threads to ctx owned by I/O thread
+
+struct io_new_flow_args {
+    struct sockaddr *src_addr;
+    struct sockaddr *dst_addr;
+    struct sockaddr *ext_addr;
+    uint8_t protocol;
+    uint32_t lifetime;
+    void *userdata;
+    pcp_flow_t *ret;
+};
+
+static void io_new_flow(pcp_ctx_t *ctx, void *args)
+{
+    struct io_new_flow_args *a=(struct io_new_flow_args *)args;
+
+    a->ret=pcp_new_flow(ctx, a->src_addr, a->dst_addr, a->ext_addr,
+            a->protocol, a->lifetime, a->userdata);
+}
+
+struct io_add_server_args {
+    struct sockaddr *pcp_server;
+    uint8_t pcp_version;
+    int ret;
+};
+
+static void io_add_server(pcp_ctx_t *ctx, void *args)
+{
+    struct io_add_server_args *a=(struct io_add_server_args *)args;
+
+    a->ret=pcp_add_server(ctx, a->pcp_server, a->pcp_version);
+}
+
+struct io_get_io_stats_args {
+    int pcp_server;
+    pcp_io_stats_t *stats;
+    int ret;
+};
+
+static void io_get_io_stats(pcp_ctx_t *ctx, void *args)
+{
+    struct io_get_io_stats_args *a=(struct io_get_io_stats_args *)args;
+
+    a->ret=pcp_get_io_stats(ctx, a->pcp_server, a->stats);
+}
+
+struct io_set_rcvbuf_args {
+    int pcp_server;
+    int bytes;
+    int ret;
+};
+
+static void io_set_rcvbuf(pcp_ctx_t *ctx, void *args)
+{
+    struct io_set_rcvbuf_args *a=(struct io_set_rcvbuf_args *)args;
+
+    a->ret=pcp_set_rcvbuf(ctx, a->pcp_server, a->bytes);
+}
+
+static void io_routes_changed(pcp_ctx_t *ctx, void *args)
+{
+    *(int *)args=pcp_routes_changed(ctx);
+}
+
+static void io_enable_route_monitor(pcp_ctx_t *ctx, void *args)
+{
+    *(int *)args=pcp_enable_route_monitor(ctx);
+}
+
+struct io_flow_args {
+    pcp_flow_t *f;
+    uint32_t val;
+    uint8_t val2;
+    struct sockaddr_storage addr;
+};
+
+static void io_flow_set_lifetime(pcp_ctx_t *ctx UNUSED, void *args)
+{
+    struct io_flow_args *a=(struct io_flow_args *)args;
+
+    pcp_flow_set_lifetime(a->f, a->val);
+}
+
+static void io_flow_set_3rd_party_opt(pcp_ctx_t *ctx UNUSED, void *args)
+{
+    struct io_flow_args *a=(struct io_flow_args *)args;
+
+    pcp_flow_set_3rd_party_opt(a->f, (struct sockaddr *)&a->addr);
+}
+
+static void io_flow_set_filter_opt(pcp_ctx_t *ctx UNUSED, void *args)
+{
+    struct io_flow_args *a=(struct io_flow_args *)args;
+
+    pcp_flow_set_filter_opt(a->f, (struct sockaddr *)&a->addr, a->val2);
+}
+
+static void io_flow_set_prefer_failure_opt(pcp_ctx_t *ctx UNUSED, void *args)
+{
+    pcp_flow_set_prefer_failure_opt(((struct io_flow_args *)args)->f);
+}
+
+#ifdef PCP_FLOW_PRIORITY
+static void io_flow_set_flowp(pcp_ctx_t *ctx UNUSED, void *args)
+{
+    struct io_flow_args *a=(struct io_flow_args *)args;
+
+    pcp_flow_set_flowp(a->f, (uint8_t)a->val, a->val2);
+}
+#endif
+
+static void io_close_flow(pcp_ctx_t *ctx UNUSED, void *args)
+{
+    pcp_close_flow(((struct io_flow_args *)args)->f);
+}
+
+static void io_delete_flow(pcp_ctx_t *ctx UNUSED, void *args)
+{
+    pcp_delete_flow(((struct io_flow_args *)args)->f);
+}
+
+static void io_post_flow_cmd(pcp_io_call_fn fn, pcp_flow_t *f, uint32_t val,
+        uint8_t val2, struct sockaddr *addr)
+{
+    struct io_flow_args a;
+
+    a.f=f;
+    a.val=val;
+    a.val2=val2;
+    if (addr) {
+        memcpy(&a.addr, addr, SA_LEN(addr));
+    }
+    if (pcp_io_post(f->ctx, fn, &a, sizeof(a)) != PCP_ERR_SUCCESS) {
+        PCP_LOG(PCP_LOGLVL_ERR, "%s", "Cannot pass command to PCP I/O thread.");
+    }
+}
+
+struct io_flow_get_info_args {
+    pcp_flow_t *f;
+    size_t *info_count;
+    pcp_flow_info_t *ret;
+};
+
+static void io_flow_get_info(pcp_ctx_t *ctx UNUSED, void *args)
+{
+    struct io_flow_get_info_args *a=(struct io_flow_get_info_args *)args;
+
+    a->ret=pcp_flow_get_info(a->f, a->info_count);
+}
+
+struct io_eval_flow_state_args {
+    pcp_flow_t *f;
+    pcp_fstate_e *fstate;
+    int ret;
+};
+
+static void io_eval_flow_state(pcp_ctx_t *ctx UNUSED, void *args)
+{
+    struct io_eval_flow_state_args *a=(struct io_eval_flow_state_args *)args;
+
+    a->ret=pcp_eval_flow_state(a->f, a->fstate);
+}
+
+struct io_submit_args {
+    pcp_io_cmd_fn fn;
+    void *arg;
+};
+
+static void io_submit(pcp_ctx_t *ctx, void *args)
+{
+    struct io_submit_args *a=(struct io_submit_args *)args;
+
+    a->fn(ctx, a->arg);
+}
+
+int pcp_io_submit(pcp_ctx_t *ctx, pcp_io_cmd_fn fn, void *arg)
+{
+    if ((!ctx) || (!fn)) {
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    if (pcp_io_is_foreign(ctx)) {
+        struct io_submit_args a={fn, arg};
+
+        return pcp_io_post(ctx, io_submit, &a, sizeof(a));
+    }
+
+    fn(ctx, arg);
+    return PCP_ERR_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//                          API functions
 
 PCP_SOCKET pcp_get_socket(pcp_ctx_t *ctx)
 {
+    if ((ctx) && (ctx->uring)) {
+        return pcp_uring_fd(ctx->uring);
+    }
 
     return ctx ? ctx->socket : PCP_INVALID_SOCKET;
 }
@@ -79,6 +285,13 @@ int pcp_add_server(pcp_ctx_t *ctx, struct sockaddr *pcp_server,
     if (!ctx) {
         return PCP_ERR_BAD_ARGS;
     }
+    if (pcp_io_is_foreign(ctx)) {
+        struct io_add_server_args a={pcp_server, pcp_version, PCP_ERR_UNKNOWN};
+
+        pcp_io_call(ctx, io_add_server, &a);
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return a.ret;
+    }
     if (pcp_version > PCP_MAX_SUPPORTED_VERSION) {
         PCP_LOG_END(PCP_LOGLVL_INFO);
         return PCP_ERR_UNSUP_VERSION;
@@ -90,7 +303,173 @@ int pcp_add_server(pcp_ctx_t *ctx, struct sockaddr *pcp_server,
     return res;
 }
 
-pcp_ctx_t *pcp_init(uint8_t autodiscovery, pcp_socket_vt_t *socket_vt)
+int pcp_get_io_stats(pcp_ctx_t *ctx, int pcp_server, pcp_io_stats_t *stats)
+{
+    pcp_server_t *s=NULL;
+
+    if ((!ctx) || (!stats)) {
+        return PCP_ERR_BAD_ARGS;
+    }
+    if (pcp_io_is_foreign(ctx)) {
+        struct io_get_io_stats_args a={pcp_server, stats, PCP_ERR_UNKNOWN};
+
+        pcp_io_call(ctx, io_get_io_stats, &a);
+        return a.ret;
+    }
+    if ((pcp_server >= 0)
+            && ((s=get_pcp_server(ctx, pcp_server)) == NULL)) {
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    if (s) {
+        stats->rtt_samples=s->rtt_samples;
+        stats->rtt_last_us=s->rtt_last_us;
+        stats->rtt_min_us=s->rtt_min_us;
+        stats->rtt_srtt_us=s->rtt_srtt_us;
+        stats->rtt_var_us=s->rtt_var_us;
+    }
+    stats->rx_msgs=ctx->rx_msgs;
+    stats->rx_kernel_ts=ctx->rx_kernel_ts;
+    stats->queue_last_us=ctx->queue_last_us;
+    stats->queue_max_us=ctx->queue_max_us;
+    stats->queue_total_us=ctx->queue_total_us;
+
+    return PCP_ERR_SUCCESS;
+}
+
+int pcp_set_rcvbuf(pcp_ctx_t *ctx, int pcp_server, int bytes)
+{
+    pcp_server_t *s;
+
+    if ((!ctx) || (bytes <= 0)) {
+        return PCP_ERR_BAD_ARGS;
+    }
+    if (pcp_io_is_foreign(ctx)) {
+        struct io_set_rcvbuf_args a={pcp_server, bytes, PCP_ERR_UNKNOWN};
+
+        pcp_io_call(ctx, io_set_rcvbuf, &a);
+        return a.ret;
+    }
+    if (pcp_server < 0) {
+        if ((ctx->socket6 != PCP_INVALID_SOCKET)
+                && (pcp_socket_set_rcvbuf(ctx->socket6, bytes))) {
+            return PCP_ERR_UNKNOWN;
+        }
+        return pcp_socket_set_rcvbuf(ctx->socket, bytes);
+    }
+
+    s=get_pcp_server(ctx, pcp_server);
+    if (!s) {
+        return PCP_ERR_BAD_ARGS;
+    }
+    // kept for socket opened when server is added again
+    s->rcvbuf=bytes;
+    if (s->socket == PCP_INVALID_SOCKET) {
+        return PCP_ERR_NOT_FOUND;
+    }
+
+    return pcp_socket_set_rcvbuf(s->socket, bytes);
+}
+
+int pcp_routes_changed(pcp_ctx_t *ctx)
+{
+    if (!ctx) {
+        return PCP_ERR_BAD_ARGS;
+    }
+    if (pcp_io_is_foreign(ctx)) {
+        int ret=PCP_ERR_UNKNOWN;
+
+        pcp_io_call(ctx, io_routes_changed, &ret);
+        return ret;
+    }
+
+    return psd_check_routes(ctx);
+}
+
+int pcp_enable_route_monitor(pcp_ctx_t *ctx)
+{
+    if (!ctx) {
+        return PCP_ERR_BAD_ARGS;
+    }
+    if (pcp_io_is_foreign(ctx)) {
+        int ret=PCP_ERR_UNKNOWN;
+
+        pcp_io_call(ctx, io_enable_route_monitor, &ret);
+        return ret;
+    }
+
+#ifdef __linux__
+    if (ctx->route_fd == PCP_INVALID_SOCKET) {
+        ctx->route_fd=gw_monitor_open();
+        if (ctx->route_fd == PCP_INVALID_SOCKET) {
+            PCP_LOG(PCP_LOGLVL_ERR, "%s",
+                    "Cannot subscribe to route notifications.");
+            return PCP_ERR_UNKNOWN;
+        }
+        // changes made before subscription are caught up
+        psd_check_routes(ctx);
+    }
+    return PCP_ERR_SUCCESS;
+#else
+    return PCP_ERR_NOT_FOUND;
+#endif
+}
+
+static void pcp_ctx_seed_rand(pcp_ctx_t *ctx)
+{
+    uint64_t seed=0;
+
+#if defined(__linux__) && defined(SYS_getrandom)
+    if (syscall(SYS_getrandom, &seed, sizeof(seed), 0) != sizeof(seed)) {
+        seed=0;
+    }
+#endif
+    if (!seed) {
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        seed=((uint64_t)tv.tv_sec << 20) ^ (uint64_t)tv.tv_usec
+                ^ (uint64_t)(uintptr_t)ctx;
+    }
+    ctx->rand_state=seed;
+}
+
+/* dual-stack socket if preferred and possible, AF_INET and IPv6 only socket
+ * otherwise */
+static void pcp_ctx_open_sockets(pcp_ctx_t *ctx, int separate)
+{
+    ctx->socket6=PCP_INVALID_SOCKET;
+    ctx->dual_stack=0;
+
+#ifdef PCP_USE_IPV6_SOCKET
+    if (!separate) {
+        ctx->socket=pcp_socket_create(ctx, AF_INET6, SOCK_DGRAM, 0);
+        if (ctx->socket != PCP_INVALID_SOCKET) {
+            ctx->dual_stack=1;
+            return;
+        }
+        PCP_LOG(PCP_LOGLVL_INFO, "%s", "Cannot create dual-stack socket, "
+                "using separate IPv4 and IPv6 sockets.");
+    }
+
+    ctx->socket6=pcp_socket_create_src(ctx, AF_INET6, SOCK_DGRAM, 0, NULL, 1);
+    if (ctx->socket6 == PCP_INVALID_SOCKET) {
+        PCP_LOG(PCP_LOGLVL_INFO, "%s", "Cannot create IPv6 socket, "
+                "IPv6 PCP servers can't be used.");
+    }
+#else
+    OSDEP(separate);
+#endif
+    ctx->socket=pcp_socket_create(ctx, AF_INET, SOCK_DGRAM, 0);
+    if ((ctx->socket == PCP_INVALID_SOCKET)
+            && (ctx->socket6 != PCP_INVALID_SOCKET)) {
+        pcp_socket_close(ctx, ctx->socket6);
+        ctx->socket6=PCP_INVALID_SOCKET;
+    }
+}
+
+pcp_ctx_t *pcp_init(uint32_t autodiscovery, pcp_socket_vt_t *socket_vt)
 {
     pcp_ctx_t *ctx=(pcp_ctx_t *)calloc(1, sizeof(pcp_ctx_t));
 
@@ -103,20 +482,49 @@ pcp_ctx_t *pcp_init(uint8_t autodiscovery, pcp_socket_vt_t *socket_vt)
         return NULL;
     }
 
+    ctx->timer_fd=PCP_INVALID_SOCKET;
+    ctx->route_fd=PCP_INVALID_SOCKET;
+    ctx->gw_discovery=(autodiscovery & ENABLE_AUTODISCOVERY) != 0;
+    pcp_ctx_seed_rand(ctx);
+
     if (socket_vt) {
         ctx->virt_socket_tb=socket_vt;
+        if ((autodiscovery & PCP_INIT_SOCKET_VT_EXT)
+                && (((pcp_socket_vt_ext_t *)socket_vt)->version >= 1)) {
+            ctx->virt_socket_ext=(pcp_socket_vt_ext_t *)socket_vt;
+        }
     } else {
-        ctx->virt_socket_tb=&default_socket_vt;
+        ctx->virt_socket_tb=&default_socket_vt.base;
+        ctx->virt_socket_ext=&default_socket_vt;
     }
+    ctx->socket_connected=(autodiscovery & PCP_INIT_SOCKET_CONNECTED) != 0;
+    ctx->socket_per_server=(ctx->socket_connected)
+            || (autodiscovery & PCP_INIT_SOCKET_PER_SERVER);
+
+    // application moves datagrams itself, socket options don't apply;
+    // servers get addresses of their own family, as with separate sockets
+    if (autodiscovery & PCP_INIT_SANS_IO) {
+        ctx->socket=PCP_INVALID_SOCKET;
+        ctx->socket6=PCP_INVALID_SOCKET;
+        ctx->dual_stack=0;
+        ctx->socket_connected=0;
+        ctx->socket_per_server=0;
+        ctx->sio=pcp_sio_create();
+        if (!ctx->sio) {
+            PCP_LOG(PCP_LOGLVL_ERR, "%s", "Error allocating memory");
+            free(ctx);
 
-    ctx->socket=pcp_socket_create(ctx,
-#ifdef PCP_USE_IPV6_SOCKET
-            AF_INET6,
-#else
-            AF_INET,
-#endif
-            SOCK_DGRAM, 0);
+            PCP_LOG_END(PCP_LOGLVL_DEBUG);
+            return NULL;
+        }
+        if (autodiscovery & ENABLE_AUTODISCOVERY)
+            psd_add_gws(ctx);
 
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return ctx;
+    }
+
+    pcp_ctx_open_sockets(ctx, autodiscovery & PCP_INIT_SOCKET_SEPARATE_AF);
     if (ctx->socket == PCP_INVALID_SOCKET) {
         PCP_LOG(PCP_LOGLVL_WARN, "%s",
                 "Error occurred while creating a PCP socket.");
@@ -126,9 +534,27 @@ pcp_ctx_t *pcp_init(uint8_t autodiscovery, pcp_socket_vt_t *socket_vt)
     }
     PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "Created a new PCP socket.");
 
-    if (autodiscovery)
+    if ((autodiscovery & PCP_INIT_IO_URING)
+            && (ctx->virt_socket_tb == &default_socket_vt.base)
+            && (pcp_uring_init(ctx) != PCP_ERR_SUCCESS)) {
+        PCP_LOG(PCP_LOGLVL_INFO, "%s", "io_uring is not available, "
+                "using plain socket calls.");
+    }
+
+    if (autodiscovery & ENABLE_AUTODISCOVERY)
         psd_add_gws(ctx);
 
+    if ((autodiscovery & PCP_INIT_IO_THREAD)
+            && (pcp_io_thread_start(ctx) != PCP_ERR_SUCCESS)) {
+        PCP_LOG(PCP_LOGLVL_ERR, "%s",
+                "Error occurred while starting PCP I/O thread.");
+        pcp_terminate(ctx, 0);
+        free(ctx);
+
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return NULL;
+    }
+
     PCP_LOG_END(PCP_LOGLVL_DEBUG);
     return ctx;
 }
@@ -143,6 +569,14 @@ int pcp_eval_flow_state(pcp_flow_t *flow, pcp_fstate_e *fstate)
 
     PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
 
+    if ((flow) && (pcp_io_is_foreign(flow->ctx))) {
+        struct io_eval_flow_state_args a={flow, fstate, 0};
+
+        pcp_io_call(flow->ctx, io_eval_flow_state, &a);
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return a.ret;
+    }
+
     for (fiter=flow; fiter != NULL; fiter=fiter->next_child) {
         switch (fiter->state) {
             case pfs_wait_for_lifetime_renew:
@@ -184,6 +618,52 @@ int pcp_eval_flow_state(pcp_flow_t *flow, pcp_fstate_e *fstate)
     return nexit_states;
 }
 
+#ifndef PCP_SOCKET_IS_VOIDPTR
+/* adds context sockets and own sockets of servers to fds, returns fdmax */
+static int wait_fd_set(pcp_ctx_t *ctx, fd_set *fds)
+{
+    int fdmax=(int)ctx->socket + 1;
+    size_t i;
+
+    if (ctx->route_fd != PCP_INVALID_SOCKET) {
+        FD_SET(ctx->route_fd, fds);
+    }
+    if (ctx->uring) {
+        FD_SET(pcp_uring_fd(ctx->uring), fds);
+        fdmax=(int)pcp_uring_fd(ctx->uring) + 1;
+    } else {
+        FD_SET(ctx->socket, fds);
+    }
+    if ((int)ctx->route_fd + 1 > fdmax) {
+        fdmax=(int)ctx->route_fd + 1;
+    }
+    if (ctx->uring) {
+        return fdmax;
+    }
+
+    if (ctx->socket6 != PCP_INVALID_SOCKET) {
+        FD_SET(ctx->socket6, fds);
+        if ((int)ctx->socket6 + 1 > fdmax) {
+            fdmax=(int)ctx->socket6 + 1;
+        }
+    }
+    for (i=0; i < ctx->pcp_db.pcp_servers_length; ++i) {
+        pcp_server_t *s=ctx->pcp_db.pcp_servers + i;
+
+        if ((s->server_state == pss_unitialized)
+                || (s->socket == PCP_INVALID_SOCKET)) {
+            continue;
+        }
+        FD_SET(s->socket, fds);
+        if ((int)s->socket + 1 > fdmax) {
+            fdmax=(int)s->socket + 1;
+        }
+    }
+
+    return fdmax;
+}
+#endif
+
 pcp_fstate_e pcp_wait(pcp_flow_t *flow, int timeout, int exit_on_partial_res)
 {
 #ifdef PCP_SOCKET_IS_VOIDPTR
@@ -191,7 +671,6 @@ pcp_fstate_e pcp_wait(pcp_flow_t *flow, int timeout, int exit_on_partial_res)
 #else
     fd_set read_fds;
     int fdmax;
-    PCP_SOCKET fd;
     struct timeval tout_end;
     struct timeval tout_select;
     pcp_fstate_e fstate;
@@ -205,6 +684,18 @@ pcp_fstate_e pcp_wait(pcp_flow_t *flow, int timeout, int exit_on_partial_res)
         return pcp_state_failed;
     }
 
+    if (pcp_io_is_foreign(flow->ctx)) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return pcp_io_wait(flow, timeout, exit_on_partial_res);
+    }
+
+    if (flow->ctx->sio) {
+        PCP_LOG(PCP_LOGLVL_ERR, "%s",
+                "pcp_wait can't be used with sans-I/O context.");
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return pcp_state_failed;
+    }
+
     switch (fstate) {
         case pcp_state_partial_result:
         case pcp_state_processing:
@@ -225,9 +716,7 @@ pcp_fstate_e pcp_wait(pcp_flow_t *flow, int timeout, int exit_on_partial_res)
             flow->key_bucket, timeout);
 
     FD_ZERO(&read_fds);
-
-    fd=pcp_get_socket(flow->ctx);
-    fdmax=fd + 1;
+    fdmax=wait_fd_set(flow->ctx, &read_fds);
 
     // main loop
     for (;;) {
@@ -258,7 +747,7 @@ pcp_fstate_e pcp_wait(pcp_flow_t *flow, int timeout, int exit_on_partial_res)
         }
 
         FD_ZERO(&read_fds);
-        FD_SET(fd, &read_fds);
+        fdmax=wait_fd_set(flow->ctx, &read_fds);
 
         PCP_LOG(PCP_LOGLVL_DEBUG,
                 "Executing select with fdmax=%d, timeout = %ld s; %ld us",
@@ -315,7 +804,11 @@ static inline void init_flow(pcp_flow_t *f, pcp_server_t *s, int lifetime,
             f->state=pfs_wait_for_server_init;
         }
 
-        s->next_timeout=curtime;
+        // don't force ping retransmission, flow is sent once server responds
+        if (s->server_state != pss_wait_ping_resp) {
+            s->next_timeout=curtime;
+            pcp_ctx_deadline_update(s->ctx, &curtime);
+        }
         f->user_data=NULL;
 
         pcp_db_add_flow(f);
@@ -360,6 +853,7 @@ static int chain_and_assign_src_ip(pcp_server_t *s, void *data)
             PCP_LOG_END(PCP_LOGLVL_DEBUG);
             return 1;
         }
+        f->src_auto=IN6_IS_ADDR_UNSPECIFIED(d->src_ip);
 #ifdef PCP_SADSCP
         if (d->kd->operation == PCP_OPCODE_SADSCP) {
             f->sadscp.toler_fields = d->toler_fields;
@@ -402,6 +896,15 @@ pcp_flow_t *pcp_new_flow(pcp_ctx_t *ctx, struct sockaddr *src_addr,
     if ((!src_addr) || (!ctx)) {
         return NULL;
     }
+
+    if (pcp_io_is_foreign(ctx)) {
+        struct io_new_flow_args a={src_addr, dst_addr, ext_addr, protocol,
+                lifetime, userdata, NULL};
+
+        pcp_io_call(ctx, io_new_flow, &a);
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return a.ret;
+    }
     pcp_fill_in6_addr(&src_ip, &kd.map_peer.src_port, src_addr);
 
     kd.map_peer.protocol=protocol;
@@ -431,10 +934,10 @@ pcp_flow_t *pcp_new_flow(pcp_ctx_t *ctx, struct sockaddr *src_addr,
         kd.operation=PCP_OPCODE_PEER;
         if (src_addr->sa_family == AF_INET) {
             if (S6_ADDR32(&src_ip)[3] == INADDR_ANY) {
-                findsaddr((struct sockaddr_in*)dst_addr, &src_ip);
+                pcp_findsaddr(ctx, dst_addr, &src_ip);
             }
         } else if (IN6_IS_ADDR_UNSPECIFIED(&src_ip)) {
-            findsaddr6((struct sockaddr_in6*)dst_addr, &src_ip);
+            pcp_findsaddr(ctx, dst_addr, &src_ip);
         } else if (dst_addr->sa_family != src_addr->sa_family) {
             PCP_LOG(PCP_LOGLVL_PERR, "%s",
                     "Socket family mismatch.");
@@ -475,7 +978,8 @@ pcp_flow_t *pcp_new_flow(pcp_ctx_t *ctx, struct sockaddr *src_addr,
     data.ffirst=NULL;
     data.userdata=userdata;
 
-    if (pcp_db_foreach_server(ctx, chain_and_assign_src_ip, &data)
+    // requests to the fastest server leave first, its flow heads the chain
+    if (pcp_db_foreach_server_by_rtt(ctx, chain_and_assign_src_ip, &data)
             != PCP_ERR_MAX_SIZE) {    // didn't iterate through each server => error happened
         pcp_delete_flow(data.ffirst);
         PCP_LOG_END(PCP_LOGLVL_DEBUG);
@@ -490,6 +994,11 @@ void pcp_flow_set_lifetime(pcp_flow_t *f, uint32_t lifetime)
 {
     pcp_flow_t *fiter;
 
+    if ((f) && (pcp_io_is_foreign(f->ctx))) {
+        io_post_flow_cmd(io_flow_set_lifetime, f, lifetime, 0, NULL);
+        return;
+    }
+
     for (fiter=f; fiter != NULL; fiter=fiter->next_child) {
         fiter->lifetime=lifetime;
 
@@ -501,6 +1010,11 @@ void pcp_flow_set_3rd_party_opt(pcp_flow_t *f, struct sockaddr *thirdp_addr)
 {
     pcp_flow_t *fiter;
 
+    if ((f) && (thirdp_addr) && (pcp_io_is_foreign(f->ctx))) {
+        io_post_flow_cmd(io_flow_set_3rd_party_opt, f, 0, 0, thirdp_addr);
+        return;
+    }
+
     for (fiter=f; fiter != NULL; fiter=fiter->next_child) {
         fiter->third_party_option_present=1;
         pcp_fill_in6_addr(&fiter->third_party_ip, NULL, thirdp_addr);
@@ -513,6 +1027,12 @@ void pcp_flow_set_filter_opt(pcp_flow_t *f, struct sockaddr *filter_ip,
 {
     pcp_flow_t *fiter;
 
+    if ((f) && (filter_ip) && (pcp_io_is_foreign(f->ctx))) {
+        io_post_flow_cmd(io_flow_set_filter_opt, f, 0, filter_prefix,
+                filter_ip);
+        return;
+    }
+
     for (fiter=f; fiter != NULL; fiter=fiter->next_child) {
         if (!fiter->filter_option_present) {
             fiter->filter_option_present=1;
@@ -527,6 +1047,11 @@ void pcp_flow_set_prefer_failure_opt(pcp_flow_t *f)
 {
     pcp_flow_t *fiter;
 
+    if ((f) && (pcp_io_is_foreign(f->ctx))) {
+        io_post_flow_cmd(io_flow_set_prefer_failure_opt, f, 0, 0, NULL);
+        return;
+    }
+
     for (fiter=f; fiter != NULL; fiter=fiter->next_child) {
         if (!fiter->pfailure_option_present) {
             fiter->pfailure_option_present=1;
@@ -586,6 +1111,11 @@ void pcp_flow_set_flowp(pcp_flow_t *f, uint8_t dscp_up, uint8_t dscp_down)
 {
     pcp_flow_t *fiter;
 
+    if ((f) && (pcp_io_is_foreign(f->ctx))) {
+        io_post_flow_cmd(io_flow_set_flowp, f, dscp_up, dscp_down, NULL);
+        return;
+    }
+
     for (fiter=f; fiter; fiter=fiter->next_child) {
         uint8_t fpresent = (dscp_up!=0)||(dscp_down!=0);
         if (fiter->flowp_option_present != fpresent) {
@@ -627,6 +1157,11 @@ void pcp_close_flow(pcp_flow_t *f)
 {
     pcp_flow_t *fiter;
 
+    if ((f) && (pcp_io_is_foreign(f->ctx))) {
+        io_post_flow_cmd(io_close_flow, f, 0, 0, NULL);
+        return;
+    }
+
     for (fiter=f; fiter; fiter=fiter->next_child) {
         pcp_close_flow_intern(fiter);
     }
@@ -641,6 +1176,11 @@ void pcp_delete_flow(pcp_flow_t *f)
     pcp_flow_t *fiter=f;
     pcp_flow_t *fnext=NULL;
 
+    if ((f) && (pcp_io_is_foreign(f->ctx))) {
+        io_post_flow_cmd(io_delete_flow, f, 0, 0, NULL);
+        return;
+    }
+
     while (fiter) {
         fnext=fiter->next_child;
         pcp_delete_flow_intern(fiter);
@@ -648,12 +1188,18 @@ void pcp_delete_flow(pcp_flow_t *f)
     }
 }
 
-static int delete_flow_iter(pcp_flow_t *f, void *data)
+static int close_flow_iter(pcp_flow_t *f, void *data UNUSED)
 {
-    if (data) {
+    // ANNOUNCE probe of a server has no mapping to close
+    if (f->kd.operation != PCP_OPCODE_ANNOUNCE) {
         pcp_close_flow_intern(f);
-        pcp_pulse(f->ctx, NULL);
     }
+
+    return 0;
+}
+
+static int delete_flow_iter(pcp_flow_t *f, void *data UNUSED)
+{
     pcp_delete_flow_intern(f);
 
     return 0;
@@ -661,9 +1207,47 @@ static int delete_flow_iter(pcp_flow_t *f, void *data)
 
 void pcp_terminate(pcp_ctx_t *ctx, int close_flows)
 {
-    pcp_db_foreach_flow(ctx, delete_flow_iter, close_flows ? (void *)1 : NULL);
+    if (ctx->io) {
+        if (!pcp_io_is_foreign(ctx)) {
+            PCP_LOG(PCP_LOGLVL_ERR, "%s",
+                    "pcp_terminate called from PCP I/O thread.");
+            return;
+        }
+        pcp_io_thread_stop(ctx);
+    }
+
+    // pulse may add or remove ANNOUNCE probes, so it's not run while flows
+    // are iterated; closing requests leave by one pulse
+    if (close_flows) {
+        pcp_db_foreach_flow(ctx, close_flow_iter, NULL);
+        pcp_pulse(ctx, NULL);
+    }
+    pcp_db_foreach_flow(ctx, delete_flow_iter, NULL);
+    free(ctx->flow_changes);
+    ctx->flow_changes=NULL;
+    ctx->flow_changes_cnt=ctx->flow_changes_size=0;
+    ctx->flow_changes_lost=0;
+    pcp_cq_free(ctx);
     pcp_db_free_pcp_servers(ctx);
-    pcp_socket_close(ctx);
+    if (ctx->socket != PCP_INVALID_SOCKET) {
+        pcp_socket_close(ctx, ctx->socket);
+    }
+    if (ctx->socket6 != PCP_INVALID_SOCKET) {
+        pcp_socket_close(ctx, ctx->socket6);
+        ctx->socket6=PCP_INVALID_SOCKET;
+    }
+    pcp_uring_free(ctx);
+    pcp_sio_destroy(ctx->sio);
+    ctx->sio=NULL;
+    if (ctx->timer_fd != PCP_INVALID_SOCKET) {
+        CLOSE(ctx->timer_fd);
+        ctx->timer_fd=PCP_INVALID_SOCKET;
+    }
+    if (ctx->route_fd != PCP_INVALID_SOCKET) {
+        CLOSE(ctx->route_fd);
+        ctx->route_fd=PCP_INVALID_SOCKET;
+    }
+    pcp_saddr_cache_free(ctx);
 }
 
 pcp_flow_info_t *pcp_flow_get_info(pcp_flow_t *f, size_t *info_count)
@@ -677,6 +1261,13 @@ pcp_flow_info_t *pcp_flow_get_info(pcp_flow_t *f, size_t *info_count)
         return NULL;
     }
 
+    if ((f) && (pcp_io_is_foreign(f->ctx))) {
+        struct io_flow_get_info_args a={f, info_count, NULL};
+
+        pcp_io_call(f->ctx, io_flow_get_info, &a);
+        return a.ret;
+    }
+
     for (fiter=f; fiter; fiter=fiter->next_child) {
       ++cnt;
     }
@@ -708,6 +1299,7 @@ pcp_flow_info_t *pcp_flow_get_info(pcp_flow_t *f, size_t *info_count)
         info_iter->recv_lifetime_end=fiter->recv_lifetime;
         info_iter->lifetime_renew_s=fiter->lifetime;
         info_iter->pcp_result_code=fiter->recv_result;
+        info_iter->accepted_opts=(uint8_t)fiter->opt_flags;
         memcpy(&info_iter->int_ip, &fiter->kd.src_ip, sizeof(struct in6_addr));
         memcpy(&info_iter->pcp_server_ip, &fiter->kd.pcp_server_ip,
                 sizeof(info_iter->pcp_server_ip));
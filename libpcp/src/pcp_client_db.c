@@ -40,6 +40,7 @@
 #include "pcp_utils.h"
 #include "pcp_client_db.h"
 #include "pcp_logger.h"
+#include "pcp_socket.h"
 
 #define EMPTY 0xFFFFFFFF
 #define PCP_INIT_SERVER_COUNT 5
@@ -78,7 +79,6 @@ pcp_flow_t *pcp_create_flow(pcp_server_t *s, struct flow_key_data *fkd)
         return NULL;
     }
 
-    flow->pcp_msg_len=0;
     flow->pcp_server_indx=(s ? s->index : PCP_INV_SERVER);
     flow->kd=*fkd;
     flow->key_bucket=EMPTY;
@@ -88,17 +88,6 @@ pcp_flow_t *pcp_create_flow(pcp_server_t *s, struct flow_key_data *fkd)
     return flow;
 }
 
-void pcp_flow_clear_msg_buf(pcp_flow_t *f)
-{
-    if (f) {
-        if (f->pcp_msg_buffer) {
-            free(f->pcp_msg_buffer);
-            f->pcp_msg_buffer=NULL;
-        }
-        f->pcp_msg_len=0;
-    }
-}
-
 pcp_errno pcp_delete_flow_intern(pcp_flow_t *f)
 {
     pcp_server_t *s;
@@ -107,8 +96,12 @@ pcp_errno pcp_delete_flow_intern(pcp_flow_t *f)
 
     pcp_db_rem_flow(f);
 
-    if (f->pcp_msg_buffer) {
-        free(f->pcp_msg_buffer);
+    if (f->change_idx) {
+        f->ctx->flow_changes[f->change_idx - 1].flow=NULL;
+    }
+
+    if (f->wire) {
+        free(f->wire);
     }
 
 #ifdef PCP_EXPERIMENTAL
@@ -146,6 +139,9 @@ pcp_errno pcp_db_add_flow(pcp_flow_t *f)
     ctx=f->ctx;
 
     f->key_bucket=indx=compute_flow_key(&f->kd);
+    // key data may have changed since flow was encoded
+    f->wire_len=0;
+    f->encoder=NULL;
     PCP_LOG(PCP_LOGLVL_DEBUG, "Adding flow %p, key_bucket %d",
             f, f->key_bucket);
 
@@ -202,6 +198,14 @@ pcp_errno pcp_db_rem_flow(pcp_flow_t *f)
     for (fdb=ctx->pcp_db.flows + f->key_bucket; (*fdb) != NULL;
             fdb=&((*fdb)->next)) {
         if (*fdb == f) {
+            uint32_t i;
+
+            // interrupted server sweeps continue past the removed flow
+            for (i=0; i < ctx->pcp_db.pcp_servers_length; ++i) {
+                if (ctx->pcp_db.pcp_servers[i].sweep_next == f) {
+                    ctx->pcp_db.pcp_servers[i].sweep_next=f->next;
+                }
+            }
             (*fdb)->key_bucket=EMPTY;
             (*fdb)=(*fdb)->next;
             ctx->pcp_db.flow_cnt--;
@@ -326,18 +330,17 @@ int pcp_new_server(pcp_ctx_t *ctx, struct in6_addr *ip, uint16_t port, uint32_t
     }
 
     ret->epoch=~0;
-#ifdef PCP_USE_IPV6_SOCKET
-    ret->af = AF_INET6;
-#else
-    ret->af=IN6_IS_ADDR_V4MAPPED(ip) ? AF_INET : AF_INET6;
-#endif
+    ret->socket=PCP_INVALID_SOCKET;
+    // family of server's address on the wire, v4-mapped on dual-stack socket
+    ret->af=(ctx->dual_stack) || (!IN6_IS_ADDR_V4MAPPED(ip)) ? AF_INET6 :
+            AF_INET;
     IPV6_ADDR_COPY((struct in6_addr*)ret->pcp_ip, ip);
     ret->pcp_port=port;
     ret->pcp_scope_id=scope_id;
     ret->ctx=ctx;
     ret->server_state=pss_allocated;
     ret->pcp_version=PCP_MAX_SUPPORTED_VERSION;
-    createNonce(&ret->nonce);
+    createNonce(ctx, &ret->nonce);
     ret->index=ret - ctx->pcp_db.pcp_servers;
 
     PCP_LOG_END(PCP_LOGLVL_DEBUG);
@@ -392,6 +395,58 @@ pcp_errno pcp_db_foreach_server(pcp_ctx_t *ctx, pcp_db_server_iterate f,
     return ret;
 }
 
+// sort key of server, smoothed RTT in upper half, index breaks ties
+static uint64_t server_rtt_key(pcp_server_t *s)
+{
+    uint64_t rtt=s->rtt_samples ? s->rtt_srtt_us : UINT32_MAX;
+
+    return (rtt << 32) | (uint32_t)s->index;
+}
+
+pcp_errno pcp_db_foreach_server_by_rtt(pcp_ctx_t *ctx,
+        pcp_db_server_iterate f, void *data)
+{
+    uint64_t prev=0, key, next;
+    uint32_t indx, i, cnt;
+    int first=1;
+
+    PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
+
+    assert(ctx && f);
+
+    // there are just a few servers, so next one is found by selection
+    cnt=(uint32_t)ctx->pcp_db.pcp_servers_length;
+    for (i=0; i < cnt; ++i) {
+        pcp_server_t *s=NULL;
+
+        next=UINT64_MAX;
+        for (indx=0; indx < cnt; ++indx) {
+            pcp_server_t *si=ctx->pcp_db.pcp_servers + indx;
+
+            if (si->server_state == pss_unitialized) {
+                continue;
+            }
+            key=server_rtt_key(si);
+            if (((first) || (key > prev)) && (key <= next)) {
+                next=key;
+                s=si;
+            }
+        }
+        if (!s) {
+            break;
+        }
+        first=0;
+        prev=next;
+        if ((*f)(s, data)) {
+            PCP_LOG_END(PCP_LOGLVL_DEBUG);
+            return PCP_ERR_SUCCESS;
+        }
+    }
+
+    PCP_LOG_END(PCP_LOGLVL_DEBUG);
+    return PCP_ERR_MAX_SIZE;
+}
+
 typedef struct find_data {
     struct in6_addr *ip;
     pcp_server_t *found_server;
@@ -437,6 +492,10 @@ void pcp_db_free_pcp_servers(pcp_ctx_t *ctx)
         if ((state != pss_unitialized) && (state != pss_allocated)) {
             run_server_state_machine(s, pcpe_terminate);
         }
+        if ((state != pss_unitialized) && (s->socket != PCP_INVALID_SOCKET)) {
+            pcp_socket_close(ctx, s->socket);
+            s->socket=PCP_INVALID_SOCKET;
+        }
     }
     free(ctx->pcp_db.pcp_servers);
     ctx->pcp_db.pcp_servers=NULL;
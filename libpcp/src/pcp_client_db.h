@@ -40,11 +40,18 @@ extern "C" {
 #endif
 
 typedef enum {
-    optf_3rd_party=1 << 0, optf_flowp=1 << 1,
+    optf_3rd_party=PCP_OPT_THIRD_PARTY, optf_flowp=PCP_OPT_FLOW_PRIORITY,
+    optf_pref_fail=PCP_OPT_PREFER_FAILURE, optf_filter=PCP_OPT_FILTER,
 } opt_flags_e;
 
 #define PCP_INV_SERVER (~0u)
 
+#ifndef PCP_IO_BATCH
+#define PCP_IO_BATCH 8 //datagrams sent or received by one socket call
+#endif
+
+#define PCP_RX_CONTROL_LEN 64 //ancillary data of received datagram
+
 #ifdef PCP_EXPERIMENTAL
 
 #ifndef MD_VAL_MAX_LEN
@@ -77,7 +84,12 @@ struct flow_key_data {
 };
 
 typedef struct pcp_recv_msg {
-    opt_flags_e opt_flags;
+    opt_flags_e opt_flags;  //options found in response
+    uint8_t filter_cnt;     //FILTER options found, data of the first is kept
+    uint8_t filter_prefix;
+    uint16_t filter_port;
+    struct in6_addr filter_ip;
+    struct in6_addr third_party_ip;
     struct flow_key_data kd;
     uint32_t key_bucket;
 
@@ -90,17 +102,22 @@ typedef struct pcp_recv_msg {
     uint32_t recv_lifetime;
     uint32_t recv_result;
     time_t received_time;
+    struct timeval rcvd_ts; //kernel receive timestamp, or time of reading
 
     //control data
     uint32_t pcp_server_indx;
     struct sockaddr_storage rcvd_from_addr;
-    //msg buffer
+    //received datagram, not owned by the message
     uint32_t pcp_msg_len;
-    char pcp_msg_buffer[PCP_MAX_LEN];
+    char *pcp_msg_buffer;
 } pcp_recv_msg_t;
 
 struct pcp_ctx_s {
-    PCP_SOCKET socket;
+    PCP_SOCKET socket;            //dual-stack AF_INET6, or AF_INET one
+    PCP_SOCKET socket6;           //IPv6 only socket next to AF_INET one
+    int dual_stack;               //socket carries IPv4 as v4-mapped IPv6
+    int socket_per_server;        //servers get own sockets, see pcp_server
+    int socket_connected;         //... connected to the server
     struct pcp_client_db {
         size_t pcp_servers_length;
         pcp_server_t *pcp_servers;
@@ -110,13 +127,63 @@ struct pcp_ctx_s {
     pcp_flow_change_notify flow_change_cb_fun;
     void *flow_change_cb_arg;
     pcp_recv_msg_t msg;
+    //datagrams received by one batch, msg is parsed from one of them
+    char msg_in[PCP_IO_BATCH][PCP_MAX_LEN];
+    struct sockaddr_storage msg_in_addr[PCP_IO_BATCH];
+    char msg_in_control[PCP_IO_BATCH][PCP_RX_CONTROL_LEN];
+    pcp_sock_msg_t rx[PCP_IO_BATCH];
+    //time received datagrams spent in socket queue
+    uint64_t rx_msgs;
+    uint64_t rx_kernel_ts;
+    uint32_t queue_last_us;
+    uint32_t queue_max_us;
+    uint64_t queue_total_us;
+    char msg_out[PCP_MAX_LEN];    //requests are encoded here before sending
     pcp_socket_vt_t *virt_socket_tb;
+    pcp_socket_vt_ext_t *virt_socket_ext; //NULL => batches emulated
+    struct pcp_uring *uring;      //io_uring transport, NULL => socket calls
+    struct pcp_sio *sio;          //transmit queue of context without sockets
+    //requests queued by flow sweeps, sent in batches
+    int tx_batching;
+    PCP_SOCKET tx_sock;           //socket of queued requests
+    pcp_server_t *tx_server;      //their server if they use its own socket
+    uint32_t tx_cnt;
+    pcp_sock_msg_t tx[PCP_IO_BATCH];
+    char tx_buf[PCP_IO_BATCH][PCP_MAX_LEN];
+    struct sockaddr_storage tx_addr[PCP_IO_BATCH];
+    //reactor integration
+    struct timeval next_deadline; //earliest server timeout, zero if none
+    PCP_SOCKET timer_fd;          //armed at next_deadline if enabled
+    PCP_SOCKET route_fd;          //route and address notifications
+    int gw_discovery;             //default gateways are used as servers
+    struct pcp_saddr_cache *saddr_cache; //source addresses of destinations
+    struct pcp_io_thread *io;     //non NULL if ctx is owned by I/O thread
+    uint64_t rand_state;          //pcp_rand() state, seeded in pcp_init
+    //batched flow change notifications
+    pcp_flow_change_batch_notify flow_change_batch_fun;
+    void *flow_change_batch_arg;
+    pcp_flow_change_t *flow_changes;
+    size_t flow_changes_cnt;
+    size_t flow_changes_size;
+    int flow_changes_lost;        //change not queued, reported by flush
+    struct pcp_cq *cq;            //completion queue, NULL if not enabled
+    //work budget of pcp_pulse_budget, unlimited if not active
+    int budget_active;
+    int budget_exhausted;
+    uint32_t budget_max_flows;    //0 => no limit
+    uint32_t budget_used;         //responses read and flows visited so far
+    uint32_t budget_clock_at;     //budget_used of the next time check
+    struct timeval budget_end;    //zero => no time limit
+    uint32_t sweep_gen;           //last generation assigned to flow sweep
 };
 
+/* encodes request of the flow into buf, returns end of the message or NULL */
+typedef void *(*pcp_msg_encoder_t)(struct pcp_flow_s *flow, char *buf);
+
 struct pcp_flow_s {
     // flow's data
     struct pcp_ctx_s *ctx;
-    opt_flags_e opt_flags;
+    opt_flags_e opt_flags; //options accepted by server in last response
     struct flow_key_data kd;
     uint32_t key_bucket;
 
@@ -144,6 +211,9 @@ struct pcp_flow_s {
     //control data
     struct pcp_flow_s *next; //next flow with same key bucket
     struct pcp_flow_s *next_child; //next flow for MAP with 0.0.0.0 src ip
+    uint32_t change_idx; //1 based index in ctx->flow_changes, 0 => none
+    uint32_t sweep_gen; //last server sweep which visited this flow
+    uint8_t src_auto; //src_ip taken from server, follows its changes
     uint32_t pcp_server_indx;
     pcp_flow_state_e state;
     uint32_t resend_timeout;
@@ -188,9 +258,20 @@ struct pcp_flow_s {
     md_val_t *md_vals;
 #endif
 
-    //msg buffer
-    uint32_t pcp_msg_len;
-    char *pcp_msg_buffer;
+    //encoded request, valid if wire_len != 0; only lifetime is patched
+    //before sending, setters of other fields invalidate it
+    char *wire;
+    uint16_t wire_len;
+    uint16_t wire_size;
+    uint8_t wire_ver; //server's version the request was encoded for
+    //encoder specialized for server's version, opcode and presence of
+    //options; reset together with wire
+    pcp_msg_encoder_t encoder;
+    uint8_t encoder_ver;
+    uint8_t encoder_op;
+    //last transmission, RTT is sampled only if it wasn't a retransmission
+    struct timeval sent_ts;
+    uint8_t sent_retx;
     void *user_data;
 };
 
@@ -202,6 +283,12 @@ struct pcp_server {
     uint16_t pcp_port;
     uint32_t pcp_scope_id;
     uint32_t src_ip[4];
+    //own socket bound to src_ip, PCP_INVALID_SOCKET => context socket is used
+    PCP_SOCKET socket;
+    int rcvbuf;                   //SO_RCVBUF of own socket, 0 => default
+    uint8_t connected;            //own socket is connected, send w/o address
+    uint8_t route_check;          //sending failed, check route before next
+    uint8_t discovered;           //default gateway, follows routing changes
     char pcp_server_paddr[INET6_ADDRSTRLEN];
     struct sockaddr_storage pcp_server_saddr;
     uint8_t pcp_version;
@@ -217,6 +304,19 @@ struct pcp_server {
     struct timeval next_timeout;
     uint32_t natpmp_ext_addr;
     void *app_data;
+    //flow sweep interrupted by work budget, continued by next pulse
+    uint32_t sweep_gen;           //0 => no sweep in progress
+    uint32_t sweep_bucket;        //flow DB bucket the sweep continues in
+    pcp_flow_t *sweep_next;       //next flow of the bucket to visit
+    pcp_server_state_e sweep_then;//state change asked by response received
+                                  //during sweep, pss_unitialized => none
+    struct timeval sweep_timeout; //nearest flow timeout found so far
+    //round trip time in microseconds
+    uint32_t rtt_samples;
+    uint32_t rtt_last_us;
+    uint32_t rtt_min_us;
+    uint32_t rtt_srtt_us;
+    uint32_t rtt_var_us;
 };
 
 typedef int (*pcp_db_flow_iterate)(pcp_flow_t *f, void *data);
@@ -236,7 +336,6 @@ pcp_errno pcp_db_rem_flow(pcp_flow_t *f);
 pcp_errno pcp_db_foreach_flow(pcp_ctx_t *ctx, pcp_db_flow_iterate f,
         void *data);
 
-void pcp_flow_clear_msg_buf(pcp_flow_t *f);
 
 #ifdef PCP_EXPERIMENTAL
 void pcp_db_add_md(pcp_flow_t *f, uint16_t md_id, void *val, size_t val_len);
@@ -247,6 +346,11 @@ int pcp_new_server(pcp_ctx_t *ctx, struct in6_addr *ip, uint16_t port, uint32_t
 pcp_errno pcp_db_foreach_server(pcp_ctx_t *ctx, pcp_db_server_iterate f,
         void *data);
 
+/* as pcp_db_foreach_server, servers which responded go first, ordered by
+ * smoothed RTT, the others follow in order of their index */
+pcp_errno pcp_db_foreach_server_by_rtt(pcp_ctx_t *ctx,
+        pcp_db_server_iterate f, void *data);
+
 pcp_server_t *get_pcp_server(pcp_ctx_t *ctx, int pcp_server_index);
 
 pcp_server_t *get_pcp_server_by_ip(pcp_ctx_t *ctx, struct in6_addr *ip);
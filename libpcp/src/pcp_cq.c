@@ -0,0 +1,284 @@
+/*
+ Copyright (c) 2014 by Cisco Systems, Inc.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "pcp.h"
+#include "pcp_client_db.h"
+#include "pcp_logger.h"
+#include "pcp_utils.h"
+#include "pcp_socket.h"
+#include "pcp_io_thread.h"
+#include "pcp_cq.h"
+
+#ifdef __GNUC__
+#define CQ_LOAD(p)      __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define CQ_STORE(p, v)  __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define CQ_CAS(p, e, v) __atomic_compare_exchange_n(p, e, v, 0, \
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define CQ_INC(p)       __atomic_add_fetch(p, 1, __ATOMIC_RELAXED)
+#else
+#define CQ_LOAD(p)      (*(p))
+#define CQ_STORE(p, v)  (*(p)=(v))
+#define CQ_CAS(p, e, v) ((*(p) == *(e)) ? (*(p)=(v), 1) : (*(e)=*(p), 0))
+#define CQ_INC(p)       (++*(p))
+#endif
+
+#define PCP_CQ_DEFAULT_ENTRIES 1024
+
+/*
+ * Ring with single producer (thread running state machines of the context)
+ * and any number of consumers. Consumer copies records first and then claims
+ * them by moving head with CAS; if other consumer was faster, the copy is
+ * thrown away and taken again from the new head. Producer never overwrites
+ * records before head moves past them.
+ */
+struct pcp_cq {
+    uint64_t head;          //next record to reap, moved by consumers
+    uint64_t tail;          //next free slot, moved by producer only
+    uint64_t overflow;      //records dropped because ring was full
+    uint32_t mask;
+    int signal_pending;     //producer only
+    PCP_SOCKET event_fd;
+    pcp_completion_t *ring;
+};
+
+static void cq_signal(struct pcp_cq *cq)
+{
+#ifdef __linux__
+    uint64_t one=1;
+
+    if ((cq->event_fd != PCP_INVALID_SOCKET)
+            && (write(cq->event_fd, &one, sizeof(one)) < 0)) {
+        PCP_LOG(PCP_LOGLVL_PERR, "%s", "Cannot signal PCP completion fd.");
+    }
+#else
+    OSDEP(cq);
+#endif
+}
+
+static void cq_clear_signal(struct pcp_cq *cq)
+{
+#ifdef __linux__
+    uint64_t cnt;
+
+    if ((cq->event_fd != PCP_INVALID_SOCKET)
+            && (read(cq->event_fd, &cnt, sizeof(cnt)) < 0)) {
+        PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "PCP completion fd not signaled.");
+    }
+#else
+    OSDEP(cq);
+#endif
+}
+
+struct cq_init_args {
+    uint32_t entries;
+    int ret;
+};
+
+static void cq_init(pcp_ctx_t *ctx, void *args)
+{
+    struct cq_init_args *a=(struct cq_init_args *)args;
+    struct pcp_cq *cq;
+    uint32_t size=16;
+
+    if (ctx->cq) {
+        a->ret=PCP_ERR_BAD_ARGS;
+        return;
+    }
+
+    if (!a->entries) {
+        a->entries=PCP_CQ_DEFAULT_ENTRIES;
+    }
+    while ((size < a->entries) && (size < 0x80000000u)) {
+        size<<=1;
+    }
+
+    cq=(struct pcp_cq *)calloc(1, sizeof(*cq));
+    if (!cq) {
+        a->ret=PCP_ERR_NO_MEM;
+        return;
+    }
+    cq->ring=(pcp_completion_t *)calloc(size, sizeof(*cq->ring));
+    if (!cq->ring) {
+        free(cq);
+        a->ret=PCP_ERR_NO_MEM;
+        return;
+    }
+    cq->mask=size - 1;
+
+#ifdef __linux__
+    cq->event_fd=eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cq->event_fd == PCP_INVALID_SOCKET) {
+        PCP_LOG(PCP_LOGLVL_WARN, "%s", "Cannot create PCP completion fd.");
+    }
+#else
+    cq->event_fd=PCP_INVALID_SOCKET;
+#endif
+
+    ctx->cq=cq;
+    a->ret=PCP_ERR_SUCCESS;
+}
+
+int pcp_cq_init(pcp_ctx_t *ctx, uint32_t entries)
+{
+    struct cq_init_args a={entries, PCP_ERR_BAD_ARGS};
+
+    if (!ctx) {
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    if (pcp_io_is_foreign(ctx)) {
+        pcp_io_call(ctx, cq_init, &a);
+    } else {
+        cq_init(ctx, &a);
+    }
+
+    return a.ret;
+}
+
+PCP_SOCKET pcp_cq_get_fd(pcp_ctx_t *ctx)
+{
+    if ((!ctx) || (!ctx->cq)) {
+        return PCP_INVALID_SOCKET;
+    }
+
+    return ctx->cq->event_fd;
+}
+
+size_t pcp_cq_reap(pcp_ctx_t *ctx, pcp_completion_t *cqes, size_t max)
+{
+    struct pcp_cq *cq;
+    uint64_t head, tail;
+    size_t n, i;
+
+    if ((!ctx) || (!ctx->cq) || (!cqes)) {
+        return 0;
+    }
+    cq=ctx->cq;
+
+    // reset before looking at the ring, so no record is left unsignaled
+    cq_clear_signal(cq);
+
+    head=CQ_LOAD(&cq->head);
+    do {
+        tail=CQ_LOAD(&cq->tail);
+        n=(size_t)(tail - head);
+        if (n > max) {
+            n=max;
+        }
+        for (i=0; i < n; ++i) {
+            cqes[i]=cq->ring[(head + i) & cq->mask];
+        }
+    } while ((n) && (!CQ_CAS(&cq->head, &head, head + n)));
+
+    // caller's buffer was too small => let other reapers know about the rest
+    if (CQ_LOAD(&cq->tail) != CQ_LOAD(&cq->head)) {
+        cq_signal(cq);
+    }
+
+    return n;
+}
+
+uint64_t pcp_cq_overflow(pcp_ctx_t *ctx)
+{
+    if ((!ctx) || (!ctx->cq)) {
+        return 0;
+    }
+
+    return CQ_LOAD(&ctx->cq->overflow);
+}
+
+void pcp_cq_push(pcp_flow_t *f, pcp_cq_event_e event)
+{
+    struct pcp_cq *cq=f->ctx->cq;
+    pcp_completion_t *c;
+    uint64_t tail;
+
+    if (!cq) {
+        return;
+    }
+
+    tail=cq->tail;
+    if (tail - CQ_LOAD(&cq->head) > cq->mask) {
+        CQ_INC(&cq->overflow);
+        PCP_LOG(PCP_LOGLVL_WARN, "PCP completion queue full, "
+                "dropped event %d of flow %d", event, f->key_bucket);
+        return;
+    }
+
+    c=cq->ring + (tail & cq->mask);
+    c->flow=f;
+    c->user_data=f->user_data;
+    c->event=event;
+    c->result_code=(uint8_t)f->recv_result;
+    c->ext_ip=f->map_peer.ext_ip;
+    c->ext_port=f->map_peer.ext_port;
+    c->lifetime_end=f->recv_lifetime;
+
+    CQ_STORE(&cq->tail, tail + 1);
+    cq->signal_pending=1;
+}
+
+void pcp_cq_flush(pcp_ctx_t *ctx)
+{
+    struct pcp_cq *cq=ctx->cq;
+
+    if ((cq) && (cq->signal_pending)) {
+        cq->signal_pending=0;
+        cq_signal(cq);
+    }
+}
+
+void pcp_cq_free(pcp_ctx_t *ctx)
+{
+    struct pcp_cq *cq=ctx->cq;
+
+    if (!cq) {
+        return;
+    }
+
+    if (cq->event_fd != PCP_INVALID_SOCKET) {
+        CLOSE(cq->event_fd);
+    }
+    free(cq->ring);
+    free(cq);
+    ctx->cq=NULL;
+}
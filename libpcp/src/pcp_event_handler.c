@@ -48,6 +48,10 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/timerfd.h>
+#endif
 #endif
 
 #include "pcp.h"
@@ -58,11 +62,18 @@
 #include "pcp_event_handler.h"
 #include "pcp_server_discovery.h"
 #include "pcp_socket.h"
+#include "pcp_uring.h"
+#include "pcp_io_thread.h"
+#include "pcp_cq.h"
 
 #define MIN(a, b) (a<b?a:b)
 #define MAX(a, b) (a>b?a:b)
-#define PCP_RT(rtprev) ((rtprev=rtprev<<1),(((8192+(1024-(rand()&2047))) \
+#define PCP_RT(ctx, rtprev) ((rtprev=rtprev<<1), \
+        (((8192+(1024-(pcp_rand(ctx)&2047))) \
         * MIN (MAX(rtprev,PCP_RETX_IRT), PCP_RETX_MRT))>>13))
+/* the first RT = IRT + RAND*IRT (RFC 6887) */
+#define PCP_IRT(ctx) (((8192+(1024-(pcp_rand(ctx)&2047))) \
+        * PCP_RETX_IRT)>>13)
 
 static pcp_flow_event_e fhndl_send(pcp_flow_t *f, pcp_recv_msg_t *msg);
 static pcp_flow_event_e fhndl_resend(pcp_flow_t *f, pcp_recv_msg_t *msg);
@@ -251,7 +262,7 @@ typedef struct pcp_flow_state_trans {
     handle_flow_state_event handler;
 } pcp_flow_state_trans_t;
 
-pcp_flow_state_trans_t flow_transitions[]={
+static const pcp_flow_state_trans_t flow_transitions[]={
         {pfs_any, pfs_wait_resp, fhndl_waitresp},
         {pfs_wait_resp, pfs_send, fhndl_resend},
         {pfs_any, pfs_send, fhndl_send},
@@ -271,7 +282,7 @@ typedef struct pcp_flow_state_event {
     pcp_flow_state_e new_state;
 } pcp_flow_state_events_t;
 
-pcp_flow_state_events_t flow_events_sm[]={
+static const pcp_flow_state_events_t flow_events_sm[]={
         {pfs_any, fev_send, pfs_send},
         {pfs_wait_for_server_init, fev_server_initialized, pfs_send},
         {pfs_wait_resp, fev_res_success, pfs_wait_for_lifetime_renew},
@@ -321,67 +332,216 @@ pcp_flow_state_events_t flow_events_sm[]={
 
 #define FLOW_EVENTS_SM_COUNT (sizeof(flow_events_sm)/sizeof(*flow_events_sm))
 
+/* sends requests queued by flow sweep; those the socket refuses are dropped
+ * and left to retransmission, like lost ones */
+static void pcp_tx_flush(pcp_ctx_t *ctx)
+{
+    uint32_t sent=0;
+
+    while (sent < ctx->tx_cnt) {
+        int ret=pcp_socket_sendmmsg(ctx, ctx->tx_sock, ctx->tx + sent,
+                ctx->tx_cnt - sent);
+
+        if (ret <= 0) {
+            PCP_LOG(PCP_LOGLVL_WARN, "%s", "Error occurred while sending "
+            "queued PCP packet, left to retransmission.");
+            if (ctx->tx_server) {
+                ctx->tx_server->route_check=1;
+            }
+            ret=1; //skip it
+        }
+        sent+=ret;
+    }
+    ctx->tx_cnt=0;
+}
+
 static pcp_errno pcp_flow_send_msg(pcp_flow_t *flow, pcp_server_t *s)
 {
-    ssize_t ret;
-    size_t to_send_count;
+    size_t msg_len;
+    const char *msg;
     pcp_ctx_t *ctx=s->ctx;
+    struct sockaddr *addr=(struct sockaddr*)&s->pcp_server_saddr;
+    PCP_SOCKET sock;
+    socklen_t addrlen;
 
     PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
 
-    if ((!flow->pcp_msg_buffer) || (flow->pcp_msg_len == 0)) {
-        build_pcp_msg(flow);
-        if (flow->pcp_msg_buffer == NULL) {
-            PCP_LOG(PCP_LOGLVL_DEBUG, "Cannot build PCP MSG (flow bucket:%d)",
-                    flow->key_bucket);
-            PCP_LOG_END(PCP_LOGLVL_DEBUG);
-            return PCP_ERR_SEND_FAILED;
+    // io_uring transport learns about failed send from its completion
+    if ((s->socket != PCP_INVALID_SOCKET)
+            && (pcp_uring_send_error(ctx->uring, s->socket))) {
+        s->route_check=1;
+    }
+    // previous send failed, source address may have changed
+    if (s->route_check) {
+        if (ctx->tx_cnt) {
+            pcp_tx_flush(ctx);
         }
+        psd_server_check_route(s);
+    }
+    if (s->socket != PCP_INVALID_SOCKET) {
+        sock=s->socket;
+    } else if ((s->af == AF_INET6) && (!ctx->dual_stack)) {
+        sock=ctx->socket6;
+    } else {
+        sock=ctx->socket;
     }
+    // connected socket sends without address - no route lookup per packet
+    addrlen=s->connected ? 0 : SA_LEN(addr);
 
-    to_send_count=flow->pcp_msg_len;
+    msg=pcp_flow_wire_msg(flow, &msg_len);
+    if (!msg) {
+        PCP_LOG(PCP_LOGLVL_DEBUG, "Cannot build PCP MSG (flow bucket:%d)",
+                flow->key_bucket);
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_SEND_FAILED;
+    }
 
-    while (to_send_count != 0) {
-        ret=flow->pcp_msg_len - to_send_count;
+    gettimeofday(&flow->sent_ts, NULL);
+    if (ctx->tx_batching) {
+        pcp_sock_msg_t *m;
 
-        ret=pcp_socket_sendto(ctx, flow->pcp_msg_buffer + ret,
-                flow->pcp_msg_len - ret, MSG_DONTWAIT,
-                (struct sockaddr*)&s->pcp_server_saddr,
-                SA_LEN((struct sockaddr*)&s->pcp_server_saddr));
-        if (ret <= 0) {
+        // batch goes through one socket
+        if ((ctx->tx_cnt) && (ctx->tx_sock != sock)) {
+            pcp_tx_flush(ctx);
+        }
+        ctx->tx_sock=sock;
+        ctx->tx_server=sock == s->socket ? s : NULL;
+        m=ctx->tx + ctx->tx_cnt;
+        memcpy(ctx->tx_buf[ctx->tx_cnt], msg, msg_len);
+        m->buf=ctx->tx_buf[ctx->tx_cnt];
+        m->len=msg_len;
+        if (addrlen) {
+            memcpy(&ctx->tx_addr[ctx->tx_cnt], addr, addrlen);
+            m->addr=(struct sockaddr*)&ctx->tx_addr[ctx->tx_cnt];
+        } else {
+            m->addr=NULL;
+        }
+        m->addrlen=addrlen;
+        m->control=NULL;
+        m->controllen=0;
+        if (++ctx->tx_cnt == PCP_IO_BATCH) {
+            pcp_tx_flush(ctx);
+        }
+    } else {
+        pcp_sock_msg_t m={(void *)msg, msg_len, addrlen ? addr : NULL,
+                addrlen, NULL, 0, 0};
+
+        if (pcp_socket_sendmmsg(ctx, sock, &m, 1) != 1) {
             PCP_LOG(PCP_LOGLVL_WARN, "Error occurred while sending "
             "PCP packet to server %s", s->pcp_server_paddr);
+            if (sock == s->socket) {
+                s->route_check=1;
+            }
             PCP_LOG_END(PCP_LOGLVL_DEBUG);
             return PCP_ERR_SEND_FAILED;
         }
-        to_send_count-=ret;
     }
 
     PCP_LOG(PCP_LOGLVL_INFO, "Sent PCP MSG (flow bucket:%d)",
             flow->key_bucket);
 
-    pcp_flow_clear_msg_buf(flow);
-
     PCP_LOG_END(PCP_LOGLVL_DEBUG);
     return PCP_ERR_SUCCESS;
 }
 
-static pcp_errno read_msg(pcp_ctx_t *ctx, pcp_recv_msg_t *msg)
+/* receives up to cnt datagrams from sock into ctx->msg_in, returns their
+ * count or negative pcp_errno */
+static int read_msgs(pcp_ctx_t *ctx, PCP_SOCKET sock, unsigned cnt)
+{
+    unsigned i;
+
+    for (i=0; i < cnt; ++i) {
+        pcp_sock_msg_t *m=ctx->rx + i;
+
+        m->buf=ctx->msg_in[i];
+        m->len=sizeof(ctx->msg_in[i]);
+        m->addr=(struct sockaddr*)&ctx->msg_in_addr[i];
+        m->addrlen=sizeof(ctx->msg_in_addr[i]);
+        m->control=ctx->msg_in_control[i];
+        m->controllen=sizeof(ctx->msg_in_control[i]);
+        m->flags=0;
+    }
+
+    return pcp_socket_recvmmsg(ctx, sock, ctx->rx, cnt);
+}
+
+/* receive time of msg - ts taken on arrival if known, then time spent in
+ * queue is accounted, otherwise now */
+static void rx_timestamp(pcp_ctx_t *ctx, pcp_recv_msg_t *msg,
+        const struct timeval *ts)
 {
-    ssize_t ret;
-    socklen_t src_len=sizeof(msg->rcvd_from_addr);
+    ++ctx->rx_msgs;
+    if (ts) {
+        struct timeval ctv, delay, t=*ts;
+        uint32_t us;
 
-    memset(msg, 0, sizeof(*msg));
+        gettimeofday(&ctv, NULL);
+        msg->rcvd_ts=*ts;
+        us=0;
+        if (timeval_subtract(&delay, &ctv, &t) == 0) {
+            us=(uint32_t)(delay.tv_sec * 1000000 + delay.tv_usec);
+        }
+        ++ctx->rx_kernel_ts;
+        ctx->queue_last_us=us;
+        ctx->queue_total_us+=us;
+        if (us > ctx->queue_max_us) {
+            ctx->queue_max_us=us;
+        }
+    } else {
+        gettimeofday(&msg->rcvd_ts, NULL);
+    }
+}
 
-    if ((ret=pcp_socket_recvfrom(ctx, msg->pcp_msg_buffer,
-            sizeof(msg->pcp_msg_buffer), MSG_DONTWAIT,
-            (struct sockaddr*)&msg->rcvd_from_addr, &src_len)) < 0) {
-        return ret;
+/* makes msg refer to i-th datagram of the last batch */
+static void select_msg(pcp_ctx_t *ctx, pcp_recv_msg_t *msg, unsigned i)
+{
+    socklen_t addrlen=ctx->rx[i].addrlen;
+    struct timeval ts;
+
+    if (addrlen > sizeof(msg->rcvd_from_addr)) {
+        addrlen=sizeof(msg->rcvd_from_addr);
     }
+    // parsed fields are initialized by parse_response
+    memcpy(&msg->rcvd_from_addr, &ctx->msg_in_addr[i], addrlen);
+    msg->pcp_msg_buffer=ctx->msg_in[i];
+    msg->pcp_msg_len=(uint32_t)ctx->rx[i].len;
 
-    msg->pcp_msg_len=ret;
+    rx_timestamp(ctx, msg,
+            pcp_sock_msg_timestamp(ctx->rx + i, &ts) ? &ts : NULL);
+}
 
-    return PCP_ERR_SUCCESS;
+/* RTT estimation of RFC 6298 */
+static void server_rtt_sample(pcp_server_t *s, pcp_flow_t *f,
+        pcp_recv_msg_t *msg)
+{
+    struct timeval rtt, sent=f->sent_ts;
+    uint32_t us, diff;
+
+    // Karn's algorithm - response can't be matched to one of retransmissions
+    if ((f->sent_retx) || ((f->sent_ts.tv_sec == 0)
+            && (f->sent_ts.tv_usec == 0))) {
+        return;
+    }
+    if (timeval_subtract(&rtt, &msg->rcvd_ts, &sent)) {
+        return; //clock stepped back
+    }
+    f->sent_ts.tv_sec=0;
+    f->sent_ts.tv_usec=0;
+
+    us=(uint32_t)(rtt.tv_sec * 1000000 + rtt.tv_usec);
+    s->rtt_last_us=us;
+    if (s->rtt_samples++ == 0) {
+        s->rtt_min_us=us;
+        s->rtt_srtt_us=us;
+        s->rtt_var_us=us / 2;
+        return;
+    }
+    if (us < s->rtt_min_us) {
+        s->rtt_min_us=us;
+    }
+    diff=us > s->rtt_srtt_us ? us - s->rtt_srtt_us : s->rtt_srtt_us - us;
+    s->rtt_var_us=s->rtt_var_us - s->rtt_var_us / 4 + diff / 4;
+    s->rtt_srtt_us=s->rtt_srtt_us - s->rtt_srtt_us / 8 + us / 8;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -406,7 +566,13 @@ static pcp_flow_event_e fhndl_send(pcp_flow_t *f, UNUSED pcp_recv_msg_t *msg)
         return fev_failed;
     }
 
+    f->sent_retx=0;
     f->resend_timeout=PCP_RETX_IRT;
+    if (f->kd.operation == PCP_OPCODE_ANNOUNCE) {
+        // probes of all servers leave together, RAND of the first RT
+        // (RFC 6887) keeps their retransmissions apart
+        f->resend_timeout=PCP_IRT(f->ctx);
+    }
     //set timeout field
     gettimeofday(&f->timeout, NULL);
     f->timeout.tv_sec+=f->resend_timeout / 1000;
@@ -437,7 +603,8 @@ static pcp_flow_event_e fhndl_resend(pcp_flow_t *f, UNUSED pcp_recv_msg_t *msg)
         return fev_failed;
     }
 
-    f->resend_timeout=PCP_RT(f->resend_timeout);
+    f->sent_retx=1;
+    f->resend_timeout=PCP_RT(f->ctx, f->resend_timeout);
 
 #if (PCP_RETX_MRD>0)
     {
@@ -474,15 +641,60 @@ static pcp_flow_event_e fhndl_shortlifeerror(pcp_flow_t *f, pcp_recv_msg_t *msg)
     return fev_none;
 }
 
+/* server has to echo options it processed (RFC 6887 7.3); returns 0 if
+ * mandatory option sent by the flow is missing or changed in response */
+static int options_echoed(pcp_flow_t *f, pcp_recv_msg_t *msg)
+{
+    if (msg->recv_version == 0) {
+        // NAT-PMP requests carry no options
+        return 1;
+    }
+    if (f->third_party_option_present) {
+        if ((!(msg->opt_flags & optf_3rd_party)) || (!IN6_ARE_ADDR_EQUAL(
+                &msg->third_party_ip, &f->third_party_ip))) {
+            PCP_LOG(PCP_LOGLVL_WARN, "%s",
+                    "THIRD_PARTY option not echoed by PCP server");
+            return 0;
+        }
+    }
+    if ((f->pfailure_option_present) && (!(msg->opt_flags & optf_pref_fail))) {
+        PCP_LOG(PCP_LOGLVL_WARN, "%s",
+                "PREFER_FAILURE option not echoed by PCP server");
+        return 0;
+    }
+    if (f->filter_option_present) {
+        if ((msg->filter_cnt != 1) || (msg->filter_prefix != f->filter_prefix)
+                || (msg->filter_port != f->filter_port)
+                || (!IN6_ARE_ADDR_EQUAL(&msg->filter_ip, &f->filter_ip))) {
+            PCP_LOG(PCP_LOGLVL_WARN, "%s",
+                    "FILTER option not echoed by PCP server");
+            return 0;
+        }
+    }
+    return 1;
+}
+
 static pcp_flow_event_e fhndl_received_success(pcp_flow_t *f,
         pcp_recv_msg_t *msg)
 {
     struct timeval ctv;
 
     PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
+    f->opt_flags=msg->opt_flags;
+    if (!options_echoed(f, msg)) {
+        // mapping may differ from the requested one, e.g. without filter
+        msg->recv_result=PCP_RES_UNSUPP_OPTION;
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return fev_res_unsupp_option;
+    }
     f->recv_lifetime=msg->received_time + msg->recv_lifetime;
     if ((f->kd.operation == PCP_OPCODE_MAP)
             || (f->kd.operation == PCP_OPCODE_PEER)) {
+        // assigned address is suggested by renewals
+        if ((!IN6_ARE_ADDR_EQUAL(&f->map_peer.ext_ip, &msg->assigned_ext_ip))
+                || (f->map_peer.ext_port != msg->assigned_ext_port)) {
+            pcp_flow_wire_invalidate(f);
+        }
         f->map_peer.ext_ip=msg->assigned_ext_ip;
         f->map_peer.ext_port=msg->assigned_ext_port;
 #ifdef PCP_SADSCP
@@ -519,6 +731,7 @@ static pcp_flow_event_e fhndl_send_renew(pcp_flow_t *f,
     if (pcp_flow_send_msg(f, s) != PCP_ERR_SUCCESS) {
         return fev_failed;
     }
+    f->sent_retx=0;
 
     gettimeofday(&f->timeout, NULL);
     timeout_add=(long)((f->recv_lifetime - f->timeout.tv_sec) >> 1);
@@ -537,7 +750,6 @@ static pcp_flow_event_e fhndl_clear_timeouts(pcp_flow_t *f, pcp_recv_msg_t *msg)
     if (msg) {
         f->recv_result=msg->recv_result;
     }
-    pcp_flow_clear_msg_buf(f);
     f->timeout.tv_sec=0;
     f->timeout.tv_usec=0;
 
@@ -559,17 +771,44 @@ static pcp_flow_event_e fhndl_waitresp(pcp_flow_t *f,
 
 static void flow_change_notify(pcp_flow_t *flow, pcp_fstate_e state);
 
+static void flow_cq_push(pcp_flow_t *f, pcp_fstate_e before,
+        pcp_fstate_e after, int ext_changed, time_t prev_recv_lifetime)
+{
+    pcp_cq_event_e ev;
+
+    if (after == pcp_state_succeeded) {
+        if (before != pcp_state_succeeded) {
+            ev=pcp_cq_succeeded;
+        } else if (ext_changed) {
+            ev=pcp_cq_mapping_changed;
+        } else if (f->recv_lifetime != prev_recv_lifetime) {
+            ev=pcp_cq_renewed;
+        } else {
+            return;
+        }
+    } else if ((before != after) && ((after == pcp_state_failed)
+            || (after == pcp_state_short_lifetime_error))) {
+        ev=pcp_cq_failed;
+    } else {
+        return;
+    }
+
+    pcp_cq_push(f, ev);
+}
+
 static pcp_flow_state_e handle_flow_event(pcp_flow_t *f, pcp_flow_event_e ev,
         pcp_recv_msg_t *r)
 {
     pcp_flow_state_e cur_state=f->state, next_state;
-    pcp_flow_state_events_t *esm;
-    pcp_flow_state_events_t *esm_end=flow_events_sm + FLOW_EVENTS_SM_COUNT;
-    pcp_flow_state_trans_t *trans;
-    pcp_flow_state_trans_t *trans_end=flow_transitions + FLOW_TRANS_COUNT;
+    const pcp_flow_state_events_t *esm;
+    const pcp_flow_state_events_t *esm_end=flow_events_sm + FLOW_EVENTS_SM_COUNT;
+    const pcp_flow_state_trans_t *trans;
+    const pcp_flow_state_trans_t *trans_end=flow_transitions + FLOW_TRANS_COUNT;
     pcp_fstate_e before, after;
     struct in6_addr prev_ext_addr=f->map_peer.ext_ip;
     uint16_t prev_ext_port=f->map_peer.ext_port;
+    time_t prev_recv_lifetime=f->recv_lifetime;
+    int ext_changed;
 
     PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
     pcp_eval_flow_state(f, &before);
@@ -625,12 +864,18 @@ static pcp_flow_state_e handle_flow_event(pcp_flow_t *f, pcp_flow_event_e ev,
         }
     }
 end:
+    if (f->kd.operation == PCP_OPCODE_ANNOUNCE) {
+        // internal probe, not seen by application
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return f->state;
+    }
     pcp_eval_flow_state(f, &after);
-    if ((before != after)
-            || (!IN6_ARE_ADDR_EQUAL(&prev_ext_addr, &f->map_peer.ext_ip))
-            || (prev_ext_port != f->map_peer.ext_port)) {
+    ext_changed=(!IN6_ARE_ADDR_EQUAL(&prev_ext_addr, &f->map_peer.ext_ip))
+            || (prev_ext_port != f->map_peer.ext_port);
+    if ((before != after) || (ext_changed)) {
         flow_change_notify(f, after);
     }
+    flow_cq_push(f, before, after, ext_changed, prev_recv_lifetime);
 
     PCP_LOG_END(PCP_LOGLVL_DEBUG);
     return f->state;
@@ -643,30 +888,32 @@ static pcp_flow_t *server_process_rcvd_pcp_msg(pcp_server_t *s,
         pcp_recv_msg_t *msg)
 {
     pcp_flow_t *f;
+
+    if (msg->kd.operation == PCP_OPCODE_ANNOUNCE) {
 #ifndef PCP_DISABLE_NATPMP
-    if (msg->recv_version == 0) {
-        if (msg->kd.operation == NATPMP_OPCODE_ANNOUNCE) {
+        if (msg->recv_version == 0) {
             s->natpmp_ext_addr=S6_ADDR32(&msg->assigned_ext_ip)[3];
-            if ((s->pcp_version == 0) && (s->ping_flow_msg)
-                    && (s->ping_flow_msg->kd.operation == PCP_OPCODE_ANNOUNCE)) {
-                f=s->ping_flow_msg;
-            } else {
-                f=NULL;
-            }
+        }
+#endif
+        // ANNOUNCE has no flow key (v2 nonce included), so response belongs
+        // to the probe of the server
+        if ((s->ping_flow_msg)
+                && (s->ping_flow_msg->kd.operation == PCP_OPCODE_ANNOUNCE)) {
+            f=s->ping_flow_msg;
         } else {
+            f=NULL;
+        }
+    } else {
+#ifndef PCP_DISABLE_NATPMP
+        if (msg->recv_version == 0) {
             S6_ADDR32(&msg->assigned_ext_ip)[3]=s->natpmp_ext_addr;
             S6_ADDR32(&msg->assigned_ext_ip)[2]=htonl(0xFFFF);
             S6_ADDR32(&msg->assigned_ext_ip)[1]=0;
             S6_ADDR32(&msg->assigned_ext_ip)[0]=0;
-
-            f=pcp_get_flow(&msg->kd, s);
         }
-    } else {
+#endif
         f=pcp_get_flow(&msg->kd, s);
     }
-#else
-    f = pcp_get_flow(&msg->kd, s->index);
-#endif
 
     if (!f) {
         char in6[INET6_ADDRSTRLEN];
@@ -691,6 +938,7 @@ static pcp_flow_t *server_process_rcvd_pcp_msg(pcp_server_t *s,
     PCP_LOG(PCP_LOGLVL_INFO,
             "Found matching flow %d to received PCP message.", f->key_bucket);
 
+    server_rtt_sample(s, f, msg);
     handle_flow_event(f, FEV_RES_BEGIN + msg->recv_result, msg);
 
     return f;
@@ -751,8 +999,9 @@ static int get_first_flow_iter(pcp_flow_t *f, void *data)
     }
 }
 
-#ifndef PCP_DISABLE_NATPMP
-static inline pcp_flow_t *create_natpmp_ann_msg(pcp_server_t *s)
+// ANNOUNCE probe of the server, it pings the server which has no flow yet
+// and it's the NAT-PMP ping; opcode of ANNOUNCE is the same in both
+static inline pcp_flow_t *create_ann_msg(pcp_server_t *s)
 {
     struct flow_key_data kd;
 
@@ -760,14 +1009,31 @@ static inline pcp_flow_t *create_natpmp_ann_msg(pcp_server_t *s)
     memcpy(&kd.src_ip, s->src_ip, sizeof(kd.src_ip));
     memcpy(&kd.pcp_server_ip, s->pcp_ip, sizeof(kd.pcp_server_ip));
     memcpy(&kd.nonce, &s->nonce, sizeof(kd.nonce));
-    kd.operation=NATPMP_OPCODE_ANNOUNCE;
+    kd.operation=PCP_OPCODE_ANNOUNCE;
 
     s->ping_flow_msg=pcp_create_flow(s, &kd);
-    pcp_db_add_flow(s->ping_flow_msg);
+    if (s->ping_flow_msg) {
+        // follows source address of the server
+        s->ping_flow_msg->src_auto=1;
+        pcp_db_add_flow(s->ping_flow_msg);
+    }
 
     return s->ping_flow_msg;
 }
-#endif
+
+// probe isn't needed once the server answered
+static void drop_ann_msg(pcp_server_t *s)
+{
+    pcp_flow_t *f=s->ping_flow_msg;
+
+    if ((!f) || (f->kd.operation != PCP_OPCODE_ANNOUNCE)) {
+        return;
+    }
+    if (s->restart_flow_msg == f) {
+        s->restart_flow_msg=NULL;
+    }
+    pcp_delete_flow_intern(f);
+}
 
 static inline pcp_flow_t *get_ping_msg(pcp_server_t *s)
 {
@@ -797,11 +1063,132 @@ static int flow_send_event_iter(pcp_flow_t *f, void *data)
 {
     struct flow_iterator_data *d=(struct flow_iterator_data *)data;
 
-    if (f->pcp_server_indx == d->s->index) {
-        handle_flow_event(f, d->event, NULL);
-        check_flow_timeout(f, &d->s->next_timeout);
+    handle_flow_event(f, d->event, NULL);
+    check_flow_timeout(f, &d->s->next_timeout);
+
+    return 0;
+}
+
+// keep the nearest absolute flow timeout, so sweep can span several pulses
+static int flow_timeout_iter(pcp_flow_t *f, void *data)
+{
+    pcp_server_t *s=(pcp_server_t *)data;
+    struct timeval tout={0, 0};
+    struct timeval ctv;
+
+    check_flow_timeout(f, &tout);
+    if ((tout.tv_sec == 0) && (tout.tv_usec == 0)) {
+        return 0;
     }
 
+    gettimeofday(&ctv, NULL);
+    tout.tv_sec+=ctv.tv_sec;
+    tout.tv_usec+=ctv.tv_usec;
+    timeval_align(&tout);
+
+    if (((s->sweep_timeout.tv_sec == 0) && (s->sweep_timeout.tv_usec == 0))
+            || (timeval_comp(&tout, &s->sweep_timeout) < 0)) {
+        s->sweep_timeout=tout;
+    }
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//                 Work budget and resumable flow sweeps
+
+// time budget is checked once per this many flows
+#define BUDGET_CLOCK_FLOWS 16
+
+// nonzero if pcp_pulse_budget has spent its budget
+static int budget_exhausted(pcp_ctx_t *ctx)
+{
+    struct timeval ctv;
+
+    if ((!ctx->budget_active) || (ctx->budget_exhausted)) {
+        return ctx->budget_exhausted;
+    }
+
+    if ((ctx->budget_max_flows)
+            && (ctx->budget_used >= ctx->budget_max_flows)) {
+        ctx->budget_exhausted=1;
+    } else if ((ctx->budget_used >= ctx->budget_clock_at)
+            && ((ctx->budget_end.tv_sec != 0)
+            || (ctx->budget_end.tv_usec != 0))) {
+        // at least one flow is processed per call, so time budget can't
+        // stop the progress
+        ctx->budget_clock_at=ctx->budget_used + BUDGET_CLOCK_FLOWS;
+        gettimeofday(&ctv, NULL);
+        if (timeval_comp(&ctv, &ctx->budget_end) >= 0) {
+            ctx->budget_exhausted=1;
+        }
+    }
+
+    return ctx->budget_exhausted;
+}
+
+/*
+ * Run fn for flows of the server until work budget is spent. Sweep keeps
+ * its position in the flow DB (bucket and next flow, fixed up by
+ * pcp_db_rem_flow), so repeated call continues where the previous one
+ * stopped. Visited flows are stamped by generation of the sweep, so flow
+ * moved to a later bucket in the meantime isn't visited twice. Only flows
+ * of the server are charged to the budget. Returns nonzero if sweep has to
+ * be continued.
+ */
+static int server_flow_sweep(pcp_server_t *s, pcp_db_flow_iterate fn,
+        void *data)
+{
+    pcp_ctx_t *ctx=s->ctx;
+    int batching=ctx->tx_batching;
+    int interrupted=0;
+
+    if (!s->sweep_gen) {
+        if (++ctx->sweep_gen == 0) {
+            ++ctx->sweep_gen;
+        }
+        s->sweep_gen=ctx->sweep_gen;
+        s->sweep_bucket=0;
+        s->sweep_next=ctx->pcp_db.flows[0];
+    }
+
+    // requests sent by the sweep leave in batches
+    ctx->tx_batching=1;
+    while (s->sweep_bucket < FLOW_HASH_SIZE) {
+        pcp_flow_t *f=s->sweep_next;
+
+        if (!f) {
+            if (++s->sweep_bucket < FLOW_HASH_SIZE) {
+                s->sweep_next=ctx->pcp_db.flows[s->sweep_bucket];
+            }
+            continue;
+        }
+        if ((f->pcp_server_indx != s->index)
+                || (f->sweep_gen == s->sweep_gen)) {
+            s->sweep_next=f->next;
+            continue;
+        }
+        if (budget_exhausted(ctx)) {
+            interrupted=1;
+            break;
+        }
+        ++ctx->budget_used;
+        f->sweep_gen=s->sweep_gen;
+        s->sweep_next=f->next;
+        if (fn(f, data)) {
+            break;
+        }
+    }
+    ctx->tx_batching=batching;
+    if (!batching) {
+        pcp_tx_flush(ctx);
+    }
+    if (interrupted) {
+        return 1;
+    }
+
+    s->sweep_gen=0;
+    s->sweep_next=NULL;
     return 0;
 }
 
@@ -814,7 +1201,12 @@ static pcp_server_state_e handle_server_ping(pcp_server_t *s)
     PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
     s->ping_count=0;
 
+    // server without flows is probed right away, so it's initialized by
+    // the time the first flow is created
     msg=get_ping_msg(s);
+    if (!msg) {
+        msg=create_ann_msg(s);
+    }
 
     if (!msg) {
         s->next_timeout.tv_sec=0;
@@ -874,6 +1266,10 @@ static pcp_server_state_e handle_wait_ping_resp_recv(pcp_server_t *s)
     switch (res) {
         case pss_wait_io_calc_nearest_timeout:
             res=pss_send_all_msgs;
+            drop_ann_msg(s);
+            break;
+        case pss_server_restart:
+            drop_ann_msg(s);
             break;
         case pss_wait_io:
             res=pss_wait_ping_resp;
@@ -913,13 +1309,14 @@ static pcp_server_state_e handle_version_negotiation(pcp_server_t *s)
     ping_msg=s->ping_flow_msg;
 
 #ifndef PCP_DISABLE_NATPMP
-    if (s->pcp_version == 0) {
+    if ((s->pcp_version == 0) && ((!ping_msg)
+            || (ping_msg->kd.operation != PCP_OPCODE_ANNOUNCE))) {
         if (ping_msg) {
             ping_msg->state=pfs_wait_for_server_init;
             ping_msg->timeout.tv_sec=0;
             ping_msg->timeout.tv_usec=0;
         }
-        ping_msg=create_natpmp_ann_msg(s);
+        ping_msg=create_ann_msg(s);
     }
 #endif
 
@@ -948,20 +1345,23 @@ static pcp_server_state_e handle_version_negotiation(pcp_server_t *s)
 static pcp_server_state_e handle_send_all_msgs(pcp_server_t *s)
 {
     struct flow_iterator_data d={s, fev_server_initialized};
+    int pending=server_flow_sweep(s, flow_send_event_iter, &d);
 
-    pcp_db_foreach_flow(s->ctx, flow_send_event_iter, &d);
     gettimeofday(&s->next_timeout, NULL);
 
-    return pss_wait_io_calc_nearest_timeout;
+    return pending ? pss_send_all_msgs : pss_wait_io_calc_nearest_timeout;
 }
 
 static pcp_server_state_e handle_server_restart(pcp_server_t *s)
 {
     struct flow_iterator_data d={s, fev_server_restarted};
+    int pending=server_flow_sweep(s, flow_send_event_iter, &d);
 
-    pcp_db_foreach_flow(s->ctx, flow_send_event_iter, &d);
-    s->restart_flow_msg=NULL;
     gettimeofday(&s->next_timeout, NULL);
+    if (pending) {
+        return pss_server_restart;
+    }
+    s->restart_flow_msg=NULL;
 
     return pss_wait_io_calc_nearest_timeout;
 }
@@ -1008,19 +1408,16 @@ static pcp_server_state_e handle_wait_io_receive_msg(pcp_server_t *s)
 
 static pcp_server_state_e handle_wait_io_timeout(pcp_server_t *s)
 {
-    struct timeval ctv;
-
-    s->next_timeout.tv_sec=0;
-    s->next_timeout.tv_usec=0;
-
-    pcp_db_foreach_flow(s->ctx, check_flow_timeout, &s->next_timeout);
+    if (!s->sweep_gen) {
+        s->sweep_timeout.tv_sec=0;
+        s->sweep_timeout.tv_usec=0;
+    }
 
-    if ((s->next_timeout.tv_sec != 0) || (s->next_timeout.tv_usec != 0)) {
-        gettimeofday(&ctv, NULL);
-        s->next_timeout.tv_sec+=ctv.tv_sec;
-        s->next_timeout.tv_usec+=ctv.tv_usec;
-        timeval_align(&s->next_timeout);
+    if (server_flow_sweep(s, flow_timeout_iter, s)) {
+        gettimeofday(&s->next_timeout, NULL);
+        return pss_wait_io_calc_nearest_timeout;
     }
+    s->next_timeout=s->sweep_timeout;
 
     return pss_wait_io;
 }
@@ -1028,15 +1425,21 @@ static pcp_server_state_e handle_wait_io_timeout(pcp_server_t *s)
 static pcp_server_state_e handle_server_set_not_working(pcp_server_t *s)
 {
     struct flow_iterator_data d={s, fev_failed};
+    int pending;
 
     PCP_LOG(PCP_LOGLVL_DEBUG, "Entered function %s", __FUNCTION__);
-    PCP_LOG(PCP_LOGLVL_WARN, "PCP server %s failed to respond. "
-    "Disabling sending of PCP messages to this server for %d minutes.",
-            s->pcp_server_paddr, PCP_SERVER_DISCOVERY_RETRY_DELAY / 60);
+    if (!s->sweep_gen) {
+        PCP_LOG(PCP_LOGLVL_WARN, "PCP server %s failed to respond. "
+        "Disabling sending of PCP messages to this server for %d minutes.",
+                s->pcp_server_paddr, PCP_SERVER_DISCOVERY_RETRY_DELAY / 60);
+    }
 
-    pcp_db_foreach_flow(s->ctx, flow_send_event_iter, &d);
+    pending=server_flow_sweep(s, flow_send_event_iter, &d);
 
     gettimeofday(&s->next_timeout, NULL);
+    if (pending) {
+        return pss_set_not_working;
+    }
     s->next_timeout.tv_sec+=PCP_SERVER_DISCOVERY_RETRY_DELAY;
 
     return pss_not_working;
@@ -1083,6 +1486,9 @@ static pcp_server_state_e handle_server_reping(pcp_server_t *s)
     PCP_LOG(PCP_LOGLVL_INFO, "Trying to ping PCP server %s again. ",
             s->pcp_server_paddr);
 
+    // server may be reachable by another route now
+    psd_server_check_route(s);
+
     s->pcp_version=PCP_MAX_SUPPORTED_VERSION;
     gettimeofday(&s->next_timeout, NULL);
 
@@ -1093,6 +1499,8 @@ static pcp_server_state_e pcp_terminate_server(pcp_server_t *s)
 {
     s->next_timeout.tv_sec=0;
     s->next_timeout.tv_usec=0;
+    s->sweep_gen=0;
+    s->sweep_then=pss_unitialized;
 
     PCP_LOG(PCP_LOGLVL_INFO, "PCP server %s terminated. ",
             s->pcp_server_paddr);
@@ -1130,7 +1538,7 @@ typedef struct pcp_server_state_machine {
     handle_server_state_event handler;
 } pcp_server_state_machine_t;
 
-pcp_server_state_machine_t server_sm[]={{pss_any, pcpe_terminate,
+static const pcp_server_state_machine_t server_sm[]={{pss_any, pcpe_terminate,
         pcp_terminate_server},
 // -> allocated
         {pss_ping, pcpe_any, handle_server_ping},
@@ -1174,7 +1582,7 @@ pcp_errno run_server_state_machine(pcp_server_t *s, pcp_event_e event)
     }
 
     for (i=0; i < SERVER_STATE_MACHINE_COUNT; ++i) {
-        pcp_server_state_machine_t *state_def=server_sm + i;
+        const pcp_server_state_machine_t *state_def=server_sm + i;
         if ((state_def->state == s->server_state)
                 || (state_def->state == pss_any)) {
             if ((state_def->event == pcpe_any) || (state_def->event == event)) {
@@ -1185,6 +1593,12 @@ pcp_errno run_server_state_machine(pcp_server_t *s, pcp_event_e event)
                         dbg_get_func_name(state_def->handler), s->pcp_server_paddr, s->index, dbg_get_sstate_name(s->server_state), dbg_get_sevent_name(event));
 
                 s->server_state=state_def->handler(s);
+                // sweep is done, response received during it takes over
+                if ((s->sweep_then != pss_unitialized) && (!s->sweep_gen)) {
+                    s->server_state=s->sweep_then;
+                    s->sweep_then=pss_unitialized;
+                    gettimeofday(&s->next_timeout, NULL);
+                }
 
                 PCP_LOG_DEBUG(
                         "Return from server state handler's %s \n    result state: %s",
@@ -1202,6 +1616,76 @@ struct hserver_iter_data {
     pcp_event_e ev;
 };
 
+// server states running over all flows, they can span several pulses
+static int server_in_sweep(pcp_server_t *s)
+{
+    switch (s->server_state) {
+        case pss_send_all_msgs:
+        case pss_wait_io_calc_nearest_timeout:
+        case pss_server_restart:
+        case pss_set_not_working:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int sweep_then_rank(pcp_server_state_e state)
+{
+    switch (state) {
+        case pss_set_not_working:
+            return 3;
+        case pss_version_negotiation:
+            return 2;
+        case pss_server_restart:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void queue_sweep_then(pcp_server_t *s, pcp_server_state_e state)
+{
+    if (sweep_then_rank(state) > sweep_then_rank(s->sweep_then)) {
+        s->sweep_then=state;
+    }
+}
+
+/* response received while flow sweep of the server waits for the next
+ * pulse: flows take it right away, while state change it asks for (as
+ * handle_wait_io_receive_msg would do) is done after the sweep, so the
+ * sweep isn't abandoned halfway */
+static void handle_rcvd_in_sweep(pcp_server_t *s)
+{
+    pcp_recv_msg_t *msg=&s->ctx->msg;
+    pcp_flow_t *f;
+
+    switch (msg->recv_result) {
+        case PCP_RES_UNSUPP_VERSION:
+            if (s->server_state != pss_set_not_working) {
+                s->next_version=msg->recv_version;
+                queue_sweep_then(s, pss_version_negotiation);
+            }
+            return;
+        case PCP_RES_ADDRESS_MISMATCH:
+            PCP_LOG(PCP_LOGLVL_WARN, "There is PCP-unaware NAT present "
+            "between client and PCP server %s. "
+            "Sending of PCP messages was disabled.", s->pcp_server_paddr);
+            queue_sweep_then(s, pss_set_not_working);
+            return;
+    }
+
+    f=server_process_rcvd_pcp_msg(s, msg);
+
+    // server being disabled answers, so it's restarted as not working one
+    if ((s->server_state == pss_set_not_working) || (compare_epochs(msg, s))) {
+        s->epoch=msg->recv_epoch;
+        s->cepoch=msg->received_time;
+        s->restart_flow_msg=f;
+        queue_sweep_then(s, pss_server_restart);
+    }
+}
+
 static int hserver_iter(pcp_server_t *s, void *data)
 {
     pcp_event_e ev=((struct hserver_iter_data*)data)->ev;
@@ -1214,10 +1698,26 @@ static int hserver_iter(pcp_server_t *s, void *data)
         return 0;
     }
 
-    if (ev != pcpe_timeout)
+    if ((ev == pcpe_io_event) && (s->server_state
+            == pss_wait_io_calc_nearest_timeout) && (!s->sweep_gen)) {
+        // work budget ran out before timeouts were looked at, no flow was
+        // visited yet
+        s->server_state=pss_wait_io;
+        run_server_state_machine(s, ev);
+    } else if ((ev == pcpe_io_event) && (server_in_sweep(s))) {
+        // flow sweep was interrupted by work budget and it's continued by
+        // the timeout loop
+        handle_rcvd_in_sweep(s);
+    } else if (ev != pcpe_timeout) {
         run_server_state_machine(s, ev);
+    }
 
     while (1) {
+        if (budget_exhausted(s->ctx)) {
+            // rest of the work is done by next pulse
+            PCP_LOG_END(PCP_LOGLVL_DEBUG);
+            return 1;
+        }
         gettimeofday(&ctv, NULL);
         if (((s->next_timeout.tv_sec == 0) && (s->next_timeout.tv_usec == 0))
                 || (!timeval_subtract(&ctv, &s->next_timeout, &ctv))) {
@@ -1245,67 +1745,455 @@ static int hserver_iter(pcp_server_t *s, void *data)
     return 0;
 }
 
+static void pcp_handle_rcvd_msg(pcp_ctx_t *ctx, pcp_recv_msg_t *msg)
+{
+    struct in6_addr ip6;
+    pcp_server_t *s;
+    struct hserver_iter_data param={NULL, pcpe_io_event};
+
+    msg->received_time=msg->rcvd_ts.tv_sec;
+
+    if (!validate_pcp_msg(msg)) {
+        PCP_LOG(PCP_LOGLVL_PERR, "%s", "Invalid PCP msg");
+        return;
+    }
+
+    if ((parse_response(msg)) != PCP_ERR_SUCCESS) {
+        PCP_LOG(PCP_LOGLVL_PERR, "%s", "Cannot parse PCP msg");
+        return;
+    }
+
+    pcp_fill_in6_addr(&ip6, NULL, (struct sockaddr*)&msg->rcvd_from_addr);
+    s=get_pcp_server_by_ip(ctx, &ip6);
+
+    if (s) {
+      msg->pcp_server_indx=s->index;
+      memcpy(&msg->kd.src_ip, s->src_ip, sizeof(struct in6_addr));
+      memcpy(&msg->kd.pcp_server_ip, s->pcp_ip, sizeof(struct in6_addr));
+      if (msg->recv_version < 2) {
+        memcpy(&msg->kd.nonce, &s->nonce, sizeof(struct pcp_nonce));
+      }
+
+      // process pcpe_io_event for server
+      hserver_iter(s, &param);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//                  Next deadline tracking (reactor integration)
+
+static void pcp_ctx_arm_timer(pcp_ctx_t *ctx)
+{
+#ifdef __linux__
+    struct itimerspec its;
+
+    if (ctx->timer_fd == PCP_INVALID_SOCKET) {
+        return;
+    }
+
+    // zero it_value disarms the timer => no deadline pending
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec=ctx->next_deadline.tv_sec;
+    its.it_value.tv_nsec=ctx->next_deadline.tv_usec * 1000;
+
+    if (timerfd_settime(ctx->timer_fd, TFD_TIMER_ABSTIME, &its, NULL)) {
+        PCP_LOG(PCP_LOGLVL_PERR, "%s", "Cannot arm PCP timer fd.");
+    }
+#else
+    OSDEP(ctx);
+#endif
+}
+
+static int calc_deadline_iter(pcp_server_t *s, void *data)
+{
+    struct timeval *deadline=(struct timeval *)data;
+
+    if ((s->server_state == pss_unitialized)
+            || ((s->next_timeout.tv_sec == 0) && (s->next_timeout.tv_usec == 0))) {
+        return 0;
+    }
+
+    if (((deadline->tv_sec == 0) && (deadline->tv_usec == 0))
+            || (timeval_comp(&s->next_timeout, deadline) < 0)) {
+        *deadline=s->next_timeout;
+    }
+
+    return 0;
+}
+
+static void pcp_ctx_calc_deadline(pcp_ctx_t *ctx)
+{
+    struct timeval deadline={0, 0};
+
+    pcp_db_foreach_server(ctx, calc_deadline_iter, &deadline);
+
+    if (timeval_comp(&deadline, &ctx->next_deadline)) {
+        ctx->next_deadline=deadline;
+        pcp_ctx_arm_timer(ctx);
+    }
+}
+
+void pcp_ctx_deadline_update(pcp_ctx_t *ctx, struct timeval *deadline)
+{
+    if ((!ctx) || (!deadline)) {
+        return;
+    }
+
+    if (((ctx->next_deadline.tv_sec == 0) && (ctx->next_deadline.tv_usec == 0))
+            || (timeval_comp(deadline, &ctx->next_deadline) < 0)) {
+        ctx->next_deadline=*deadline;
+        pcp_ctx_arm_timer(ctx);
+    }
+}
+
+static int pcp_ctx_deadline_ms(pcp_ctx_t *ctx)
+{
+    struct timeval ctv, rem;
+
+    if ((ctx->next_deadline.tv_sec == 0) && (ctx->next_deadline.tv_usec == 0)) {
+        return -1;
+    }
+
+    gettimeofday(&ctv, NULL);
+    timeval_subtract(&rem, &ctx->next_deadline, &ctv);
+
+    // round up, so the caller doesn't wake up just before the deadline
+    return (rem.tv_sec * 1000) + ((rem.tv_usec + 999) / 1000);
+}
+
+/* handles datagrams waiting in sock, cnt at a time; drain => until it's
+ * empty (short batch), otherwise one batch only. Each datagram is charged
+ * to the work budget of pcp_pulse_budget, reading stops once it's spent. */
+static void pcp_read_socket(pcp_ctx_t *ctx, PCP_SOCKET sock, unsigned cnt,
+        int drain)
+{
+    unsigned batch;
+    int n, i;
+
+    do {
+        if (budget_exhausted(ctx)) {
+            return;
+        }
+        batch=cnt;
+        if ((ctx->budget_active) && (ctx->budget_max_flows)
+                && (ctx->budget_max_flows - ctx->budget_used < batch)) {
+            batch=ctx->budget_max_flows - ctx->budget_used;
+        }
+        n=read_msgs(ctx, sock, batch);
+        // charged before handling, as a response may start a flow sweep
+        if ((ctx->budget_active) && (n > 0)) {
+            ctx->budget_used+=n;
+        }
+        for (i=0; i < n; ++i) {
+            select_msg(ctx, &ctx->msg, i);
+            pcp_handle_rcvd_msg(ctx, &ctx->msg);
+        }
+    } while ((drain) && (n == (int)batch));
+}
+
+/* reads context sockets and own sockets of servers */
+static void pcp_read_sockets(pcp_ctx_t *ctx, unsigned cnt, int drain)
+{
+    size_t i;
+
+    // sans-I/O context has no sockets, see pcp_ctx_input
+    if (ctx->sio) {
+        return;
+    }
+
+    // completions of all sockets are in one ring; datagrams left in it
+    // keep pcp_uring_pending set, so the next pulse is due at once
+    if (ctx->uring) {
+        pcp_read_socket(ctx, ctx->socket, cnt, drain);
+        return;
+    }
+
+    pcp_read_socket(ctx, ctx->socket, cnt, drain);
+    if (ctx->socket6 != PCP_INVALID_SOCKET) {
+        pcp_read_socket(ctx, ctx->socket6, cnt, drain);
+    }
+
+    for (i=0; i < ctx->pcp_db.pcp_servers_length; ++i) {
+        pcp_server_t *s=ctx->pcp_db.pcp_servers + i;
+
+        if ((s->server_state != pss_unitialized)
+                && (s->socket != PCP_INVALID_SOCKET)) {
+            pcp_read_socket(ctx, s->socket, cnt, drain);
+        }
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //                       Exported functions
 
-int pcp_pulse(pcp_ctx_t *ctx, struct timeval *next_timeout)
+static int pcp_pulse_intern(pcp_ctx_t *ctx, struct timeval *next_timeout)
 {
-    pcp_recv_msg_t *msg;
     struct timeval tmp_timeout={0, 0};
 
+    if (!next_timeout) {
+        next_timeout=&tmp_timeout;
+    }
+
+    // budgeted pulse reads responses until the budget is spent, so it keeps
+    // up with requests it sends; the rest waits for the next pulse
+    if (ctx->budget_active) {
+        pcp_read_sockets(ctx, PCP_IO_BATCH, 1);
+    } else {
+        pcp_read_sockets(ctx, 1, 0);
+    }
+    // route notification socket is nonblocking, nothing waits if it's empty
+    psd_route_events(ctx);
+
+    {
+        struct hserver_iter_data param={next_timeout, pcpe_timeout};
+
+        // fastest servers get their requests first (and the budget)
+        pcp_db_foreach_server_by_rtt(ctx, hserver_iter, &param);
+    }
+    pcp_ctx_calc_deadline(ctx);
+    pcp_flow_changes_flush(ctx);
+    pcp_cq_flush(ctx);
+
+    // datagrams put aside by io_uring transport while sending don't make
+    // ring fd readable, so they are due now
+    if ((ctx->budget_exhausted) || (pcp_uring_pending(ctx->uring))) {
+        next_timeout->tv_sec=0;
+        next_timeout->tv_usec=0;
+    }
+
+    PCP_LOG_END(PCP_LOGLVL_DEBUG);
+    return (next_timeout->tv_sec * 1000) + (next_timeout->tv_usec / 1000);
+}
+
+int pcp_pulse(pcp_ctx_t *ctx, struct timeval *next_timeout)
+{
+    if ((!ctx) || (pcp_io_is_foreign(ctx))) {
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    return pcp_pulse_intern(ctx, next_timeout);
+}
+
+int pcp_pulse_budget(pcp_ctx_t *ctx, const pcp_budget_t *budget,
+        struct timeval *next_timeout, int *pending)
+{
+    int ret;
+
+    if ((!ctx) || (pcp_io_is_foreign(ctx))) {
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    if (budget) {
+        ctx->budget_active=1;
+        ctx->budget_exhausted=0;
+        ctx->budget_max_flows=budget->max_flows;
+        ctx->budget_used=0;
+        ctx->budget_clock_at=1;
+        ctx->budget_end.tv_sec=0;
+        ctx->budget_end.tv_usec=0;
+        if (budget->max_usec) {
+            gettimeofday(&ctx->budget_end, NULL);
+            ctx->budget_end.tv_sec+=budget->max_usec / 1000000;
+            ctx->budget_end.tv_usec+=budget->max_usec % 1000000;
+            timeval_align(&ctx->budget_end);
+        }
+    }
+
+    ret=pcp_pulse_intern(ctx, next_timeout);
+
+    if (pending) {
+        *pending=ctx->budget_exhausted;
+    }
+    // API calls between pulses aren't limited
+    ctx->budget_active=0;
+    ctx->budget_exhausted=0;
+
+    return ret;
+}
+
+int pcp_enable_timerfd(pcp_ctx_t *ctx)
+{
     if (!ctx) {
         return PCP_ERR_BAD_ARGS;
     }
 
-    msg=&ctx->msg;
+#ifdef __linux__
+    if (ctx->timer_fd == PCP_INVALID_SOCKET) {
+        ctx->timer_fd=timerfd_create(CLOCK_REALTIME,
+                TFD_NONBLOCK | TFD_CLOEXEC);
+        if (ctx->timer_fd == PCP_INVALID_SOCKET) {
+            PCP_LOG(PCP_LOGLVL_ERR, "%s", "Cannot create PCP timer fd.");
+            return PCP_ERR_UNKNOWN;
+        }
+        pcp_ctx_arm_timer(ctx);
+    }
+    return PCP_ERR_SUCCESS;
+#else
+    return PCP_ERR_NOT_FOUND;
+#endif
+}
 
-    if (!next_timeout) {
-        next_timeout=&tmp_timeout;
+int pcp_get_pollfds(pcp_ctx_t *ctx, pcp_pollfd_t *fds, int max_fds)
+{
+    int cnt=0;
+    size_t i;
+
+    if ((!ctx) || ((!fds) && (max_fds > 0))) {
+        return PCP_ERR_BAD_ARGS;
     }
 
-    memset(msg, 1, sizeof(*msg));
+    // io_uring transport reads all sockets, its ring fd is polled instead
+    if (ctx->uring) {
+        if (cnt < max_fds) {
+            fds[cnt].fd=pcp_uring_fd(ctx->uring);
+            fds[cnt].events=PCP_EV_READ;
+        }
+        ++cnt;
+        goto timer;
+    }
+    if (ctx->sio) {
+        goto timer;
+    }
 
-    if (read_msg(ctx, msg) == PCP_ERR_SUCCESS) {
-        struct in6_addr ip6;
-        pcp_server_t *s;
-        struct hserver_iter_data param={NULL, pcpe_io_event};
+    if (cnt < max_fds) {
+        fds[cnt].fd=ctx->socket;
+        fds[cnt].events=PCP_EV_READ;
+    }
+    ++cnt;
+
+    if (ctx->socket6 != PCP_INVALID_SOCKET) {
+        if (cnt < max_fds) {
+            fds[cnt].fd=ctx->socket6;
+            fds[cnt].events=PCP_EV_READ;
+        }
+        ++cnt;
+    }
 
-        msg->received_time=time(NULL);
+    for (i=0; i < ctx->pcp_db.pcp_servers_length; ++i) {
+        pcp_server_t *s=ctx->pcp_db.pcp_servers + i;
 
-        if (!validate_pcp_msg(msg)) {
-            PCP_LOG(PCP_LOGLVL_PERR, "%s", "Invalid PCP msg");
-            goto process_timeouts;
+        if ((s->server_state == pss_unitialized)
+                || (s->socket == PCP_INVALID_SOCKET)) {
+            continue;
         }
+        if (cnt < max_fds) {
+            fds[cnt].fd=s->socket;
+            fds[cnt].events=PCP_EV_READ;
+        }
+        ++cnt;
+    }
 
-        if ((parse_response(msg)) != PCP_ERR_SUCCESS) {
-            PCP_LOG(PCP_LOGLVL_PERR, "%s", "Cannot parse PCP msg");
-            goto process_timeouts;
+timer:
+    if (ctx->timer_fd != PCP_INVALID_SOCKET) {
+        if (cnt < max_fds) {
+            fds[cnt].fd=ctx->timer_fd;
+            fds[cnt].events=PCP_EV_TIMER;
+        }
+        ++cnt;
+    }
+    if (ctx->route_fd != PCP_INVALID_SOCKET) {
+        if (cnt < max_fds) {
+            fds[cnt].fd=ctx->route_fd;
+            fds[cnt].events=PCP_EV_ROUTE;
         }
+        ++cnt;
+    }
+
+    return cnt;
+}
+
+int pcp_get_deadline(pcp_ctx_t *ctx, struct timeval *deadline)
+{
+    if ((!ctx) || (!deadline)) {
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    *deadline=ctx->next_deadline;
+
+    return pcp_ctx_deadline_ms(ctx);
+}
 
-        pcp_fill_in6_addr(&ip6, NULL, (struct sockaddr*)&msg->rcvd_from_addr);
-        s=get_pcp_server_by_ip(ctx, &ip6);
+int pcp_process(pcp_ctx_t *ctx, int events)
+{
+    struct timeval ctv;
+
+    PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
 
-        if (s) {
-          msg->pcp_server_indx=s->index;
-          memcpy(&msg->kd.src_ip, s->src_ip, sizeof(struct in6_addr));
-          memcpy(&msg->kd.pcp_server_ip, s->pcp_ip, sizeof(struct in6_addr));
-          if (msg->recv_version < 2) {
-            memcpy(&msg->kd.nonce, &s->nonce, sizeof(struct pcp_nonce));
-          }
+    if ((!ctx) || (pcp_io_is_foreign(ctx))) {
+        return PCP_ERR_BAD_ARGS;
+    }
 
-          // process pcpe_io_event for server
-          hserver_iter(s, &param);
+#ifdef __linux__
+    if ((events & PCP_EV_TIMER) && (ctx->timer_fd != PCP_INVALID_SOCKET)) {
+        uint64_t expirations;
+
+        // acknowledge expiration, otherwise timer fd stays readable
+        if (read(ctx->timer_fd, &expirations, sizeof(expirations)) < 0) {
+            PCP_LOG(PCP_LOGLVL_DEBUG, "%s", "PCP timer fd not expired yet.");
         }
     }
+#endif
 
-process_timeouts:
-    {
-        struct hserver_iter_data param={next_timeout, pcpe_timeout};
-        pcp_db_foreach_server(ctx, hserver_iter, &param);
+    if ((events & PCP_EV_READ) || (pcp_uring_pending(ctx->uring))) {
+        // drain the sockets, so edge triggered loops don't miss datagrams
+        pcp_read_sockets(ctx, PCP_IO_BATCH, 1);
+    }
+    if (events & PCP_EV_ROUTE) {
+        psd_route_events(ctx);
+    }
+
+    gettimeofday(&ctv, NULL);
+    if (((ctx->next_deadline.tv_sec != 0) || (ctx->next_deadline.tv_usec != 0))
+            && (timeval_comp(&ctx->next_deadline, &ctv) <= 0)) {
+        struct hserver_iter_data param={NULL, pcpe_timeout};
+
+        // hserver_iter runs state machine only for servers with expired
+        // timeout, the fastest ones first
+        pcp_db_foreach_server_by_rtt(ctx, hserver_iter, &param);
     }
+    pcp_ctx_calc_deadline(ctx);
+    pcp_flow_changes_flush(ctx);
+    pcp_cq_flush(ctx);
 
     PCP_LOG_END(PCP_LOGLVL_DEBUG);
-    return (next_timeout->tv_sec * 1000) + (next_timeout->tv_usec / 1000);
+    return pcp_uring_pending(ctx->uring) ? 0 : pcp_ctx_deadline_ms(ctx);
+}
+
+int pcp_ctx_input(pcp_ctx_t *ctx, const void *buf, size_t len,
+        const struct sockaddr *from, const struct timeval *ts)
+{
+    pcp_recv_msg_t *msg;
+    socklen_t addrlen;
+
+    if ((!ctx) || (!buf) || (!from) || (pcp_io_is_foreign(ctx))) {
+        return PCP_ERR_BAD_ARGS;
+    }
+    if ((from->sa_family != AF_INET) && (from->sa_family != AF_INET6)) {
+        return PCP_ERR_BAD_AFINET;
+    }
+    if (len > PCP_MAX_LEN) {
+        return PCP_ERR_MAX_SIZE;
+    }
+
+    PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
+
+    // datagram is parsed in place, application keeps its buffer
+    memcpy(ctx->msg_in[0], buf, len);
+    msg=&ctx->msg;
+    addrlen=SA_LEN((struct sockaddr *)from);
+    memset(&msg->rcvd_from_addr, 0, sizeof(msg->rcvd_from_addr));
+    memcpy(&msg->rcvd_from_addr, from, addrlen);
+    msg->pcp_msg_buffer=ctx->msg_in[0];
+    msg->pcp_msg_len=(uint32_t)len;
+    rx_timestamp(ctx, msg, ts);
+    pcp_handle_rcvd_msg(ctx, msg);
+
+    pcp_ctx_calc_deadline(ctx);
+    pcp_flow_changes_flush(ctx);
+    pcp_cq_flush(ctx);
+
+    PCP_LOG_END(PCP_LOGLVL_DEBUG);
+    return pcp_ctx_deadline_ms(ctx);
 }
 
 void pcp_flow_updated(pcp_flow_t *f)
@@ -1316,12 +2204,13 @@ void pcp_flow_updated(pcp_flow_t *f)
     if (!f)
         return;
 
+    pcp_flow_wire_invalidate(f);
     gettimeofday(&curtime, NULL);
     s=get_pcp_server(f->ctx, f->pcp_server_indx);
     if (s) {
         s->next_timeout=curtime;
+        pcp_ctx_deadline_update(f->ctx, &curtime);
     }
-    pcp_flow_clear_msg_buf(f);
     f->timeout=curtime;
     if ((f->state != pfs_wait_for_server_init) && (f->state != pfs_idle)
             && (f->state != pfs_failed)) {
@@ -1329,15 +2218,150 @@ void pcp_flow_updated(pcp_flow_t *f)
     }
 }
 
+struct io_set_flow_change_cb_args {
+    pcp_flow_change_notify cb_fun;
+    void *cb_arg;
+};
+
+static void io_set_flow_change_cb(pcp_ctx_t *ctx, void *args)
+{
+    struct io_set_flow_change_cb_args *a=
+            (struct io_set_flow_change_cb_args *)args;
+
+    pcp_set_flow_change_cb(ctx, a->cb_fun, a->cb_arg);
+}
+
 void pcp_set_flow_change_cb(pcp_ctx_t *ctx, pcp_flow_change_notify cb_fun,
         void *cb_arg)
 {
     if (ctx) {
+        if (pcp_io_is_foreign(ctx)) {
+            struct io_set_flow_change_cb_args a={cb_fun, cb_arg};
+
+            pcp_io_call(ctx, io_set_flow_change_cb, &a);
+            return;
+        }
         ctx->flow_change_cb_fun=cb_fun;
         ctx->flow_change_cb_arg=cb_arg;
     }
 }
 
+struct io_set_flow_change_batch_cb_args {
+    pcp_flow_change_batch_notify cb_fun;
+    void *cb_arg;
+};
+
+static void io_set_flow_change_batch_cb(pcp_ctx_t *ctx, void *args)
+{
+    struct io_set_flow_change_batch_cb_args *a=
+            (struct io_set_flow_change_batch_cb_args *)args;
+
+    pcp_set_flow_change_batch_cb(ctx, a->cb_fun, a->cb_arg);
+}
+
+void pcp_set_flow_change_batch_cb(pcp_ctx_t *ctx,
+        pcp_flow_change_batch_notify cb_fun, void *cb_arg)
+{
+    if (ctx) {
+        if (pcp_io_is_foreign(ctx)) {
+            struct io_set_flow_change_batch_cb_args a={cb_fun, cb_arg};
+
+            pcp_io_call(ctx, io_set_flow_change_batch_cb, &a);
+            return;
+        }
+        // deliver what was collected for previous callback
+        pcp_flow_changes_flush(ctx);
+        ctx->flow_change_batch_fun=cb_fun;
+        ctx->flow_change_batch_arg=cb_arg;
+    }
+}
+
+// returns 0 if change can't be queued (no memory)
+static int flow_change_queue(pcp_ctx_t *ctx, pcp_flow_t *flow,
+        pcp_fstate_e state)
+{
+    pcp_flow_change_t *c;
+
+    if (flow->change_idx) {
+        // coalesce, report only the latest state
+        ctx->flow_changes[flow->change_idx - 1].state=state;
+        return 1;
+    }
+
+    if (ctx->flow_changes_cnt == ctx->flow_changes_size) {
+        size_t size=ctx->flow_changes_size ? ctx->flow_changes_size * 2 : 16;
+
+        c=(pcp_flow_change_t *)realloc(ctx->flow_changes, size * sizeof(*c));
+        if (!c) {
+            return 0;
+        }
+        ctx->flow_changes=c;
+        ctx->flow_changes_size=size;
+    }
+
+    c=ctx->flow_changes + ctx->flow_changes_cnt++;
+    c->flow=flow;
+    c->state=state;
+    flow->change_idx=ctx->flow_changes_cnt;
+
+    return 1;
+}
+
+/* changes which couldn't be queued are reported by empty batch */
+static void changes_lost(pcp_ctx_t *ctx)
+{
+    if (ctx->flow_changes_lost) {
+        ctx->flow_changes_lost=0;
+        if (ctx->flow_change_batch_fun) {
+            ctx->flow_change_batch_fun(ctx, NULL, 0,
+                    ctx->flow_change_batch_arg);
+        }
+    }
+}
+
+void pcp_flow_changes_flush(pcp_ctx_t *ctx)
+{
+    pcp_flow_change_t *changes=ctx->flow_changes;
+    size_t cnt=ctx->flow_changes_cnt;
+    size_t size=ctx->flow_changes_size;
+    size_t i, n;
+
+    if (!cnt) {
+        changes_lost(ctx);
+        return;
+    }
+
+    // detach the array, callback may cause new changes
+    ctx->flow_changes=NULL;
+    ctx->flow_changes_cnt=0;
+    ctx->flow_changes_size=0;
+
+    for (i=n=0; i < cnt; ++i) {
+        pcp_flow_t *f=changes[i].flow;
+
+        if (f) { //NULL => flow deleted meanwhile
+            f->change_idx=0;
+            changes[n].flow=f;
+            changes[n].state=changes[i].state;
+            changes[n].user_data=f->user_data;
+            ++n;
+        }
+    }
+
+    if ((n) && (ctx->flow_change_batch_fun)) {
+        ctx->flow_change_batch_fun(ctx, changes, n,
+                ctx->flow_change_batch_arg);
+    }
+
+    if (!ctx->flow_changes) {
+        ctx->flow_changes=changes;
+        ctx->flow_changes_size=size;
+    } else {
+        free(changes);
+    }
+    changes_lost(ctx);
+}
+
 static void flow_change_notify(pcp_flow_t *flow, pcp_fstate_e state)
 {
     struct sockaddr_storage src_addr, ext_addr;
@@ -1346,7 +2370,13 @@ static void flow_change_notify(pcp_flow_t *flow, pcp_fstate_e state)
     PCP_LOG_DEBUG( "Flow's %d state changed to: %s",
             flow->key_bucket, dbg_get_fstate_name(state));
 
-    if (ctx->flow_change_cb_fun) {
+    if (ctx->flow_change_batch_fun) {
+        // user callback is never called from within the state machine
+        if (!flow_change_queue(ctx, flow, state)) {
+            PCP_LOG(PCP_LOGLVL_ERR, "%s", "Flow change couldn't be queued");
+            ctx->flow_changes_lost=1;
+        }
+    } else if (ctx->flow_change_cb_fun) {
         pcp_fill_sockaddr((struct sockaddr*)&src_addr, &flow->kd.src_ip,
                 flow->kd.map_peer.src_port, 0, 0/* scope_id */);
         if (state == pcp_state_succeeded) {
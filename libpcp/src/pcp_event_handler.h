@@ -89,10 +89,15 @@ typedef enum {
 
 void pcp_flow_updated(pcp_flow_t *f);
 
+/* deliver flow changes collected for batch callback */
+void pcp_flow_changes_flush(pcp_ctx_t *ctx);
+
 typedef struct pcp_server pcp_server_t;
 
 pcp_errno run_server_state_machine(pcp_server_t *s, pcp_event_e event);
 
 void pcp_fd_change_notify(pcp_server_t *s, int added);
 
+void pcp_ctx_deadline_update(pcp_ctx_t *ctx, struct timeval *deadline);
+
 #endif /* PCP_EVENT_HANDLER_H_ */
@@ -0,0 +1,542 @@
+/*
+ Copyright (c) 2014 by Cisco Systems, Inc.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE //pthread_setaffinity_np
+#endif
+#endif
+
+#include "pcp_io_thread.h"
+
+#ifdef PCP_USE_THREADS
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "pcp.h"
+#include "pcp_client_db.h"
+#include "pcp_logger.h"
+#include "pcp_utils.h"
+#include "pcp_socket.h"
+
+#define ATOMIC_LOAD(p)      __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE(p, v)  __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define ATOMIC_XCHG(p, v)   __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+
+struct pcp_io_sync {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+};
+
+typedef struct pcp_io_cmd {
+    struct pcp_io_cmd *next;
+    pcp_io_call_fn fn;
+    void *args;
+    struct pcp_io_sync *sync; //NULL => cmd allocated by pcp_io_post
+} pcp_io_cmd_t;
+
+struct pcp_io_thread {
+    pthread_t thread;
+    //intrusive MPSC queue of commands (D. Vyukov's algorithm)
+    pcp_io_cmd_t *head;     //producers push here
+    pcp_io_cmd_t *tail;     //only I/O thread pops from here
+    pcp_io_cmd_t stub;
+    int wake_pending;
+    int wake_fd[2];         //read/write end, the same fd for eventfd
+    int stop;
+    //progress notification for pcp_io_wait
+    pthread_mutex_t progress_lock;
+    pthread_cond_t progress_cond;
+    uint32_t progress_gen;
+    //poll set
+    pcp_pollfd_t *pfds;
+    struct pollfd *fds;
+    int fds_size;
+};
+
+// context owned by current thread, if it is I/O thread
+static PCP_THREAD_LOCAL pcp_ctx_t *pcp_io_cur_ctx;
+
+////////////////////////////////////////////////////////////////////////////////
+//                      MPSC command queue
+
+static void io_queue_push(struct pcp_io_thread *io, pcp_io_cmd_t *cmd)
+{
+    pcp_io_cmd_t *prev;
+
+    ATOMIC_STORE(&cmd->next, NULL);
+    prev=ATOMIC_XCHG(&io->head, cmd);
+    ATOMIC_STORE(&prev->next, cmd);
+}
+
+static pcp_io_cmd_t *io_queue_pop(struct pcp_io_thread *io)
+{
+    pcp_io_cmd_t *tail=io->tail;
+    pcp_io_cmd_t *next=ATOMIC_LOAD(&tail->next);
+
+    if (tail == &io->stub) {
+        if (!next) {
+            return NULL;
+        }
+        io->tail=next;
+        tail=next;
+        next=ATOMIC_LOAD(&next->next);
+    }
+
+    if (next) {
+        io->tail=next;
+        return tail;
+    }
+
+    if (tail != ATOMIC_LOAD(&io->head)) {
+        // producer is in the middle of push, it will wake us up again
+        return NULL;
+    }
+
+    io_queue_push(io, &io->stub);
+
+    next=ATOMIC_LOAD(&tail->next);
+    if (next) {
+        io->tail=next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+static void io_wakeup(struct pcp_io_thread *io)
+{
+    if (!ATOMIC_XCHG(&io->wake_pending, 1)) {
+        uint64_t one=1;
+
+        if (write(io->wake_fd[1], &one,
+#ifdef __linux__
+                sizeof(one)
+#else
+                1
+#endif
+                ) < 0) {
+            PCP_LOG(PCP_LOGLVL_PERR, "%s", "Cannot wake up PCP I/O thread.");
+        }
+    }
+}
+
+static void io_drain_wakeup(struct pcp_io_thread *io)
+{
+    uint64_t buf[8];
+
+    while (read(io->wake_fd[0], buf, sizeof(buf)) > 0) {
+#ifdef __linux__
+        break;
+#endif
+    }
+    ATOMIC_STORE(&io->wake_pending, 0);
+}
+
+static void io_run_cmds(pcp_ctx_t *ctx)
+{
+    pcp_io_cmd_t *cmd;
+
+    while ((cmd=io_queue_pop(ctx->io)) != NULL) {
+        struct pcp_io_sync *sync=cmd->sync;
+
+        cmd->fn(ctx, cmd->args);
+
+        if (sync) {
+            // cmd lives on submitter's stack, don't touch it after signal
+            pthread_mutex_lock(&sync->lock);
+            sync->done=1;
+            pthread_cond_signal(&sync->cond);
+            pthread_mutex_unlock(&sync->lock);
+        } else {
+            free(cmd);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//                      I/O thread
+
+static int io_prepare_fds(pcp_ctx_t *ctx)
+{
+    struct pcp_io_thread *io=ctx->io;
+    int i, n=pcp_get_pollfds(ctx, NULL, 0);
+
+    if (n < 0) {
+        n=0;
+    }
+
+    if (n + 1 > io->fds_size) {
+        pcp_pollfd_t *pfds=(pcp_pollfd_t *)realloc(io->pfds,
+                (n + 1) * sizeof(*pfds));
+        struct pollfd *fds;
+
+        if (!pfds) {
+            return -1;
+        }
+        io->pfds=pfds;
+        fds=(struct pollfd *)realloc(io->fds, (n + 1) * sizeof(*fds));
+        if (!fds) {
+            return -1;
+        }
+        io->fds=fds;
+        io->fds_size=n + 1;
+    }
+
+    pcp_get_pollfds(ctx, io->pfds, n);
+    for (i=0; i < n; ++i) {
+        io->fds[i].fd=io->pfds[i].fd;
+        io->fds[i].events=POLLIN;
+        io->fds[i].revents=0;
+    }
+    io->fds[n].fd=io->wake_fd[0];
+    io->fds[n].events=POLLIN;
+    io->fds[n].revents=0;
+
+    return n;
+}
+
+static void *pcp_io_thread_main(void *arg)
+{
+    pcp_ctx_t *ctx=(pcp_ctx_t *)arg;
+    struct pcp_io_thread *io=ctx->io;
+    int tout;
+
+    pcp_io_cur_ctx=ctx;
+
+    PCP_LOG(PCP_LOGLVL_INFO, "%s", "PCP I/O thread started.");
+
+    tout=pcp_process(ctx, 0);
+
+    while (!ATOMIC_LOAD(&io->stop)) {
+        int i, ret, events=0;
+        int n=io_prepare_fds(ctx);
+
+        if (n < 0) {
+            PCP_LOG(PCP_LOGLVL_ERR, "%s", "Error allocating memory");
+            break;
+        }
+
+        ret=poll(io->fds, n + 1, tout);
+        if ((ret < 0) && (errno != EINTR)) {
+            char error[ERR_BUF_LEN];
+            pcp_strerror(errno, error, sizeof(error));
+            PCP_LOG(PCP_LOGLVL_PERR, "poll failed: %s", error);
+        }
+
+        for (i=0; i < n; ++i) {
+            if (io->fds[i].revents) {
+                events|=io->pfds[i].events;
+            }
+        }
+
+        if (io->fds[n].revents) {
+            io_drain_wakeup(io);
+        }
+        io_run_cmds(ctx);
+
+        tout=pcp_process(ctx, events);
+
+        // notify waiters only if something could have changed flows' states
+        // (socket or timer event), commands alone don't count
+        if ((events) || (ret == 0)) {
+            pthread_mutex_lock(&io->progress_lock);
+            ++io->progress_gen;
+            pthread_cond_broadcast(&io->progress_cond);
+            pthread_mutex_unlock(&io->progress_lock);
+        }
+    }
+
+    // don't leave synchronous callers waiting
+    io_run_cmds(ctx);
+
+    PCP_LOG(PCP_LOGLVL_INFO, "%s", "PCP I/O thread finished.");
+    pcp_io_cur_ctx=NULL;
+    return NULL;
+}
+
+static void io_free(struct pcp_io_thread *io)
+{
+    if (io->wake_fd[0] >= 0) {
+        close(io->wake_fd[0]);
+    }
+    if ((io->wake_fd[1] >= 0) && (io->wake_fd[1] != io->wake_fd[0])) {
+        close(io->wake_fd[1]);
+    }
+    pthread_mutex_destroy(&io->progress_lock);
+    pthread_cond_destroy(&io->progress_cond);
+    free(io->pfds);
+    free(io->fds);
+    free(io);
+}
+
+pcp_errno pcp_io_thread_start(pcp_ctx_t *ctx)
+{
+    struct pcp_io_thread *io;
+
+    PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
+
+    if ((!ctx) || (ctx->io)) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    io=(struct pcp_io_thread *)calloc(1, sizeof(*io));
+    if (!io) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_NO_MEM;
+    }
+
+    io->head=io->tail=&io->stub;
+    pthread_mutex_init(&io->progress_lock, NULL);
+    pthread_cond_init(&io->progress_cond, NULL);
+
+#ifdef __linux__
+    io->wake_fd[0]=io->wake_fd[1]=eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (io->wake_fd[0] < 0) {
+#else
+    if (pipe(io->wake_fd) == 0) {
+        fcntl(io->wake_fd[0], F_SETFL, O_NONBLOCK);
+        fcntl(io->wake_fd[1], F_SETFL, O_NONBLOCK);
+    } else {
+#endif
+        PCP_LOG(PCP_LOGLVL_ERR, "%s", "Cannot create PCP I/O thread wakeup fd.");
+        io->wake_fd[0]=io->wake_fd[1]=-1;
+        io_free(io);
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_UNKNOWN;
+    }
+
+    ctx->io=io;
+    if (pthread_create(&io->thread, NULL, pcp_io_thread_main, ctx)) {
+        PCP_LOG(PCP_LOGLVL_ERR, "%s", "Cannot create PCP I/O thread.");
+        ctx->io=NULL;
+        io_free(io);
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return PCP_ERR_UNKNOWN;
+    }
+
+    PCP_LOG_END(PCP_LOGLVL_DEBUG);
+    return PCP_ERR_SUCCESS;
+}
+
+void pcp_io_thread_stop(pcp_ctx_t *ctx)
+{
+    struct pcp_io_thread *io;
+
+    if ((!ctx) || (!ctx->io)) {
+        return;
+    }
+
+    io=ctx->io;
+    if (pcp_io_cur_ctx == ctx) {
+        PCP_LOG(PCP_LOGLVL_ERR, "%s",
+                "PCP I/O thread can't be stopped from its own callback.");
+        return;
+    }
+
+    ATOMIC_STORE(&io->stop, 1);
+    io_wakeup(io);
+    pthread_join(io->thread, NULL);
+
+    ctx->io=NULL;
+    io_free(io);
+}
+
+pcp_errno pcp_io_thread_pin(pcp_ctx_t *ctx, int cpu)
+{
+    if ((!ctx) || (!ctx->io) || (cpu < 0)) {
+        return PCP_ERR_BAD_ARGS;
+    }
+#ifdef __linux__
+    {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(ctx->io->thread, sizeof(set), &set)) {
+            PCP_LOG(PCP_LOGLVL_WARN, "Cannot pin PCP I/O thread to CPU %d.",
+                    cpu);
+            return PCP_ERR_UNKNOWN;
+        }
+    }
+    return PCP_ERR_SUCCESS;
+#else
+    return PCP_ERR_NOT_FOUND;
+#endif
+}
+
+int pcp_io_is_foreign(pcp_ctx_t *ctx)
+{
+    return (ctx->io != NULL) && (pcp_io_cur_ctx != ctx);
+}
+
+pcp_errno pcp_io_post(pcp_ctx_t *ctx, pcp_io_call_fn fn, const void *args,
+        size_t args_len)
+{
+    pcp_io_cmd_t *cmd;
+
+    if ((!ctx) || (!ctx->io) || (!fn)) {
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    // args are stored right behind the command => one allocation only
+    cmd=(pcp_io_cmd_t *)malloc(sizeof(*cmd) + args_len);
+    if (!cmd) {
+        return PCP_ERR_NO_MEM;
+    }
+    cmd->fn=fn;
+    cmd->sync=NULL;
+    cmd->args=cmd + 1;
+    if (args_len) {
+        memcpy(cmd->args, args, args_len);
+    }
+
+    io_queue_push(ctx->io, cmd);
+    io_wakeup(ctx->io);
+
+    return PCP_ERR_SUCCESS;
+}
+
+pcp_errno pcp_io_call(pcp_ctx_t *ctx, pcp_io_call_fn fn, void *args)
+{
+    pcp_io_cmd_t cmd;
+    struct pcp_io_sync sync;
+
+    if ((!ctx) || (!ctx->io) || (!fn)) {
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    pthread_mutex_init(&sync.lock, NULL);
+    pthread_cond_init(&sync.cond, NULL);
+    sync.done=0;
+
+    cmd.fn=fn;
+    cmd.args=args;
+    cmd.sync=&sync;
+
+    io_queue_push(ctx->io, &cmd);
+    io_wakeup(ctx->io);
+
+    pthread_mutex_lock(&sync.lock);
+    while (!sync.done) {
+        pthread_cond_wait(&sync.cond, &sync.lock);
+    }
+    pthread_mutex_unlock(&sync.lock);
+
+    pthread_mutex_destroy(&sync.lock);
+    pthread_cond_destroy(&sync.cond);
+
+    return PCP_ERR_SUCCESS;
+}
+
+struct io_eval_args {
+    pcp_flow_t *flow;
+    pcp_fstate_e state;
+    int nexit_states;
+};
+
+static void io_eval_flow_state(pcp_ctx_t *ctx UNUSED, void *args)
+{
+    struct io_eval_args *a=(struct io_eval_args *)args;
+
+    a->nexit_states=pcp_eval_flow_state(a->flow, &a->state);
+}
+
+pcp_fstate_e pcp_io_wait(pcp_flow_t *flow, int timeout,
+        int exit_on_partial_res)
+{
+    struct pcp_io_thread *io=flow->ctx->io;
+    struct io_eval_args a;
+    struct timeval tout_end;
+    struct timespec ts;
+    int nflow_exit_states;
+
+    gettimeofday(&tout_end, NULL);
+    tout_end.tv_usec+=(timeout % 1000) * 1000;
+    tout_end.tv_sec+=timeout / 1000;
+    timeval_align(&tout_end);
+    ts.tv_sec=tout_end.tv_sec;
+    ts.tv_nsec=tout_end.tv_usec * 1000;
+
+    a.flow=flow;
+    pcp_io_call(flow->ctx, io_eval_flow_state, &a);
+    switch (a.state) {
+        case pcp_state_partial_result:
+        case pcp_state_processing:
+            nflow_exit_states=a.nexit_states;
+            break;
+        default:
+            nflow_exit_states=0;
+            break;
+    }
+
+    for (;;) {
+        uint32_t gen;
+
+        pthread_mutex_lock(&io->progress_lock);
+        gen=io->progress_gen;
+        pthread_mutex_unlock(&io->progress_lock);
+
+        pcp_io_call(flow->ctx, io_eval_flow_state, &a);
+        if (a.nexit_states > nflow_exit_states) {
+            if ((exit_on_partial_res)
+                    || (a.state != pcp_state_partial_result)) {
+                return a.state;
+            }
+        }
+
+        pthread_mutex_lock(&io->progress_lock);
+        while (gen == io->progress_gen) {
+            if (pthread_cond_timedwait(&io->progress_cond, &io->progress_lock,
+                    &ts) == ETIMEDOUT) {
+                pthread_mutex_unlock(&io->progress_lock);
+                return pcp_state_processing;
+            }
+        }
+        pthread_mutex_unlock(&io->progress_lock);
+    }
+}
+
+#endif //PCP_USE_THREADS
@@ -0,0 +1,99 @@
+/*
+ Copyright (c) 2014 by Cisco Systems, Inc.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PCP_IO_THREAD_H_
+#define PCP_IO_THREAD_H_
+
+#include "pcp.h"
+
+/* function executed on I/O thread; args points to a copy of submitted args */
+typedef void (*pcp_io_call_fn)(pcp_ctx_t *ctx, void *args);
+
+#ifdef PCP_USE_THREADS
+
+pcp_errno pcp_io_thread_start(pcp_ctx_t *ctx);
+
+void pcp_io_thread_stop(pcp_ctx_t *ctx);
+
+/* bind I/O thread of ctx to given CPU */
+pcp_errno pcp_io_thread_pin(pcp_ctx_t *ctx, int cpu);
+
+/* nonzero if ctx is owned by I/O thread and caller runs on other thread */
+int pcp_io_is_foreign(pcp_ctx_t *ctx);
+
+/* queue fn to be run on I/O thread, args are copied, caller doesn't wait */
+pcp_errno pcp_io_post(pcp_ctx_t *ctx, pcp_io_call_fn fn, const void *args,
+        size_t args_len);
+
+/* run fn on I/O thread and wait until it's executed */
+pcp_errno pcp_io_call(pcp_ctx_t *ctx, pcp_io_call_fn fn, void *args);
+
+/* pcp_wait counterpart for flows owned by I/O thread */
+pcp_fstate_e pcp_io_wait(pcp_flow_t *flow, int timeout,
+        int exit_on_partial_res);
+
+#else //PCP_USE_THREADS
+
+#include "pcp_utils.h"
+
+static inline pcp_errno pcp_io_thread_start(pcp_ctx_t *ctx UNUSED)
+{
+    return PCP_ERR_NOT_FOUND;
+}
+
+static inline void pcp_io_thread_stop(pcp_ctx_t *ctx UNUSED)
+{
+}
+
+static inline pcp_errno pcp_io_thread_pin(pcp_ctx_t *ctx UNUSED,
+        int cpu UNUSED)
+{
+    return PCP_ERR_NOT_FOUND;
+}
+
+#define pcp_io_is_foreign(ctx) 0
+
+static inline pcp_errno pcp_io_post(pcp_ctx_t *ctx UNUSED,
+        pcp_io_call_fn fn UNUSED, const void *args UNUSED,
+        size_t args_len UNUSED)
+{
+    return PCP_ERR_NOT_FOUND;
+}
+
+static inline pcp_errno pcp_io_call(pcp_ctx_t *ctx UNUSED,
+        pcp_io_call_fn fn UNUSED, void *args UNUSED)
+{
+    return PCP_ERR_NOT_FOUND;
+}
+
+static inline pcp_fstate_e pcp_io_wait(pcp_flow_t *flow UNUSED,
+        int timeout UNUSED, int exit_on_partial_res UNUSED)
+{
+    return pcp_state_failed;
+}
+
+#endif //PCP_USE_THREADS
+
+#endif /* PCP_IO_THREAD_H_ */
@@ -40,6 +40,7 @@
 #include <string.h>
 #include "pcp.h"
 #include "pcp_logger.h"
+#include "pcp_utils.h"
 #ifdef _MSC_VER
 #include "pcp_gettimeofday.h" //gettimeofday()
 #else
@@ -47,14 +48,30 @@
 #endif //_MSC_VER
 pcp_loglvl_e pcp_log_level=PCP_MAX_LOG_LEVEL;
 
+#ifdef __GNUC__
+#define LOGGER_LOAD(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define LOGGER_STORE(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#else
+#define LOGGER_LOAD(p) (p)
+#define LOGGER_STORE(p, v) ((p)=(v))
+#endif
+
 void pcp_logger_init(void)
 {
+    static int env_read=0;
     char *env, *ret;
 
+    // environment is applied once, so pcp_init() running in parallel
+    // threads doesn't rewrite the level other contexts are logging with
+    if (LOGGER_LOAD(env_read)) {
+        return;
+    }
+    LOGGER_STORE(env_read, 1);
+
     if ((env=getenv("PCP_LOG_LEVEL"))) {
         long lvl=strtol(env, &ret, 0);
         if ((ret) && (!*ret) && (lvl>=0) && (lvl<=PCP_MAX_LOG_LEVEL)) {
-            pcp_log_level=lvl;
+            LOGGER_STORE(pcp_log_level, (pcp_loglvl_e)lvl);
         }
     }
 }
@@ -63,7 +80,8 @@ static void default_logfn(pcp_loglvl_e mode, const char *msg)
 {
 
     const char *prefix;
-    static struct timeval prev_timestamp={0, 0};
+    // per thread, each context driven by its own thread logs own deltas
+    static PCP_THREAD_LOCAL struct timeval prev_timestamp={0, 0};
     struct timeval cur_timestamp;
     uint64_t diff;
 
@@ -102,11 +120,11 @@ static void default_logfn(pcp_loglvl_e mode, const char *msg)
             prefix, msg);
 }
 
-external_logger logger=default_logfn;
+static external_logger logger=default_logfn;
 
 void pcp_set_loggerfn(external_logger ext_log)
 {
-    logger=ext_log;
+    LOGGER_STORE(logger, ext_log);
 }
 
 void pcp_logger(pcp_loglvl_e log_level, const char *fmt, ...)
@@ -115,8 +133,9 @@ void pcp_logger(pcp_loglvl_e log_level, const char *fmt, ...)
     int size=256; /* Guess we need no more than 256 bytes. */
     char *p, *np;
     va_list ap;
+    external_logger logfn;
 
-    if (log_level > pcp_log_level) {
+    if (log_level > LOGGER_LOAD(pcp_log_level)) {
         return;
     }
 
@@ -153,8 +172,8 @@ void pcp_logger(pcp_loglvl_e log_level, const char *fmt, ...)
         p=np;
     }
 
-    if (logger)
-        (*logger)(log_level, p);
+    if ((logfn=LOGGER_LOAD(logger)))
+        (*logfn)(log_level, p);
 
     free(p);
     return;
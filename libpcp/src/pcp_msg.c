@@ -97,6 +97,7 @@ static void *add_userid_option(pcp_flow_t *f, void *cur)
     pcp_userid_option_t *userid_op = (pcp_userid_option_t *) cur;
 
     userid_op->option=PCP_OPTION_USERID;
+    userid_op->reserved=0;
     userid_op->len=htons(sizeof(pcp_userid_option_t) - sizeof(pcp_options_hdr_t));
     memcpy(&(userid_op->userid[0]), &(f->f_userid.userid[0]), MAX_USER_ID);
     cur=userid_op + 1;
@@ -109,6 +110,7 @@ static void *add_location_option(pcp_flow_t *f, void *cur)
     pcp_location_option_t *location_op = (pcp_location_option_t *) cur;
 
     location_op->option=PCP_OPTION_LOCATION;
+    location_op->reserved=0;
     location_op->len=htons(sizeof(pcp_location_option_t) - sizeof(pcp_options_hdr_t));
     memcpy(&(location_op->location[0]), &(f->f_location.location[0]), MAX_GEO_STR);
     cur=location_op + 1;
@@ -121,6 +123,7 @@ static void *add_deviceid_option(pcp_flow_t *f, void *cur)
     pcp_deviceid_option_t *deviceid_op = (pcp_deviceid_option_t *) cur;
 
     deviceid_op->option=PCP_OPTION_DEVICEID;
+    deviceid_op->reserved=0;
     PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
     deviceid_op->len=htons(sizeof(pcp_deviceid_option_t) - sizeof(pcp_options_hdr_t));
     memcpy(&(deviceid_op->deviceid[0]), &(f->f_deviceid.deviceid[0]), MAX_DEVICE_ID);
@@ -137,6 +140,9 @@ static void *add_flowp_option(pcp_flow_t *f, void *cur)
     pcp_flow_priority_option_t *flowp_op = (pcp_flow_priority_option_t *)cur;
 
     flowp_op->option=PCP_OPTION_FLOW_PRIORITY;
+    flowp_op->reserved=0;
+    flowp_op->reserved2=0;
+    flowp_op->response_bit=0;
     flowp_op->len=htons(sizeof(pcp_flow_priority_option_t) - sizeof(pcp_options_hdr_t));
     flowp_op->dscp_up=f->flowp_dscp_up;
     flowp_op->dscp_down=f->flowp_dscp_down;
@@ -147,12 +153,12 @@ static void *add_flowp_option(pcp_flow_t *f, void *cur)
 #endif
 
 #ifdef PCP_EXPERIMENTAL
-static inline pcp_metadata_option_t *add_md_option(pcp_flow_t *f,
+static inline pcp_metadata_option_t *add_md_option(char *buf,
         pcp_metadata_option_t *md_opt, md_val_t *md)
 {
     size_t len_md=md->val_len;
     uint32_t padding=(4 - (len_md % 4)) % 4;
-    size_t pcp_msg_len=((const char*)md_opt) - f->pcp_msg_buffer;
+    size_t pcp_msg_len=((const char*)md_opt) - buf;
 
     if ( (pcp_msg_len + (sizeof(pcp_metadata_option_t) + len_md + padding)) >
             PCP_MAX_LEN) {
@@ -160,14 +166,16 @@ static inline pcp_metadata_option_t *add_md_option(pcp_flow_t *f,
     }
 
     md_opt->option=PCP_OPTION_METADATA;
+    md_opt->reserved=0;
     md_opt->metadata_id=htonl(md->md_id);
     memcpy(md_opt->metadata, md->val_buf, len_md);
+    memset(md_opt->metadata + len_md, 0, padding);
     md_opt->len=htons(sizeof(*md_opt) - sizeof(pcp_options_hdr_t) + len_md + padding);
 
     return (pcp_metadata_option_t *)(((uint8_t *)(md_opt+1)) + len_md + padding);
 }
 
-static void *add_md_options(pcp_flow_t *f, void *cur)
+static void *add_md_options(pcp_flow_t *f, char *buf, void *cur)
 {
     uint32_t i;
     md_val_t *md;
@@ -176,14 +184,15 @@ static void *add_md_options(pcp_flow_t *f, void *cur)
     for (i=f->md_val_count, md=f->md_vals; i>0 && md!=NULL; --i, ++md)
     {
         if (md->val_len) {
-            md_opt = add_md_option(f, md_opt, md);
+            md_opt = add_md_option(buf, md_opt, md);
         }
     }
     return md_opt;
 }
 #endif
 
-static pcp_errno build_pcp_options(pcp_flow_t *flow, void *cur)
+/* returns end of the message */
+static void *build_pcp_options(pcp_flow_t *flow, char *buf, void *cur)
 {
 #ifdef PCP_FLOW_PRIORITY
     if (flow->flowp_option_present) {
@@ -214,236 +223,350 @@ static pcp_errno build_pcp_options(pcp_flow_t *flow, void *cur)
     }
 
     if (flow->md_val_count>0) {
-        cur=add_md_options(flow, cur);
+        cur=add_md_options(flow, buf, cur);
     }
 #endif
 
-    flow->pcp_msg_len=((char*)cur) - flow->pcp_msg_buffer;
-
     //TODO: implement building all pcp options into msg
-    return PCP_ERR_SUCCESS;
+    return cur;
 }
 
-static pcp_errno build_pcp_peer(pcp_server_t *server, pcp_flow_t *flow,
-        void *peer_loc)
-{
-    void *next=NULL;
-
-    if (server->pcp_version == 1) {
-        pcp_peer_v1_t *peer_info=(pcp_peer_v1_t *)peer_loc;
-
-        peer_info->protocol=flow->kd.map_peer.protocol;
-        peer_info->int_port=flow->kd.map_peer.src_port;
-        peer_info->ext_port=flow->map_peer.ext_port;
-        peer_info->peer_port=flow->kd.map_peer.dst_port;
-        memcpy(peer_info->ext_ip, &flow->map_peer.ext_ip,
-                sizeof(peer_info->ext_ip));
-        memcpy(peer_info->peer_ip, &flow->kd.map_peer.dst_ip,
-                sizeof(peer_info->peer_ip));
-        next=peer_info + 1;
-    } else if (server->pcp_version == 2) {
-        pcp_peer_v2_t *peer_info=(pcp_peer_v2_t *)peer_loc;
-
-        peer_info->protocol=flow->kd.map_peer.protocol;
-        peer_info->int_port=flow->kd.map_peer.src_port;
-        peer_info->ext_port=flow->map_peer.ext_port;
-        peer_info->peer_port=flow->kd.map_peer.dst_port;
-        memcpy(peer_info->ext_ip, &flow->map_peer.ext_ip,
-                sizeof(peer_info->ext_ip));
-        memcpy(peer_info->peer_ip, &flow->kd.map_peer.dst_ip,
-                sizeof(peer_info->peer_ip));
-        peer_info->nonce=flow->kd.nonce;
-        next=peer_info + 1;
-    } else {
-        return PCP_ERR_UNSUP_VERSION;
+static int has_options(pcp_flow_t *flow)
+{
+#ifdef PCP_FLOW_PRIORITY
+    if (flow->flowp_option_present) {
+        return 1;
+    }
+#endif
+#ifdef PCP_EXPERIMENTAL
+    if ((flow->f_deviceid.deviceid[0] != '\0')
+            || (flow->f_userid.userid[0] != '\0')
+            || (flow->f_location.location[0] != '\0')
+            || (flow->md_val_count > 0)) {
+        return 1;
     }
-    return build_pcp_options(flow, next);
+#endif
+    return (flow->filter_option_present) || (flow->pfailure_option_present)
+            || (flow->third_party_option_present);
 }
 
-static pcp_errno build_pcp_map(pcp_server_t *server, pcp_flow_t *flow,
-        void *map_loc)
+/* writes common header, zeroes it and opcode specific data of data_len;
+ * returns beginning of opcode specific data */
+static inline void *encode_header(pcp_flow_t *flow, char *buf, uint8_t ver,
+        size_t data_len)
 {
-    void *next=NULL;
+    pcp_request_t *req=(pcp_request_t *)buf;
 
-    if (server->pcp_version == 1) {
-        pcp_map_v1_t *map_info=(pcp_map_v1_t *)map_loc;
+    memset(buf, 0, sizeof(pcp_request_t) + data_len);
+    req->ver=ver;
+    req->r_opcode=(uint8_t)(flow->kd.operation & 0x7f);
+    req->req_lifetime=htonl((uint32_t)flow->lifetime);
+    memcpy(&req->ip, &flow->kd.src_ip, 16);
 
-        map_info->protocol=flow->kd.map_peer.protocol;
-        map_info->int_port=flow->kd.map_peer.src_port;
-        map_info->ext_port=flow->map_peer.ext_port;
-        memcpy(map_info->ext_ip, &flow->map_peer.ext_ip,
-                sizeof(map_info->ext_ip));
-        next=map_info + 1;
-    } else if (server->pcp_version == 2) {
-        pcp_map_v2_t *map_info=(pcp_map_v2_t *)map_loc;
+    return req->next_data;
+}
 
-        map_info->protocol=flow->kd.map_peer.protocol;
-        map_info->int_port=flow->kd.map_peer.src_port;
-        map_info->ext_port=flow->map_peer.ext_port;
-        memcpy(map_info->ext_ip, &flow->map_peer.ext_ip,
-                sizeof(map_info->ext_ip));
-        map_info->nonce=flow->kd.nonce;
-        next=map_info + 1;
-    } else {
-        return PCP_ERR_UNSUP_VERSION;
-    }
+static void *encode_announce_v1(pcp_flow_t *flow, char *buf)
+{
+    return encode_header(flow, buf, 1, 0);
+}
+
+static void *encode_announce_v2(pcp_flow_t *flow, char *buf)
+{
+    return encode_header(flow, buf, 2, 0);
+}
+
+static void *encode_map_v1(pcp_flow_t *flow, char *buf)
+{
+    pcp_map_v1_t *map_info;
+
+    map_info=(pcp_map_v1_t *)encode_header(flow, buf, 1, sizeof(*map_info));
+    map_info->protocol=flow->kd.map_peer.protocol;
+    map_info->int_port=flow->kd.map_peer.src_port;
+    map_info->ext_port=flow->map_peer.ext_port;
+    memcpy(map_info->ext_ip, &flow->map_peer.ext_ip, sizeof(map_info->ext_ip));
+
+    return map_info + 1;
+}
+
+static void *encode_map_v2(pcp_flow_t *flow, char *buf)
+{
+    pcp_map_v2_t *map_info;
+
+    map_info=(pcp_map_v2_t *)encode_header(flow, buf, 2, sizeof(*map_info));
+    map_info->nonce=flow->kd.nonce;
+    map_info->protocol=flow->kd.map_peer.protocol;
+    map_info->int_port=flow->kd.map_peer.src_port;
+    map_info->ext_port=flow->map_peer.ext_port;
+    memcpy(map_info->ext_ip, &flow->map_peer.ext_ip, sizeof(map_info->ext_ip));
 
-    return build_pcp_options(flow, next);
+    return map_info + 1;
+}
+
+static void *encode_peer_v1(pcp_flow_t *flow, char *buf)
+{
+    pcp_peer_v1_t *peer_info;
+
+    peer_info=(pcp_peer_v1_t *)encode_header(flow, buf, 1, sizeof(*peer_info));
+    peer_info->protocol=flow->kd.map_peer.protocol;
+    peer_info->int_port=flow->kd.map_peer.src_port;
+    peer_info->ext_port=flow->map_peer.ext_port;
+    peer_info->peer_port=flow->kd.map_peer.dst_port;
+    memcpy(peer_info->ext_ip, &flow->map_peer.ext_ip,
+            sizeof(peer_info->ext_ip));
+    memcpy(peer_info->peer_ip, &flow->kd.map_peer.dst_ip,
+            sizeof(peer_info->peer_ip));
+
+    return peer_info + 1;
+}
+
+static void *encode_peer_v2(pcp_flow_t *flow, char *buf)
+{
+    pcp_peer_v2_t *peer_info;
+
+    peer_info=(pcp_peer_v2_t *)encode_header(flow, buf, 2, sizeof(*peer_info));
+    peer_info->nonce=flow->kd.nonce;
+    peer_info->protocol=flow->kd.map_peer.protocol;
+    peer_info->int_port=flow->kd.map_peer.src_port;
+    peer_info->ext_port=flow->map_peer.ext_port;
+    peer_info->peer_port=flow->kd.map_peer.dst_port;
+    memcpy(peer_info->ext_ip, &flow->map_peer.ext_ip,
+            sizeof(peer_info->ext_ip));
+    memcpy(peer_info->peer_ip, &flow->kd.map_peer.dst_ip,
+            sizeof(peer_info->peer_ip));
+
+    return peer_info + 1;
+}
+
+static void *encode_map_v1_opts(pcp_flow_t *flow, char *buf)
+{
+    return build_pcp_options(flow, buf, encode_map_v1(flow, buf));
+}
+
+static void *encode_map_v2_opts(pcp_flow_t *flow, char *buf)
+{
+    return build_pcp_options(flow, buf, encode_map_v2(flow, buf));
+}
+
+static void *encode_peer_v1_opts(pcp_flow_t *flow, char *buf)
+{
+    return build_pcp_options(flow, buf, encode_peer_v1(flow, buf));
+}
+
+static void *encode_peer_v2_opts(pcp_flow_t *flow, char *buf)
+{
+    return build_pcp_options(flow, buf, encode_peer_v2(flow, buf));
 }
 
 #ifdef PCP_SADSCP
-static pcp_errno build_pcp_sadscp(pcp_server_t *server, pcp_flow_t *flow,
-        void *sadscp_loc)
-{
-    void *next=NULL;
-
-    if (server->pcp_version == 1) {
-        return PCP_ERR_UNSUP_VERSION;
-    } else if (server->pcp_version == 2) {
-        size_t fill_len;
-        pcp_sadscp_req_t *sadscp=(pcp_sadscp_req_t *)sadscp_loc;
-
-        sadscp->nonce=flow->kd.nonce;
-        sadscp->tolerance_fields=flow->sadscp.toler_fields;
-
-        //app name fill size to multiple of 4
-        fill_len=(4-((flow->sadscp.app_name_length+2)%4))%4;
-
-        sadscp->app_name_length=flow->sadscp.app_name_length + fill_len;
-        if (flow->sadscp_app_name) {
-            memcpy(sadscp->app_name, flow->sadscp_app_name,
-                    flow->sadscp.app_name_length);
-        } else {
-            memset(sadscp->app_name, 0,
-                    flow->sadscp.app_name_length);
-        }
+static void *encode_sadscp_v2(pcp_flow_t *flow, char *buf)
+{
+    size_t fill_len;
+    pcp_sadscp_req_t *sadscp;
+
+    sadscp=(pcp_sadscp_req_t *)encode_header(flow, buf, 2, sizeof(*sadscp));
+    sadscp->nonce=flow->kd.nonce;
+    sadscp->tolerance_fields=flow->sadscp.toler_fields;
 
-        next=((uint8_t *)sadscp_loc) + sizeof(pcp_sadscp_req_t) +
-                sadscp->app_name_length;
+    //app name fill size to multiple of 4
+    fill_len=(4-((flow->sadscp.app_name_length+2)%4))%4;
+
+    sadscp->app_name_length=flow->sadscp.app_name_length + fill_len;
+    if (flow->sadscp_app_name) {
+        memcpy(sadscp->app_name, flow->sadscp_app_name,
+                flow->sadscp.app_name_length);
     } else {
-        return PCP_ERR_UNSUP_VERSION;
+        memset(sadscp->app_name, 0,
+                flow->sadscp.app_name_length);
     }
+    memset(sadscp->app_name + flow->sadscp.app_name_length, 0, fill_len);
 
-    return build_pcp_options(flow, next);
+    return build_pcp_options(flow, buf, ((uint8_t *)sadscp)
+            + sizeof(pcp_sadscp_req_t) + sadscp->app_name_length);
 }
 #endif
 
 #ifndef PCP_DISABLE_NATPMP
-static pcp_errno build_natpmp_msg(pcp_flow_t *flow)
+static void *encode_natpmp_announce(pcp_flow_t *flow UNUSED, char *buf)
 {
-    nat_pmp_announce_req_t *ann_msg;
-    nat_pmp_map_req_t *map_info;
+    nat_pmp_announce_req_t *ann_msg=(nat_pmp_announce_req_t *)buf;
 
-    switch (flow->kd.operation) {
-        case PCP_OPCODE_ANNOUNCE:
-            ann_msg=(nat_pmp_announce_req_t *)flow->pcp_msg_buffer;
-            ann_msg->ver=0;
-            ann_msg->opcode=NATPMP_OPCODE_ANNOUNCE;
-            flow->pcp_msg_len=sizeof(*ann_msg);
-            return PCP_RES_SUCCESS;
+    ann_msg->ver=0;
+    ann_msg->opcode=NATPMP_OPCODE_ANNOUNCE;
 
-        case PCP_OPCODE_MAP:
-            map_info=(nat_pmp_map_req_t *)flow->pcp_msg_buffer;
-            switch (flow->kd.map_peer.protocol) {
-                case IPPROTO_TCP:
-                    map_info->opcode=NATPMP_OPCODE_MAP_TCP;
-                    break;
-                case IPPROTO_UDP:
-                    map_info->opcode=NATPMP_OPCODE_MAP_UDP;
-                    break;
-                default:
-                    return PCP_RES_UNSUPP_PROTOCOL;
-            }
-            map_info->ver=0;
-            map_info->lifetime=htonl(flow->lifetime);
-            map_info->int_port=flow->kd.map_peer.src_port;
-            map_info->ext_port=flow->map_peer.ext_port;
-            flow->pcp_msg_len=sizeof(*map_info);
-            return PCP_RES_SUCCESS;
+    return ann_msg + 1;
+}
 
+static void *encode_natpmp_map(pcp_flow_t *flow, char *buf)
+{
+    nat_pmp_map_req_t *map_info=(nat_pmp_map_req_t *)buf;
+
+    switch (flow->kd.map_peer.protocol) {
+        case IPPROTO_TCP:
+            map_info->opcode=NATPMP_OPCODE_MAP_TCP;
+            break;
+        case IPPROTO_UDP:
+            map_info->opcode=NATPMP_OPCODE_MAP_UDP;
+            break;
         default:
-            return PCP_RES_UNSUPP_OPCODE;
+            return NULL;
     }
+    map_info->ver=0;
+    map_info->reserved=0;
+    map_info->lifetime=htonl(flow->lifetime);
+    map_info->int_port=flow->kd.map_peer.src_port;
+    map_info->ext_port=flow->map_peer.ext_port;
+
+    return map_info + 1;
 }
 #endif
 
-void *build_pcp_msg(pcp_flow_t *flow)
+/* encoder of the flow's request for server of given version, NULL if such
+ * request isn't supported */
+static pcp_msg_encoder_t select_encoder(pcp_flow_t *flow, uint8_t ver)
 {
-    ssize_t ret=-1;
-    pcp_server_t *pcp_server=NULL;
-    pcp_request_t *req;
-    // pointer used for referencing next data structure in linked list
-    void *next_data=NULL;
+    int opts=has_options(flow);
 
-    PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
+    switch (ver) {
+#ifndef PCP_DISABLE_NATPMP
+        case 0:
+            switch (flow->kd.operation) {
+                case PCP_OPCODE_ANNOUNCE:
+                    return encode_natpmp_announce;
+                case PCP_OPCODE_MAP:
+                    return encode_natpmp_map;
+                default:
+                    return NULL;
+            }
+#endif
+        case 1:
+            switch (flow->kd.operation) {
+                case PCP_OPCODE_ANNOUNCE:
+                    return encode_announce_v1;
+                case PCP_OPCODE_MAP:
+                    return opts ? encode_map_v1_opts : encode_map_v1;
+                case PCP_OPCODE_PEER:
+                    return opts ? encode_peer_v1_opts : encode_peer_v1;
+                default:
+                    return NULL;
+            }
+        case 2:
+            switch (flow->kd.operation) {
+                case PCP_OPCODE_ANNOUNCE:
+                    return encode_announce_v2;
+                case PCP_OPCODE_MAP:
+                    return opts ? encode_map_v2_opts : encode_map_v2;
+                case PCP_OPCODE_PEER:
+                    return opts ? encode_peer_v2_opts : encode_peer_v2;
+#ifdef PCP_SADSCP
+                case PCP_OPCODE_SADSCP:
+                    return encode_sadscp_v2;
+#endif
+                default:
+                    return NULL;
+            }
+        default:
+            return NULL;
+    }
+}
 
-    if (!flow) {
-        return NULL;
+size_t build_pcp_msg(pcp_flow_t *flow, char *buf, size_t buf_len)
+{
+    pcp_server_t *pcp_server=NULL;
+    char *end;
+
+    if ((!flow) || (!buf) || (buf_len < PCP_MAX_LEN)) {
+        return 0;
     }
 
     pcp_server=get_pcp_server(flow->ctx, flow->pcp_server_indx);
 
     if (!pcp_server) {
-        return NULL;
+        return 0;
     }
 
-    if (!flow->pcp_msg_buffer) {
-        flow->pcp_msg_buffer=(char*)calloc(1, PCP_MAX_LEN);
-        if (flow->pcp_msg_buffer == NULL) {
-            PCP_LOG(PCP_LOGLVL_ERR, "%s",
-                    "Malloc can't allocate enough memory for the pcp_flow.");
-            PCP_LOG_END(PCP_LOGLVL_DEBUG);
-            return NULL;
+    // encoder is selected once, again only after version negotiation or
+    // change of the flow
+    if ((!flow->encoder) || (flow->encoder_ver != pcp_server->pcp_version)
+            || (flow->encoder_op != flow->kd.operation)) {
+        flow->encoder=select_encoder(flow, pcp_server->pcp_version);
+        flow->encoder_ver=pcp_server->pcp_version;
+        flow->encoder_op=flow->kd.operation;
+        if (!flow->encoder) {
+            PCP_LOG(PCP_LOGLVL_ERR, "%s", "Unsupported operation.");
+            return 0;
         }
     }
 
-    req=(pcp_request_t *)flow->pcp_msg_buffer;
+    end=(char *)flow->encoder(flow, buf);
+    if (!end) {
+        PCP_LOG(PCP_LOGLVL_ERR, "%s", "Unsupported operation.");
+        return 0;
+    }
+
+    return end - buf;
+}
+
+static void patch_lifetime(pcp_flow_t *flow)
+{
+    uint32_t lifetime=htonl(flow->lifetime);
 
-    if (pcp_server->pcp_version == 0) {
-        // NATPMP
+    if (flow->wire_ver != 0) {
+        memcpy(flow->wire + offsetof(pcp_request_t, req_lifetime), &lifetime,
+                sizeof(lifetime));
 #ifndef PCP_DISABLE_NATPMP
-        ret=build_natpmp_msg(flow);
+    } else if (flow->kd.operation == PCP_OPCODE_MAP) {
+        memcpy(flow->wire + offsetof(nat_pmp_map_req_t, lifetime), &lifetime,
+                sizeof(lifetime));
 #endif
-    } else {
+    }
+}
 
-        req->ver=pcp_server->pcp_version;
+const char *pcp_flow_wire_msg(pcp_flow_t *flow, size_t *len)
+{
+    pcp_ctx_t *ctx=flow->ctx;
+    pcp_server_t *s;
 
-        req->r_opcode|=(uint8_t)(flow->kd.operation & 0x7f); //set  opcode
-        req->req_lifetime=htonl((uint32_t)flow->lifetime);
+    s=get_pcp_server(ctx, flow->pcp_server_indx);
+    if (!s) {
+        return NULL;
+    }
 
-        memcpy(&req->ip, &flow->kd.src_ip, 16);
-        // next data in the packet
-        next_data=req->next_data;
-        flow->pcp_msg_len=(uint8_t *)next_data - (uint8_t *)req;
+    if ((flow->wire_len) && (flow->wire_ver == s->pcp_version)) {
+        patch_lifetime(flow);
+        *len=flow->wire_len;
+        return flow->wire;
+    }
 
-        switch (flow->kd.operation) {
-            case PCP_OPCODE_PEER:
-                ret=build_pcp_peer(pcp_server, flow, next_data);
-                break;
-            case PCP_OPCODE_MAP:
-                ret=build_pcp_map(pcp_server, flow, next_data);
-                break;
-#ifdef PCP_SADSCP
-            case PCP_OPCODE_SADSCP:
-                ret=build_pcp_sadscp(pcp_server, flow, next_data);
-                break;
-#endif
-            case PCP_OPCODE_ANNOUNCE:
-                ret=0;
-                break;
-        }
+    *len=build_pcp_msg(flow, ctx->msg_out, sizeof(ctx->msg_out));
+    if (*len == 0) {
+        flow->wire_len=0;
+        return NULL;
     }
 
-    if (ret < 0) {
-        PCP_LOG(PCP_LOGLVL_ERR, "%s", "Unsupported operation.");
-        free(flow->pcp_msg_buffer);
-        flow->pcp_msg_buffer=NULL;
-        flow->pcp_msg_len=0;
-        req=NULL;
+    if (*len > flow->wire_size) {
+        char *wire=(char *)realloc(flow->wire, *len);
+
+        if (!wire) {
+            // send it without caching
+            flow->wire_len=0;
+            return ctx->msg_out;
+        }
+        flow->wire=wire;
+        flow->wire_size=(uint16_t)*len;
     }
 
-    PCP_LOG_END(PCP_LOGLVL_DEBUG);
-    return req;
+    memcpy(flow->wire, ctx->msg_out, *len);
+    flow->wire_len=(uint16_t)*len;
+    flow->wire_ver=s->pcp_version;
+
+    return flow->wire;
+}
+
+void pcp_flow_wire_invalidate(pcp_flow_t *flow)
+{
+    flow->wire_len=0;
+    flow->encoder=NULL;
 }
 
 int validate_pcp_msg(pcp_recv_msg_t *f)
@@ -474,9 +597,94 @@ int validate_pcp_msg(pcp_recv_msg_t *f)
     return 1;
 }
 
-static pcp_errno parse_options(UNUSED pcp_recv_msg_t *f, UNUSED void *r)
+/* option code => (opt_flags bit index, expected data length) */
+static int option_index(uint8_t code, uint16_t *len)
+{
+    switch (code) {
+        case PCP_OPTION_3RD_PARTY:
+            *len=sizeof(pcp_3rd_party_option_t) - sizeof(pcp_options_hdr_t);
+            return 0;
+        case PCP_OPTION_FLOW_PRIORITY:
+            *len=sizeof(pcp_flow_priority_option_t)
+                    - sizeof(pcp_options_hdr_t);
+            return 1;
+        case PCP_OPTION_PREF_FAIL:
+            *len=0;
+            return 2;
+        case PCP_OPTION_FILTER:
+            *len=sizeof(pcp_filter_option_t) - sizeof(pcp_options_hdr_t);
+            return 3;
+        default:
+            return -1;
+    }
+}
+
+static void copy_option(pcp_recv_msg_t *f, const pcp_options_hdr_t *opt)
 {
-    //TODO: implement parsing of pcp options
+    if (opt->code == PCP_OPTION_3RD_PARTY) {
+        const pcp_3rd_party_option_t *tp=(const pcp_3rd_party_option_t *)opt;
+
+        memcpy(&f->third_party_ip, tp->ip, sizeof(f->third_party_ip));
+    } else if ((opt->code == PCP_OPTION_FILTER) && (!f->filter_cnt++)) {
+        const pcp_filter_option_t *filter=(const pcp_filter_option_t *)opt;
+
+        f->filter_prefix=filter->filter_prefix;
+        f->filter_port=filter->filter_peer_port;
+        memcpy(&f->filter_ip, filter->filter_peer_ip, sizeof(f->filter_ip));
+    }
+}
+
+/*
+ * Walk options of the response in one pass. Each option has to fit into
+ * the message including its padding, known options have to have exact
+ * length. Data of known options is copied to f, as the message buffer is
+ * reused by the next datagram; unknown ones are skipped.
+ */
+static pcp_errno parse_options(pcp_recv_msg_t *f, void *r)
+{
+    const uint8_t *cur=(const uint8_t *)r;
+    const uint8_t *end=(const uint8_t *)f->pcp_msg_buffer + f->pcp_msg_len;
+
+    // error responses may echo the request as it was sent, e.g. v2 request
+    // answered with UNSUPP_VERSION by v1 server, so the rest isn't parsed
+    if (f->recv_result != PCP_RES_SUCCESS) {
+        return PCP_ERR_SUCCESS;
+    }
+
+    while (cur < end) {
+        const pcp_options_hdr_t *opt=(const pcp_options_hdr_t *)cur;
+        size_t rest=end - cur;
+        uint16_t len, exp_len;
+        size_t opt_size;
+        int idx;
+
+        if (rest < sizeof(pcp_options_hdr_t)) {
+            PCP_LOG(PCP_LOGLVL_WARN, "%s", "Truncated PCP option header");
+            return PCP_ERR_RECV_FAILED;
+        }
+
+        len=ntohs(opt->len);
+        opt_size=sizeof(pcp_options_hdr_t) + ((len + 3) & ~3u);
+        if (opt_size > rest) {
+            PCP_LOG(PCP_LOGLVL_WARN, "PCP option %d exceeds message",
+                    opt->code);
+            return PCP_ERR_RECV_FAILED;
+        }
+
+        idx=option_index(opt->code, &exp_len);
+        if (idx >= 0) {
+            if (len != exp_len) {
+                PCP_LOG(PCP_LOGLVL_WARN, "PCP option %d has invalid "
+                        "length %d", opt->code, len);
+                return PCP_ERR_RECV_FAILED;
+            }
+            f->opt_flags|=(opt_flags_e)(1 << idx);
+            copy_option(f, opt);
+        }
+
+        cur+=opt_size;
+    }
+
     return PCP_ERR_SUCCESS;
 }
 
@@ -689,6 +897,14 @@ pcp_errno parse_response(pcp_recv_msg_t *f)
 
     f->recv_version=resp->ver;
     f->recv_result=resp->result_code;
+    f->recv_epoch=0;
+    f->recv_lifetime=0;
+    f->recv_dscp=0;
+    f->assigned_ext_port=0;
+    memset(&f->assigned_ext_ip, 0, sizeof(f->assigned_ext_ip));
+    f->opt_flags=0;
+    f->filter_cnt=0;
+    // flow key is compared by memcmp, padding included
     memset(&f->kd, 0, sizeof(f->kd));
 
     f->kd.operation=resp->r_opcode & 0x7f;
@@ -39,7 +39,19 @@
 #include "pcp_client_db.h"
 #include "pcp_msg_structs.h"
 
-void *build_pcp_msg(struct pcp_flow_s *flow);
+/* encode request of the flow into buf, which has to hold at least PCP_MAX_LEN
+ * bytes; returns length of the request, 0 if it can't be encoded.
+ * Encoder specialized for server's version, flow's opcode and options is
+ * kept by the flow, pcp_flow_wire_invalidate drops it */
+size_t build_pcp_msg(struct pcp_flow_s *flow, char *buf, size_t buf_len);
+
+/* get request of the flow ready for sending; it's encoded once and kept
+ * by the flow, later calls only patch current lifetime into it.
+ * Returns NULL if flow can't be encoded */
+const char *pcp_flow_wire_msg(struct pcp_flow_s *flow, size_t *len);
+
+/* force encoding of the flow's request by next pcp_flow_wire_msg */
+void pcp_flow_wire_invalidate(struct pcp_flow_s *flow);
 
 int validate_pcp_msg(pcp_recv_msg_t *f);
 
@@ -0,0 +1,221 @@
+/*
+ Copyright (c) 2014 by Cisco Systems, Inc.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef WIN32
+#include "pcp_win_defines.h"
+#else
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#endif
+
+#include "pcp.h"
+#include "pcp_client_db.h"
+#include "pcp_utils.h"
+#include "pcp_socket.h"
+#include "findsaddr.h"
+#include "gateway.h"
+#include "pcp_saddr_cache.h"
+
+#define PCP_SADDR_CACHE_BITS 10
+#define PCP_SADDR_CACHE_SIZE (1 << PCP_SADDR_CACHE_BITS)
+#define PCP_SADDR_CACHE_TTL 5
+#define PCP_SADDR_ROUTES_MAX 256 //more routes => no shared default entry
+
+struct saddr_entry {
+    struct in6_addr dst;
+    uint32_t scope_id;
+    uint32_t gen;           //entry is valid if it equals gen of the cache
+    time_t expires;
+    struct in6_addr src;
+};
+
+/* direct mapped, colliding destination replaces the entry; flush only
+ * moves generation, so it doesn't touch the entries.
+ * With route monitor IPv4 destinations not covered by any other route than
+ * default one share entry def, their source address is given by the route.
+ * Routes are read again after flush, changed ones are added as they come. */
+struct pcp_saddr_cache {
+    uint32_t gen;
+    uint32_t routes_gen;    //gen of routes below, 0 => not read yet
+    int route_cnt;          //negative => def isn't used
+    struct in6_addr route[PCP_SADDR_ROUTES_MAX];
+    uint8_t route_len[PCP_SADDR_ROUTES_MAX];
+    struct saddr_entry def;
+    struct saddr_entry e[PCP_SADDR_CACHE_SIZE];
+};
+
+static uint32_t saddr_hash(const struct in6_addr *dst, uint32_t scope_id)
+{
+    uint32_t h=scope_id;
+    int i;
+
+    for (i=0; i < 4; ++i) {
+        h=(h ^ S6_ADDR32(dst)[i]) * 0x9E3779B9;
+    }
+    return h >> (32 - PCP_SADDR_CACHE_BITS);
+}
+
+/* entry of IPv4 destination reached by default route, NULL if some other
+ * route covers it or routing isn't known */
+static struct saddr_entry *default_entry(pcp_ctx_t *ctx,
+        struct pcp_saddr_cache *c, const struct in6_addr *dst)
+{
+    int i;
+
+    if (ctx->route_fd == PCP_INVALID_SOCKET) {
+        return NULL;
+    }
+    if (c->routes_gen != c->gen) {
+        c->route_cnt=getroutes4(c->route, c->route_len, PCP_SADDR_ROUTES_MAX);
+        c->routes_gen=c->gen;
+    }
+    for (i=0; i < c->route_cnt; ++i) {
+        if (ipv6_prefix_covers(c->route + i, c->route_len[i], dst)) {
+            return NULL;
+        }
+    }
+    return c->route_cnt >= 0 ? &c->def : NULL;
+}
+
+const char *pcp_findsaddr(pcp_ctx_t *ctx, const struct sockaddr *to,
+        struct in6_addr *from)
+{
+    struct pcp_saddr_cache *c=ctx->saddr_cache;
+    struct saddr_entry *e;
+    struct in6_addr dst;
+    uint32_t scope_id=0;
+    struct timeval now;
+    const char *err;
+
+    if (to->sa_family == AF_INET) {
+        S6_ADDR32(&dst)[0]=0;
+        S6_ADDR32(&dst)[1]=0;
+        S6_ADDR32(&dst)[2]=htonl(0xFFFF);
+        S6_ADDR32(&dst)[3]=((const struct sockaddr_in *)to)->sin_addr.s_addr;
+    } else {
+        const struct sockaddr_in6 *to6=(const struct sockaddr_in6 *)to;
+
+        IPV6_ADDR_COPY(&dst, &to6->sin6_addr);
+        scope_id=to6->sin6_scope_id;
+    }
+
+    if (!c) {
+        c=(struct pcp_saddr_cache *)calloc(1, sizeof(*c));
+        if (c) {
+            c->gen=1;
+            ctx->saddr_cache=c;
+        }
+    }
+
+    gettimeofday(&now, NULL);
+    e=NULL;
+    if ((c) && (to->sa_family == AF_INET)) {
+        e=default_entry(ctx, c, &dst);
+    }
+    if ((c) && (!e)) {
+        e=c->e + saddr_hash(&dst, scope_id);
+    }
+    // with route monitor entries are valid until flush
+    if ((e) && (e->gen == c->gen) && (e->scope_id == scope_id)
+            && ((e == &c->def) || (IN6_ARE_ADDR_EQUAL(&e->dst, &dst)))
+            && ((ctx->route_fd != PCP_INVALID_SOCKET)
+                    || (now.tv_sec < e->expires))) {
+        IPV6_ADDR_COPY(from, &e->src);
+        return NULL;
+    }
+
+    if (to->sa_family == AF_INET) {
+        err=findsaddr((const struct sockaddr_in *)to, from);
+    } else {
+        err=findsaddr6((const struct sockaddr_in6 *)to, from);
+    }
+    if ((!err) && (e)) {
+        IPV6_ADDR_COPY(&e->dst, &dst);
+        e->scope_id=scope_id;
+        e->gen=c->gen;
+        e->expires=now.tv_sec + PCP_SADDR_CACHE_TTL;
+        IPV6_ADDR_COPY(&e->src, from);
+    }
+
+    return err;
+}
+
+void pcp_saddr_cache_flush(pcp_ctx_t *ctx)
+{
+    struct pcp_saddr_cache *c=ctx->saddr_cache;
+
+    if (!c) {
+        return;
+    }
+    if (++c->gen == 0) {
+        memset(c->e, 0, sizeof(c->e));
+        c->gen=1;
+    }
+}
+
+void pcp_saddr_cache_flush_prefix(pcp_ctx_t *ctx,
+        const struct in6_addr *prefix, int prefix_len)
+{
+    struct pcp_saddr_cache *c=ctx->saddr_cache;
+    int i;
+
+    if (!c) {
+        return;
+    }
+    // destinations of the route don't take default entry any more
+    if ((c->routes_gen == c->gen) && (c->route_cnt >= 0)
+            && (IN6_IS_ADDR_V4MAPPED(prefix)) && (prefix_len >= 96)) {
+        if (c->route_cnt < PCP_SADDR_ROUTES_MAX) {
+            c->route[c->route_cnt]=*prefix;
+            c->route_len[c->route_cnt++]=(uint8_t)prefix_len;
+        } else {
+            c->route_cnt=-1;
+        }
+    }
+    // gen 0 is never valid one
+    for (i=0; i < PCP_SADDR_CACHE_SIZE; ++i) {
+        if ((c->e[i].gen == c->gen)
+                && (ipv6_prefix_covers(prefix, prefix_len, &c->e[i].dst))) {
+            c->e[i].gen=0;
+        }
+    }
+}
+
+void pcp_saddr_cache_free(pcp_ctx_t *ctx)
+{
+    free(ctx->saddr_cache);
+    ctx->saddr_cache=NULL;
+}
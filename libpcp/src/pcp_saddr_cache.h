@@ -0,0 +1,58 @@
+/*
+ Copyright (c) 2014 by Cisco Systems, Inc.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PCP_SADDR_CACHE_H_
+#define PCP_SADDR_CACHE_H_
+
+#include "pcp.h"
+
+/*
+ * Source addresses selected by kernel for destinations (findsaddr,
+ * findsaddr6) are cached per context, so flows and servers with the same
+ * destination don't repeat socket, connect, getsockname and close. Cache
+ * is flushed on changes of default routes and addresses (route monitor,
+ * pcp_routes_changed), other route changes drop only destinations within
+ * the route; without route monitor entries expire after
+ * PCP_SADDR_CACHE_TTL seconds. With route monitor IPv4 destinations of
+ * default route share one entry.
+ */
+
+struct sockaddr;
+struct in6_addr;
+
+/* as findsaddr/findsaddr6 for AF_INET/AF_INET6 destination to, from is
+ * v4-mapped for IPv4; returns NULL or error description */
+const char *pcp_findsaddr(pcp_ctx_t *ctx, const struct sockaddr *to,
+        struct in6_addr *from);
+
+void pcp_saddr_cache_flush(pcp_ctx_t *ctx);
+
+/* drops destinations within prefix/prefix_len (v4-mapped for IPv4) */
+void pcp_saddr_cache_flush_prefix(pcp_ctx_t *ctx,
+        const struct in6_addr *prefix, int prefix_len);
+
+void pcp_saddr_cache_free(pcp_ctx_t *ctx);
+
+#endif /* PCP_SADDR_CACHE_H_ */
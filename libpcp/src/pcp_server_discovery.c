@@ -51,8 +51,120 @@
 #include "pcp_msg.h"
 #include "pcp_logger.h"
 #include "findsaddr.h"
+#include "pcp_saddr_cache.h"
 #include "pcp_socket.h"
 
+/* creates own socket of the server bound to its source address, server
+ * falls back to context socket if it fails */
+static void psd_open_server_socket(pcp_server_t *s)
+{
+    pcp_ctx_t *ctx=s->ctx;
+    struct sockaddr_storage src;
+
+    memset(&src, 0, sizeof(src));
+    pcp_fill_sockaddr((struct sockaddr *)&src, (struct in6_addr *)s->src_ip,
+            0, s->af == AF_INET6, s->pcp_scope_id);
+
+    s->socket=pcp_socket_create_src(ctx, src.ss_family, SOCK_DGRAM, 0,
+            (struct sockaddr *)&src, !ctx->dual_stack);
+    if (s->socket == PCP_INVALID_SOCKET) {
+        PCP_LOG(PCP_LOGLVL_WARN, "Cannot create socket of PCP server %s, "
+                "using shared one.", s->pcp_server_paddr);
+        return;
+    }
+    if ((s->rcvbuf) && (pcp_socket_set_rcvbuf(s->socket, s->rcvbuf))) {
+        PCP_LOG(PCP_LOGLVL_WARN, "Cannot set receive buffer of PCP server "
+                "%s socket.", s->pcp_server_paddr);
+    }
+
+    s->connected=0;
+    if (ctx->socket_connected) {
+        if (pcp_socket_connect(ctx, s->socket,
+                (struct sockaddr *)&s->pcp_server_saddr) == PCP_ERR_SUCCESS) {
+            s->connected=1;
+        } else {
+            PCP_LOG(PCP_LOGLVL_DEBUG, "Socket of PCP server %s is not "
+                    "connected.", s->pcp_server_paddr);
+        }
+    }
+}
+
+static void psd_close_server_socket(pcp_server_t *s)
+{
+    if (s->socket != PCP_INVALID_SOCKET) {
+        pcp_socket_close(s->ctx, s->socket);
+        s->socket=PCP_INVALID_SOCKET;
+    }
+    s->connected=0;
+}
+
+struct remap_data {
+    pcp_server_t *s;
+    struct in6_addr old_src;
+};
+
+/* flows which got source address from the server are mapped again from the
+ * new one, flows with address given by application are left alone */
+static int remap_flow_iter(pcp_flow_t *f, void *data)
+{
+    struct remap_data *d=(struct remap_data *)data;
+
+    if ((f->pcp_server_indx != d->s->index) || (!f->src_auto)
+            || (!IN6_ARE_ADDR_EQUAL(&f->kd.src_ip, &d->old_src))) {
+        return 0;
+    }
+
+    // source address is part of flow key
+    pcp_db_rem_flow(f);
+    IPV6_ADDR_COPY(&f->kd.src_ip, (struct in6_addr *)d->s->src_ip);
+    pcp_db_add_flow(f);
+    pcp_flow_updated(f);
+
+    return 0;
+}
+
+int psd_server_check_route(pcp_server_t *s)
+{
+    struct in6_addr src_ip;
+    struct remap_data d;
+    const char *err;
+
+    s->route_check=0;
+
+    memset(&src_ip, 0, sizeof(src_ip));
+    if (s->af == AF_INET) {
+        err=findsaddr((struct sockaddr_in *)&s->pcp_server_saddr, &src_ip);
+    } else {
+        err=findsaddr6((struct sockaddr_in6*)&s->pcp_server_saddr, &src_ip);
+    }
+    if (err) {
+        PCP_LOG(PCP_LOGLVL_DEBUG, "Error (%s) occurred while looking up "
+                "route to PCP server %s", err, s->pcp_server_paddr);
+        return 0;
+    }
+    if (IN6_ARE_ADDR_EQUAL(&src_ip, (struct in6_addr *)s->src_ip)) {
+        // socket which couldn't be opened before is tried again
+        if ((s->ctx->socket_per_server) && (s->socket == PCP_INVALID_SOCKET)) {
+            psd_open_server_socket(s);
+            return 1;
+        }
+        return 0;
+    }
+
+    PCP_LOG(PCP_LOGLVL_INFO, "Source address of PCP server %s changed, "
+            "mapping its flows again.", s->pcp_server_paddr);
+    d.s=s;
+    IPV6_ADDR_COPY(&d.old_src, (struct in6_addr *)s->src_ip);
+    IPV6_ADDR_COPY((struct in6_addr *)s->src_ip, &src_ip);
+    if (s->ctx->socket_per_server) {
+        psd_close_server_socket(s);
+        psd_open_server_socket(s);
+    }
+    pcp_db_foreach_flow(s->ctx, remap_flow_iter, &d);
+
+    return 1;
+}
+
 static pcp_errno psd_fill_pcp_server_src(pcp_server_t *s)
 {
     struct in6_addr src_ip;
@@ -65,12 +177,13 @@ static pcp_errno psd_fill_pcp_server_src(pcp_server_t *s)
         return PCP_ERR_BAD_ARGS;
     }
 
+    // source address may change when server is added again
+    psd_close_server_socket(s);
     memset(&s->pcp_server_saddr, 0, sizeof(s->pcp_server_saddr));
     memset(&src_ip, 0, sizeof(src_ip));
 
-#ifndef PCP_USE_IPV6_SOCKET
-    s->pcp_server_saddr.ss_family=AF_INET;
     if (s->af == AF_INET) {
+        s->pcp_server_saddr.ss_family=AF_INET;
         ((struct sockaddr_in *)&s->pcp_server_saddr)->sin_addr.s_addr=
                 s->pcp_ip[3];
         ((struct sockaddr_in *)&s->pcp_server_saddr)->sin_port=s->pcp_port;
@@ -79,7 +192,8 @@ static pcp_errno psd_fill_pcp_server_src(pcp_server_t *s)
                 (void *)&((struct sockaddr_in *)&s->pcp_server_saddr)->sin_addr,
                 s->pcp_server_paddr, sizeof(s->pcp_server_paddr));
 
-        err=findsaddr((struct sockaddr_in *)&s->pcp_server_saddr, &src_ip);
+        err=pcp_findsaddr(s->ctx, (struct sockaddr *)&s->pcp_server_saddr,
+                &src_ip);
         if (err) {
             PCP_LOG(PCP_LOGLVL_WARN,
                     "Error (%s) occurred while registering a new "
@@ -94,46 +208,97 @@ static pcp_errno psd_fill_pcp_server_src(pcp_server_t *s)
         s->src_ip[2]=htonl(0xFFFF);
         s->src_ip[3]=S6_ADDR32(&src_ip)[3];
     } else {
-        PCP_LOG(PCP_LOGLVL_WARN, "%s",
-                "IPv6 is disabled and IPv6 address of PCP server occurred");
+        // IPv6 server needs dual-stack or IPv6 only context socket, unless
+        // application moves datagrams
+        if ((!s->ctx->dual_stack) && (!s->ctx->sio)
+                && (s->ctx->socket6 == PCP_INVALID_SOCKET)) {
+            PCP_LOG(PCP_LOGLVL_WARN, "%s",
+                    "IPv6 is disabled and IPv6 address of PCP server occurred");
 
-        PCP_LOG_END(PCP_LOGLVL_DEBUG);
-        return PCP_ERR_BAD_AFINET;
-    }
-#else //PCP_USE_IPV6_SOCKET
-    s->pcp_server_saddr.ss_family=AF_INET6;
-    if (s->af == AF_INET) {
-        return PCP_ERR_BAD_AFINET; //should never happen
-    }
-    pcp_fill_sockaddr((struct sockaddr *)&s->pcp_server_saddr,
-            (struct in6_addr *)&s->pcp_ip, s->pcp_port, 1, s->pcp_scope_id);
+            PCP_LOG_END(PCP_LOGLVL_DEBUG);
+            return PCP_ERR_BAD_AFINET;
+        }
+        s->pcp_server_saddr.ss_family=AF_INET6;
+        pcp_fill_sockaddr((struct sockaddr *)&s->pcp_server_saddr,
+                (struct in6_addr *)&s->pcp_ip, s->pcp_port, 1,
+                s->pcp_scope_id);
 
-    inet_ntop(AF_INET6,
-            (void *)&((struct sockaddr_in6*) &s->pcp_server_saddr)->sin6_addr,
-            s->pcp_server_paddr, sizeof(s->pcp_server_paddr));
+        inet_ntop(AF_INET6,
+                (void *)&((struct sockaddr_in6*) &s->pcp_server_saddr)->sin6_addr,
+                s->pcp_server_paddr, sizeof(s->pcp_server_paddr));
 
-    err=findsaddr6((struct sockaddr_in6*)&s->pcp_server_saddr, &src_ip);
-    if (err) {
-        PCP_LOG(PCP_LOGLVL_WARN,
-                "Error (%s) occurred while registering a new "
-                "PCP server %s", err, s->pcp_server_paddr);
+        err=pcp_findsaddr(s->ctx, (struct sockaddr *)&s->pcp_server_saddr,
+                &src_ip);
+        if (err) {
+            PCP_LOG(PCP_LOGLVL_WARN,
+                    "Error (%s) occurred while registering a new "
+                    "PCP server %s", err, s->pcp_server_paddr);
 
-        PCP_LOG_END(PCP_LOGLVL_DEBUG);
-        return PCP_ERR_UNKNOWN;
+            PCP_LOG_END(PCP_LOGLVL_DEBUG);
+            return PCP_ERR_UNKNOWN;
+        }
+        s->src_ip[0]=S6_ADDR32(&src_ip)[0];
+        s->src_ip[1]=S6_ADDR32(&src_ip)[1];
+        s->src_ip[2]=S6_ADDR32(&src_ip)[2];
+        s->src_ip[3]=S6_ADDR32(&src_ip)[3];
     }
-    s->src_ip[0]=S6_ADDR32(&src_ip)[0];
-    s->src_ip[1]=S6_ADDR32(&src_ip)[1];
-    s->src_ip[2]=S6_ADDR32(&src_ip)[2];
-    s->src_ip[3]=S6_ADDR32(&src_ip)[3];
-#endif //PCP_USE_IPV6_SOCKET
+    if (s->ctx->socket_per_server) {
+        psd_open_server_socket(s);
+    }
+    // server is probed by the next pulse, so it's initialized by the time
+    // the first flow is created
     s->server_state=pss_ping;
-    s->next_timeout.tv_sec=0;
-    s->next_timeout.tv_usec=0;
+    gettimeofday(&s->next_timeout, NULL);
+    pcp_ctx_deadline_update(s->ctx, &s->next_timeout);
 
     PCP_LOG_END(PCP_LOGLVL_DEBUG);
     return PCP_ERR_SUCCESS;
 }
 
+static void psd_add_gw(pcp_ctx_t *ctx, struct sockaddr_in6 *gw)
+{
+    pcp_server_t *s;
+    int pcps_indx;
+
+    if ((IN6_IS_ADDR_V4MAPPED(&gw->sin6_addr)) && (S6_ADDR32(&gw->sin6_addr)[3] == INADDR_ANY))
+        return;
+
+    if (IN6_IS_ADDR_UNSPECIFIED(&gw->sin6_addr))
+        return;
+
+    s=get_pcp_server_by_ip(ctx, &gw->sin6_addr);
+    if (s) {
+        // gateway came back, don't wait for retry of not working server
+        if ((s->discovered) && ((s->server_state == pss_not_working)
+                || (s->server_state == pss_set_not_working))) {
+            s->server_state=pss_server_reping;
+            s->sweep_gen=0;
+            s->sweep_then=pss_unitialized;
+            gettimeofday(&s->next_timeout, NULL);
+            pcp_ctx_deadline_update(ctx, &s->next_timeout);
+        }
+        return;
+    }
+
+    pcps_indx=pcp_new_server(ctx, &gw->sin6_addr, ntohs(PCP_SERVER_PORT), gw->sin6_scope_id);
+    if (pcps_indx >= 0) {
+        s=get_pcp_server(ctx, pcps_indx);
+        if (!s)
+            return;
+
+        s->discovered=1;
+        if (psd_fill_pcp_server_src(s)) {
+            PCP_LOG(PCP_LOGLVL_ERR,
+                    "Failed to initialize gateway %s as a PCP server.",
+                    s?s->pcp_server_paddr:"NULL pointer!!!");
+        } else {
+            PCP_LOG(PCP_LOGLVL_INFO, "Found gateway %s. "
+            "Added as possible PCP server.",
+                    s?s->pcp_server_paddr:"NULL pointer!!!");
+        }
+    }
+}
+
 void psd_add_gws(pcp_ctx_t *ctx)
 {
     struct sockaddr_in6 *gws=NULL, *gw;
@@ -142,37 +307,146 @@ void psd_add_gws(pcp_ctx_t *ctx)
     gw=gws;
 
     for (; rcount > 0; rcount--, gw++) {
-        int pcps_indx;
+        psd_add_gw(ctx, gw);
+    }
+    free(gws);
+}
 
-        if ((IN6_IS_ADDR_V4MAPPED(&gw->sin6_addr)) && (S6_ADDR32(&gw->sin6_addr)[3] == INADDR_ANY))
-            continue;
+/* discovered server whose gateway is gone is handled as not responding */
+static void psd_remove_gws(pcp_ctx_t *ctx)
+{
+    struct sockaddr_in6 *gws=NULL;
+    int rcount=getgateways(&gws);
+    size_t i;
 
-        if (IN6_IS_ADDR_UNSPECIFIED(&gw->sin6_addr))
-            continue;
+    if (rcount < 0) {
+        return;
+    }
 
-        if (get_pcp_server_by_ip(ctx, &gw->sin6_addr))
-            continue;
+    for (i=0; i < ctx->pcp_db.pcp_servers_length; ++i) {
+        pcp_server_t *s=ctx->pcp_db.pcp_servers + i;
+        int j;
 
-        pcps_indx=pcp_new_server(ctx, &gw->sin6_addr, ntohs(PCP_SERVER_PORT), gw->sin6_scope_id);
-        if (pcps_indx >= 0) {
-            pcp_server_t *s=get_pcp_server(ctx, pcps_indx);
-            if (!s)
-                continue;
-
-            if (psd_fill_pcp_server_src(s)) {
-                PCP_LOG(PCP_LOGLVL_ERR,
-                        "Failed to initialize gateway %s as a PCP server.",
-                        s?s->pcp_server_paddr:"NULL pointer!!!");
-            } else {
-                PCP_LOG(PCP_LOGLVL_INFO, "Found gateway %s. "
-                "Added as possible PCP server.",
-                        s?s->pcp_server_paddr:"NULL pointer!!!");
+        if ((!s->discovered) || (s->server_state == pss_unitialized)
+                || (s->server_state == pss_allocated)
+                || (s->server_state == pss_set_not_working)
+                || (s->server_state == pss_not_working)) {
+            continue;
+        }
+        for (j=0; j < rcount; ++j) {
+            if (IN6_ARE_ADDR_EQUAL(&gws[j].sin6_addr,
+                    (struct in6_addr *)s->pcp_ip)) {
+                break;
             }
         }
+        if (j < rcount) {
+            continue;
+        }
+
+        PCP_LOG(PCP_LOGLVL_INFO, "Gateway %s is gone, PCP server disabled.",
+                s->pcp_server_paddr);
+        s->server_state=pss_set_not_working;
+        s->sweep_gen=0;
+        s->sweep_then=pss_unitialized;
+        gettimeofday(&s->next_timeout, NULL);
+        pcp_ctx_deadline_update(ctx, &s->next_timeout);
     }
     free(gws);
 }
 
+static int check_server_routes(pcp_ctx_t *ctx)
+{
+    size_t i;
+    int cnt=0;
+
+    for (i=0; i < ctx->pcp_db.pcp_servers_length; ++i) {
+        pcp_server_t *s=ctx->pcp_db.pcp_servers + i;
+
+        if ((s->server_state != pss_unitialized)
+                && (s->server_state != pss_allocated)) {
+            cnt+=psd_server_check_route(s);
+        }
+    }
+
+    return cnt;
+}
+
+struct gw_events {
+    pcp_ctx_t *ctx;
+    int removed;
+    int servers;  //changed routes (not default ones) covering some server
+};
+
+static void gw_event(void *arg, gw_event_e ev, struct sockaddr_in6 *addr,
+        int prefix_len)
+{
+    struct gw_events *e=(struct gw_events *)arg;
+    size_t i;
+
+    switch (ev) {
+    case gw_added:
+        if (e->ctx->gw_discovery) {
+            psd_add_gw(e->ctx, addr);
+        }
+        break;
+    case gw_removed:
+        e->removed|=e->ctx->gw_discovery;
+        break;
+    case gw_route:
+        pcp_saddr_cache_flush_prefix(e->ctx, &addr->sin6_addr, prefix_len);
+        for (i=0; i < e->ctx->pcp_db.pcp_servers_length; ++i) {
+            pcp_server_t *s=e->ctx->pcp_db.pcp_servers + i;
+
+            if ((s->server_state != pss_unitialized)
+                    && (ipv6_prefix_covers(&addr->sin6_addr, prefix_len,
+                            (struct in6_addr *)s->pcp_ip))) {
+                ++e->servers;
+                break;
+            }
+        }
+        break;
+    }
+}
+
+int psd_route_events(pcp_ctx_t *ctx)
+{
+    struct gw_events e={ctx, 0, 0};
+    int changes;
+
+    if (ctx->route_fd == PCP_INVALID_SOCKET) {
+        return 0;
+    }
+
+    // other routes than default ones drop only cached destinations they
+    // cover, those not leading to any server don't change its source address
+    changes=gw_monitor_read(ctx->route_fd, gw_event, &e);
+    if ((changes == 0) && (e.servers == 0)) {
+        return 0;
+    }
+    // default route or address changes may move any source address
+    if (changes != 0) {
+        pcp_saddr_cache_flush(ctx);
+    }
+    // lost notifications => whole routing is read again
+    if ((changes < 0) && (ctx->gw_discovery)) {
+        psd_add_gws(ctx);
+        e.removed=1;
+    }
+    // another default route may still use the gateway of removed one
+    if (e.removed) {
+        psd_remove_gws(ctx);
+    }
+
+    return check_server_routes(ctx);
+}
+
+int psd_check_routes(pcp_ctx_t *ctx)
+{
+    pcp_saddr_cache_flush(ctx);
+
+    return check_server_routes(ctx);
+}
+
 pcp_errno psd_add_pcp_server(pcp_ctx_t *ctx, struct sockaddr *sa,
         uint8_t version)
 {
@@ -32,4 +32,17 @@ void psd_add_gws(pcp_ctx_t *ctx);
 pcp_errno psd_add_pcp_server(pcp_ctx_t *ctx, struct sockaddr *sa,
         uint8_t version);
 
+/* looks up source address of server again; if it changed, reopens own
+ * socket of the server and maps flows using the address again; returns 1
+ * if the address changed or socket was opened */
+int psd_server_check_route(pcp_server_t *s);
+
+/* psd_server_check_route of all active servers, returns sum of results */
+int psd_check_routes(pcp_ctx_t *ctx);
+
+/* reads route notifications of ctx->route_fd: adds new default gateways as
+ * servers, disables those which are gone and checks routes of all servers;
+ * returns number of servers whose source address changed */
+int psd_route_events(pcp_ctx_t *ctx);
+
 #endif /* PCP_SERVER_DISCOVERY_H_ */
@@ -0,0 +1,390 @@
+/*
+ Copyright (c) 2014 by Cisco Systems, Inc.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms, with or without
+ modification, are permitted provided that the following conditions are met:
+
+ 1. Redistributions of source code must retain the above copyright notice, this
+ list of conditions and the following disclaimer.
+ 2. Redistributions in binary form must reproduce the above copyright notice,
+ this list of conditions and the following disclaimer in the documentation
+ and/or other materials provided with the distribution.
+
+ THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcp.h"
+#include "pcp_utils.h"
+
+#ifdef PCP_USE_THREADS
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "pcp_client_db.h"
+#include "pcp_logger.h"
+#include "pcp_socket.h"
+#include "pcp_event_handler.h"
+#include "pcp_io_thread.h"
+
+struct pcp_shards_s {
+    int count;
+    pcp_ctx_t **ctx;
+    pthread_mutex_t cb_lock;
+    pcp_flow_change_notify cb_fun;
+    void *cb_arg;
+};
+
+struct shard_server {
+    struct sockaddr_storage addr;
+    uint8_t version;
+};
+
+struct shard_servers {
+    struct shard_server *srv;
+    size_t cnt;
+    size_t size;
+};
+
+static void shards_notify(pcp_flow_t *f, struct sockaddr *src_addr,
+        struct sockaddr *ext_addr, pcp_fstate_e s, void *cb_arg)
+{
+    pcp_shards_t *sh=(pcp_shards_t *)cb_arg;
+
+    pthread_mutex_lock(&sh->cb_lock);
+    if (sh->cb_fun) {
+        sh->cb_fun(f, src_addr, ext_addr, s, sh->cb_arg);
+    }
+    pthread_mutex_unlock(&sh->cb_lock);
+}
+
+static int collect_server_iter(pcp_server_t *s, void *data)
+{
+    struct shard_servers *d=(struct shard_servers *)data;
+
+    if (s->server_state == pss_unitialized) {
+        return 0;
+    }
+
+    if (d->cnt == d->size) {
+        size_t size=d->size ? d->size * 2 : 4;
+        struct shard_server *srv=(struct shard_server *)realloc(d->srv,
+                size * sizeof(*srv));
+
+        if (!srv) {
+            return 1;
+        }
+        d->srv=srv;
+        d->size=size;
+    }
+
+    memset(&d->srv[d->cnt], 0, sizeof(d->srv[d->cnt]));
+    pcp_fill_sockaddr((struct sockaddr *)&d->srv[d->cnt].addr,
+            (struct in6_addr *)s->pcp_ip, s->pcp_port, 0, s->pcp_scope_id);
+    d->srv[d->cnt].version=s->pcp_version;
+    ++d->cnt;
+
+    return 0;
+}
+
+static void collect_servers(pcp_ctx_t *ctx, void *args)
+{
+    pcp_db_foreach_server(ctx, collect_server_iter, args);
+}
+
+// copy servers discovered by shard 0 to other shards
+static void shards_share_servers(pcp_shards_t *sh)
+{
+    struct shard_servers d;
+    int i;
+    size_t j;
+
+    memset(&d, 0, sizeof(d));
+    pcp_io_call(sh->ctx[0], collect_servers, &d);
+
+    for (i=1; i < sh->count; ++i) {
+        for (j=0; j < d.cnt; ++j) {
+            pcp_add_server(sh->ctx[i], (struct sockaddr *)&d.srv[j].addr,
+                    d.srv[j].version);
+        }
+    }
+    PCP_LOG(PCP_LOGLVL_INFO, "Shared %d discovered PCP server(s) by %d shards.",
+            (int)d.cnt, sh->count);
+
+    free(d.srv);
+}
+
+// gateways found by route monitor are added by every shard itself
+static void enable_gw_discovery(pcp_ctx_t *ctx, void *args UNUSED)
+{
+    ctx->gw_discovery=1;
+}
+
+pcp_shards_t *pcp_shards_init(int shards, uint32_t autodiscovery,
+        pcp_socket_vt_t *socket_vt)
+{
+    pcp_shards_t *sh;
+    long ncpu=sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    PCP_LOG_BEGIN(PCP_LOGLVL_DEBUG);
+
+    if (ncpu < 1) {
+        ncpu=1;
+    }
+    if (shards <= 0) {
+        shards=(int)ncpu;
+    }
+
+    sh=(pcp_shards_t *)calloc(1, sizeof(*sh));
+    if (!sh) {
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return NULL;
+    }
+    sh->ctx=(pcp_ctx_t **)calloc(shards, sizeof(*sh->ctx));
+    if (!sh->ctx) {
+        free(sh);
+        PCP_LOG_END(PCP_LOGLVL_DEBUG);
+        return NULL;
+    }
+    pthread_mutex_init(&sh->cb_lock, NULL);
+
+    for (i=0; i < shards; ++i) {
+        uint32_t flags=PCP_INIT_IO_THREAD
+                | (autodiscovery & (PCP_INIT_SOCKET_VT_EXT
+                        | PCP_INIT_SOCKET_PER_SERVER
+                        | PCP_INIT_SOCKET_CONNECTED
+                        | PCP_INIT_SOCKET_SEPARATE_AF
+                        | PCP_INIT_IO_URING));
+
+        if (i == 0) {
+            flags|=autodiscovery & ENABLE_AUTODISCOVERY;
+        }
+        sh->ctx[i]=pcp_init(flags, socket_vt);
+        if (!sh->ctx[i]) {
+            PCP_LOG(PCP_LOGLVL_ERR, "Cannot create PCP shard %d.", i);
+            pcp_shards_terminate(sh, 0);
+            PCP_LOG_END(PCP_LOGLVL_DEBUG);
+            return NULL;
+        }
+        sh->count=i + 1;
+
+        pcp_io_thread_pin(sh->ctx[i], i % ncpu);
+        pcp_set_flow_change_cb(sh->ctx[i], shards_notify, sh);
+    }
+
+    if (autodiscovery & ENABLE_AUTODISCOVERY) {
+        shards_share_servers(sh);
+        for (i=1; i < sh->count; ++i) {
+            pcp_io_call(sh->ctx[i], enable_gw_discovery, NULL);
+        }
+    }
+
+    PCP_LOG_END(PCP_LOGLVL_DEBUG);
+    return sh;
+}
+
+int pcp_shards_count(pcp_shards_t *sh)
+{
+    return sh ? sh->count : 0;
+}
+
+pcp_ctx_t *pcp_shards_get_ctx(pcp_shards_t *sh, int shard)
+{
+    if ((!sh) || (shard < 0) || (shard >= sh->count)) {
+        return NULL;
+    }
+    return sh->ctx[shard];
+}
+
+int pcp_shards_add_server(pcp_shards_t *sh, struct sockaddr *pcp_server,
+        uint8_t pcp_version)
+{
+    int i, ret=PCP_ERR_BAD_ARGS;
+
+    if (!sh) {
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    for (i=0; i < sh->count; ++i) {
+        int r=pcp_add_server(sh->ctx[i], pcp_server, pcp_version);
+
+        // shards have the same servers, so the ID is the same in all of them
+        if ((i == 0) || (r < 0)) {
+            ret=r;
+        }
+    }
+
+    return ret;
+}
+
+int pcp_shards_enable_route_monitor(pcp_shards_t *sh)
+{
+    int i, ret=PCP_ERR_SUCCESS;
+
+    if (!sh) {
+        return PCP_ERR_BAD_ARGS;
+    }
+
+    // every shard reads its own notifications, so all of them add and
+    // disable the same gateways
+    for (i=0; i < sh->count; ++i) {
+        int r=pcp_enable_route_monitor(sh->ctx[i]);
+
+        if ((r != PCP_ERR_SUCCESS) && (ret == PCP_ERR_SUCCESS)) {
+            ret=r;
+        }
+    }
+
+    return ret;
+}
+
+// FNV-1a of flow key parts known before flow is created
+static uint32_t shard_hash(uint32_t h, const void *data, size_t len)
+{
+    const uint8_t *p=(const uint8_t *)data;
+
+    while (len--) {
+        h^=*p++;
+        h*=16777619u;
+    }
+    return h;
+}
+
+static int shard_of_flow(pcp_shards_t *sh, struct sockaddr *src_addr,
+        struct sockaddr *dst_addr, uint8_t protocol)
+{
+    uint32_t h=2166136261u;
+    struct in6_addr ip;
+    uint16_t port=0;
+
+    h=shard_hash(h, &protocol, sizeof(protocol));
+
+    memset(&ip, 0, sizeof(ip));
+    pcp_fill_in6_addr(&ip, &port, src_addr);
+    h=shard_hash(h, &ip, sizeof(ip));
+    h=shard_hash(h, &port, sizeof(port));
+
+    if (dst_addr) {
+        port=0;
+        memset(&ip, 0, sizeof(ip));
+        pcp_fill_in6_addr(&ip, &port, dst_addr);
+        h=shard_hash(h, &ip, sizeof(ip));
+        h=shard_hash(h, &port, sizeof(port));
+    }
+
+    return (int)(h % (uint32_t)sh->count);
+}
+
+pcp_flow_t *pcp_shards_new_flow(pcp_shards_t *sh, struct sockaddr *src_addr,
+        struct sockaddr *dst_addr, struct sockaddr *ext_addr, uint8_t protocol,
+        uint32_t lifetime, void *userdata)
+{
+    if ((!sh) || (!src_addr)) {
+        return NULL;
+    }
+
+    return pcp_new_flow(
+            sh->ctx[shard_of_flow(sh, src_addr, dst_addr, protocol)],
+            src_addr, dst_addr, ext_addr, protocol, lifetime, userdata);
+}
+
+void pcp_shards_set_flow_change_cb(pcp_shards_t *sh,
+        pcp_flow_change_notify cb_fun, void *cb_arg)
+{
+    if (!sh) {
+        return;
+    }
+
+    pthread_mutex_lock(&sh->cb_lock);
+    sh->cb_fun=cb_fun;
+    sh->cb_arg=cb_arg;
+    pthread_mutex_unlock(&sh->cb_lock);
+}
+
+void pcp_shards_terminate(pcp_shards_t *sh, int close_flows)
+{
+    int i;
+
+    if (!sh) {
+        return;
+    }
+
+    for (i=0; i < sh->count; ++i) {
+        pcp_terminate(sh->ctx[i], close_flows);
+        free(sh->ctx[i]);
+    }
+
+    pthread_mutex_destroy(&sh->cb_lock);
+    free(sh->ctx);
+    free(sh);
+}
+
+#else //PCP_USE_THREADS
+
+pcp_shards_t *pcp_shards_init(int shards UNUSED, uint32_t autodiscovery UNUSED,
+        pcp_socket_vt_t *socket_vt UNUSED)
+{
+    return NULL;
+}
+
+int pcp_shards_count(pcp_shards_t *sh UNUSED)
+{
+    return 0;
+}
+
+pcp_ctx_t *pcp_shards_get_ctx(pcp_shards_t *sh UNUSED, int shard UNUSED)
+{
+    return NULL;
+}
+
+int pcp_shards_add_server(pcp_shards_t *sh UNUSED,
+        struct sockaddr *pcp_server UNUSED, uint8_t pcp_version UNUSED)
+{
+    return PCP_ERR_BAD_ARGS;
+}
+
+int pcp_shards_enable_route_monitor(pcp_shards_t *sh UNUSED)
+{
+    return PCP_ERR_BAD_ARGS;
+}
+
+pcp_flow_t *pcp_shards_new_flow(pcp_shards_t *sh UNUSED,
+        struct sockaddr *src_addr UNUSED, struct sockaddr *dst_addr UNUSED,
+        struct sockaddr *ext_addr UNUSED, uint8_t protocol UNUSED,
+        uint32_t lifetime UNUSED, void *userdata UNUSED)
+{
+    return NULL;
+}
+
+void pcp_shards_set_flow_change_cb(pcp_shards_t *sh UNUSED,
+        pcp_flow_change_notify cb_fun UNUSED, void *cb_arg UNUSED)
+{
+}
+
+void pcp_shards_terminate(pcp_shards_t *sh UNUSED, int close_flows UNUSED)
+{
+}
+
+#endif //PCP_USE_THREADS
@@ -52,6 +52,12 @@
   #define UNUSED
  #endif
 
+#ifdef _MSC_VER
+#define PCP_THREAD_LOCAL __declspec(thread)
+#else
+#define PCP_THREAD_LOCAL __thread
+#endif
+
 #ifdef WIN32
 /* variable num of arguments*/
 #define DUPPRINT(fp, fmt, ...)    \
@@ -212,17 +218,47 @@ inline static int timeval_subtract(struct timeval *result, struct timeval *x,
     return ret <= 0;
 }
 
+/* addr is within prefix/prefix_len */
+static inline int ipv6_prefix_covers(const struct in6_addr *prefix,
+        int prefix_len, const struct in6_addr *addr)
+{
+    const uint8_t *p=(const uint8_t *)prefix;
+    const uint8_t *a=(const uint8_t *)addr;
+    int bytes=prefix_len / 8;
+    int bits=prefix_len % 8;
+
+    if (memcmp(p, a, bytes)) {
+        return 0;
+    }
+
+    return (bits == 0)
+            || (((p[bytes] ^ a[bytes]) & (uint8_t)(0xff << (8 - bits))) == 0);
+}
+
+/* Per context xorshift64* generator, so contexts running in different
+   threads don't share (and don't serialize on) libc PRNG state. */
+static inline uint32_t pcp_rand(pcp_ctx_t *ctx)
+{
+    uint64_t x=ctx->rand_state;
+
+    if (!x) {
+        x=0x9E3779B97F4A7C15ULL; //state must not be zero
+    }
+    x^=x >> 12;
+    x^=x << 25;
+    x^=x >> 27;
+    ctx->rand_state=x;
+
+    return (uint32_t)((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
 /* Nonce is part of the MAP and PEER requests/responses
    as of version 2 of the PCP protocol */
-static inline void createNonce(struct pcp_nonce *nonce_field)
+static inline void createNonce(pcp_ctx_t *ctx, struct pcp_nonce *nonce_field)
 {
     int i;
     for (i = 2; i >= 0; --i)
-#ifdef WIN32
-        nonce_field->n[i]=htonl (rand());
-#else  //WIN32
-        nonce_field->n[i]=htonl(random());
-#endif //WIN32
+        nonce_field->n[i]=htonl(pcp_rand(ctx));
 }
 
 #ifndef HAVE_STRNDUP
@@ -75,37 +75,11 @@
 #include "pcp_msg_structs.h"
 #include "pcp_utils.h"
 #include "pcp.h"
+#include "pcp_server_resp.h"
 
 #define PCP_PORT "5351"
 #define PCP_TEST_MAX_VERSION 2
 
-#define MAX_LOG_FILE 64u
-
-typedef struct options_occur {
-    int third_party_occur;
-    int pfailure_occur;
-} options_occur_t;
-
-typedef struct server_info {
-    uint8_t server_version;
-    uint8_t end_after_recv;
-    uint8_t default_result_code;
-    struct in6_addr ext_ip;
-    uint8_t app_bit;
-    uint8_t ret_dscp;
-    char log_file[MAX_LOG_FILE];
-    struct timeval tv;
-    time_t epoch_time_start;
-} server_info_t;
-
-static void reset_option_occur(options_occur_t *opt_occ)
-{
-
-    opt_occ->third_party_occur = 0;
-    opt_occ->pfailure_occur = 0;
-
-}
-
 // get sockaddr, IPv4 or IPv6:
 static void *get_in_addr(struct sockaddr *sa)
 {
@@ -252,13 +226,12 @@ static int print_SADSCP_opcode_ver2(pcp_sadscp_req_t *sadscp_buf,
     return sizeof(pcp_sadscp_req_t) + sadscp_buf->app_name_length;
 }
 
-static int print_PCP_options(void* pcp_buf, int* remainingSize,
-    int* processedSize, options_occur_t *opt_occ, FILE *log_file)
+static void print_PCP_options(void* pcp_buf, int* remainingSize,
+    int* processedSize, FILE *log_file)
 {
 
     int remain = *remainingSize;
     int processed = *processedSize;
-    int pcp_result_code = PCP_RES_SUCCESS;
     char third_addr[INET6_ADDRSTRLEN];
     char filter_addr[INET6_ADDRSTRLEN];
     pcp_request_t* common_req = (pcp_request_t*) pcp_buf;
@@ -280,12 +253,6 @@ static int print_PCP_options(void* pcp_buf, int* remainingSize,
     switch (opt_hdr->code) {
 
     case PCP_OPTION_3RD_PARTY:
-        if (opt_occ->third_party_occur != 0) {
-            DUPPRINT(log_file, "THIRD PARTY OPTION was already present. \n");
-            pcp_result_code = PCP_RES_MALFORMED_OPTION;
-        } else {
-            opt_occ->third_party_occur = 1;
-        }
         DUPPRINT(log_file, "\n");
         DUPPRINT(log_file, "OPTION: \t Third party \n");
         opt_3rd = (pcp_3rd_party_option_t*) (pcp_buf_helper
@@ -300,13 +267,6 @@ static int print_PCP_options(void* pcp_buf, int* remainingSize,
     case PCP_OPTION_PREF_FAIL:
         if (opcode != PCP_OPCODE_MAP) {
             DUPPRINT(log_file, "Unsupported OPTION for given OPCODE.\n");
-            pcp_result_code = PCP_RES_MALFORMED_REQUEST;
-        }
-        if (opt_occ->pfailure_occur != 0) {
-            DUPPRINT(log_file, "PREFER FAILURE OPTION was already present. \n");
-            pcp_result_code = PCP_RES_MALFORMED_OPTION;
-        } else {
-            opt_occ->pfailure_occur = 1;
         }
         DUPPRINT(log_file, "\n");
         DUPPRINT(log_file, "OPTION: \t Prefer fail \n");
@@ -318,7 +278,6 @@ static int print_PCP_options(void* pcp_buf, int* remainingSize,
 
         if (opcode != PCP_OPCODE_MAP) {
             DUPPRINT(log_file, "Unsupported OPTION for given OPCODE.\n");
-            pcp_result_code = PCP_RES_MALFORMED_REQUEST;
         }
         opt_filter =
                 (pcp_filter_option_t*) (pcp_buf_helper+processed);
@@ -405,7 +364,6 @@ static int print_PCP_options(void* pcp_buf, int* remainingSize,
     // shift processed and remaining values to new values
     *remainingSize = remain;
     *processedSize = processed;
-    return pcp_result_code;
 }
 
 
@@ -413,15 +371,12 @@ static int print_PCP_options(void* pcp_buf, int* remainingSize,
 #define str(s) #s
 
 /*
- * return value indicates whether the request is valid or not.
- * Based on the return value simple response can be formed.
+ * Print the request as far as it can be parsed. Result code of the response
+ * is decided by pcp_server_check_request.
  */
-static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
-        uint8_t version, const char *server_log_file)
+static void printPCPreq(void * req, int req_size, uint8_t version,
+        const char *server_log_file)
 {
-    // while request is being printed we can set analyze it as well, and decide
-    // on return code which is then used to create response to request
-    int pcp_return_val = PCP_RES_SUCCESS;
     int remainingSize;
     int processedSize;
     char s[INET6_ADDRSTRLEN];
@@ -436,7 +391,7 @@ static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
             "Size of PCP packet is either smaller than 4 octets or larger "
             "than "xstr(PCP_MAX_LEN)" bytes or the size is not multiple of 4.\n");
         printf("The size was: %d \n", req_size);
-        return PCP_RES_MALFORMED_REQUEST;
+        return;
     }
 
     if ((server_log_file != NULL)&&(server_log_file[0]!=0)) {
@@ -476,7 +431,7 @@ static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
 
 
     if ((common_req->ver > version)) {
-        return PCP_RES_UNSUPP_VERSION;
+        return;
     }
 
     // analyze two possible versions of protocol,
@@ -487,7 +442,7 @@ static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
             pcp_map_v1_t* map;
             remainingSize -= sizeof(pcp_map_v1_t);
             if (remainingSize < 0) {
-                return PCP_RES_MALFORMED_OPTION;
+                return;
             }
             map = (pcp_map_v1_t*) (req_help + processedSize);
             print_MAP_opcode_ver1(map, log_file);
@@ -495,8 +450,8 @@ static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
 
             printf("Remaining size is %d \n", remainingSize);
             while (remainingSize > 0) {
-                pcp_return_val = print_PCP_options(req, &remainingSize,
-                        &processedSize, opt_occ, log_file);
+                print_PCP_options(req, &remainingSize, &processedSize,
+                        log_file);
             }
 
         }
@@ -507,7 +462,7 @@ static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
             remainingSize -= sizeof(pcp_map_v1_t);
             printf("Remaining size is %d \n", remainingSize);
             if (remainingSize < 0) {
-                return PCP_RES_MALFORMED_OPTION;
+                return;
             }
 
             peer = (pcp_peer_v1_t*) (req_help + processedSize);
@@ -516,8 +471,8 @@ static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
             processedSize += sizeof(pcp_peer_v1_t);
 
             while (remainingSize > 0) {
-                pcp_return_val = print_PCP_options(req, &remainingSize,
-                        &processedSize, opt_occ, log_file);
+                print_PCP_options(req, &remainingSize, &processedSize,
+                        log_file);
             }
 
         }
@@ -528,7 +483,7 @@ static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
         if ((common_req->r_opcode & 0x7F) == PCP_OPCODE_MAP) {
             remainingSize -= sizeof(pcp_map_v2_t);
             if (remainingSize < 0) {
-                return PCP_RES_MALFORMED_OPTION;
+                return;
             }
             map = (pcp_map_v2_t*) (req_help + processedSize);
             print_MAP_opcode_ver2(map, log_file);
@@ -536,8 +491,8 @@ static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
 
             printf("Remaining size is %d \n", remainingSize);
             while (remainingSize > 0) {
-                pcp_return_val = print_PCP_options(req, &remainingSize,
-                        &processedSize, opt_occ, log_file);
+                print_PCP_options(req, &remainingSize, &processedSize,
+                        log_file);
             }
 
         }
@@ -548,7 +503,7 @@ static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
             remainingSize -= sizeof(pcp_peer_v2_t);
             printf("Remaining size is %d \n", remainingSize);
             if (remainingSize < 0) {
-                return PCP_RES_MALFORMED_OPTION;
+                return;
             }
 
             peer = (pcp_peer_v2_t*) (req_help + processedSize);
@@ -557,8 +512,8 @@ static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
             processedSize += sizeof(pcp_peer_v2_t);
 
             while (remainingSize > 0) {
-                pcp_return_val = print_PCP_options(req, &remainingSize,
-                        &processedSize, opt_occ, log_file);
+                print_PCP_options(req, &remainingSize, &processedSize,
+                        log_file);
             }
 
         }
@@ -569,7 +524,7 @@ static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
             size_t sadscp_size;
 
             if (remainingSize < (int)sizeof(pcp_sadscp_req_t)) {
-                return PCP_RES_MALFORMED_REQUEST;
+                return;
             }
 
             sadscp = (pcp_sadscp_req_t*)(req_help + processedSize);
@@ -579,53 +534,13 @@ static int printPCPreq(void * req, int req_size, options_occur_t *opt_occ,
             remainingSize -= sadscp_size;
 
             while (remainingSize > 0) {
-                pcp_return_val = print_PCP_options(req, &remainingSize,
-                        &processedSize, opt_occ, log_file);
+                print_PCP_options(req, &remainingSize, &processedSize,
+                        log_file);
             }
 
         }
-    } else {
-        return PCP_RES_UNSUPP_VERSION;
     }
     fflush(log_file);
-    return pcp_return_val;
-}
-
-static int create_response(char *request, int pcp_result_code,
-        const server_info_t *server_info)
-{
-
-    pcp_response_t *resp = (pcp_response_t*) request;
-    resp->reserved = 0;
-    resp->reserved1[0] = 0;
-    resp->reserved1[1] = 0;
-    resp->reserved1[2] = 0;
-    resp->r_opcode |= 0x80;
-    resp->result_code = (uint8_t)pcp_result_code;
-    resp->epochtime = htonl((uint32_t) (time(NULL) - server_info->epoch_time_start));
-
-    if (pcp_result_code == PCP_RES_UNSUPP_VERSION) {
-        resp->ver = server_info->server_version;
-        return 0;
-    }
-
-    if ((resp->r_opcode & 0x7f) == PCP_OPCODE_MAP) {
-        if (resp->ver==1) {
-            pcp_map_v1_t *m1 = (pcp_map_v1_t *)resp->next_data;
-            memcpy(m1->ext_ip, &server_info->ext_ip, sizeof(m1->ext_ip));
-        } else if (resp->ver==2) {
-            pcp_map_v2_t *m2 = (pcp_map_v2_t *)resp->next_data;
-            memcpy(m2->ext_ip, &server_info->ext_ip, sizeof(m2->ext_ip));
-        }
-    }
-
-    if ((resp->r_opcode & 0x7f) == PCP_OPCODE_SADSCP) {
-        pcp_sadscp_resp_t * r = (pcp_sadscp_resp_t*)resp->next_data;
-        r->a_r_dscp = server_info->app_bit << 7;
-        r->a_r_dscp |= server_info->ret_dscp;
-    }
-
-    return 0;
 }
 
 static int execPCPServer(const char* serverPort, const char* serverAddress,
@@ -636,7 +551,6 @@ static int execPCPServer(const char* serverPort, const char* serverAddress,
     int pcp_result_code;
     struct sockaddr_storage their_addr;
     int execute = 1;
-    options_occur_t opt_occurence = { 0, 0 };
 
     char buf[PCP_MAX_LEN];
     socklen_t addr_len=0;
@@ -710,12 +624,14 @@ static int execPCPServer(const char* serverPort, const char* serverAddress,
 
         printf("PCP server: packet is %d bytes long\n", numbytes);
 
-        pcp_result_code = printPCPreq(buf, numbytes, &opt_occurence,
-                server_info->server_version, server_info->log_file);
+        printPCPreq(buf, numbytes, server_info->server_version,
+                server_info->log_file);
+        pcp_result_code = pcp_server_check_request(buf, numbytes,
+                server_info->server_version);
 
         // check if default result code should be returned
         // or the result code that was retrieved after message parsing
-        create_response(buf,
+        pcp_server_create_response(buf,
                 (server_info->default_result_code == 255) ?
                         pcp_result_code : server_info->default_result_code,
                 server_info);
@@ -724,7 +640,6 @@ static int execPCPServer(const char* serverPort, const char* serverAddress,
         sendto(sockfd, buf, numbytes, 0, (struct sockaddr*) &their_addr,
                 addr_len);
 
-        reset_option_occur(&opt_occurence);
         printf("\n");
     }
 
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2014 by Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <arpa/inet.h>
+#endif
+
+#include "pcp_msg_structs.h"
+#include "pcp_utils.h"
+#include "pcp.h"
+#include "pcp_server_resp.h"
+
+/* size of opcode specific data of the request, -1 if it's too short */
+static int opcode_data_size(const pcp_request_t *common_req, int remain)
+{
+    uint8_t opcode = common_req->r_opcode & 0x7F;
+    int size = 0;
+
+    switch (opcode) {
+    case PCP_OPCODE_MAP:
+        size = common_req->ver == 1 ? sizeof(pcp_map_v1_t) :
+                sizeof(pcp_map_v2_t);
+        break;
+    case PCP_OPCODE_PEER:
+        size = common_req->ver == 1 ? sizeof(pcp_peer_v1_t) :
+                sizeof(pcp_peer_v2_t);
+        break;
+    case PCP_OPCODE_SADSCP:
+        if (common_req->ver == 1) {
+            break;
+        }
+        if (remain < (int)sizeof(pcp_sadscp_req_t)) {
+            return -1;
+        }
+        size = sizeof(pcp_sadscp_req_t) +
+                ((const pcp_sadscp_req_t *)common_req->next_data)
+                ->app_name_length;
+        break;
+    default:
+        break;
+    }
+
+    return size <= remain ? size : -1;
+}
+
+int pcp_server_check_request(const void *req, int req_size, uint8_t version)
+{
+    const pcp_request_t *common_req = (const pcp_request_t *)req;
+    const uint8_t *req_help = (const uint8_t *)req;
+    int pcp_return_val = PCP_RES_SUCCESS;
+    int third_party_occur = 0;
+    int pfailure_occur = 0;
+    int remainingSize;
+    int processedSize;
+    int opcode_size;
+    uint8_t opcode;
+
+    // discard request that exceeds maximal length, is shorter than 3,
+    // or is not the multiple of 4
+    if ((req_size > PCP_MAX_LEN) || (req_size < 4) || ((req_size & 3) != 0)) {
+        return PCP_RES_MALFORMED_REQUEST;
+    }
+    if ((common_req->ver > version) || (common_req->ver < 1)
+            || (common_req->ver > 2)) {
+        return PCP_RES_UNSUPP_VERSION;
+    }
+    if (req_size < (int)sizeof(pcp_request_t)) {
+        return PCP_RES_MALFORMED_REQUEST;
+    }
+
+    opcode = common_req->r_opcode & 0x7F;
+    remainingSize = req_size - sizeof(pcp_request_t);
+    processedSize = sizeof(pcp_request_t);
+
+    opcode_size = opcode_data_size(common_req, remainingSize);
+    if (opcode_size < 0) {
+        return opcode == PCP_OPCODE_SADSCP ? PCP_RES_MALFORMED_REQUEST :
+                PCP_RES_MALFORMED_OPTION;
+    }
+    remainingSize -= opcode_size;
+    processedSize += opcode_size;
+
+    while (remainingSize >= (int)sizeof(pcp_options_hdr_t)) {
+        const pcp_options_hdr_t *opt_hdr =
+                (const pcp_options_hdr_t *)(req_help + processedSize);
+        int opt_size = sizeof(pcp_options_hdr_t) + ntohs(opt_hdr->len);
+
+        switch (opt_hdr->code) {
+        case PCP_OPTION_3RD_PARTY:
+            if (third_party_occur) {
+                pcp_return_val = PCP_RES_MALFORMED_OPTION;
+            }
+            third_party_occur = 1;
+            break;
+        case PCP_OPTION_PREF_FAIL:
+            if (opcode != PCP_OPCODE_MAP) {
+                pcp_return_val = PCP_RES_MALFORMED_REQUEST;
+            } else if (pfailure_occur) {
+                pcp_return_val = PCP_RES_MALFORMED_OPTION;
+            }
+            pfailure_occur = 1;
+            break;
+        case PCP_OPTION_FILTER:
+            if (opcode != PCP_OPCODE_MAP) {
+                pcp_return_val = PCP_RES_MALFORMED_REQUEST;
+            }
+            break;
+        case PCP_OPTION_FLOW_PRIORITY:
+        case PCP_OPTION_METADATA:
+        case PCP_OPTION_LOCATION:
+        case PCP_OPTION_USERID:
+        case PCP_OPTION_DEVICEID:
+            break;
+        default:
+            // rest of the request is not parsed, as by pcp-server
+            return pcp_return_val;
+        }
+
+        remainingSize -= opt_size;
+        processedSize += opt_size;
+    }
+
+    return pcp_return_val;
+}
+
+void pcp_server_create_response(char *request, int pcp_result_code,
+        const server_info_t *server_info)
+{
+
+    pcp_response_t *resp = (pcp_response_t*) request;
+    resp->reserved = 0;
+    resp->reserved1[0] = 0;
+    resp->reserved1[1] = 0;
+    resp->reserved1[2] = 0;
+    resp->r_opcode |= 0x80;
+    resp->result_code = (uint8_t)pcp_result_code;
+    resp->epochtime = htonl((uint32_t) (time(NULL) - server_info->epoch_time_start));
+
+    if (pcp_result_code == PCP_RES_UNSUPP_VERSION) {
+        resp->ver = server_info->server_version;
+        return;
+    }
+
+    if ((resp->r_opcode & 0x7f) == PCP_OPCODE_MAP) {
+        if (resp->ver==1) {
+            pcp_map_v1_t *m1 = (pcp_map_v1_t *)resp->next_data;
+            memcpy(m1->ext_ip, &server_info->ext_ip, sizeof(m1->ext_ip));
+        } else if (resp->ver==2) {
+            pcp_map_v2_t *m2 = (pcp_map_v2_t *)resp->next_data;
+            memcpy(m2->ext_ip, &server_info->ext_ip, sizeof(m2->ext_ip));
+        }
+    }
+
+    if ((resp->r_opcode & 0x7f) == PCP_OPCODE_SADSCP) {
+        pcp_sadscp_resp_t * r = (pcp_sadscp_resp_t*)resp->next_data;
+        r->a_r_dscp = server_info->app_bit << 7;
+        r->a_r_dscp |= server_info->ret_dscp;
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2014 by Cisco Systems, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PCP_SERVER_RESP_H_
+#define PCP_SERVER_RESP_H_
+
+#include <stdint.h>
+#include <time.h>
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/time.h>
+#include <netinet/in.h>
+#endif
+
+#define MAX_LOG_FILE 64u
+
+typedef struct server_info {
+    uint8_t server_version;
+    uint8_t end_after_recv;
+    uint8_t default_result_code;
+    struct in6_addr ext_ip;
+    uint8_t app_bit;
+    uint8_t ret_dscp;
+    char log_file[MAX_LOG_FILE];
+    struct timeval tv;
+    time_t epoch_time_start;
+} server_info_t;
+
+/*
+ * Request checks of pcp-server without printing the request: size, version,
+ * opcode specific data and options valid for the opcode.
+ *    return value - PCP result code the request is answered by
+ */
+int pcp_server_check_request(const void *req, int req_size, uint8_t version);
+
+/*
+ * Rewrite request in place to response with given result code.
+ */
+void pcp_server_create_response(char *request, int pcp_result_code,
+        const server_info_t *server_info);
+
+#endif /* PCP_SERVER_RESP_H_ */
@@ -66,6 +66,18 @@ Get_Status $? "test_lifetime_renewal      "
 $PATH_SCRIPT/test_server_reping.sh
 Get_Status $? "test_server_reping         "
 
+$PATH_SCRIPT/test_event_loop.sh
+Get_Status $? "test_event_loop            "
+
+$PATH_SCRIPT/test_io_thread.sh
+Get_Status $? "test_io_thread             "
+
+$PATH_SCRIPT/test_shards.sh
+Get_Status $? "test_shards                "
+
+$PATH_SCRIPT/test_flow_batch.sh
+Get_Status $? "test_flow_batch            "
+
 test_event_handler
 Get_Status $? "test_event_handler         "
 
@@ -87,6 +99,42 @@ Get_Status $? "test_pcp_logger            "
 test_pcp_msg
 Get_Status $? "test_pcp_msg               "
 
+fuzz_pcp_msg
+Get_Status $? "fuzz_pcp_msg               "
+
+test_mt_contexts
+Get_Status $? "test_mt_contexts           "
+
+test_cq
+Get_Status $? "test_cq                    "
+
+test_pulse_budget
+Get_Status $? "test_pulse_budget          "
+
+test_socket_vt_ext
+Get_Status $? "test_socket_vt_ext         "
+
+test_rx_timestamps
+Get_Status $? "test_rx_timestamps         "
+
+test_socket_per_server
+Get_Status $? "test_socket_per_server     "
+
+test_dual_stack
+Get_Status $? "test_dual_stack            "
+
+test_io_uring
+Get_Status $? "test_io_uring              "
+
+test_sans_io
+Get_Status $? "test_sans_io               "
+
+test_route_monitor
+Get_Status $? "test_route_monitor         "
+
+test_shm_transport
+Get_Status $? "test_shm_transport         "
+
 $PATH_SCRIPT/test_server_reping.sh
 Get_Status $? "test_server_reping         "
 
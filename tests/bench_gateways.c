@@ -0,0 +1,127 @@
+/*
+ *------------------------------------------------------------------
+ * bench_gateways.c
+ *
+ * Time of default gateway discovery (getgateways) with big routing table.
+ * Table is filled in its own network namespace, so the system one is not
+ * touched.
+ * usage: bench_gateways [-n routes] [-i iterations]
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE //unshare
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "pcp.h"
+#include "gateway.h"
+#include "test_macro.h"
+
+#define DEFAULT_ROUTES 100000
+#define DEFAULT_ITERATIONS 10
+
+static double elapsed_s(struct timeval *start)
+{
+    struct timeval end;
+
+    gettimeofday(&end, NULL);
+    return (end.tv_sec - start->tv_sec) + (end.tv_usec - start->tv_usec) / 1e6;
+}
+
+/* /24 routes of 20.0.0.0/8 and further, default route is added last */
+static void fill_table(long routes)
+{
+    FILE *ip=popen("ip -batch -", "w");
+    long i;
+
+    TEST(ip);
+    fprintf(ip, "link set lo up\n");
+    fprintf(ip, "addr add 10.9.0.1/24 dev lo\n");
+    for (i=0; i < routes; ++i) {
+        fprintf(ip, "route add %ld.%ld.%ld.0/24 via 10.9.0.3 dev lo\n",
+                20 + (i >> 16), (i >> 8) & 0xff, i & 0xff);
+    }
+    fprintf(ip, "route add default via 10.9.0.2 dev lo\n");
+    TEST(pclose(ip) == 0);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in6 *gws=NULL;
+    struct timeval start;
+    double fill_s, first_s, avg_s;
+    long routes=DEFAULT_ROUTES;
+    int iterations=DEFAULT_ITERATIONS;
+    int i, cnt=0;
+
+    for (i=1; i < argc; ++i) {
+        if ((!strcmp(argv[i], "-n")) && (i + 1 < argc)) {
+            routes=atol(argv[++i]);
+        } else if ((!strcmp(argv[i], "-i")) && (i + 1 < argc)) {
+            iterations=atoi(argv[++i]);
+        } else {
+            printf("usage: %s [-n routes] [-i iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+    if ((routes < 0) || (routes > 200 * 65536)) {
+        routes=DEFAULT_ROUTES;
+    }
+    if (iterations <= 0) {
+        iterations=1;
+    }
+    pcp_log_level=PCP_LOGLVL_NONE;
+
+#ifdef __linux__
+    if (unshare(CLONE_NEWNET))
+#endif
+    {
+        printf("Network namespace can't be created, benchmark skipped.\n");
+        return 0;
+    }
+    gettimeofday(&start, NULL);
+    fill_table(routes);
+    fill_s=elapsed_s(&start);
+
+    // the first dump runs with cold caches
+    gettimeofday(&start, NULL);
+    cnt=getgateways(&gws);
+    first_s=elapsed_s(&start);
+    free(gws);
+    TEST(cnt == 1);
+
+    gettimeofday(&start, NULL);
+    for (i=0; i < iterations; ++i) {
+        gws=NULL;
+        cnt=getgateways(&gws);
+        free(gws);
+        TEST(cnt == 1);
+    }
+    avg_s=elapsed_s(&start) / iterations;
+
+    printf("%ld routes, filled in %.3f s\n", routes, fill_s);
+    printf("getgateways: first %.3f ms, average of %d %.3f ms, %d gateway\n",
+            first_s * 1000, iterations, avg_s * 1000, cnt);
+
+    return 0;
+}
@@ -0,0 +1,202 @@
+/*
+ *------------------------------------------------------------------
+ * bench_pcp_flows.c
+ *
+ * Request rate of the library itself - flows are created and mapped
+ * through in-process shared-memory transport answered by simulated PCP
+ * server, no network or server process is involved.
+ * usage: bench_pcp_flows [-n flows] [-s servers] [-r ring_slots] [-t]
+ *   -t runs simulated server in its own thread (needs PCP_USE_THREADS),
+ *      otherwise it's run between pulses of the library
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <sys/time.h>
+#endif
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#ifdef PCP_USE_THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "pcp.h"
+#include "unp.h"
+#include "pcp_utils.h"
+#include "pcp_shm_transport.h"
+#include "test_macro.h"
+
+#define DEFAULT_FLOWS 20000
+#define DEFAULT_SERVERS 1
+#define DEFAULT_SLOTS 4096
+#define MAX_SERVERS 16
+
+static volatile int succeeded;
+
+static void notify_cb(pcp_flow_t *f UNUSED, struct sockaddr *src_addr UNUSED,
+        struct sockaddr *ext_addr UNUSED, pcp_fstate_e s, void *cb_arg UNUSED)
+{
+    if (s == pcp_state_succeeded) {
+        ++succeeded;
+    }
+}
+
+static double elapsed_s(struct timeval *start)
+{
+    struct timeval end;
+
+    gettimeofday(&end, NULL);
+    return (end.tv_sec - start->tv_sec) + (end.tv_usec - start->tv_usec) / 1e6;
+}
+
+#ifdef PCP_USE_THREADS
+static volatile int server_stop;
+
+static void *server_thread(void *arg)
+{
+    pcp_shm_t *shm=(pcp_shm_t *)arg;
+
+    while (!__atomic_load_n(&server_stop, __ATOMIC_ACQUIRE)) {
+        if (!pcp_shm_serve(shm, NULL, 0)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    pcp_ctx_t *ctx;
+    pcp_shm_t *shm;
+    pcp_shm_stats_t st;
+    pcp_budget_t budget;
+    struct timeval start;
+    double create_s, map_s;
+    long flows=DEFAULT_FLOWS, i;
+    int servers=DEFAULT_SERVERS;
+    uint32_t slots=DEFAULT_SLOTS;
+    int threaded=0;
+#ifdef PCP_USE_THREADS
+    pthread_t thr;
+#endif
+
+    for (i=1; i < argc; ++i) {
+        if ((!strcmp(argv[i], "-n")) && (i + 1 < argc)) {
+            flows=atol(argv[++i]);
+        } else if ((!strcmp(argv[i], "-s")) && (i + 1 < argc)) {
+            servers=atoi(argv[++i]);
+        } else if ((!strcmp(argv[i], "-r")) && (i + 1 < argc)) {
+            slots=(uint32_t)atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-t")) {
+            threaded=1;
+        } else {
+            printf("usage: %s [-n flows] [-s servers] [-r ring_slots] [-t]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (flows <= 0) {
+        flows=1;
+    }
+    if ((servers <= 0) || (servers > MAX_SERVERS)) {
+        servers=DEFAULT_SERVERS;
+    }
+#ifndef PCP_USE_THREADS
+    if (threaded) {
+        printf("Library is built without thread support, -t ignored.\n");
+        threaded=0;
+    }
+#endif
+    pcp_log_level=PCP_LOGLVL_NONE;
+
+    shm=pcp_shm_create(slots, 0);
+    TEST(shm);
+    ctx=pcp_init(DISABLE_AUTODISCOVERY | PCP_INIT_SOCKET_VT_EXT,
+            pcp_shm_socket_vt(shm));
+    TEST(ctx);
+    pcp_set_flow_change_cb(ctx, notify_cb, NULL);
+
+    // servers on loopback addresses share source address, so each flow is
+    // mapped by all of them
+    for (i=0; i < servers; ++i) {
+        char addr[32];
+
+        snprintf(addr, sizeof(addr), "127.0.0.%ld:5351", i + 1);
+        TEST(pcp_add_server(ctx, Sock_pton(addr), 2) == i);
+    }
+
+    gettimeofday(&start, NULL);
+    for (i=0; i < flows; ++i) {
+        struct sockaddr_in src;
+
+        memset(&src, 0, sizeof(src));
+        src.sin_family=AF_INET;
+        src.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+        src.sin_port=htons((uint16_t)(1024 + i % 64000));
+        TEST(pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL,
+                (uint8_t)(1 + i / 64000 % 254), 3600, NULL));
+    }
+    create_s=elapsed_s(&start);
+
+#ifdef PCP_USE_THREADS
+    if (threaded) {
+        TEST(pthread_create(&thr, NULL, server_thread, shm) == 0);
+    }
+#endif
+
+    // requests of all servers sent by one pulse fill half of the ring at
+    // most, so they are never refused
+    budget.max_flows=slots / (2 * servers) ? slots / (2 * servers) : 1;
+    budget.max_usec=0;
+    gettimeofday(&start, NULL);
+    while (succeeded < flows) {
+        struct timeval tv={0, 0};
+
+        pcp_pulse_budget(ctx, &budget, &tv, NULL);
+        if (!threaded) {
+            pcp_shm_serve(shm, NULL, 0);
+        }
+    }
+    map_s=elapsed_s(&start);
+
+#ifdef PCP_USE_THREADS
+    if (threaded) {
+        __atomic_store_n(&server_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(thr, NULL);
+    }
+#endif
+
+    pcp_shm_get_stats(shm, &st);
+    printf("%ld flows, %d servers, %u ring slots, server %s\n", flows,
+            servers, slots, threaded ? "thread" : "inline");
+    printf("create: %.3f s, %.0f flows/s\n", create_s, flows / create_s);
+    printf("map:    %.3f s, %.0f requests/s, %.0f responses/s\n", map_s,
+            st.requests / map_s, st.rx_msgs / map_s);
+    printf("requests %llu, refused by full ring %llu\n",
+            (unsigned long long)st.requests,
+            (unsigned long long)st.tx_full);
+
+    pcp_terminate(ctx, 0);
+    free(ctx);
+    pcp_shm_destroy(shm);
+
+    return 0;
+}
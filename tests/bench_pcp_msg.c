@@ -0,0 +1,256 @@
+/*
+ *------------------------------------------------------------------
+ * bench_pcp_msg.c
+ *
+ * Throughput of request encoding, response validation and response
+ * parsing for each supported (version, opcode, option set) combination.
+ * usage: bench_pcp_msg [-n iterations] [-c corpus_dir]
+ *   -c writes response of each combination to corpus_dir, used as seed
+ *      corpus of fuzz_pcp_msg
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <sys/time.h>
+#endif
+
+#include "pcp.h"
+#include "unp.h"
+#include "pcp_utils.h"
+#include "pcp_msg.h"
+#include "test_macro.h"
+
+#define DEFAULT_ITERATIONS 200000
+#define UNKNOWN_OPTIONS 16
+
+struct bench_case {
+    const char *name;
+    uint8_t version;
+    uint8_t opcode;
+    int options; //0 - none, 1 - all known, 2 - all known and unknown ones
+};
+
+static const struct bench_case cases[]={
+#ifndef PCP_DISABLE_NATPMP
+        {"natpmp_announce", 0, PCP_OPCODE_ANNOUNCE, 0},
+        {"natpmp_map", 0, PCP_OPCODE_MAP, 0},
+#endif
+        {"v1_announce", 1, PCP_OPCODE_ANNOUNCE, 0},
+        {"v1_map", 1, PCP_OPCODE_MAP, 0},
+        {"v1_map_opts", 1, PCP_OPCODE_MAP, 1},
+        {"v1_peer", 1, PCP_OPCODE_PEER, 0},
+        {"v1_peer_opts", 1, PCP_OPCODE_PEER, 1},
+        {"v2_announce", 2, PCP_OPCODE_ANNOUNCE, 0},
+        {"v2_map", 2, PCP_OPCODE_MAP, 0},
+        {"v2_map_opts", 2, PCP_OPCODE_MAP, 1},
+        {"v2_map_many_opts", 2, PCP_OPCODE_MAP, 2},
+        {"v2_peer", 2, PCP_OPCODE_PEER, 0},
+        {"v2_peer_opts", 2, PCP_OPCODE_PEER, 1},
+#ifdef PCP_SADSCP
+        {"v2_sadscp", 2, PCP_OPCODE_SADSCP, 0},
+#endif
+};
+
+#define CASES_COUNT (sizeof(cases) / sizeof(*cases))
+
+static double elapsed_ns(struct timeval *start, long iterations)
+{
+    struct timeval end;
+
+    gettimeofday(&end, NULL);
+    return ((end.tv_sec - start->tv_sec) * 1e9
+            + (end.tv_usec - start->tv_usec) * 1e3) / iterations;
+}
+
+static void init_flow(pcp_ctx_t *ctx, struct pcp_flow_s *fs,
+        const struct bench_case *c)
+{
+    pcp_server_t *s;
+    char addr[32];
+
+    memset(fs, 0, sizeof(*fs));
+    fs->ctx=ctx;
+    snprintf(addr, sizeof(addr), "127.0.1.%u", (unsigned)(c - cases) + 1);
+    fs->pcp_server_indx=pcp_add_server(ctx, Sock_pton(addr), c->version);
+    s=get_pcp_server(ctx, fs->pcp_server_indx);
+    TEST(s);
+    s->pcp_version=c->version;
+
+    fs->kd.operation=c->opcode;
+    fs->kd.map_peer.protocol=IPPROTO_TCP;
+    fs->kd.map_peer.src_port=htons(1234);
+    fs->kd.map_peer.dst_port=htons(80);
+    fs->map_peer.ext_port=htons(5678);
+    fs->lifetime=3600;
+
+    if (c->options) {
+        fs->filter_option_present=1;
+        fs->filter_prefix=128;
+        fs->pfailure_option_present=1;
+        fs->third_party_option_present=1;
+#ifdef PCP_FLOW_PRIORITY
+        fs->flowp_option_present=1;
+        fs->flowp_dscp_up=10;
+        fs->flowp_dscp_down=20;
+#endif
+    }
+}
+
+/* server's answer to request in buf, returns its length */
+static size_t make_response(const struct bench_case *c, char *buf,
+        size_t req_len)
+{
+    size_t len=req_len;
+    int i;
+
+#ifndef PCP_DISABLE_NATPMP
+    if (c->version == 0) {
+        if (c->opcode == PCP_OPCODE_ANNOUNCE) {
+            nat_pmp_announce_resp_t *r=(nat_pmp_announce_resp_t *)buf;
+
+            memset(r, 0, sizeof(*r));
+            r->opcode=0x80;
+            r->epoch=htonl(100);
+            r->ext_ip=htonl(0x0A000001);
+            return sizeof(*r);
+        } else {
+            nat_pmp_map_resp_t *r=(nat_pmp_map_resp_t *)buf;
+            nat_pmp_map_req_t req=*(nat_pmp_map_req_t *)buf;
+
+            memset(r, 0, sizeof(*r));
+            r->opcode=0x80 | req.opcode;
+            r->epoch=htonl(100);
+            r->int_port=req.int_port;
+            r->ext_port=req.ext_port;
+            r->lifetime=req.lifetime;
+            return sizeof(*r);
+        }
+    }
+#endif
+
+    buf[1]|=0x80;
+    ((pcp_response_t *)buf)->epochtime=htonl(100);
+
+    if (c->options == 2) {
+        for (i=0; (i < UNKNOWN_OPTIONS) && (len + 20 <= PCP_MAX_LEN); ++i) {
+            pcp_options_hdr_t *opt=(pcp_options_hdr_t *)(buf + len);
+
+            opt->code=(uint8_t)(128 + i);
+            opt->reserved=0;
+            opt->len=htons(16);
+            memset(opt->next_data, 0, 16);
+            len+=sizeof(*opt) + 16;
+        }
+    }
+
+    return len;
+}
+
+static void write_seed(const char *dir, const char *name, const char *buf,
+        size_t len)
+{
+    char path[1024];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    f=fopen(path, "wb");
+    TEST(f);
+    TEST(fwrite(buf, 1, len, f) == len);
+    fclose(f);
+}
+
+int main(int argc, char *argv[])
+{
+    pcp_ctx_t *ctx;
+    long iterations=DEFAULT_ITERATIONS;
+    const char *corpus_dir=NULL;
+    size_t n;
+    int i;
+
+    for (i=1; i < argc; ++i) {
+        if ((!strcmp(argv[i], "-n")) && (i + 1 < argc)) {
+            iterations=atol(argv[++i]);
+        } else if ((!strcmp(argv[i], "-c")) && (i + 1 < argc)) {
+            corpus_dir=argv[++i];
+        } else {
+            printf("usage: %s [-n iterations] [-c corpus_dir]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (iterations <= 0) {
+        iterations=1;
+    }
+    pcp_log_level=PCP_LOGLVL_NONE;
+
+    ctx=pcp_init(DISABLE_AUTODISCOVERY, NULL);
+    TEST(ctx);
+
+    printf("%-18s %5s %12s %12s %12s\n", "case", "bytes", "encode ns",
+            "validate ns", "parse ns");
+
+    for (n=0; n < CASES_COUNT; ++n) {
+        const struct bench_case *c=cases + n;
+        struct pcp_flow_s fs;
+        pcp_recv_msg_t msg;
+        char req[PCP_MAX_LEN];
+        char resp[PCP_MAX_LEN];
+        struct timeval start;
+        double enc_ns, val_ns, parse_ns;
+        size_t req_len, resp_len;
+        long it;
+
+        init_flow(ctx, &fs, c);
+
+        gettimeofday(&start, NULL);
+        for (it=0; it < iterations; ++it) {
+            req_len=build_pcp_msg(&fs, req, sizeof(req));
+        }
+        enc_ns=elapsed_ns(&start, iterations);
+        TEST(req_len != 0);
+
+        memcpy(resp, req, req_len);
+        resp_len=make_response(c, resp, req_len);
+        if (corpus_dir) {
+            write_seed(corpus_dir, c->name, resp, resp_len);
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.pcp_msg_buffer=resp;
+        msg.pcp_msg_len=(uint32_t)resp_len;
+
+        gettimeofday(&start, NULL);
+        for (it=0; it < iterations; ++it) {
+            TEST(validate_pcp_msg(&msg));
+        }
+        val_ns=elapsed_ns(&start, iterations);
+
+        gettimeofday(&start, NULL);
+        for (it=0; it < iterations; ++it) {
+            TEST(parse_response(&msg) == PCP_ERR_SUCCESS);
+        }
+        parse_ns=elapsed_ns(&start, iterations);
+
+        printf("%-18s %5u %12.1f %12.1f %12.1f\n", c->name,
+                (unsigned)resp_len, enc_ns, val_ns, parse_ns);
+    }
+    printf("%ld iterations per case; Mmsg/s = 1000 / ns\n", iterations);
+
+    pcp_terminate(ctx, 1);
+    free(ctx);
+
+    return 0;
+}
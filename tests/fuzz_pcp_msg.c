@@ -0,0 +1,201 @@
+/*
+ *------------------------------------------------------------------
+ * fuzz_pcp_msg.c
+ *
+ * Fuzz driver of response validation and parsing (validate_pcp_msg,
+ * parse_response).
+ *
+ * Built with -DPCP_FUZZ_LIBFUZZER and -fsanitize=fuzzer it's a libFuzzer
+ * target, seed corpus is in tests/fuzz_corpus/pcp_msg:
+ *   fuzz_pcp_msg tests/fuzz_corpus/pcp_msg
+ * Otherwise it runs inputs given as files or directories on command line;
+ * without arguments it runs pseudo-random inputs derived from valid
+ * response headers, which is part of the test suite.
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include "pcp.h"
+#include "pcp_utils.h"
+#include "pcp_msg.h"
+#include "test_macro.h"
+
+#define RANDOM_INPUTS 200000
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    pcp_recv_msg_t msg;
+    char *buf;
+
+    // longer datagrams are truncated by recvfrom
+    if (size > PCP_MAX_LEN) {
+        size=PCP_MAX_LEN;
+    }
+
+    // exact size, so sanitizers see any read past the datagram
+    buf=(char *)malloc(size ? size : 1);
+    TEST(buf);
+    memcpy(buf, data, size);
+    msg.pcp_msg_buffer=buf;
+    msg.pcp_msg_len=(uint32_t)size;
+
+    if ((validate_pcp_msg(&msg))
+            && (parse_response(&msg) == PCP_ERR_SUCCESS)) {
+        // option data was copied out of the exactly sized buffer
+        TEST((msg.filter_cnt != 0) == ((msg.opt_flags & optf_filter) != 0));
+    }
+
+    free(buf);
+    return 0;
+}
+
+#ifndef PCP_FUZZ_LIBFUZZER
+
+static uint32_t rnd_state=0x2545F491;
+
+static uint32_t rnd(void)
+{
+    rnd_state^=rnd_state << 13;
+    rnd_state^=rnd_state >> 17;
+    rnd_state^=rnd_state << 5;
+    return rnd_state;
+}
+
+/* random datagram, mostly with plausible header and option headers */
+static size_t random_input(uint8_t *buf)
+{
+    static const uint8_t opcodes[]={0, 1, 2, 3, 0x7f};
+    // option codes with their valid lengths
+    static const uint8_t opt_codes[]={PCP_OPTION_3RD_PARTY,
+            PCP_OPTION_PREF_FAIL, PCP_OPTION_FILTER, PCP_OPTION_FLOW_PRIORITY,
+            PCP_OPTION_METADATA, 0x80};
+    static const uint16_t opt_lens[]={16, 0, 20, 4, 12, 3};
+    size_t len, pos, i;
+
+    len=rnd() % (PCP_MAX_LEN + 1);
+    if (rnd() & 1) {
+        len&=~3u;
+    }
+    for (i=0; i < len; ++i) {
+        buf[i]=(uint8_t)rnd();
+    }
+    if (len < 4) {
+        return len;
+    }
+
+    buf[0]=(uint8_t)(rnd() % 4);
+    buf[1]=0x80 | opcodes[rnd() % sizeof(opcodes)];
+    if (rnd() & 1) {
+        buf[3]=0;
+    }
+
+    // chain of options after MAP/PEER payload of random size
+    pos=sizeof(pcp_response_t) + (rnd() % 4) * 12 + 36;
+    while (pos + sizeof(pcp_options_hdr_t) <= len) {
+        pcp_options_hdr_t *opt=(pcp_options_hdr_t *)(buf + pos);
+        size_t o=rnd() % sizeof(opt_codes);
+        uint16_t opt_len=(uint16_t)(rnd() % 8 ? opt_lens[o] : rnd() % 24);
+
+        opt->code=opt_codes[o];
+        opt->len=htons(opt_len);
+        pos+=sizeof(*opt) + ((opt_len + 3) & ~3u);
+
+        // end the datagram right after the option
+        if ((pos <= len) && (rnd() % 4 == 0)) {
+            return pos;
+        }
+    }
+
+    return len;
+}
+
+static int run_file(const char *path)
+{
+    uint8_t buf[PCP_MAX_LEN];
+    size_t len;
+    FILE *f;
+
+    f=fopen(path, "rb");
+    if (!f) {
+        printf("Cannot open %s\n", path);
+        return 1;
+    }
+    len=fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+
+    return LLVMFuzzerTestOneInput(buf, len);
+}
+
+static int run_path(const char *path)
+{
+#ifndef WIN32
+    struct stat st;
+    DIR *d;
+    struct dirent *e;
+    int ret=0;
+
+    if ((stat(path, &st) == 0) && (S_ISDIR(st.st_mode))) {
+        d=opendir(path);
+        if (!d) {
+            return 1;
+        }
+        while ((e=readdir(d)) != NULL) {
+            char file[1024];
+
+            if (e->d_name[0] == '.') {
+                continue;
+            }
+            snprintf(file, sizeof(file), "%s/%s", path, e->d_name);
+            ret|=run_file(file);
+        }
+        closedir(d);
+        return ret;
+    }
+#endif
+    return run_file(path);
+}
+
+int main(int argc, char *argv[])
+{
+    uint8_t buf[PCP_MAX_LEN];
+    int ret=0;
+    int i;
+
+    pcp_log_level=PCP_LOGLVL_NONE;
+
+    if (argc > 1) {
+        for (i=1; i < argc; ++i) {
+            ret|=run_path(argv[i]);
+        }
+        return ret;
+    }
+
+    for (i=0; i < RANDOM_INPUTS; ++i) {
+        LLVMFuzzerTestOneInput(buf, random_input(buf));
+    }
+    printf("Fuzzing of PCP response parser with %d inputs passed.\n",
+            RANDOM_INPUTS);
+
+    return 0;
+}
+
+#endif
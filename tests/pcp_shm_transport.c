@@ -0,0 +1,438 @@
+/*
+ *------------------------------------------------------------------
+ * pcp_shm_transport.c
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "pcp.h"
+#include "pcp_msg_structs.h"
+#include "pcp_utils.h"
+#include "pcp_socket.h"
+#include "pcp_server_resp.h"
+#include "pcp_shm_transport.h"
+
+#define SHM_LOAD(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define SHM_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+#define SHM_CACHE_LINE 64
+#define SHM_MAX_SOCKETS 64
+
+typedef struct shm_slot {
+    uint32_t len;
+    socklen_t addrlen;
+    //destination of request, source of response
+    struct sockaddr_storage addr;
+    char buf[PCP_MAX_LEN];
+} shm_slot_t;
+
+/*
+ * Indexes run freely and are masked on access. Each side keeps last seen
+ * index of the other one on its own cache line, so the shared index is
+ * read only when the cached one says ring is full/empty.
+ */
+typedef struct shm_ring {
+    uint32_t head;          //next slot to consume, written by consumer
+    uint32_t tail_cache;    //consumer's copy of tail
+    char pad1[SHM_CACHE_LINE - 2 * sizeof(uint32_t)];
+    uint32_t tail;          //next slot to produce, written by producer
+    uint32_t head_cache;    //producer's copy of head
+    char pad2[SHM_CACHE_LINE - 2 * sizeof(uint32_t)];
+    uint32_t mask;
+    shm_slot_t *slots;
+} shm_ring_t;
+
+struct pcp_shm {
+    shm_ring_t to_server;
+    shm_ring_t to_client;
+    int notify;
+    PCP_SOCKET notify_fd;   //first socket of the transport
+    pcp_shm_stats_t stats;
+};
+
+static pcp_shm_t *shm_pending;
+static struct {
+    PCP_SOCKET fd;
+    pcp_shm_t *shm;
+} shm_sockets[SHM_MAX_SOCKETS];
+
+/* free slots for producer, up to want */
+static uint32_t ring_free(shm_ring_t *r, uint32_t want)
+{
+    uint32_t size=r->mask + 1;
+
+    if (size - (r->tail - r->head_cache) < want) {
+        r->head_cache=SHM_LOAD(&r->head);
+    }
+    size-=r->tail - r->head_cache;
+    return size < want ? size : want;
+}
+
+/* queued slots for consumer, up to want */
+static uint32_t ring_avail(shm_ring_t *r, uint32_t want)
+{
+    uint32_t n=r->tail_cache - r->head;
+
+    if (n < want) {
+        r->tail_cache=SHM_LOAD(&r->tail);
+        n=r->tail_cache - r->head;
+    }
+    return n < want ? n : want;
+}
+
+static shm_slot_t *ring_slot(shm_ring_t *r, uint32_t idx)
+{
+    return r->slots + (idx & r->mask);
+}
+
+static int ring_init(shm_ring_t *r, uint32_t slots)
+{
+    uint32_t size=16;
+
+    while (size < slots) {
+        size<<=1;
+    }
+    memset(r, 0, sizeof(*r));
+    r->mask=size - 1;
+    r->slots=(shm_slot_t *)calloc(size, sizeof(*r->slots));
+    return r->slots != NULL;
+}
+
+static pcp_shm_t *shm_lookup(PCP_SOCKET fd)
+{
+    int i;
+
+    for (i=0; i < SHM_MAX_SOCKETS; ++i) {
+        if ((shm_sockets[i].shm) && (shm_sockets[i].fd == fd)) {
+            return shm_sockets[i].shm;
+        }
+    }
+    return NULL;
+}
+
+static void shm_signal(pcp_shm_t *shm)
+{
+#ifdef __linux__
+    uint64_t one=1;
+
+    if (write(shm->notify_fd, &one, sizeof(one)) < 0) {
+        perror("shm notify");
+    }
+#else
+    (void)shm;
+#endif
+}
+
+static void shm_clear_signal(pcp_shm_t *shm)
+{
+#ifdef __linux__
+    uint64_t cnt;
+
+    // fails with EAGAIN if not signaled
+    if (read(shm->notify_fd, &cnt, sizeof(cnt)) < 0) {
+        return;
+    }
+#else
+    (void)shm;
+#endif
+}
+
+static PCP_SOCKET shm_sock_create(int domain UNUSED, int type UNUSED,
+        int protocol UNUSED)
+{
+    PCP_SOCKET fd;
+    int i;
+
+    if (!shm_pending) {
+        return PCP_INVALID_SOCKET;
+    }
+    // real descriptor, so socket can be passed to poll and select
+#ifdef __linux__
+    fd=eventfd(0, EFD_NONBLOCK);
+#else
+    fd=socket(AF_INET, SOCK_DGRAM, 0);
+#endif
+    if (fd == PCP_INVALID_SOCKET) {
+        return PCP_INVALID_SOCKET;
+    }
+    for (i=0; i < SHM_MAX_SOCKETS; ++i) {
+        if (!shm_sockets[i].shm) {
+            shm_sockets[i].fd=fd;
+            shm_sockets[i].shm=shm_pending;
+            if (shm_pending->notify_fd == PCP_INVALID_SOCKET) {
+                shm_pending->notify_fd=fd;
+            }
+            return fd;
+        }
+    }
+    close(fd);
+    return PCP_INVALID_SOCKET;
+}
+
+static int shm_sock_close(PCP_SOCKET sockfd)
+{
+    int i;
+
+    for (i=0; i < SHM_MAX_SOCKETS; ++i) {
+        if ((shm_sockets[i].shm) && (shm_sockets[i].fd == sockfd)) {
+            if (shm_sockets[i].shm->notify_fd == sockfd) {
+                shm_sockets[i].shm->notify_fd=PCP_INVALID_SOCKET;
+            }
+            shm_sockets[i].shm=NULL;
+            break;
+        }
+    }
+    return close(sockfd);
+}
+
+static int shm_sock_sendmmsg(PCP_SOCKET sockfd, pcp_sock_msg_t *msgs,
+        unsigned cnt, int flags UNUSED)
+{
+    pcp_shm_t *shm=shm_lookup(sockfd);
+    shm_ring_t *r;
+    uint32_t i, n;
+
+    if (!shm) {
+        return PCP_ERR_SEND_FAILED;
+    }
+    r=&shm->to_server;
+    n=ring_free(r, cnt);
+    for (i=0; i < n; ++i) {
+        shm_slot_t *s=ring_slot(r, r->tail + i);
+        size_t len=msgs[i].len;
+
+        if (len > sizeof(s->buf)) {
+            len=sizeof(s->buf);
+        }
+        memcpy(s->buf, msgs[i].buf, len);
+        s->len=(uint32_t)len;
+        s->addrlen=0;
+        if ((msgs[i].addr) && (msgs[i].addrlen <= sizeof(s->addr))) {
+            memcpy(&s->addr, msgs[i].addr, msgs[i].addrlen);
+            s->addrlen=msgs[i].addrlen;
+        }
+    }
+    SHM_STORE(&r->tail, r->tail + n);
+    shm->stats.tx_full+=cnt - n;
+
+    return n ? (int)n : PCP_ERR_WOULDBLOCK;
+}
+
+static int shm_sock_recvmmsg(PCP_SOCKET sockfd, pcp_sock_msg_t *msgs,
+        unsigned cnt, int flags UNUSED)
+{
+    pcp_shm_t *shm=shm_lookup(sockfd);
+    shm_ring_t *r;
+    uint32_t i, n;
+
+    if (!shm) {
+        return PCP_ERR_RECV_FAILED;
+    }
+    // cleared before ring is checked, so response queued after the check
+    // leaves socket readable
+    if ((shm->notify) && (sockfd == shm->notify_fd)) {
+        shm_clear_signal(shm);
+    }
+    r=&shm->to_client;
+    n=ring_avail(r, cnt);
+    for (i=0; i < n; ++i) {
+        shm_slot_t *s=ring_slot(r, r->head + i);
+        size_t len=s->len;
+
+        if (len > msgs[i].len) {
+            len=msgs[i].len;
+        }
+        memcpy(msgs[i].buf, s->buf, len);
+        msgs[i].len=len;
+        if ((msgs[i].addr) && (msgs[i].addrlen >= s->addrlen)) {
+            memcpy(msgs[i].addr, &s->addr, s->addrlen);
+            msgs[i].addrlen=s->addrlen;
+        }
+        msgs[i].controllen=0;
+        msgs[i].flags=0;
+    }
+    SHM_STORE(&r->head, r->head + n);
+    shm->stats.rx_msgs+=n;
+
+    return n ? (int)n : PCP_ERR_WOULDBLOCK;
+}
+
+static ssize_t shm_sock_sendto(PCP_SOCKET sockfd, const void *buf, size_t len,
+        int flags, struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    pcp_sock_msg_t m;
+    int ret;
+
+    memset(&m, 0, sizeof(m));
+    m.buf=(void *)buf;
+    m.len=len;
+    m.addr=dest_addr;
+    m.addrlen=addrlen;
+    ret=shm_sock_sendmmsg(sockfd, &m, 1, flags);
+
+    return ret == 1 ? (ssize_t)len : ret;
+}
+
+static ssize_t shm_sock_recvfrom(PCP_SOCKET sockfd, void *buf, size_t len,
+        int flags, struct sockaddr *src_addr, socklen_t *addrlen)
+{
+    pcp_sock_msg_t m;
+    int ret;
+
+    memset(&m, 0, sizeof(m));
+    m.buf=buf;
+    m.len=len;
+    m.addr=src_addr;
+    m.addrlen=addrlen ? *addrlen : 0;
+    ret=shm_sock_recvmmsg(sockfd, &m, 1, flags);
+    if (ret != 1) {
+        return ret;
+    }
+    if (addrlen) {
+        *addrlen=m.addrlen;
+    }
+
+    return (ssize_t)m.len;
+}
+
+static pcp_socket_vt_ext_t shm_socket_vt={
+        {
+            shm_sock_create,
+            shm_sock_recvfrom,
+            shm_sock_sendto,
+            shm_sock_close
+        },
+        PCP_SOCKET_VT_EXT_VERSION,
+        shm_sock_sendmmsg,
+        shm_sock_recvmmsg
+};
+
+pcp_shm_t *pcp_shm_create(uint32_t slots, int notify)
+{
+    pcp_shm_t *shm=(pcp_shm_t *)calloc(1, sizeof(*shm));
+
+    if (!shm) {
+        return NULL;
+    }
+    if ((!ring_init(&shm->to_server, slots))
+            || (!ring_init(&shm->to_client, slots))) {
+        pcp_shm_destroy(shm);
+        return NULL;
+    }
+#ifdef __linux__
+    shm->notify=notify;
+#else
+    (void)notify;
+#endif
+    shm->notify_fd=PCP_INVALID_SOCKET;
+
+    return shm;
+}
+
+void pcp_shm_destroy(pcp_shm_t *shm)
+{
+    int i;
+
+    if (!shm) {
+        return;
+    }
+    for (i=0; i < SHM_MAX_SOCKETS; ++i) {
+        if (shm_sockets[i].shm == shm) {
+            shm_sockets[i].shm=NULL;
+        }
+    }
+    if (shm_pending == shm) {
+        shm_pending=NULL;
+    }
+    free(shm->to_server.slots);
+    free(shm->to_client.slots);
+    free(shm);
+}
+
+pcp_socket_vt_t *pcp_shm_socket_vt(pcp_shm_t *shm)
+{
+    shm_pending=shm;
+
+    return &shm_socket_vt.base;
+}
+
+unsigned pcp_shm_serve(pcp_shm_t *shm, const server_info_t *info,
+        unsigned max)
+{
+    static server_info_t default_info;
+    shm_ring_t *req=&shm->to_server;
+    shm_ring_t *resp=&shm->to_client;
+    uint32_t i, n;
+
+    if (!info) {
+        if (!default_info.server_version) {
+            default_info.server_version=2;
+            default_info.default_result_code=255;
+            default_info.epoch_time_start=time(NULL);
+            S6_ADDR32(&default_info.ext_ip)[2]=htonl(0xFFFF);
+            S6_ADDR32(&default_info.ext_ip)[3]=htonl(0xC0000201);
+        }
+        info=&default_info;
+    }
+
+    n=ring_avail(req, max ? max : req->mask + 1);
+    n=ring_free(resp, n);
+    for (i=0; i < n; ++i) {
+        shm_slot_t *q=ring_slot(req, req->head + i);
+        shm_slot_t *s=ring_slot(resp, resp->tail + i);
+        int result;
+
+        // response is built in place of request copy, as by pcp-server
+        memcpy(s->buf, q->buf, q->len);
+        s->len=q->len;
+        s->addr=q->addr;
+        s->addrlen=q->addrlen;
+
+        result=pcp_server_check_request(s->buf, (int)s->len,
+                info->server_version);
+        if (info->default_result_code != 255) {
+            result=info->default_result_code;
+        }
+        if (s->len < sizeof(pcp_response_t)) {
+            memset(s->buf + s->len, 0, sizeof(pcp_response_t) - s->len);
+            s->len=sizeof(pcp_response_t);
+        }
+        pcp_server_create_response(s->buf, result, info);
+    }
+    SHM_STORE(&req->head, req->head + n);
+    SHM_STORE(&resp->tail, resp->tail + n);
+    shm->stats.requests+=n;
+
+    if ((n) && (shm->notify) && (shm->notify_fd != PCP_INVALID_SOCKET)) {
+        shm_signal(shm);
+    }
+
+    return n;
+}
+
+void pcp_shm_get_stats(pcp_shm_t *shm, pcp_shm_stats_t *stats)
+{
+    *stats=shm->stats;
+}
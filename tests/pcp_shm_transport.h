@@ -0,0 +1,61 @@
+/*
+ *------------------------------------------------------------------
+ * pcp_shm_transport.h
+ *
+ * In-process transport for tests and benchmarks - extended socket virtual
+ * table backed by pair of lock-free single producer single consumer rings
+ * (requests to server, responses to client), and simulated PCP server
+ * answering requests from the ring by request logic of pcp-server.
+ * Library thread produces requests and consumes responses, server side may
+ * run in another thread.
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifndef PCP_SHM_TRANSPORT_H_
+#define PCP_SHM_TRANSPORT_H_
+
+#include <stdint.h>
+
+#include "pcp.h"
+#include "pcp_server_resp.h"
+
+typedef struct pcp_shm pcp_shm_t;
+
+typedef struct pcp_shm_stats {
+    uint64_t requests;      //requests answered by simulated server
+    uint64_t tx_full;       //requests refused because ring was full
+    uint64_t rx_msgs;       //responses received by library
+} pcp_shm_stats_t;
+
+/*
+ * Create transport with rings of at least slots datagrams.
+ *    notify - socket is Linux eventfd readable while responses are queued,
+ *             so it can be polled; otherwise caller runs pcp_process itself
+ */
+pcp_shm_t *pcp_shm_create(uint32_t slots, int notify);
+
+/* only after contexts using the transport were terminated */
+void pcp_shm_destroy(pcp_shm_t *shm);
+
+/*
+ * Socket virt. table for pcp_init with PCP_INIT_SOCKET_VT_EXT; sockets
+ * created by the next pcp_init are bound to shm. Not thread safe.
+ */
+pcp_socket_vt_t *pcp_shm_socket_vt(pcp_shm_t *shm);
+
+/*
+ * Simulated PCP server - answers up to max queued requests (0 => all) of
+ * any PCP server address, as pcp-server with given info would (NULL =>
+ * version 2, result by request checks). Stops when response ring is full.
+ *    return value - number of answered requests
+ */
+unsigned pcp_shm_serve(pcp_shm_t *shm, const server_info_t *info,
+        unsigned max);
+
+void pcp_shm_get_stats(pcp_shm_t *shm, pcp_shm_stats_t *stats);
+
+#endif /* PCP_SHM_TRANSPORT_H_ */
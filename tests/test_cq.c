@@ -0,0 +1,243 @@
+/*
+ *------------------------------------------------------------------
+ * test_cq.c
+ *
+ * Test of per-context completion queue - records for succeeded, failed,
+ * renewed and changed mappings, overflow accounting and concurrent reaping.
+ * Context talks to in-process responder (socket virtual table).
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pcp.h"
+#include "pcp_socket.h"
+#include "unp.h"
+#include "pcp_utils.h"
+#include "test_macro.h"
+#include "test_responder.h"
+
+#ifdef PCP_USE_THREADS
+#include <pthread.h>
+#endif
+
+#define FLOWS 40
+#define REAPERS 4
+
+#define RESULT_NOT_AUTHORIZED 2
+
+static test_responder_t responder;
+
+// MAP v2 responder, internal ports >= 5000 are refused
+static int refuse_high_ports(test_responder_t *r UNUSED, const char *req,
+        size_t len UNUSED)
+{
+    uint16_t int_port;
+
+    memcpy(&int_port, req + PCP_HDR_LEN + 16, sizeof(int_port));
+    return ntohs(int_port) >= 5000 ? RESULT_NOT_AUTHORIZED : PCP_RES_SUCCESS;
+}
+
+static pcp_ctx_t *ctx;
+static int flow_ids[FLOWS];
+static int events[FLOWS][pcp_cq_mapping_changed + 1];
+static int reaped;
+static int done;
+
+static void create_flows(pcp_flow_t **flows, int first, int cnt,
+        uint16_t port_base, uint32_t lifetime)
+{
+    int i;
+
+    for (i=first; i < first + cnt; ++i) {
+        struct sockaddr_in src;
+
+        memset(&src, 0, sizeof(src));
+        src.sin_family=AF_INET;
+        src.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+        src.sin_port=htons(port_base + i);
+        flow_ids[i]=i;
+        flows[i]=pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL,
+                IPPROTO_UDP, lifetime, &flow_ids[i]);
+        TEST(flows[i]);
+    }
+}
+
+static void account(const pcp_completion_t *c, size_t n)
+{
+    size_t i;
+
+    for (i=0; i < n; ++i) {
+        int id=*(int *)c[i].user_data;
+
+        TEST((id >= 0) && (id < FLOWS));
+        TEST(c[i].event <= pcp_cq_mapping_changed);
+        __atomic_add_fetch(&events[id][c[i].event], 1, __ATOMIC_SEQ_CST);
+        if (c[i].event == pcp_cq_failed) {
+            TEST(c[i].result_code == RESULT_NOT_AUTHORIZED);
+        } else {
+            TEST(c[i].result_code == 0);
+            TEST(IN6_ARE_ADDR_EQUAL(&c[i].ext_ip, &responder.info.ext_ip));
+            TEST(c[i].lifetime_end > time(NULL));
+        }
+    }
+    __atomic_add_fetch(&reaped, (int)n, __ATOMIC_SEQ_CST);
+}
+
+#ifdef PCP_USE_THREADS
+static void *reaper(void *arg UNUSED)
+{
+    pcp_completion_t c[4];
+    struct pollfd pfd;
+
+    pfd.fd=pcp_cq_get_fd(ctx);
+    pfd.events=POLLIN;
+
+    while (!__atomic_load_n(&done, __ATOMIC_SEQ_CST)) {
+        size_t n;
+
+        if (poll(&pfd, 1, 10) <= 0) {
+            continue;
+        }
+        // small buffer => records are split among reapers
+        while ((n=pcp_cq_reap(ctx, c, sizeof(c) / sizeof(*c))) > 0) {
+            account(c, n);
+        }
+    }
+
+    return NULL;
+}
+#endif
+
+static void pulse_until(int expected)
+{
+    int pulses;
+
+    for (pulses=0; (__atomic_load_n(&reaped, __ATOMIC_SEQ_CST) < expected)
+            && (pulses < 5000); ++pulses) {
+#ifndef PCP_USE_THREADS
+        pcp_completion_t c[16];
+        size_t n;
+
+        while ((n=pcp_cq_reap(ctx, c, 16)) > 0) {
+            account(c, n);
+        }
+#endif
+        pcp_pulse(ctx, NULL);
+        usleep(2000);
+    }
+    TEST(__atomic_load_n(&reaped, __ATOMIC_SEQ_CST) == expected);
+}
+
+int main(int argc, char *argv[] UNUSED)
+{
+    pcp_flow_t *flows[FLOWS];
+    pcp_completion_t c[FLOWS];
+    struct pollfd pfd;
+    int i;
+#ifdef PCP_USE_THREADS
+    pthread_t reapers[REAPERS];
+#endif
+
+    pcp_log_level=argc > 1 ? PCP_LOGLVL_DEBUG : PCP_LOGLVL_NONE;
+    test_resp_init(&responder);
+    responder.on_request=refuse_high_ports;
+    test_responder=&responder;
+
+    // disabled queue
+    ctx=pcp_init(DISABLE_AUTODISCOVERY, &test_responder_vt);
+    TEST(ctx);
+    TEST(pcp_cq_reap(ctx, c, FLOWS) == 0);
+    TEST(pcp_cq_overflow(ctx) == 0);
+
+    // overflow - nobody reaps, ring of 16 records
+    TEST(pcp_cq_init(ctx, 10) == PCP_ERR_SUCCESS);
+    TEST(pcp_cq_init(ctx, 10) == PCP_ERR_BAD_ARGS);
+    TEST(pcp_add_server(ctx, Sock_pton("127.0.0.1:5351"), 2) == 0);
+    create_flows(flows, 0, FLOWS, 4000, 100);
+    // pcp_wait would select on real socket, responder doesn't use it
+    for (i=0; i < 100; ++i) {
+        pcp_pulse(ctx, NULL);
+    }
+    for (i=0; i < FLOWS; ++i) {
+        pcp_fstate_e st;
+
+        pcp_eval_flow_state(flows[i], &st);
+        TEST(st == pcp_state_succeeded);
+    }
+    TEST(pcp_cq_overflow(ctx) == FLOWS - 16);
+    pfd.fd=pcp_cq_get_fd(ctx);
+    pfd.events=POLLIN;
+    TEST(poll(&pfd, 1, 0) == 1);
+    TEST(pcp_cq_reap(ctx, c, FLOWS) == 16);
+    TEST(poll(&pfd, 1, 0) == 0);
+    pcp_terminate(ctx, 0);
+    free(ctx);
+
+    responder.head=responder.tail=0;
+    ctx=pcp_init(DISABLE_AUTODISCOVERY, &test_responder_vt);
+    TEST(ctx);
+    TEST(pcp_cq_init(ctx, 0) == PCP_ERR_SUCCESS);
+    TEST(pcp_add_server(ctx, Sock_pton("127.0.0.1:5351"), 2) == 0);
+
+#ifdef PCP_USE_THREADS
+    for (i=0; i < REAPERS; ++i) {
+        TEST(pthread_create(&reapers[i], NULL, reaper, NULL) == 0);
+    }
+#endif
+
+    // half of flows is refused by server, others succeed
+    create_flows(flows, 0, FLOWS / 2, 4000, 6);
+    create_flows(flows, FLOWS / 2, FLOWS / 2, 5000, 6);
+    pulse_until(FLOWS);
+
+    // renewal at half of 6s lifetime, then with different external address;
+    // renewal less than 2s before expiry (whole seconds) would resend request
+    pulse_until(FLOWS + FLOWS / 2);
+    S6_ADDR32(&responder.info.ext_ip)[3]=htonl(0x0A000002);
+    pulse_until(FLOWS + FLOWS);
+
+    done=1;
+#ifdef PCP_USE_THREADS
+    for (i=0; i < REAPERS; ++i) {
+        pthread_join(reapers[i], NULL);
+    }
+#endif
+
+    for (i=0; i < FLOWS / 2; ++i) {
+        TEST(events[i][pcp_cq_succeeded] == 1);
+        TEST(events[i][pcp_cq_renewed] == 1);
+        TEST(events[i][pcp_cq_mapping_changed] == 1);
+        TEST(events[i][pcp_cq_failed] == 0);
+    }
+    for (i=FLOWS / 2; i < FLOWS; ++i) {
+        TEST(events[i][pcp_cq_failed] == 1);
+        TEST(events[i][pcp_cq_succeeded] == 0);
+    }
+    TEST(pcp_cq_overflow(ctx) == 0);
+
+    pcp_terminate(ctx, 0);
+    free(ctx);
+
+    printf("Test of PCP completion queue passed.\n");
+    return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ *------------------------------------------------------------------
+ * test_dual_stack.c
+ *
+ * Test of runtime choice between one dual-stack socket and separate IPv4
+ * and IPv6 only sockets (PCP_INIT_SOCKET_SEPARATE_AF) - IPv4 and IPv6
+ * servers work side by side in both cases, each of separate sockets talks
+ * to servers of its family only.
+ * Servers are simulated by in-process responders on UDP sockets.
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pcp.h"
+#include "pcp_socket.h"
+#include "unp.h"
+#include "pcp_utils.h"
+#include "test_macro.h"
+#include "test_responder.h"
+
+#define SERVERS 2 //IPv4 and IPv6 one
+#define FLOWS 10  //per server
+#define PORT_BASE 10000
+#define RESP_PORT 15361
+#define MAX_FDS 8
+
+static test_udp_responder_t resp[SERVERS];
+
+static uint16_t sock_port(PCP_SOCKET s, int *af)
+{
+    struct sockaddr_storage ss;
+    socklen_t len=sizeof(ss);
+
+    TEST(getsockname(s, (struct sockaddr *)&ss, &len) == 0);
+    if (af) {
+        *af=ss.ss_family;
+    }
+    return ss.ss_family == AF_INET6 ? ((struct sockaddr_in6 *)&ss)->sin6_port :
+            ((struct sockaddr_in *)&ss)->sin_port;
+}
+
+static void run(uint32_t flags)
+{
+    pcp_ctx_t *ctx;
+    pcp_flow_t *flows[SERVERS * FLOWS];
+    pcp_pollfd_t pfds[MAX_FDS];
+    struct pollfd fds[MAX_FDS];
+    int i, n, tout, af, succeeded=0;
+    int separate=(flags & PCP_INIT_SOCKET_SEPARATE_AF) != 0;
+    int per_server=(flags & PCP_INIT_SOCKET_PER_SERVER) != 0;
+
+    ctx=pcp_init(DISABLE_AUTODISCOVERY | flags, NULL);
+    TEST(ctx);
+    n=pcp_get_pollfds(ctx, pfds, MAX_FDS);
+    TEST(n == 1 + separate);
+    sock_port(pfds[0].fd, &af);
+    TEST(af == (separate ? AF_INET : AF_INET6));
+    TEST(pfds[0].fd == pcp_get_socket(ctx));
+    if (separate) {
+        int v6only=0;
+        socklen_t len=sizeof(v6only);
+
+        sock_port(pfds[1].fd, &af);
+        TEST(af == AF_INET6);
+        TEST(getsockopt(pfds[1].fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only,
+                &len) == 0);
+        TEST(v6only);
+    }
+
+    TEST(pcp_add_server(ctx, Sock_pton("127.0.0.1:15361"), 2) == 0);
+    TEST(pcp_add_server(ctx, Sock_pton("[::1]:15361"), 2) == 1);
+
+    n=pcp_get_pollfds(ctx, pfds, MAX_FDS);
+    TEST(n == 1 + separate + (per_server ? SERVERS : 0));
+    for (i=0; i < n; ++i) {
+        fds[i].fd=pfds[i].fd;
+        fds[i].events=POLLIN;
+    }
+
+    for (i=0; i < SERVERS * FLOWS; ++i) {
+        struct sockaddr_storage src;
+
+        memset(&src, 0, sizeof(src));
+        if (i < FLOWS) {
+            struct sockaddr_in *sin=(struct sockaddr_in *)&src;
+
+            sin->sin_family=AF_INET;
+            sin->sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+            sin->sin_port=htons(PORT_BASE + i);
+        } else {
+            struct sockaddr_in6 *sin6=(struct sockaddr_in6 *)&src;
+
+            sin6->sin6_family=AF_INET6;
+            sin6->sin6_addr=in6addr_loopback;
+            sin6->sin6_port=htons(PORT_BASE + i);
+        }
+        flows[i]=pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL,
+                IPPROTO_TCP, 3600, NULL);
+        TEST(flows[i]);
+    }
+
+    tout=pcp_process(ctx, 0);
+    for (i=0; (succeeded < SERVERS * FLOWS) && (i < 100); ++i) {
+        int j, events=PCP_EV_TIMER;
+
+        for (j=0; j < SERVERS; ++j) {
+            test_udp_resp_run(resp + j);
+        }
+        TEST(poll(fds, n, tout < 0 || tout > 100 ? 100 : tout) >= 0);
+        for (j=0; j < n; ++j) {
+            if (fds[j].revents & POLLIN) {
+                events|=pfds[j].events;
+            }
+        }
+        tout=pcp_process(ctx, events);
+
+        succeeded=0;
+        for (j=0; j < SERVERS * FLOWS; ++j) {
+            pcp_fstate_e st;
+
+            pcp_eval_flow_state(flows[j], &st);
+            succeeded+=st == pcp_state_succeeded;
+        }
+    }
+    printf("flags %u: %d flows succeeded, requests IPv4 %d, IPv6 %d\n",
+            flags, succeeded, resp[0].requests, resp[1].requests);
+    TEST(succeeded == SERVERS * FLOWS);
+
+    for (i=0; i < SERVERS; ++i) {
+        TEST(resp[i].requests >= FLOWS);
+        resp[i].requests=0;
+    }
+    if (per_server) {
+        // own sockets of servers follow context sockets
+        for (i=0; i < SERVERS; ++i) {
+            TEST(resp[i].last_src_port
+                    == sock_port(pfds[1 + separate + i].fd, NULL));
+        }
+    } else if (separate) {
+        TEST(resp[0].last_src_port == sock_port(pfds[0].fd, NULL));
+        TEST(resp[1].last_src_port == sock_port(pfds[1].fd, NULL));
+    } else {
+        TEST(resp[0].last_src_port == sock_port(pfds[0].fd, NULL));
+        TEST(resp[1].last_src_port == sock_port(pfds[0].fd, NULL));
+    }
+
+    pcp_terminate(ctx, 0);
+    free(ctx);
+}
+
+int main(int argc, char *argv[] UNUSED)
+{
+    pcp_log_level=argc > 1 ? PCP_LOGLVL_DEBUG : PCP_LOGLVL_NONE;
+
+    TEST(test_udp_resp_open(resp, AF_INET, INADDR_LOOPBACK,
+            RESP_PORT));
+    if (!test_udp_resp_open(resp + 1, AF_INET6, 0, RESP_PORT)) {
+        printf("IPv6 loopback is not available, test skipped.\n");
+        close(resp[0].fd);
+        return 0;
+    }
+
+    run(0);
+    run(PCP_INIT_SOCKET_SEPARATE_AF);
+    run(PCP_INIT_SOCKET_SEPARATE_AF | PCP_INIT_SOCKET_PER_SERVER);
+
+    close(resp[0].fd);
+    close(resp[1].fd);
+
+    printf("Test of dual-stack and separate sockets passed.\n");
+    return 0;
+}
@@ -4,8 +4,20 @@
 #include "default_config.h"
 #endif
 
+#include <stdlib.h>
+
+static int fail_realloc;
+
+/* realloc of the state machine and API, fails on demand */
+static void *test_realloc(void *ptr, size_t size)
+{
+    return fail_realloc ? NULL : realloc(ptr, size);
+}
+
+#define realloc test_realloc
 #include "pcp_event_handler.c"
 #include "pcp_api.c"
+#undef realloc
 #include <stdio.h>
 #include <time.h>
 #include "test_macro.h"
@@ -30,6 +42,18 @@ int gettimeofday (struct timeval *__restrict __tv,
 void fill_in6_addr(struct in6_addr *dst_ip6, uint16_t *dst_port,
         struct sockaddr* src);
 
+static int batch_calls, lost_calls;
+
+static void batch_cb(pcp_ctx_t *c UNUSED, const pcp_flow_change_t *changes,
+        size_t count, void *cb_arg UNUSED)
+{
+    ++batch_calls;
+    if (count == 0) {
+        TEST(changes == NULL);
+        ++lost_calls;
+    }
+}
+
 int
 main(void)
 {
@@ -133,7 +157,106 @@ main(void)
         TEST(0!=compare_epochs(&msg, &s));
     }
 
-    //test 7
+    //test 7 - options sent by flow have to be echoed in success response
+    {
+        pcp_recv_msg_t msg;
+        pcp_flow_t *f;
+        pcp_flow_info_t *info;
+        size_t cnt;
+        struct sockaddr_in src, filter, srv;
+
+        memset(&src, 0, sizeof(src));
+        src.sin_family = AF_INET;
+        src.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        src.sin_port = htons(1234);
+        filter = src;
+        filter.sin_port = htons(80);
+        srv = src;
+        srv.sin_port = htons(5351);
+        TEST(pcp_add_server(ctx, (struct sockaddr *)&srv, 2) >= 0);
+        f = pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL,
+                IPPROTO_TCP, 100, NULL);
+        TEST(f);
+        pcp_flow_set_prefer_failure_opt(f);
+
+        memset(&msg, 0, sizeof(msg));
+        msg.recv_version = 2;
+        msg.recv_lifetime = 100;
+        msg.received_time = time(NULL);
+        f->state = pfs_wait_resp;
+        TEST(handle_flow_event(f, fev_res_success, &msg) == pfs_failed);
+        TEST(f->recv_result == PCP_RES_UNSUPP_OPTION);
+
+        msg.recv_result = PCP_RES_SUCCESS;
+        msg.opt_flags = optf_pref_fail | optf_flowp;
+        f->state = pfs_wait_resp;
+        TEST(handle_flow_event(f, fev_res_success, &msg)
+                == pfs_wait_for_lifetime_renew);
+        info = pcp_flow_get_info(f, &cnt);
+        TEST((info) && (cnt == 1));
+        TEST(info->result == pcp_state_succeeded);
+        TEST(info->accepted_opts
+                == (PCP_OPT_PREFER_FAILURE | PCP_OPT_FLOW_PRIORITY));
+        free(info);
+
+        // filter has to come back unchanged, only once
+        pcp_flow_set_filter_opt(f, (struct sockaddr *)&filter, 32);
+        msg.opt_flags = optf_pref_fail | optf_filter;
+        msg.filter_cnt = 1;
+        msg.filter_prefix = 32;
+        msg.filter_ip = f->filter_ip;
+        msg.filter_port = htons(81);
+        f->state = pfs_wait_resp;
+        TEST(handle_flow_event(f, fev_res_success, &msg) == pfs_failed);
+        msg.recv_result = PCP_RES_SUCCESS;
+        msg.filter_port = htons(80);
+        msg.filter_cnt = 2;
+        f->state = pfs_wait_resp;
+        TEST(handle_flow_event(f, fev_res_success, &msg) == pfs_failed);
+        msg.recv_result = PCP_RES_SUCCESS;
+        msg.filter_cnt = 1;
+        f->state = pfs_wait_resp;
+        TEST(handle_flow_event(f, fev_res_success, &msg)
+                == pfs_wait_for_lifetime_renew);
+
+        pcp_delete_flow(f);
+    }
+
+    //test 8 - change which can't be queued isn't reported from within
+    //state machine, flush reports it was lost
+    {
+        struct sockaddr_in src;
+        pcp_flow_t *f;
+
+        memset(&src, 0, sizeof(src));
+        src.sin_family = AF_INET;
+        src.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        src.sin_port = htons(1235);
+        f = pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL,
+                IPPROTO_TCP, 100, NULL);
+        TEST(f);
+        pcp_set_flow_change_batch_cb(ctx, batch_cb, NULL);
+
+        fail_realloc = 1;
+        flow_change_notify(f, pcp_state_failed);
+        fail_realloc = 0;
+        TEST(batch_calls == 0);
+        pcp_flow_changes_flush(ctx);
+        TEST((batch_calls == 1) && (lost_calls == 1));
+        pcp_flow_changes_flush(ctx);
+        TEST(batch_calls == 1);
+
+        // queued changes come first
+        flow_change_notify(f, pcp_state_succeeded);
+        ctx->flow_changes_lost = 1;
+        pcp_flow_changes_flush(ctx);
+        TEST((batch_calls == 3) && (lost_calls == 2));
+
+        pcp_set_flow_change_batch_cb(ctx, NULL, NULL);
+        pcp_delete_flow(f);
+    }
+
+    //test 9
 /*    printf("Testing retransmit delay calcul\n");
     int32_t r=0;
     int ii=0;
@@ -0,0 +1,141 @@
+/*
+ *------------------------------------------------------------------
+ * test_event_loop.c
+ *
+ * Test of reactor integration API (pcp_get_pollfds, pcp_process).
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pcp.h"
+#include "pcp_socket.h"
+#include "unp.h"
+#include "pcp_utils.h"
+#include "test_macro.h"
+
+static int status;
+
+static void notify_cb(pcp_flow_t *f UNUSED, struct sockaddr *src_addr UNUSED,
+        struct sockaddr *ext_addr, pcp_fstate_e s, void *cb_arg UNUSED)
+{
+    if (s == pcp_state_succeeded) {
+        TEST(ext_addr->sa_family == AF_INET);
+        TEST(((struct sockaddr_in*)ext_addr)->sin_addr.s_addr == 0x281e140a);
+        status=1;
+    }
+}
+
+// poll loop driven only by pcp_process - no timeout recalculation in app
+static int poll_loop(pcp_ctx_t *ctx, int use_timerfd)
+{
+    pcp_pollfd_t pfds[2];
+    struct pollfd fds[2];
+    int i, n, tout;
+    int iterations=0;
+
+    n=pcp_get_pollfds(ctx, pfds, 2);
+    TEST(n == (use_timerfd ? 2 : 1));
+    TEST(pfds[0].fd == pcp_get_socket(ctx));
+    TEST(pfds[0].events == PCP_EV_READ);
+
+    for (i=0; i < n; ++i) {
+        fds[i].fd=pfds[i].fd;
+        fds[i].events=POLLIN;
+    }
+
+    // new flow => deadline is now
+    tout=pcp_process(ctx, 0);
+    status=0;
+
+    while (status == 0) {
+        int events=0;
+
+        TEST(++iterations < 100);
+        if (use_timerfd) {
+            tout=-1;
+        }
+        TEST(poll(fds, n, tout) >= 0);
+        for (i=0; i < n; ++i) {
+            if (fds[i].revents & POLLIN) {
+                events|=pfds[i].events;
+            }
+        }
+        if (!use_timerfd) {
+            events|=PCP_EV_TIMER;
+        }
+        tout=pcp_process(ctx, events);
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[] UNUSED)
+{
+    struct sockaddr_storage source;
+    struct sockaddr_storage ext;
+    struct timeval deadline;
+    pcp_flow_t *flow;
+    pcp_ctx_t *ctx;
+    int use_timerfd;
+
+    pcp_log_level=argc > 1 ? PCP_LOGLVL_DEBUG : 1;
+
+    sock_pton("10.20.30.40", (struct sockaddr*)&ext);
+
+    TEST(pcp_process(NULL, PCP_EV_READ) == PCP_ERR_BAD_ARGS);
+    TEST(pcp_get_pollfds(NULL, NULL, 0) == PCP_ERR_BAD_ARGS);
+    TEST(pcp_get_deadline(NULL, &deadline) == PCP_ERR_BAD_ARGS);
+
+    for (use_timerfd=0; use_timerfd < 2; ++use_timerfd) {
+        ctx=pcp_init(DISABLE_AUTODISCOVERY, NULL);
+        TEST(ctx);
+        TEST(pcp_get_pollfds(ctx, NULL, 0) == 1);
+        if (use_timerfd) {
+            TEST(pcp_enable_timerfd(ctx) == PCP_ERR_SUCCESS);
+            TEST(pcp_get_pollfds(ctx, NULL, 0) == 2);
+        }
+
+        pcp_add_server(ctx, Sock_pton("127.0.0.1:5351"), 2);
+
+        // server is probed before first flow is created, then its
+        // retransmission is the next deadline
+        TEST(pcp_get_deadline(ctx, &deadline) == 0);
+        TEST(pcp_process(ctx, PCP_EV_READ | PCP_EV_TIMER) > 1000);
+
+        pcp_set_flow_change_cb(ctx, notify_cb, NULL);
+        sock_pton("127.0.0.1:1235", (struct sockaddr*)&source);
+        flow=pcp_new_flow(ctx, (struct sockaddr*)&source, NULL,
+                (struct sockaddr*)&ext, IPPROTO_TCP, 100, NULL);
+        TEST(flow);
+        // flow waits for response of the probe, it's not sent again now
+        TEST(pcp_get_deadline(ctx, &deadline) > 1000);
+
+        TEST(poll_loop(ctx, use_timerfd) == 0);
+
+        // flow succeeded => next deadline is lifetime renewal
+        TEST(pcp_get_deadline(ctx, &deadline) > 1000);
+
+        pcp_terminate(ctx, 0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ *------------------------------------------------------------------
+ * test_flow_batch.c
+ *
+ * Test of batched flow change notifications (pcp_set_flow_change_batch_cb).
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pcp.h"
+#include "pcp_socket.h"
+#include "unp.h"
+#include "pcp_utils.h"
+#include "test_macro.h"
+
+#define FLOWS 30
+
+static pcp_ctx_t *ctx;
+static pcp_flow_t *flows[FLOWS];
+static int reported[FLOWS];
+static int flow_succeeded[FLOWS];
+static int succeeded;
+static int batches;
+static int max_batch;
+static int single_calls;
+
+static int flow_idx(pcp_flow_t *f)
+{
+    int i;
+
+    for (i=0; i < FLOWS; ++i) {
+        if (flows[i] == f) {
+            return i;
+        }
+    }
+    TEST(0);
+    return -1;
+}
+
+static void single_cb(pcp_flow_t *f UNUSED, struct sockaddr *src_addr UNUSED,
+        struct sockaddr *ext_addr UNUSED, pcp_fstate_e s UNUSED,
+        void *cb_arg UNUSED)
+{
+    ++single_calls;
+}
+
+static void batch_cb(pcp_ctx_t *c, const pcp_flow_change_t *changes,
+        size_t count, void *cb_arg)
+{
+    size_t i;
+    int seen[FLOWS];
+
+    TEST(c == ctx);
+    TEST(cb_arg == &batches);
+    TEST(count > 0);
+    ++batches;
+    if ((int)count > max_batch) {
+        max_batch=count;
+    }
+
+    memset(seen, 0, sizeof(seen));
+    for (i=0; i < count; ++i) {
+        int idx=flow_idx(changes[i].flow);
+
+        // one record per flow => changes are coalesced
+        TEST(!seen[idx]);
+        seen[idx]=1;
+        TEST(changes[i].user_data == &reported[idx]);
+        ++reported[idx];
+        if ((changes[i].state == pcp_state_succeeded)
+                && (!flow_succeeded[idx])) {
+            flow_succeeded[idx]=1;
+            ++succeeded;
+            // API can be used from callback, state machine is not running
+            pcp_flow_set_lifetime(changes[i].flow, 200);
+        }
+    }
+}
+
+int main(int argc, char *argv[] UNUSED)
+{
+    int i, pulses;
+
+    pcp_log_level=argc > 1 ? PCP_LOGLVL_DEBUG : 1;
+
+    ctx=pcp_init(DISABLE_AUTODISCOVERY, NULL);
+    TEST(ctx);
+    TEST(pcp_add_server(ctx, Sock_pton("127.0.0.1:5351"), 2) == 0);
+    pcp_set_flow_change_cb(ctx, single_cb, NULL);
+    pcp_set_flow_change_batch_cb(ctx, batch_cb, &batches);
+
+    for (i=0; i < FLOWS; ++i) {
+        struct sockaddr_in src;
+
+        memset(&src, 0, sizeof(src));
+        src.sin_family=AF_INET;
+        src.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+        src.sin_port=htons(4000 + i);
+        flows[i]=pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL,
+                IPPROTO_TCP, 100, &reported[i]);
+        TEST(flows[i]);
+    }
+
+    // reactor style processing drains all received responses at once
+    for (pulses=0; (succeeded < FLOWS) && (pulses < 1000); ++pulses) {
+        int tout=pcp_process(ctx, PCP_EV_READ | PCP_EV_TIMER);
+
+        if (succeeded < FLOWS) {
+            usleep(((tout < 0) || (tout > 10)) ? 10000 : tout * 1000);
+        }
+    }
+    TEST(succeeded == FLOWS);
+    TEST(single_calls == 0);
+    TEST(batches < FLOWS);
+    printf("%d flows reported in %d batches, largest %d\n", FLOWS, batches,
+            max_batch);
+
+    // deleted flows are never reported, even if server responds
+    for (i=0; i < FLOWS; ++i) {
+        pcp_close_flow(flows[i]);
+    }
+    for (i=1; i < FLOWS; i+=2) {
+        pcp_delete_flow(flows[i]);
+        flows[i]=NULL;
+    }
+    memset(reported, 0, sizeof(reported));
+    for (pulses=0; pulses < 20; ++pulses) {
+        pcp_pulse(ctx, NULL);
+        usleep(10000);
+    }
+    for (i=1; i < FLOWS; i+=2) {
+        TEST(reported[i] == 0);
+    }
+
+    // switching back to per flow callback
+    pcp_set_flow_change_batch_cb(ctx, NULL, NULL);
+    for (i=0; i < FLOWS; i+=2) {
+        pcp_flow_set_lifetime(flows[i], 100);
+    }
+    for (pulses=0; (single_calls == 0) && (pulses < 100); ++pulses) {
+        pcp_pulse(ctx, NULL);
+        usleep(10000);
+    }
+    TEST(single_calls > 0);
+
+    pcp_terminate(ctx, 0);
+
+    printf("Test of batched flow notifications passed.\n");
+    return 0;
+}
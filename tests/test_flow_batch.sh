@@ -0,0 +1,11 @@
+#!/bin/bash
+killall pcp-server
+sleep 0.1
+pcp-server --ext-ip ::ffff:10.20.30.40 >/dev/null &
+PCP_SERVER_PID=$!
+sleep 1
+$VALGRIND test_flow_batch
+EXIT_STATUS=$?
+kill $PCP_SERVER_PID
+killall pcp-server
+exit $EXIT_STATUS
@@ -10,6 +10,12 @@
  *------------------------------------------------------------------
  */
 
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE //unshare
+#endif
+#endif
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #else
@@ -18,6 +24,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/netlink.h>
+#endif
 #include "pcp.h"
 #include "gateway.h"
 #ifdef WIN32
@@ -49,6 +62,78 @@ static void test_getgateways(void)
     TEST(getgateways(NULL)<0)
 }
 
+#ifdef __linux__
+#define ROUTES 20000 //dump of them spans many netlink datagrams
+
+static int force_dump_intr;
+
+/* replaces recvmsg of libc, so every dump can be made interrupted, as if
+ * routes changed during it */
+ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags)
+{
+    ssize_t ret=syscall(SYS_recvmsg, sockfd, msg, flags);
+
+    if ((ret > 0) && (force_dump_intr)) {
+        struct nlmsghdr *nh=(struct nlmsghdr *)msg->msg_iov[0].iov_base;
+        int len=(int)(ret < (ssize_t)msg->msg_iov[0].iov_len ? ret
+                : (ssize_t)msg->msg_iov[0].iov_len);
+
+        for (; NLMSG_OK(nh, (unsigned)len); nh=NLMSG_NEXT(nh, len)) {
+            nh->nlmsg_flags|=NLM_F_DUMP_INTR;
+        }
+    }
+    return ret;
+}
+
+/* only default routes of big table in own network namespace are returned,
+ * the multipath one by all its gateways */
+static void test_big_table(void)
+{
+    struct sockaddr_in6 *gws=NULL;
+    struct in6_addr a;
+    FILE *ip;
+    int i;
+
+    if ((unshare(CLONE_NEWNET)) || (system("ip link set lo up"))) {
+        printf("Network namespace can't be set up, test skipped.\n");
+        return;
+    }
+    ip=popen("ip -batch -", "w");
+    TEST(ip);
+    fprintf(ip, "addr add 10.9.0.1/24 dev lo\n");
+    for (i=0; i < ROUTES; ++i) {
+        fprintf(ip, "route add 20.%d.%d.0/24 via 10.9.0.3 dev lo\n",
+                i >> 8, i & 0xff);
+    }
+    fprintf(ip, "route add default via 10.9.0.2 dev lo\n");
+    fprintf(ip, "route add default metric 10 nexthop via 10.9.0.4 dev lo "
+            "nexthop via 10.9.0.5 dev lo\n");
+    TEST(pclose(ip) == 0);
+
+    TEST(getgateways(&gws) == 3);
+    for (i=0; i < 3; ++i) {
+        char pb[INET6_ADDRSTRLEN];
+
+        printf("gw : %-20s\n", inet_ntop(AF_INET6, &gws[i].sin6_addr, pb,
+                sizeof(pb)));
+        TEST(!memcmp(pb, "::ffff:10.9.0.", 14));
+        TEST(strcmp(pb + 14, "3"));
+    }
+    TEST(inet_pton(AF_INET6, "::ffff:10.9.0.2", &a) == 1);
+    TEST(!memcmp(&gws[0].sin6_addr, &a, sizeof(a)));
+    free(gws);
+
+    // all dumps interrupted => result of the last one is returned
+    force_dump_intr=1;
+    gws=NULL;
+    TEST(getgateways(&gws) == 3);
+    TEST(gws);
+    TEST(!memcmp(&gws[0].sin6_addr, &a, sizeof(a)));
+    free(gws);
+    force_dump_intr=0;
+}
+#endif
+
 static void test_sa_len(void)
 {
     struct sockaddr sa;
@@ -79,6 +164,12 @@ int main(void)
     printf("Testing SA_LEN  \n");
     test_sa_len();
 
+#ifdef __linux__
+    // namespace of the process is changed, so it goes last
+    printf("Testing get gateways with big routing table\n");
+    test_big_table();
+#endif
+
     PD_SOCKET_CLEANUP();
 
     return 0;
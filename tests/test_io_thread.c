@@ -0,0 +1,149 @@
+/*
+ *------------------------------------------------------------------
+ * test_io_thread.c
+ *
+ * Test of flow API called from several application threads, while
+ * context is owned by background I/O thread (PCP_INIT_IO_THREAD).
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pcp.h"
+#include "pcp_socket.h"
+#include "unp.h"
+#include "pcp_utils.h"
+#include "test_macro.h"
+
+#ifdef PCP_USE_THREADS
+#include <pthread.h>
+
+#define APP_THREADS 4
+#define FLOWS_PER_THREAD 5
+
+static pcp_ctx_t *ctx;
+static pthread_t io_thread;
+static pthread_t cmd_thread;
+static int succeeded_cnt;
+
+static void notify_cb(pcp_flow_t *f UNUSED, struct sockaddr *src_addr UNUSED,
+        struct sockaddr *ext_addr UNUSED, pcp_fstate_e s, void *cb_arg)
+{
+    TEST(cb_arg == &succeeded_cnt);
+    io_thread=pthread_self();
+    if (s == pcp_state_succeeded) {
+        __atomic_add_fetch(&succeeded_cnt, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void submitted_cmd(pcp_ctx_t *c, void *arg)
+{
+    TEST(c == ctx);
+    TEST(arg == &cmd_thread);
+    cmd_thread=pthread_self();
+}
+
+static void *app_thread(void *arg)
+{
+    int id=(int)(intptr_t)arg;
+    pcp_flow_t *flows[FLOWS_PER_THREAD];
+    int i;
+
+    for (i=0; i < FLOWS_PER_THREAD; ++i) {
+        struct sockaddr_in src;
+
+        memset(&src, 0, sizeof(src));
+        src.sin_family=AF_INET;
+        src.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+        src.sin_port=htons(2000 + id * FLOWS_PER_THREAD + i);
+
+        flows[i]=pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL,
+                IPPROTO_UDP, 100, arg);
+        TEST(flows[i]);
+    }
+
+    for (i=0; i < FLOWS_PER_THREAD; ++i) {
+        pcp_flow_info_t *info;
+        size_t cnt=0;
+
+        TEST(pcp_wait(flows[i], 5000, 0) == pcp_state_succeeded);
+
+        info=pcp_flow_get_info(flows[i], &cnt);
+        TEST(info && (cnt == 1));
+        TEST(info->result == pcp_state_succeeded);
+        free(info);
+    }
+
+    for (i=0; i < FLOWS_PER_THREAD; ++i) {
+        pcp_flow_set_lifetime(flows[i], 50);
+        pcp_close_flow(flows[i]);
+        pcp_delete_flow(flows[i]);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[] UNUSED)
+{
+    pthread_t threads[APP_THREADS];
+    int i;
+
+    pcp_log_level=argc > 1 ? PCP_LOGLVL_DEBUG : 1;
+
+    ctx=pcp_init(DISABLE_AUTODISCOVERY | PCP_INIT_IO_THREAD, NULL);
+    TEST(ctx);
+
+    // pcp_pulse is driven by I/O thread only
+    TEST(pcp_pulse(ctx, NULL) == PCP_ERR_BAD_ARGS);
+    TEST(pcp_process(ctx, PCP_EV_READ) == PCP_ERR_BAD_ARGS);
+
+    TEST(pcp_add_server(ctx, Sock_pton("127.0.0.1:5351"), 2) == 0);
+    pcp_set_flow_change_cb(ctx, notify_cb, &succeeded_cnt);
+
+    TEST(pcp_io_submit(ctx, submitted_cmd, &cmd_thread) == PCP_ERR_SUCCESS);
+
+    for (i=0; i < APP_THREADS; ++i) {
+        TEST(pthread_create(&threads[i], NULL, app_thread,
+                (void *)(intptr_t)i) == 0);
+    }
+    for (i=0; i < APP_THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pcp_terminate(ctx, 0);
+
+    TEST(succeeded_cnt == APP_THREADS * FLOWS_PER_THREAD);
+    // callbacks and submitted commands run on the same, non-main thread
+    TEST(pthread_equal(io_thread, cmd_thread));
+    TEST(!pthread_equal(io_thread, pthread_self()));
+
+    printf("Test of PCP I/O thread passed.\n");
+    return 0;
+}
+
+#else //PCP_USE_THREADS
+
+int main(void)
+{
+    printf("Library built without thread support, test skipped.\n");
+    return 0;
+}
+
+#endif //PCP_USE_THREADS
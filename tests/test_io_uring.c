@@ -0,0 +1,253 @@
+/*
+ *------------------------------------------------------------------
+ * test_io_uring.c
+ *
+ * Test of io_uring transport (PCP_INIT_IO_URING) - flows of IPv4 and IPv6
+ * servers are mapped through one ring with default, separate and per
+ * server sockets, only the ring fd is polled. pcp_wait() is driven by the
+ * ring as well. Where the kernel lacks io_uring, library falls back to
+ * plain socket calls and the same flows have to succeed.
+ * Servers are simulated by in-process responders on UDP sockets.
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pcp.h"
+#include "pcp_socket.h"
+#include "unp.h"
+#include "pcp_utils.h"
+#include "test_macro.h"
+#include "test_responder.h"
+
+#ifdef PCP_USE_THREADS
+#include <pthread.h>
+#endif
+
+#define SERVERS 2 //IPv4 and IPv6 one
+#define FLOWS 10  //per server
+#define PORT_BASE 10000
+#define RESP_PORT 15371
+#define MAX_FDS 8
+
+static test_udp_responder_t resp[SERVERS];
+
+/* ring fd is not a socket */
+static int is_socket(int fd)
+{
+    struct sockaddr_storage ss;
+    socklen_t len=sizeof(ss);
+
+    return getsockname(fd, (struct sockaddr *)&ss, &len) == 0;
+}
+
+static void new_flows(pcp_ctx_t *ctx, pcp_flow_t **flows)
+{
+    int i;
+
+    for (i=0; i < SERVERS * FLOWS; ++i) {
+        struct sockaddr_storage src;
+
+        memset(&src, 0, sizeof(src));
+        if (i < FLOWS) {
+            struct sockaddr_in *sin=(struct sockaddr_in *)&src;
+
+            sin->sin_family=AF_INET;
+            sin->sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+            sin->sin_port=htons(PORT_BASE + i);
+        } else {
+            struct sockaddr_in6 *sin6=(struct sockaddr_in6 *)&src;
+
+            sin6->sin6_family=AF_INET6;
+            sin6->sin6_addr=in6addr_loopback;
+            sin6->sin6_port=htons(PORT_BASE + i);
+        }
+        flows[i]=pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL,
+                IPPROTO_TCP, 3600, NULL);
+        TEST(flows[i]);
+    }
+}
+
+static int count_succeeded(pcp_flow_t **flows)
+{
+    int i, cnt=0;
+
+    for (i=0; i < SERVERS * FLOWS; ++i) {
+        pcp_fstate_e st;
+
+        pcp_eval_flow_state(flows[i], &st);
+        cnt+=st == pcp_state_succeeded;
+    }
+    return cnt;
+}
+
+static pcp_ctx_t *init(uint32_t flags, int *uring)
+{
+    pcp_ctx_t *ctx;
+
+    ctx=pcp_init(DISABLE_AUTODISCOVERY | PCP_INIT_IO_URING | flags, NULL);
+    TEST(ctx);
+    *uring=!is_socket(pcp_get_socket(ctx));
+    TEST(pcp_add_server(ctx, Sock_pton("127.0.0.1:15371"), 2) == 0);
+    TEST(pcp_add_server(ctx, Sock_pton("[::1]:15371"), 2) == 1);
+    return ctx;
+}
+
+/* flows are driven by poll on fds of pcp_get_pollfds */
+static int run(uint32_t flags)
+{
+    pcp_ctx_t *ctx;
+    pcp_flow_t *flows[SERVERS * FLOWS];
+    pcp_pollfd_t pfds[MAX_FDS];
+    struct pollfd fds[MAX_FDS];
+    int i, n, tout, uring, succeeded=0;
+
+    ctx=init(flags, &uring);
+    n=pcp_get_pollfds(ctx, pfds, MAX_FDS);
+    TEST(n > 0);
+    if (uring) {
+        // sockets of servers are read by the ring too
+        TEST(n == 1);
+        TEST(pfds[0].fd == pcp_get_socket(ctx));
+    }
+    for (i=0; i < n; ++i) {
+        fds[i].fd=pfds[i].fd;
+        fds[i].events=POLLIN;
+    }
+
+    new_flows(ctx, flows);
+
+    tout=pcp_process(ctx, 0);
+    for (i=0; (succeeded < SERVERS * FLOWS) && (i < 100); ++i) {
+        int j, events=PCP_EV_TIMER;
+
+        for (j=0; j < SERVERS; ++j) {
+            test_udp_resp_run(resp + j);
+        }
+        TEST(poll(fds, n, tout < 0 || tout > 100 ? 100 : tout) >= 0);
+        for (j=0; j < n; ++j) {
+            if (fds[j].revents & POLLIN) {
+                events|=pfds[j].events;
+            }
+        }
+        tout=pcp_process(ctx, events);
+        succeeded=count_succeeded(flows);
+    }
+    printf("flags %u, %s: %d flows succeeded, requests IPv4 %d, IPv6 %d\n",
+            flags, uring ? "io_uring" : "sockets", succeeded,
+            resp[0].requests, resp[1].requests);
+    TEST(succeeded == SERVERS * FLOWS);
+
+    for (i=0; i < SERVERS; ++i) {
+        TEST(resp[i].requests >= FLOWS);
+        resp[i].requests=0;
+    }
+
+    pcp_terminate(ctx, 0);
+    free(ctx);
+
+    return uring;
+}
+
+#ifdef PCP_USE_THREADS
+static volatile int resp_stop;
+
+static void *responder_thread(void *arg UNUSED)
+{
+    struct pollfd fds[SERVERS];
+    int i;
+
+    for (i=0; i < SERVERS; ++i) {
+        fds[i].fd=resp[i].fd;
+        fds[i].events=POLLIN;
+    }
+    while (!__atomic_load_n(&resp_stop, __ATOMIC_ACQUIRE)) {
+        if (poll(fds, SERVERS, 10) > 0) {
+            for (i=0; i < SERVERS; ++i) {
+                test_udp_resp_run(resp + i);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* pcp_wait selects on the ring fd */
+static void run_wait(void)
+{
+    pcp_ctx_t *ctx;
+    pcp_flow_t *flows[SERVERS * FLOWS];
+    pthread_t thr;
+    int i, uring;
+
+    ctx=init(0, &uring);
+    __atomic_store_n(&resp_stop, 0, __ATOMIC_RELEASE);
+    TEST(pthread_create(&thr, NULL, responder_thread, NULL) == 0);
+
+    new_flows(ctx, flows);
+    for (i=0; i < SERVERS * FLOWS; ++i) {
+        TEST(pcp_wait(flows[i], 2000, 0) == pcp_state_succeeded);
+    }
+    TEST(count_succeeded(flows) == SERVERS * FLOWS);
+
+    __atomic_store_n(&resp_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(thr, NULL);
+    printf("pcp_wait, %s: %d flows succeeded\n",
+            uring ? "io_uring" : "sockets", SERVERS * FLOWS);
+
+    pcp_terminate(ctx, 0);
+    free(ctx);
+}
+#endif
+
+int main(int argc, char *argv[] UNUSED)
+{
+    int uring;
+
+    pcp_log_level=argc > 1 ? PCP_LOGLVL_DEBUG : PCP_LOGLVL_NONE;
+
+    TEST(test_udp_resp_open(resp, AF_INET, INADDR_LOOPBACK,
+            RESP_PORT));
+    if (!test_udp_resp_open(resp + 1, AF_INET6, 0, RESP_PORT)) {
+        printf("IPv6 loopback is not available, test skipped.\n");
+        close(resp[0].fd);
+        return 0;
+    }
+
+    uring=run(0);
+    TEST(run(PCP_INIT_SOCKET_PER_SERVER) == uring);
+    TEST(run(PCP_INIT_SOCKET_SEPARATE_AF | PCP_INIT_SOCKET_PER_SERVER)
+            == uring);
+#ifdef PCP_USE_THREADS
+    run_wait();
+#endif
+
+    close(resp[0].fd);
+    close(resp[1].fd);
+
+    if (!uring) {
+        printf("io_uring is not available, plain sockets tested.\n");
+    }
+    printf("Test of io_uring transport passed.\n");
+    return 0;
+}
@@ -0,0 +1,194 @@
+/*
+ *------------------------------------------------------------------
+ * test_mt_contexts.c
+ *
+ * Throughput of independent contexts, each driven by its own thread.
+ * Every context talks to in-process responder (socket virtual table),
+ * so the run is CPU bound and contexts should scale with thread count.
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pcp.h"
+#include "pcp_socket.h"
+#include "unp.h"
+#include "pcp_utils.h"
+#include "test_macro.h"
+#include "test_responder.h"
+
+#ifdef PCP_USE_THREADS
+#include <pthread.h>
+
+#define MAX_THREADS 8
+#define FLOWS_PER_ROUND 64
+#define ROUNDS 200
+#define MAX_PULSES (FLOWS_PER_ROUND * 20)
+
+struct thread_data {
+    pcp_ctx_t *ctx;
+    int succeeded;
+    int failed;
+    uint32_t first_nonce[3];
+    int nonce_set;
+    pthread_t th;
+};
+
+/* Responder of every context thread is in its thread local storage -
+   contexts don't share it, the same as they don't share anything inside
+   the library. */
+static int keep_nonce(test_responder_t *r, const char *req,
+        size_t len UNUSED)
+{
+    struct thread_data *td=(struct thread_data *)r->arg;
+
+    if (!td->nonce_set) {
+        memcpy(td->first_nonce, req + PCP_HDR_LEN, sizeof(td->first_nonce));
+        td->nonce_set=1;
+    }
+    return PCP_RES_SUCCESS;
+}
+
+static void notify_cb(pcp_flow_t *f UNUSED, struct sockaddr *src_addr UNUSED,
+        struct sockaddr *ext_addr UNUSED, pcp_fstate_e s, void *cb_arg)
+{
+    struct thread_data *td=(struct thread_data *)cb_arg;
+
+    if (s == pcp_state_succeeded) {
+        ++td->succeeded;
+    } else if (s == pcp_state_failed) {
+        ++td->failed;
+    }
+}
+
+static void *ctx_thread(void *arg)
+{
+    struct thread_data *td=(struct thread_data *)arg;
+    pcp_flow_t *flows[FLOWS_PER_ROUND];
+    int round, i;
+
+    test_responder=(test_responder_t *)malloc(sizeof(*test_responder));
+    TEST(test_responder);
+    test_resp_init(test_responder);
+    test_responder->on_request=keep_nonce;
+    test_responder->arg=td;
+
+    td->ctx=pcp_init(DISABLE_AUTODISCOVERY, &test_responder_vt);
+    TEST(td->ctx);
+    TEST(pcp_add_server(td->ctx, Sock_pton("127.0.0.1:5351"), 2) == 0);
+    pcp_set_flow_change_cb(td->ctx, notify_cb, td);
+
+    for (round=0; round < ROUNDS; ++round) {
+        int target=td->succeeded + FLOWS_PER_ROUND;
+        int pulses=0;
+
+        for (i=0; i < FLOWS_PER_ROUND; ++i) {
+            struct sockaddr_in src;
+
+            memset(&src, 0, sizeof(src));
+            src.sin_family=AF_INET;
+            src.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+            src.sin_port=htons(1024 + i);
+
+            flows[i]=pcp_new_flow(td->ctx, (struct sockaddr *)&src, NULL,
+                    NULL, IPPROTO_TCP, 3600, NULL);
+            TEST(flows[i]);
+        }
+
+        while ((td->succeeded < target) && (pulses++ < MAX_PULSES)) {
+            pcp_pulse(td->ctx, NULL);
+        }
+        TEST(td->succeeded == target);
+
+        for (i=0; i < FLOWS_PER_ROUND; ++i) {
+            pcp_delete_flow(flows[i]);
+        }
+    }
+
+    pcp_terminate(td->ctx, 1);
+    free(test_responder);
+
+    return NULL;
+}
+
+static double run(struct thread_data *td, int nthreads)
+{
+    struct timeval start, end;
+    int i;
+
+    memset(td, 0, sizeof(*td) * nthreads);
+    gettimeofday(&start, NULL);
+    for (i=0; i < nthreads; ++i) {
+        TEST(pthread_create(&td[i].th, NULL, ctx_thread, td + i) == 0);
+    }
+    for (i=0; i < nthreads; ++i) {
+        pthread_join(td[i].th, NULL);
+        TEST(td[i].succeeded == FLOWS_PER_ROUND * ROUNDS);
+        TEST(td[i].failed == 0);
+    }
+    gettimeofday(&end, NULL);
+
+    return (double)nthreads * FLOWS_PER_ROUND * ROUNDS
+            / ((end.tv_sec - start.tv_sec)
+                    + (end.tv_usec - start.tv_usec) / 1000000.0);
+}
+
+int main(int argc, char *argv[] UNUSED)
+{
+    struct thread_data td[MAX_THREADS];
+    long ncpu=sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads=ncpu < 2 ? 2 : (ncpu > MAX_THREADS ? MAX_THREADS : ncpu);
+    double single, multi;
+    int i, j;
+
+    pcp_log_level=argc > 1 ? PCP_LOGLVL_DEBUG : PCP_LOGLVL_NONE;
+
+    single=run(td, 1);
+    multi=run(td, nthreads);
+
+    // contexts seed their generators independently
+    for (i=0; i < nthreads; ++i) {
+        TEST(td[i].nonce_set);
+        for (j=i + 1; j < nthreads; ++j) {
+            TEST(memcmp(td[i].first_nonce, td[j].first_nonce,
+                    sizeof(td[i].first_nonce)));
+        }
+    }
+
+    printf("1 context : %10.0f flows/s\n", single);
+    printf("%d contexts: %10.0f flows/s (%.2fx)\n", nthreads, multi,
+            multi / single);
+
+    printf("Test of parallel PCP contexts passed.\n");
+    return 0;
+}
+
+#else
+
+int main(void)
+{
+    printf("Built without thread support, skipping.\n");
+    return 0;
+}
+
+#endif
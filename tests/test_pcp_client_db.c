@@ -165,23 +165,13 @@ static void test_pcp_flow_funcs(pcp_ctx_t *ctx)
     TEST(pcp_db_add_flow(f2)== PCP_ERR_SUCCESS);
     TEST(f2->key_bucket==f1->key_bucket);
 
-    f2->pcp_msg_buffer=(char*)malloc(10);
-    f2->pcp_msg_len = 10;
     TEST(pcp_db_rem_flow(f2)==PCP_ERR_SUCCESS);
     TEST(pcp_db_rem_flow(f2)!=PCP_ERR_SUCCESS);
-    TEST((f2->pcp_msg_buffer!=NULL)&&(f2->pcp_msg_len==10));
 
     TEST(pcp_get_flow(&fkd, get_pcp_server(ctx, 0))==f1);
     TEST(pcp_get_flow(&fkd, get_pcp_server(ctx, 1))==NULL);
     TEST(pcp_get_flow(&fkd2, get_pcp_server(ctx, 0))==f3);
 
-    pcp_flow_clear_msg_buf(NULL);
-    f3->pcp_msg_buffer=(char*)malloc(10);
-    f3->pcp_msg_len = 10;
-    pcp_flow_clear_msg_buf(f3);
-    TEST((f3->pcp_msg_len==0)&&(f3->pcp_msg_buffer==NULL));
-    f3->pcp_msg_buffer=(char*)malloc(10);
-    f3->pcp_msg_len = 10;
 
     TEST(pcp_delete_flow_intern(f3)==PCP_ERR_SUCCESS);
     fkd2.map_peer.src_port++;
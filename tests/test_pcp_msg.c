@@ -37,6 +37,7 @@ int main(void)
         nat_pmp_map_resp_t natpmp_mt;
         nat_pmp_map_resp_t natpmp_mu;
         pcp_recv_msg_t msg;
+        char buf[PCP_MAX_LEN];
 
 
         natpmp_a.ver = 0;
@@ -62,7 +63,9 @@ int main(void)
         natpmp_mu.lifetime = htonl(2233);
 
         memset(&msg,0,sizeof(msg));
-        memcpy(&msg.pcp_msg_buffer, &natpmp_a, sizeof(natpmp_a));
+        memset(buf,0,sizeof(buf));
+        msg.pcp_msg_buffer = buf;
+        memcpy(msg.pcp_msg_buffer, &natpmp_a, sizeof(natpmp_a));
         msg.pcp_msg_len = sizeof(natpmp_a);
         TEST(parse_response(&msg)==PCP_ERR_SUCCESS);
         TEST(msg.recv_version==0);
@@ -73,7 +76,9 @@ int main(void)
 
         natpmp_a.ver++;
         memset(&msg,0,sizeof(msg));
-        memcpy(&msg.pcp_msg_buffer, &natpmp_a, sizeof(natpmp_a));
+        memset(buf,0,sizeof(buf));
+        msg.pcp_msg_buffer = buf;
+        memcpy(msg.pcp_msg_buffer, &natpmp_a, sizeof(natpmp_a));
         msg.pcp_msg_len = sizeof(natpmp_a);
         TEST(parse_response(&msg)!=PCP_ERR_SUCCESS);
 
@@ -84,7 +89,9 @@ int main(void)
 
         natpmp_a.ver++;
         memset(&msg,0,sizeof(msg));
-        memcpy(&msg.pcp_msg_buffer, &natpmp_a, sizeof(natpmp_a));
+        memset(buf,0,sizeof(buf));
+        msg.pcp_msg_buffer = buf;
+        memcpy(msg.pcp_msg_buffer, &natpmp_a, sizeof(natpmp_a));
         msg.pcp_msg_len = sizeof(natpmp_a);
         TEST(parse_response(&msg)!=PCP_ERR_SUCCESS);
 
@@ -94,7 +101,9 @@ int main(void)
         TEST(msg.recv_result==11);
 
         memset(&msg,0,sizeof(msg));
-        memcpy(&msg.pcp_msg_buffer, &natpmp_mt, sizeof(natpmp_mt));
+        memset(buf,0,sizeof(buf));
+        msg.pcp_msg_buffer = buf;
+        memcpy(msg.pcp_msg_buffer, &natpmp_mt, sizeof(natpmp_mt));
         msg.pcp_msg_len = sizeof(natpmp_mt);
         TEST(parse_response(&msg)==PCP_ERR_SUCCESS);
         TEST(msg.assigned_ext_port==htons(1234));
@@ -106,7 +115,9 @@ int main(void)
         TEST(msg.recv_result==11);
 
         memset(&msg,0,sizeof(msg));
-        memcpy(&msg.pcp_msg_buffer, &natpmp_mu, sizeof(natpmp_mu));
+        memset(buf,0,sizeof(buf));
+        msg.pcp_msg_buffer = buf;
+        memcpy(msg.pcp_msg_buffer, &natpmp_mu, sizeof(natpmp_mu));
         msg.pcp_msg_len = sizeof(natpmp_mu);
         TEST(parse_response(&msg)==PCP_ERR_SUCCESS);
         TEST(msg.assigned_ext_port==htons(1234));
@@ -122,7 +133,9 @@ int main(void)
 
         natpmp_mu.opcode=3;
         memset(&msg,0,sizeof(msg));
-        memcpy(&msg.pcp_msg_buffer, &natpmp_mu, sizeof(natpmp_mu));
+        memset(buf,0,sizeof(buf));
+        msg.pcp_msg_buffer = buf;
+        memcpy(msg.pcp_msg_buffer, &natpmp_mu, sizeof(natpmp_mu));
 
         msg.pcp_msg_len = sizeof(natpmp_mu);
         TEST(parse_response(&msg)!=PCP_ERR_SUCCESS);
@@ -130,9 +143,12 @@ int main(void)
 #endif
     {   // TEST validate MSG
         pcp_recv_msg_t msg;
-        pcp_response_t* resp = (pcp_response_t*)msg.pcp_msg_buffer;
+        char buf[PCP_MAX_LEN];
+        pcp_response_t* resp = (pcp_response_t*)buf;
 
         memset(&msg, 0, sizeof(msg));
+        memset(buf, 0, sizeof(buf));
+        msg.pcp_msg_buffer = buf;
         resp->r_opcode=0x81;
         resp->ver=1;
         msg.pcp_msg_len=sizeof(pcp_response_t);
@@ -199,25 +215,40 @@ int main(void)
     {  //TEST build msg
         struct pcp_flow_s fs;
         pcp_server_t *s;
+        char buf[PCP_MAX_LEN];
 
         memset(&fs, 0, sizeof(fs));
         fs.ctx=ctx;
-        TEST(build_pcp_msg(&fs)==NULL);
+        TEST(build_pcp_msg(&fs, buf, sizeof(buf))==0);
         fs.pcp_server_indx=pcp_add_server(ctx, Sock_pton("127.0.0.1"),1);
         s=get_pcp_server(ctx, fs.pcp_server_indx);
         fs.kd.operation = PCP_OPCODE_ANNOUNCE;
-        TEST(build_pcp_msg(&fs)!=NULL);
+        TEST(build_pcp_msg(&fs, buf, sizeof(buf))==sizeof(pcp_request_t));
+        TEST(build_pcp_msg(&fs, buf, sizeof(buf)-1)==0);
+        TEST(build_pcp_msg(&fs, NULL, sizeof(buf))==0);
         fs.kd.operation = 0x7f;
-        TEST(build_pcp_msg(&fs)==NULL);
+        TEST(build_pcp_msg(&fs, buf, sizeof(buf))==0);
         fs.kd.operation = PCP_OPCODE_SADSCP;
-        TEST(build_pcp_msg(&fs)==NULL);
+        TEST(build_pcp_msg(&fs, buf, sizeof(buf))==0);
         s->pcp_version = 3;
-        TEST(build_pcp_msg(&fs)==NULL);
+        TEST(build_pcp_msg(&fs, buf, sizeof(buf))==0);
         fs.kd.operation = PCP_OPCODE_MAP;
-        TEST(build_pcp_msg(&fs)==NULL);
+        TEST(build_pcp_msg(&fs, buf, sizeof(buf))==0);
         fs.kd.operation = PCP_OPCODE_PEER;
-        TEST(build_pcp_msg(&fs)==NULL);
+        TEST(build_pcp_msg(&fs, buf, sizeof(buf))==0);
         s->pcp_version = 2;
+        TEST(build_pcp_msg(&fs, buf, sizeof(buf))==
+                sizeof(pcp_request_t)+sizeof(pcp_peer_v2_t));
+        // reserved fields are zero even if buffer was dirty
+        memset(buf, 0xff, sizeof(buf));
+        fs.kd.operation = PCP_OPCODE_MAP;
+        fs.lifetime = 100;
+        TEST(build_pcp_msg(&fs, buf, sizeof(buf))==
+                sizeof(pcp_request_t)+sizeof(pcp_map_v2_t));
+        TEST(((pcp_request_t*)buf)->ver==2);
+        TEST(((pcp_request_t*)buf)->r_opcode==PCP_OPCODE_MAP);
+        TEST(((pcp_request_t*)buf)->req_lifetime==htonl(100));
+        TEST(((pcp_map_v2_t*)((pcp_request_t*)buf)->next_data)->reserved[0]==0);
 #ifdef PCP_EXPERIMENTAL
         {
             uint16_t i;
@@ -227,11 +258,125 @@ int main(void)
             for (i=2; i<256; ++i) {
                 pcp_db_add_md(&fs, i, "string",sizeof("string"));
             }
-            TEST(build_pcp_msg(&fs)!=NULL);
-            TEST(fs.pcp_msg_len<=PCP_MAX_LEN);
+            TEST(build_pcp_msg(&fs, buf, sizeof(buf))!=0);
+            TEST(build_pcp_msg(&fs, buf, sizeof(buf))<=PCP_MAX_LEN);
         }
 #endif
-        TEST(build_pcp_msg(NULL)==NULL);
+        TEST(build_pcp_msg(NULL, buf, sizeof(buf))==0);
+    }
+    {  //TEST cached wire image
+        struct pcp_flow_s fs;
+        const char *w1, *w2;
+        size_t l1, l2;
+        char buf[PCP_MAX_LEN];
+        pcp_server_t *s;
+
+        memset(&fs, 0, sizeof(fs));
+        fs.ctx=ctx;
+        fs.pcp_server_indx=pcp_add_server(ctx, Sock_pton("127.0.0.2"),2);
+        s=get_pcp_server(ctx, fs.pcp_server_indx);
+        fs.kd.operation = PCP_OPCODE_MAP;
+        fs.lifetime = 100;
+        w1=pcp_flow_wire_msg(&fs, &l1);
+        TEST(w1!=NULL);
+        TEST(l1==build_pcp_msg(&fs, buf, sizeof(buf)));
+        TEST(memcmp(w1, buf, l1)==0);
+        // lifetime is patched into the same image
+        fs.lifetime = 200;
+        w2=pcp_flow_wire_msg(&fs, &l2);
+        TEST((w2==w1)&&(l2==l1));
+        TEST(((pcp_request_t*)w2)->req_lifetime==htonl(200));
+        TEST(build_pcp_msg(&fs, buf, sizeof(buf))==l1);
+        TEST(memcmp(w2, buf, l1)==0);
+        // changed options and version are encoded again
+        TEST(fs.encoder!=NULL);
+        fs.pfailure_option_present=1;
+        TEST(pcp_flow_wire_msg(&fs, &l2)!=NULL);
+        TEST(l2==l1);
+        pcp_flow_wire_invalidate(&fs);
+        TEST(fs.encoder==NULL);
+        TEST(pcp_flow_wire_msg(&fs, &l2)!=NULL);
+        TEST(l2==l1+sizeof(pcp_prefer_fail_option_t));
+        s->pcp_version = 1;
+        TEST(pcp_flow_wire_msg(&fs, &l2)!=NULL);
+        TEST(l2==sizeof(pcp_request_t)+sizeof(pcp_map_v1_t)
+                +sizeof(pcp_prefer_fail_option_t));
+        TEST(((pcp_request_t*)fs.wire)->ver==1);
+#ifndef PCP_DISABLE_NATPMP
+        s->pcp_version = 0;
+        fs.kd.map_peer.protocol = IPPROTO_TCP;
+        w2=pcp_flow_wire_msg(&fs, &l2);
+        TEST((w2!=NULL)&&(l2==sizeof(nat_pmp_map_req_t)));
+        fs.lifetime = 300;
+        w2=pcp_flow_wire_msg(&fs, &l2);
+        TEST(((nat_pmp_map_req_t*)w2)->lifetime==htonl(300));
+#endif
+        free(fs.wire);
+    }
+    {  //TEST parse options
+        struct pcp_flow_s fs;
+        pcp_recv_msg_t msg;
+        pcp_options_hdr_t *opt;
+        char buf[PCP_MAX_LEN];
+        size_t len;
+
+        memset(&fs, 0, sizeof(fs));
+        fs.ctx=ctx;
+        fs.pcp_server_indx=pcp_add_server(ctx, Sock_pton("127.0.0.3"),2);
+        fs.kd.operation = PCP_OPCODE_MAP;
+        fs.filter_option_present=1;
+        fs.filter_prefix=120;
+        fs.pfailure_option_present=1;
+        fs.third_party_option_present=1;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.pcp_msg_buffer = buf;
+        len=build_pcp_msg(&fs, buf, sizeof(buf));
+        TEST(len!=0);
+        msg.pcp_msg_buffer[1]|=0x80;
+        // unknown option with padded data is skipped
+        opt=(pcp_options_hdr_t *)(msg.pcp_msg_buffer + len);
+        opt->code=200;
+        opt->len=htons(3);
+        msg.pcp_msg_len=len + sizeof(*opt) + 4;
+        TEST(parse_response(&msg)==PCP_ERR_SUCCESS);
+        TEST(msg.opt_flags==(optf_3rd_party|optf_pref_fail|optf_filter));
+        TEST(msg.filter_cnt==1);
+        TEST(msg.filter_prefix==120);
+        // repeated FILTER is counted, data of the first one is kept
+        memcpy(msg.pcp_msg_buffer + len, msg.pcp_msg_buffer + len
+                - sizeof(pcp_3rd_party_option_t)
+                - sizeof(pcp_prefer_fail_option_t)
+                - sizeof(pcp_filter_option_t), sizeof(pcp_filter_option_t));
+        ((pcp_filter_option_t *)(msg.pcp_msg_buffer + len))->filter_prefix=96;
+        msg.pcp_msg_len=len + sizeof(pcp_filter_option_t);
+        TEST(parse_response(&msg)==PCP_ERR_SUCCESS);
+        TEST(msg.filter_cnt==2);
+        TEST(msg.filter_prefix==120);
+        opt->code=200;
+        opt->len=htons(3);
+        msg.pcp_msg_len=len + sizeof(*opt) + 4;
+
+        // option data exceeding message
+        opt->len=htons(5);
+        TEST(parse_response(&msg)!=PCP_ERR_SUCCESS);
+        opt->len=htons(8);
+        TEST(parse_response(&msg)!=PCP_ERR_SUCCESS);
+        // option without data, truncated option header
+        msg.pcp_msg_len=len + 4;
+        opt->len=htons(0);
+        TEST(parse_response(&msg)==PCP_ERR_SUCCESS);
+        msg.pcp_msg_len=len + 2;
+        TEST(parse_response(&msg)!=PCP_ERR_SUCCESS);
+        // known option with wrong length
+        msg.pcp_msg_len=len + 8;
+        opt->code=PCP_OPTION_PREF_FAIL;
+        opt->len=htons(4);
+        TEST(parse_response(&msg)!=PCP_ERR_SUCCESS);
+        // not checked in error responses
+        msg.pcp_msg_buffer[3]=PCP_RES_UNSUPP_VERSION;
+        TEST(parse_response(&msg)==PCP_ERR_SUCCESS);
+        TEST(msg.opt_flags==0);
     }
 
     PD_SOCKET_CLEANUP();
@@ -0,0 +1,222 @@
+/*
+ *------------------------------------------------------------------
+ * test_pulse_budget.c
+ *
+ * Test of pcp_pulse_budget - sending of requests queued before server
+ * answered is split among several pulses, each flow is sent exactly once.
+ * Server restart seen in response read while sweep is interrupted is not
+ * missed. Context talks to in-process responder (socket virtual table).
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pcp.h"
+#include "pcp_socket.h"
+#include "unp.h"
+#include "pcp_utils.h"
+#include "test_macro.h"
+#include "test_responder.h"
+
+#define FLOWS 500
+#define BUDGET 50
+#define PORT_BASE 10000
+
+static test_responder_t responder;
+static int sent_in_pulse;
+static int read_in_pulse;
+static int sent_per_flow[FLOWS];
+static int restarted; //responses carry epoch of restarted server
+
+static int count_request(test_responder_t *r, const char *req,
+        size_t len UNUSED)
+{
+    uint16_t int_port;
+
+    ++sent_in_pulse;
+    r->info.epoch_time_start=restarted ? time(NULL) : 0;
+    memcpy(&int_port, req + PCP_HDR_LEN + 16, sizeof(int_port));
+    int_port=ntohs(int_port);
+    if ((int_port >= PORT_BASE) && (int_port < PORT_BASE + FLOWS)) {
+        ++sent_per_flow[int_port - PORT_BASE];
+    }
+
+    return PCP_RES_SUCCESS;
+}
+
+static ssize_t count_recvfrom(PCP_SOCKET sockfd, void *buf, size_t len,
+        int flags, struct sockaddr *src_addr, socklen_t *addrlen)
+{
+    ssize_t ret=test_responder_vt.sock_recvfrom(sockfd, buf, len, flags,
+            src_addr, addrlen);
+
+    if (ret >= 0) {
+        ++read_in_pulse;
+    }
+    return ret;
+}
+
+static pcp_socket_vt_t responder_vt;
+
+static int succeeded;
+
+static void notify_cb(pcp_flow_t *f UNUSED, struct sockaddr *src_addr UNUSED,
+        struct sockaddr *ext_addr UNUSED, pcp_fstate_e s, void *cb_arg UNUSED)
+{
+    if (s == pcp_state_succeeded) {
+        ++succeeded;
+    }
+}
+
+static pcp_ctx_t *start(pcp_flow_t **flows)
+{
+    pcp_ctx_t *ctx;
+    int i;
+
+    test_resp_init(&responder);
+    responder.on_request=count_request;
+    test_responder=&responder;
+    succeeded=0;
+    restarted=0;
+    memset(sent_per_flow, 0, sizeof(sent_per_flow));
+
+    ctx=pcp_init(DISABLE_AUTODISCOVERY, &responder_vt);
+    TEST(ctx);
+    pcp_set_flow_change_cb(ctx, notify_cb, NULL);
+    TEST(pcp_add_server(ctx, Sock_pton("127.0.0.1:5351"), 2) == 0);
+
+    // flows wait for server, which is pinged first
+    for (i=0; i < FLOWS; ++i) {
+        struct sockaddr_in src;
+
+        memset(&src, 0, sizeof(src));
+        src.sin_family=AF_INET;
+        src.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+        src.sin_port=htons(PORT_BASE + i);
+        flows[i]=pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL,
+                IPPROTO_TCP, 3600, NULL);
+        TEST(flows[i]);
+    }
+    return ctx;
+}
+
+/* returns count of pulses which left work pending */
+static int run(const pcp_budget_t *budget, int max_sent)
+{
+    pcp_ctx_t *ctx;
+    pcp_flow_t *flows[FLOWS];
+    int i, pulses, pending_cnt=0;
+
+    ctx=start(flows);
+    for (pulses=0; (succeeded < FLOWS) && (pulses < FLOWS * 10); ++pulses) {
+        int pending=0;
+        int tout;
+
+        sent_in_pulse=0;
+        read_in_pulse=0;
+        tout=pcp_pulse_budget(ctx, budget, NULL, &pending);
+        TEST(sent_in_pulse <= max_sent);
+        // responses read are charged to the budget too
+        TEST((!budget) || (sent_in_pulse + read_in_pulse <= max_sent));
+        if (pending) {
+            TEST(tout == 0);
+            ++pending_cnt;
+        }
+    }
+    TEST(succeeded == FLOWS);
+
+    // interrupted sweeps continued where they stopped
+    for (i=0; i < FLOWS; ++i) {
+        TEST(sent_per_flow[i] == 1);
+    }
+
+    TEST(responder.dropped == 0);
+    pcp_terminate(ctx, 0);
+    free(ctx);
+
+    return pending_cnt;
+}
+
+/* server restarts in the middle of sweep sending queued flows; responses
+ * with the new epoch are read before the sweep continues */
+static void test_restart_in_sweep(void)
+{
+    pcp_budget_t budget={BUDGET, 0};
+    pcp_ctx_t *ctx;
+    pcp_flow_t *flows[FLOWS];
+    int i, pulses, quiet=0, resent=0;
+
+    ctx=start(flows);
+    for (pulses=0; (quiet < 3) && (pulses < FLOWS * 10); ++pulses) {
+        int pending=0;
+
+        sent_in_pulse=0;
+        read_in_pulse=0;
+        // requests sent by the third pulse are answered by restarted server
+        restarted=pulses == 2;
+        pcp_pulse_budget(ctx, &budget, NULL, &pending);
+        quiet=(pending) || (sent_in_pulse) || (read_in_pulse) ? 0 : quiet + 1;
+    }
+
+    // restart made the flows sent again
+    for (i=0; i < FLOWS; ++i) {
+        pcp_fstate_e st;
+
+        TEST(pcp_eval_flow_state(flows[i], &st) >= 0);
+        TEST(st == pcp_state_succeeded);
+        resent+=sent_per_flow[i] > 1;
+    }
+    printf("%d flows sent again after server restart\n", resent);
+    TEST(resent > FLOWS / 2);
+
+    TEST(responder.dropped == 0);
+    pcp_terminate(ctx, 0);
+    free(ctx);
+}
+
+int main(int argc, char *argv[] UNUSED)
+{
+    pcp_budget_t flows_budget={BUDGET, 0};
+    pcp_budget_t time_budget={0, 1};
+    int pending;
+
+    pcp_log_level=argc > 1 ? PCP_LOGLVL_DEBUG : PCP_LOGLVL_NONE;
+    responder_vt=test_responder_vt;
+    responder_vt.sock_recvfrom=count_recvfrom;
+
+    // no limits => all requests sent by one pulse
+    TEST(run(NULL, FLOWS) == 0);
+
+    pending=run(&flows_budget, BUDGET);
+    printf("%d flows sent by %d pulses with budget of %d flows\n", FLOWS,
+            pending + 1, BUDGET);
+    TEST(pending >= FLOWS / BUDGET - 1);
+
+    // 1us - each call does only few flows, but still progresses
+    pending=run(&time_budget, FLOWS);
+    printf("%d pulses with work pending with 1us budget\n", pending);
+    TEST(pending > 0);
+
+    test_restart_in_sweep();
+
+    printf("Test of pcp_pulse_budget passed.\n");
+    return 0;
+}
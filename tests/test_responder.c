@@ -0,0 +1,260 @@
+/*
+ *------------------------------------------------------------------
+ * test_responder.c
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "test_responder.h"
+#include "test_macro.h"
+
+PCP_THREAD_LOCAL test_responder_t *test_responder;
+
+static void resp_info_init(server_info_t *info)
+{
+    info->server_version=2;
+    info->default_result_code=255;
+    S6_ADDR32(&info->ext_ip)[2]=htonl(0xFFFF);
+    S6_ADDR32(&info->ext_ip)[3]=htonl(0x0A000001);
+}
+
+void test_resp_init(test_responder_t *r)
+{
+    memset(r, 0, sizeof(*r));
+    resp_info_init(&r->info);
+}
+
+int test_resp_request(test_responder_t *r, const void *req, size_t len)
+{
+    int result=PCP_RES_SUCCESS;
+    unsigned slot;
+
+    if ((len > PCP_MAX_LEN) || ((len < PCP_HDR_LEN + 36)
+            && ((len != PCP_HDR_LEN) || (!r->announce)))) {
+        return 0;
+    }
+    if (r->on_request) {
+        result=r->on_request(r, (const char *)req, len);
+        if (result < 0) {
+            return 0;
+        }
+    }
+    if (r->tail - r->head >= TEST_RESP_QUEUE_LEN) {
+        ++r->dropped;
+        return 0;
+    }
+
+    // MAP/PEER v2 response has the same layout as request, only common
+    // header differs: R bit, result code and epoch instead of client IP
+    slot=r->tail % TEST_RESP_QUEUE_LEN;
+    memcpy(r->buf[slot], req, len);
+    pcp_server_create_response(r->buf[slot], result, &r->info);
+    r->len[slot]=len;
+    gettimeofday(&r->ts[slot], NULL);
+    ++r->tail;
+
+    return 1;
+}
+
+int test_resp_next(test_responder_t *r, void *buf, size_t *len,
+        struct sockaddr *src_addr, socklen_t *addrlen, struct timeval *ts)
+{
+    struct sockaddr_in6 *sin6=(struct sockaddr_in6 *)src_addr;
+    unsigned slot;
+
+    if (r->head == r->tail) {
+        return 0;
+    }
+
+    slot=r->head % TEST_RESP_QUEUE_LEN;
+    if (*len > r->len[slot]) {
+        *len=r->len[slot];
+    }
+    memcpy(buf, r->buf[slot], *len);
+    if (ts) {
+        *ts=r->ts[slot];
+    }
+    ++r->head;
+
+    memset(sin6, 0, sizeof(*sin6));
+    sin6->sin6_family=AF_INET6;
+    S6_ADDR32(&sin6->sin6_addr)[2]=htonl(0xFFFF);
+    S6_ADDR32(&sin6->sin6_addr)[3]=htonl(INADDR_LOOPBACK);
+    sin6->sin6_port=htons(5351);
+    *addrlen=sizeof(*sin6);
+
+    return 1;
+}
+
+PCP_SOCKET test_resp_create(int domain, int type, int protocol)
+{
+    return socket(domain, type, protocol);
+}
+
+static ssize_t resp_sendto(PCP_SOCKET sockfd UNUSED, const void *buf,
+        size_t len, int flags UNUSED, struct sockaddr *dest_addr UNUSED,
+        socklen_t addrlen UNUSED)
+{
+    test_resp_request(test_responder, buf, len);
+    return len;
+}
+
+static ssize_t resp_recvfrom(PCP_SOCKET sockfd UNUSED, void *buf, size_t len,
+        int flags UNUSED, struct sockaddr *src_addr, socklen_t *addrlen)
+{
+    if (!test_resp_next(test_responder, buf, &len, src_addr, addrlen, NULL)) {
+        return PCP_ERR_WOULDBLOCK;
+    }
+    return len;
+}
+
+int test_resp_close(PCP_SOCKET sockfd)
+{
+    return close(sockfd);
+}
+
+pcp_socket_vt_t test_responder_vt={
+        test_resp_create,
+        resp_recvfrom,
+        resp_sendto,
+        test_resp_close
+};
+
+int test_udp_resp_open(test_udp_responder_t *r, int af, uint32_t ip,
+        uint16_t port)
+{
+    struct sockaddr_storage ss;
+    socklen_t len;
+
+    memset(r, 0, sizeof(*r));
+    resp_info_init(&r->info);
+
+    r->fd=socket(af, SOCK_DGRAM, 0);
+    if (r->fd < 0) {
+        return 0;
+    }
+    TEST(fcntl(r->fd, F_SETFL, O_NONBLOCK) == 0);
+
+    memset(&ss, 0, sizeof(ss));
+    if (af == AF_INET) {
+        struct sockaddr_in *sin=(struct sockaddr_in *)&ss;
+
+        sin->sin_family=AF_INET;
+        sin->sin_addr.s_addr=htonl(ip);
+        sin->sin_port=htons(port);
+        len=sizeof(*sin);
+    } else {
+        struct sockaddr_in6 *sin6=(struct sockaddr_in6 *)&ss;
+
+        sin6->sin6_family=AF_INET6;
+        sin6->sin6_addr=in6addr_loopback;
+        sin6->sin6_port=htons(port);
+        len=sizeof(*sin6);
+    }
+    if (bind(r->fd, (struct sockaddr *)&ss, len) != 0) {
+        close(r->fd);
+        r->fd=-1;
+        return 0;
+    }
+    return 1;
+}
+
+void test_udp_resp_run(test_udp_responder_t *r)
+{
+    char buf[PCP_MAX_LEN];
+    struct sockaddr_storage from;
+    socklen_t fromlen;
+    ssize_t len;
+
+    for (;;) {
+        fromlen=sizeof(from);
+        len=recvfrom(r->fd, buf, sizeof(buf), 0, (struct sockaddr *)&from,
+                &fromlen);
+        if (len < 0) {
+            break;
+        }
+        if (len < PCP_HDR_LEN + 36) {
+            continue;
+        }
+        ++r->requests;
+        r->last_src_port=from.ss_family == AF_INET6 ?
+                ((struct sockaddr_in6 *)&from)->sin6_port :
+                ((struct sockaddr_in *)&from)->sin_port;
+
+        pcp_server_create_response(buf, PCP_RES_SUCCESS, &r->info);
+        TEST(sendto(r->fd, buf, len, 0, (struct sockaddr *)&from, fromlen)
+                == len);
+    }
+}
+
+void test_sans_io_init(test_sans_io_t *t)
+{
+    memset(t, 0, sizeof(*t));
+    resp_info_init(&t->info);
+}
+
+int test_sans_io_poll(test_sans_io_t *t, pcp_ctx_t *ctx)
+{
+    int i, n;
+
+    memset(t->msgs, 0, sizeof(t->msgs));
+    for (i=0; i < TEST_SANS_IO_BATCH; ++i) {
+        t->msgs[i].buf=t->bufs[i];
+        t->msgs[i].len=sizeof(t->bufs[i]);
+        t->msgs[i].addr=(struct sockaddr *)&t->addrs[i];
+        t->msgs[i].addrlen=sizeof(t->addrs[i]);
+    }
+    n=pcp_ctx_poll_transmit(ctx, t->msgs, TEST_SANS_IO_BATCH);
+    TEST(n >= 0);
+    return n;
+}
+
+void test_sans_io_answer(test_sans_io_t *t, pcp_ctx_t *ctx, int i,
+        const struct sockaddr *from)
+{
+    pcp_sock_msg_t *m=t->msgs + i;
+    struct timeval ts;
+
+    TEST((m->len == PCP_HDR_LEN) || (m->len >= PCP_HDR_LEN + 36));
+    pcp_server_create_response(m->buf, PCP_RES_SUCCESS, &t->info);
+    gettimeofday(&ts, NULL);
+    TEST(pcp_ctx_input(ctx, m->buf, m->len, from ? from : m->addr, &ts)
+            >= -1);
+}
+
+int test_sans_io_serve(test_sans_io_t *t, pcp_ctx_t *ctx, int answer)
+{
+    int i, n, cnt=0;
+
+    while ((n=test_sans_io_poll(t, ctx)) > 0) {
+        for (i=0; i < n; ++i) {
+            if (t->on_msg) {
+                t->on_msg(t, t->msgs + i);
+            }
+            if (answer) {
+                test_sans_io_answer(t, ctx, i, NULL);
+            }
+        }
+        cnt+=n;
+    }
+    return cnt;
+}
@@ -0,0 +1,120 @@
+/*
+ *------------------------------------------------------------------
+ * test_responder.h
+ *
+ * In-process PCP server for tests - socket virtual table which answers
+ * requests at the moment they are sent, the library then reads responses
+ * back in order. Responses are made by request logic of pcp-server
+ * (pcp_server_create_response). test_udp_resp_* is the same server on
+ * a real UDP socket, for tests of socket handling of the library, and
+ * test_sans_io_* is the one of PCP_INIT_SANS_IO contexts.
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifndef TEST_RESPONDER_H_
+#define TEST_RESPONDER_H_
+
+#include <stddef.h>
+#include <sys/time.h>
+
+#include "pcp.h"
+#include "pcp_socket.h"
+#include "pcp_utils.h"
+#include "pcp_server_resp.h"
+
+#define PCP_HDR_LEN 24
+#define TEST_RESP_QUEUE_LEN 2048
+#define TEST_SANS_IO_BATCH 16
+
+typedef struct test_responder test_responder_t;
+
+/* result code of response to the request, negative => request is dropped */
+typedef int (*test_resp_request_fn)(test_responder_t *r, const char *req,
+        size_t len);
+
+struct test_responder {
+    unsigned head, tail;
+    size_t len[TEST_RESP_QUEUE_LEN];
+    char buf[TEST_RESP_QUEUE_LEN][PCP_MAX_LEN];
+    struct timeval ts[TEST_RESP_QUEUE_LEN]; //when request was answered
+    unsigned dropped;   //requests not answered because queue was full
+    int announce;       //ANNOUNCE requests are answered too
+    server_info_t info; //external address etc. put to responses
+    test_resp_request_fn on_request; //optional, called for every request
+    void *arg;
+};
+
+/* responder of test_responder_vt; thread local, so contexts run by
+ * different threads can have their own */
+extern PCP_THREAD_LOCAL test_responder_t *test_responder;
+
+/* empty queue, MAP responses assign ::ffff:10.0.0.1, ANNOUNCE isn't
+ * answered */
+void test_resp_init(test_responder_t *r);
+
+/* queues response to MAP/PEER v2 (or ANNOUNCE) request; returns 1 if it
+ * was queued */
+int test_resp_request(test_responder_t *r, const void *req, size_t len);
+
+/* takes the next response, which comes from ::ffff:127.0.0.1:5351; *len is
+ * size of buf on input and length of response on output, ts is optional;
+ * returns 0 if there is none */
+int test_resp_next(test_responder_t *r, void *buf, size_t *len,
+        struct sockaddr *src_addr, socklen_t *addrlen, struct timeval *ts);
+
+/* real sockets, for virt. tables of tests */
+PCP_SOCKET test_resp_create(int domain, int type, int protocol);
+int test_resp_close(PCP_SOCKET sockfd);
+
+/* sendto/recvfrom talking to test_responder, sockets are real ones */
+extern pcp_socket_vt_t test_responder_vt;
+
+typedef struct test_udp_responder {
+    int fd;
+    int requests;
+    uint16_t last_src_port; //network order
+    server_info_t info;
+} test_udp_responder_t;
+
+/* binds non-blocking UDP socket to ip:port (host order) if af is AF_INET,
+ * to [::1]:port if it is AF_INET6; returns 0 if the socket can't be bound */
+int test_udp_resp_open(test_udp_responder_t *r, int af, uint32_t ip,
+        uint16_t port);
+
+/* answers all pending MAP/PEER requests by success */
+void test_udp_resp_run(test_udp_responder_t *r);
+
+typedef struct test_sans_io test_sans_io_t;
+
+/* called for every datagram taken by test_sans_io_serve */
+typedef void (*test_sans_io_msg_fn)(test_sans_io_t *t,
+        const pcp_sock_msg_t *msg);
+
+struct test_sans_io {
+    char bufs[TEST_SANS_IO_BATCH][PCP_MAX_LEN];
+    struct sockaddr_storage addrs[TEST_SANS_IO_BATCH];
+    pcp_sock_msg_t msgs[TEST_SANS_IO_BATCH];
+    server_info_t info;
+    test_sans_io_msg_fn on_msg; //optional
+    void *arg;
+};
+
+void test_sans_io_init(test_sans_io_t *t);
+
+/* takes queued datagrams of ctx to msgs, returns their count */
+int test_sans_io_poll(test_sans_io_t *t, pcp_ctx_t *ctx);
+
+/* passes success response to msgs[i] to ctx, as if it was received from
+ * from (msgs[i].addr if NULL) right now */
+void test_sans_io_answer(test_sans_io_t *t, pcp_ctx_t *ctx, int i,
+        const struct sockaddr *from);
+
+/* takes all queued datagrams, answers them if answer is set; returns their
+ * count */
+int test_sans_io_serve(test_sans_io_t *t, pcp_ctx_t *ctx, int answer);
+
+#endif /* TEST_RESPONDER_H_ */
@@ -0,0 +1,326 @@
+/*
+ *------------------------------------------------------------------
+ * test_route_monitor.c
+ *
+ * Test of route monitor (pcp_enable_route_monitor) in its own network
+ * namespace - flows with source address taken from default gateway follow
+ * route change, flows with address given by application are left alone,
+ * removed default route takes down mappings and returning one pings the
+ * gateway. Source address of PEER flow isn't taken from stale cache, PEER
+ * flows to distinct peers of default route share one source address lookup.
+ * Requests are taken and answered through sans-I/O context. Gateway added
+ * later becomes server of all shards. Skipped when network namespace can't
+ * be created.
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE //unshare
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pcp.h"
+#include "pcp_msg_structs.h"
+#include "pcp_socket.h"
+#include "unp.h"
+#include "pcp_utils.h"
+#include "test_macro.h"
+#include "test_responder.h"
+#include "findsaddr.h"
+
+static int findsaddr_calls;
+
+/* source address cache is compiled in, its lookups are counted */
+static const char *count_findsaddr(const struct sockaddr_in *to,
+        struct in6_addr *from)
+{
+    ++findsaddr_calls;
+    return findsaddr(to, from);
+}
+
+#define findsaddr count_findsaddr
+#include "pcp_saddr_cache.c"
+#undef findsaddr
+
+#define GW "10.9.0.2"
+#define SRC "10.9.0.1"
+#define SRC2 "10.9.0.5"
+#define PEER "10.9.0.50"
+#define PEERS 1000
+
+#define PCP_CLIENT_IP_OFFSET 8
+
+static test_sans_io_t peer;
+static struct in_addr client_ip;
+
+static void count_client_ip(test_sans_io_t *t, const pcp_sock_msg_t *msg)
+{
+    if (!memcmp((const char *)msg->buf + PCP_CLIENT_IP_OFFSET + 12,
+            &client_ip, sizeof(client_ip))) {
+        ++*(int *)t->arg;
+    }
+}
+
+/* answers queued requests, counts those with client IP addr (if given) */
+static int serve(pcp_ctx_t *ctx, int answer, const char *addr, int *with_addr)
+{
+    peer.on_msg=NULL;
+    if (addr) {
+        TEST(inet_pton(AF_INET, addr, &client_ip) == 1);
+        peer.on_msg=count_client_ip;
+        peer.arg=with_addr;
+    }
+    return test_sans_io_serve(&peer, ctx, answer);
+}
+
+static pcp_fstate_e flow_state(pcp_flow_t *f)
+{
+    pcp_fstate_e st;
+
+    pcp_eval_flow_state(f, &st);
+    return st;
+}
+
+static pcp_flow_t *new_flow(pcp_ctx_t *ctx, const char *addr, uint16_t port)
+{
+    struct sockaddr_in src;
+
+    memset(&src, 0, sizeof(src));
+    src.sin_family=AF_INET;
+    src.sin_port=htons(port);
+    if (addr) {
+        TEST(inet_pton(AF_INET, addr, &src.sin_addr) == 1);
+    }
+    return pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL,
+            IPPROTO_TCP, 3600, NULL);
+}
+
+/* PEER flow to peer, its source address has to be int_ip */
+static pcp_flow_t *new_peer_flow(pcp_ctx_t *ctx, const char *peer_ip,
+        const char *int_ip, uint16_t port)
+{
+    struct sockaddr_in src, dst;
+    pcp_flow_info_t *info;
+    pcp_flow_t *f;
+    struct in_addr a;
+    size_t cnt;
+
+    memset(&src, 0, sizeof(src));
+    src.sin_family=AF_INET;
+    src.sin_port=htons(port);
+    memset(&dst, 0, sizeof(dst));
+    dst.sin_family=AF_INET;
+    dst.sin_port=htons(80);
+    TEST(inet_pton(AF_INET, peer_ip, &dst.sin_addr) == 1);
+    f=pcp_new_flow(ctx, (struct sockaddr *)&src, (struct sockaddr *)&dst,
+            NULL, IPPROTO_TCP, 3600, NULL);
+    TEST(f);
+
+    info=pcp_flow_get_info(f, &cnt);
+    TEST((info) && (cnt == 1));
+    TEST(inet_pton(AF_INET, int_ip, &a) == 1);
+    TEST(!memcmp(&S6_ADDR32(&info->int_ip)[3], &a, sizeof(a)));
+    free(info);
+    return f;
+}
+
+static void ip(const char *cmd)
+{
+    char buf[256];
+
+    snprintf(buf, sizeof(buf), "ip %s", cmd);
+    TEST(system(buf) == 0);
+}
+
+static void test_route_monitor(void)
+{
+    pcp_ctx_t *ctx;
+    pcp_flow_t *f_auto, *f_fixed;
+    pcp_pollfd_t pfd;
+    int i, cnt;
+
+    ip("link set lo up");
+    ip("addr add " SRC "/24 dev lo");
+    ip("addr add " SRC2 "/24 dev lo");
+    ip("route add default via " GW " dev lo");
+
+    ctx=pcp_init(ENABLE_AUTODISCOVERY | PCP_INIT_SANS_IO, NULL);
+    TEST(ctx);
+    test_sans_io_init(&peer);
+    TEST(pcp_enable_route_monitor(ctx) == PCP_ERR_SUCCESS);
+    TEST(pcp_get_pollfds(ctx, &pfd, 1) == 1);
+    TEST(pfd.events == PCP_EV_ROUTE);
+
+    f_auto=new_flow(ctx, NULL, 1000);
+    f_fixed=new_flow(ctx, SRC, 1001);
+    TEST((f_auto) && (f_fixed));
+    pcp_delete_flow(new_peer_flow(ctx, PEER, SRC, 1002));
+    for (i=0; i < 10; ++i) {
+        pcp_process(ctx, PCP_EV_TIMER);
+        cnt=0;
+        serve(ctx, 1, SRC, &cnt);
+    }
+    TEST(flow_state(f_auto) == pcp_state_succeeded);
+    TEST(flow_state(f_fixed) == pcp_state_succeeded);
+    TEST(pcp_routes_changed(ctx) == 0);
+
+    // only flow with address from the gateway is mapped from the new one
+    ip("route add " GW "/32 dev lo src " SRC2);
+    ip("route add " PEER "/32 dev lo src " SRC2);
+    pcp_process(ctx, PCP_EV_ROUTE);
+    cnt=0;
+    TEST(serve(ctx, 1, SRC2, &cnt) == 1);
+    TEST(cnt == 1);
+    TEST(flow_state(f_auto) == pcp_state_succeeded);
+    TEST(flow_state(f_fixed) == pcp_state_succeeded);
+
+    // cached source address of PEER was dropped
+    pcp_delete_flow(new_peer_flow(ctx, PEER, SRC2, 1002));
+    serve(ctx, 0, NULL, NULL);
+
+    // notifications without change of source address don't map anything
+    ip("route add 10.8.0.0/16 via " GW " dev lo");
+    pcp_process(ctx, PCP_EV_ROUTE);
+    TEST(serve(ctx, 0, NULL, NULL) == 0);
+    ip("route del 10.8.0.0/16");
+
+    // mappings of gateway which is gone are lost
+    ip("route del default");
+    pcp_process(ctx, PCP_EV_ROUTE);
+    pcp_process(ctx, PCP_EV_TIMER);
+    TEST(flow_state(f_auto) == pcp_state_processing);
+    TEST(flow_state(f_fixed) == pcp_state_processing);
+    serve(ctx, 0, NULL, NULL);
+
+    // and the returning one is pinged right away
+    ip("route add default via " GW " dev lo");
+    pcp_process(ctx, PCP_EV_ROUTE);
+    pcp_process(ctx, PCP_EV_TIMER);
+    TEST(serve(ctx, 0, NULL, NULL) > 0);
+
+    pcp_terminate(ctx, 0);
+    free(ctx);
+}
+
+/* source address looked up for destination is addr */
+static void check_saddr(pcp_ctx_t *ctx, const char *dst, const char *addr)
+{
+    struct in6_addr src;
+    struct in_addr a;
+
+    TEST(pcp_findsaddr(ctx, Sock_pton(dst), &src) == NULL);
+    TEST(inet_pton(AF_INET, addr, &a) == 1);
+    TEST(!memcmp(&S6_ADDR32(&src)[3], &a, sizeof(a)));
+}
+
+/* peers reached by default route share cached source address, those of
+ * other routes are looked up one by one */
+static void test_saddr_cache(void)
+{
+    pcp_ctx_t *ctx;
+    char peer_ip[INET_ADDRSTRLEN];
+    int i, calls;
+
+    // gateway is reached from the same address as peers
+    ip("route del " GW "/32");
+    ip("route del " PEER "/32");
+    ctx=pcp_init(ENABLE_AUTODISCOVERY | PCP_INIT_SANS_IO, NULL);
+    TEST(ctx);
+    TEST(pcp_enable_route_monitor(ctx) == PCP_ERR_SUCCESS);
+
+    calls=findsaddr_calls;
+    for (i=0; i < PEERS; ++i) {
+        snprintf(peer_ip, sizeof(peer_ip), "198.18.%d.%d", i / 250,
+                i % 250 + 1);
+        pcp_delete_flow(new_peer_flow(ctx, peer_ip, SRC, 2000));
+    }
+    printf("%d PEER flows to distinct peers, %d source address lookups\n",
+            PEERS, findsaddr_calls - calls);
+    TEST(findsaddr_calls - calls == 1);
+
+    calls=findsaddr_calls;
+    pcp_delete_flow(new_peer_flow(ctx, "10.9.0.60", SRC, 2000));
+    pcp_delete_flow(new_peer_flow(ctx, "10.9.0.61", SRC, 2000));
+    pcp_delete_flow(new_peer_flow(ctx, "10.9.0.61", SRC, 2000));
+    TEST(findsaddr_calls - calls == 2);
+
+    // destinations of new route don't take source of default one
+    check_saddr(ctx, "198.18.1.7", SRC);
+    ip("route add 198.18.1.0/24 dev lo src " SRC2);
+    pcp_process(ctx, PCP_EV_ROUTE);
+    check_saddr(ctx, "198.18.1.7", SRC2);
+    check_saddr(ctx, "198.18.2.7", SRC);
+    ip("route del 198.18.1.0/24");
+
+    pcp_terminate(ctx, 0);
+    free(ctx);
+}
+
+#ifdef PCP_USE_THREADS
+/* gateway added after init reaches all shards, not only the first one */
+static void test_shards(void)
+{
+    pcp_shards_t *sh;
+    pcp_io_stats_t st;
+    int i, tries;
+
+    ip("route del default");
+    sh=pcp_shards_init(2, ENABLE_AUTODISCOVERY, NULL);
+    TEST(sh);
+    TEST(pcp_shards_enable_route_monitor(sh) == PCP_ERR_SUCCESS);
+    for (i=0; i < pcp_shards_count(sh); ++i) {
+        TEST(pcp_get_io_stats(pcp_shards_get_ctx(sh, i), 0, &st)
+                == PCP_ERR_BAD_ARGS);
+    }
+
+    ip("route add default via " GW " dev lo");
+    for (i=0; i < pcp_shards_count(sh); ++i) {
+        for (tries=0; (tries < 100) && (pcp_get_io_stats(
+                pcp_shards_get_ctx(sh, i), 0, &st) != PCP_ERR_SUCCESS);
+                ++tries) {
+            usleep(10000);
+        }
+        TEST(tries < 100);
+    }
+
+    pcp_shards_terminate(sh, 0);
+}
+#endif
+
+int main(int argc, char *argv[] UNUSED)
+{
+    pcp_log_level=argc > 1 ? PCP_LOGLVL_DEBUG : PCP_LOGLVL_NONE;
+
+    if ((unshare(CLONE_NEWNET)) || (system("ip link set lo up"))) {
+        printf("Network namespace can't be set up, test skipped.\n");
+        return 0;
+    }
+    test_route_monitor();
+    test_saddr_cache();
+#ifdef PCP_USE_THREADS
+    test_shards();
+#endif
+
+    printf("Test of route monitor passed.\n");
+    return 0;
+}
@@ -0,0 +1,248 @@
+/*
+ *------------------------------------------------------------------
+ * test_rx_timestamps.c
+ *
+ * Test of receive timestamps - RTT and socket queue delay computed from
+ * timestamps passed in ancillary data by extended socket virtual table,
+ * and kernel timestamps of default socket.
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pcp.h"
+#include "pcp_socket.h"
+#include "unp.h"
+#include "pcp_utils.h"
+#include "test_macro.h"
+#include "test_responder.h"
+
+#define FLOWS 20
+#define PORT_BASE 10000
+
+// simulated network delay of responses and time they wait in queue
+#define RTT_US 2000
+#define QUEUE_US 5000
+
+static test_responder_t responder;
+
+static ssize_t resp_sendto(PCP_SOCKET sockfd UNUSED, const void *buf UNUSED,
+        size_t len, int flags UNUSED, struct sockaddr *dest_addr UNUSED,
+        socklen_t addrlen UNUSED)
+{
+    TEST(0); //everything goes through batch functions
+    return len;
+}
+
+static ssize_t resp_recvfrom(PCP_SOCKET sockfd UNUSED, void *buf UNUSED,
+        size_t len UNUSED, int flags UNUSED, struct sockaddr *src_addr UNUSED,
+        socklen_t *addrlen UNUSED)
+{
+    TEST(0);
+    return PCP_ERR_WOULDBLOCK;
+}
+
+static int resp_sendmmsg(PCP_SOCKET sockfd UNUSED, pcp_sock_msg_t *msgs,
+        unsigned cnt, int flags UNUSED)
+{
+    unsigned i;
+
+    for (i=0; i < cnt; ++i) {
+        test_resp_request(&responder, msgs[i].buf, msgs[i].len);
+    }
+    return (int)cnt;
+}
+
+static int resp_recvmmsg(PCP_SOCKET sockfd UNUSED, pcp_sock_msg_t *msgs,
+        unsigned cnt, int flags UNUSED)
+{
+    unsigned i;
+
+    for (i=0; i < cnt; ++i) {
+        struct timeval sent;
+        struct msghdr h;
+        struct cmsghdr *c;
+        struct timespec ts;
+
+        if (!test_resp_next(&responder, msgs[i].buf, &msgs[i].len,
+                msgs[i].addr, &msgs[i].addrlen, &sent)) {
+            break;
+        }
+        // response "arrives" RTT_US after request was sent
+        sent.tv_usec+=RTT_US;
+        timeval_align(&sent);
+
+        // timestamp as kernel would pass it
+        TEST(msgs[i].control && (msgs[i].controllen >=
+                CMSG_SPACE(sizeof(ts))));
+        memset(&h, 0, sizeof(h));
+        h.msg_control=msgs[i].control;
+        h.msg_controllen=msgs[i].controllen;
+        c=CMSG_FIRSTHDR(&h);
+        c->cmsg_level=SOL_SOCKET;
+        c->cmsg_type=SCM_TIMESTAMPNS;
+        c->cmsg_len=CMSG_LEN(sizeof(ts));
+        ts.tv_sec=sent.tv_sec;
+        ts.tv_nsec=sent.tv_usec * 1000;
+        memcpy(CMSG_DATA(c), &ts, sizeof(ts));
+        msgs[i].controllen=CMSG_SPACE(sizeof(ts));
+        msgs[i].flags=0;
+    }
+    return i ? (int)i : PCP_ERR_WOULDBLOCK;
+}
+
+static pcp_socket_vt_ext_t responder_vt={
+        {
+            test_resp_create,
+            resp_recvfrom,
+            resp_sendto,
+            test_resp_close
+        },
+        PCP_SOCKET_VT_EXT_VERSION,
+        resp_sendmmsg,
+        resp_recvmmsg
+};
+
+static int succeeded;
+
+static void notify_cb(pcp_flow_t *f UNUSED, struct sockaddr *src_addr UNUSED,
+        struct sockaddr *ext_addr UNUSED, pcp_fstate_e s, void *cb_arg UNUSED)
+{
+    if (s == pcp_state_succeeded) {
+        ++succeeded;
+    }
+}
+
+static void test_ancillary_timestamps(void)
+{
+    pcp_ctx_t *ctx;
+    pcp_io_stats_t st;
+    int i, srv;
+
+    test_resp_init(&responder);
+    ctx=pcp_init(DISABLE_AUTODISCOVERY | PCP_INIT_SOCKET_VT_EXT,
+            &responder_vt.base);
+    TEST(ctx);
+    pcp_set_flow_change_cb(ctx, notify_cb, NULL);
+    srv=pcp_add_server(ctx, Sock_pton("127.0.0.1:5351"), 2);
+    TEST(srv == 0);
+    TEST(pcp_get_io_stats(ctx, srv + 1, &st) == PCP_ERR_BAD_ARGS);
+
+    for (i=0; i < FLOWS; ++i) {
+        struct sockaddr_in src;
+
+        memset(&src, 0, sizeof(src));
+        src.sin_family=AF_INET;
+        src.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+        src.sin_port=htons(PORT_BASE + i);
+        TEST(pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL,
+                IPPROTO_TCP, 3600, NULL));
+    }
+
+    for (i=0; (succeeded < FLOWS) && (i < 100); ++i) {
+        pcp_process(ctx, PCP_EV_READ | PCP_EV_TIMER);
+        usleep(QUEUE_US);
+    }
+    TEST(succeeded == FLOWS);
+
+    TEST(pcp_get_io_stats(ctx, srv, &st) == PCP_ERR_SUCCESS);
+    printf("rtt: %u samples, last %uus, min %uus, srtt %uus, var %uus\n",
+            st.rtt_samples, st.rtt_last_us, st.rtt_min_us, st.rtt_srtt_us,
+            st.rtt_var_us);
+    printf("queue: %llu msgs, %llu stamped, last %uus, max %uus, avg %lluus\n",
+            (unsigned long long)st.rx_msgs,
+            (unsigned long long)st.rx_kernel_ts, st.queue_last_us,
+            st.queue_max_us,
+            (unsigned long long)(st.queue_total_us / st.rx_kernel_ts));
+    TEST(st.rtt_samples == FLOWS);
+    TEST((st.rtt_min_us >= RTT_US) && (st.rtt_min_us < RTT_US + QUEUE_US / 2));
+    TEST((st.rtt_srtt_us >= RTT_US) && (st.rtt_srtt_us < RTT_US + QUEUE_US / 2));
+    TEST(st.rx_msgs == FLOWS);
+    TEST(st.rx_kernel_ts == FLOWS);
+    TEST(st.queue_max_us >= QUEUE_US - RTT_US);
+
+    TEST(pcp_get_io_stats(ctx, -1, &st) == PCP_ERR_SUCCESS);
+    TEST((st.rtt_samples == 0) && (st.rx_msgs == FLOWS));
+
+    pcp_terminate(ctx, 0);
+    free(ctx);
+}
+
+#ifdef __linux__
+/* datagram from unknown peer is dropped, but it's timestamped by kernel */
+static void test_kernel_timestamps(void)
+{
+    pcp_ctx_t *ctx;
+    pcp_io_stats_t st;
+    struct sockaddr_storage ss;
+    struct sockaddr_in dst;
+    socklen_t len=sizeof(ss);
+    int s;
+    char buf[PCP_HDR_LEN];
+
+    ctx=pcp_init(DISABLE_AUTODISCOVERY, NULL);
+    TEST(ctx);
+    TEST(getsockname(pcp_get_socket(ctx), (struct sockaddr *)&ss, &len) == 0);
+
+    memset(&dst, 0, sizeof(dst));
+    dst.sin_family=AF_INET;
+    dst.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    dst.sin_port=ss.ss_family == AF_INET6 ?
+            ((struct sockaddr_in6 *)&ss)->sin6_port :
+            ((struct sockaddr_in *)&ss)->sin_port;
+
+    s=socket(AF_INET, SOCK_DGRAM, 0);
+    TEST(s >= 0);
+    memset(buf, 0, sizeof(buf));
+    TEST(sendto(s, buf, sizeof(buf), 0, (struct sockaddr *)&dst,
+            sizeof(dst)) == sizeof(buf));
+    close(s);
+
+    usleep(QUEUE_US);
+    pcp_process(ctx, PCP_EV_READ);
+
+    TEST(pcp_get_io_stats(ctx, -1, &st) == PCP_ERR_SUCCESS);
+    printf("kernel: %llu msgs, %llu stamped, queue %uus\n",
+            (unsigned long long)st.rx_msgs,
+            (unsigned long long)st.rx_kernel_ts, st.queue_last_us);
+    TEST(st.rx_msgs == 1);
+    // where loopback datagram gets stamped depends on kernel configuration,
+    // only presence of the timestamp is checked
+    TEST(st.rx_kernel_ts == 1);
+
+    pcp_terminate(ctx, 0);
+    free(ctx);
+}
+#endif
+
+int main(int argc, char *argv[] UNUSED)
+{
+    pcp_log_level=argc > 1 ? PCP_LOGLVL_DEBUG : PCP_LOGLVL_NONE;
+
+    test_ancillary_timestamps();
+#ifdef __linux__
+    test_kernel_timestamps();
+#endif
+
+    printf("Test of receive timestamps passed.\n");
+    return 0;
+}
@@ -0,0 +1,291 @@
+/*
+ *------------------------------------------------------------------
+ * test_sans_io.c
+ *
+ * Test of sans-I/O context (PCP_INIT_SANS_IO) - no socket is created,
+ * requests of IPv4 and IPv6 servers are taken by pcp_ctx_poll_transmit and
+ * answered through pcp_ctx_input, unanswered ones are retransmitted when
+ * pcp_process handles the deadline. Servers without flows are probed by
+ * ANNOUNCE and requests of new flow go to the fastest one first.
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pcp.h"
+#include "pcp_msg_structs.h"
+#include "pcp_socket.h"
+#include "unp.h"
+#include "pcp_utils.h"
+#include "test_macro.h"
+#include "test_responder.h"
+
+#define SERVERS 2 //IPv4 and IPv6 one
+#define FLOWS 50  //per server
+#define PORT_BASE 10000
+#define PROBED 3 //servers probed before flows exist
+
+static test_sans_io_t peer;
+static int requests[SERVERS];
+
+static void count_request(test_sans_io_t *t UNUSED, const pcp_sock_msg_t *msg)
+{
+    ++requests[msg->addr->sa_family == AF_INET6];
+}
+
+static int count_succeeded(pcp_flow_t **flows)
+{
+    int i, cnt=0;
+
+    for (i=0; i < SERVERS * FLOWS; ++i) {
+        pcp_fstate_e st;
+
+        pcp_eval_flow_state(flows[i], &st);
+        cnt+=st == pcp_state_succeeded;
+    }
+    return cnt;
+}
+
+static void new_flows(pcp_ctx_t *ctx, pcp_flow_t **flows)
+{
+    int i;
+
+    for (i=0; i < SERVERS * FLOWS; ++i) {
+        struct sockaddr_storage src;
+
+        memset(&src, 0, sizeof(src));
+        if (i < FLOWS) {
+            struct sockaddr_in *sin=(struct sockaddr_in *)&src;
+
+            sin->sin_family=AF_INET;
+            sin->sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+            sin->sin_port=htons(PORT_BASE + i);
+        } else {
+            struct sockaddr_in6 *sin6=(struct sockaddr_in6 *)&src;
+
+            sin6->sin6_family=AF_INET6;
+            sin6->sin6_addr=in6addr_loopback;
+            sin6->sin6_port=htons(PORT_BASE + i);
+        }
+        flows[i]=pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL,
+                IPPROTO_TCP, 3600, NULL);
+        TEST(flows[i]);
+    }
+}
+
+static pcp_ctx_t *init(void)
+{
+    pcp_ctx_t *ctx;
+    pcp_pollfd_t pfd;
+
+    ctx=pcp_init(DISABLE_AUTODISCOVERY | PCP_INIT_SANS_IO, NULL);
+    TEST(ctx);
+    TEST(pcp_get_socket(ctx) == PCP_INVALID_SOCKET);
+    TEST(pcp_get_pollfds(ctx, &pfd, 1) == 0);
+    TEST(pcp_add_server(ctx, Sock_pton("127.0.0.1:5351"), 2) == 0);
+    TEST(pcp_add_server(ctx, Sock_pton("[::1]:5351"), 2) == 1);
+    test_sans_io_init(&peer);
+    peer.on_msg=count_request;
+    return ctx;
+}
+
+static void test_flows(void)
+{
+    pcp_ctx_t *ctx=init();
+    pcp_flow_t *flows[SERVERS * FLOWS];
+    pcp_io_stats_t st;
+    int i;
+
+    new_flows(ctx, flows);
+    for (i=0; (count_succeeded(flows) < SERVERS * FLOWS) && (i < 10); ++i) {
+        test_sans_io_serve(&peer, ctx, 1);
+        pcp_process(ctx, PCP_EV_TIMER);
+    }
+    printf("%d flows succeeded, requests IPv4 %d, IPv6 %d\n",
+            count_succeeded(flows), requests[0], requests[1]);
+    TEST(count_succeeded(flows) == SERVERS * FLOWS);
+    TEST(requests[0] >= FLOWS);
+    TEST(requests[1] >= FLOWS);
+
+    // arrival times were passed in
+    TEST(pcp_get_io_stats(ctx, -1, &st) == PCP_ERR_SUCCESS);
+    TEST(st.rx_msgs >= SERVERS * FLOWS);
+    TEST(st.rx_kernel_ts == st.rx_msgs);
+
+    pcp_terminate(ctx, 0);
+    free(ctx);
+}
+
+static void test_retransmit(void)
+{
+    pcp_ctx_t *ctx=init();
+    pcp_flow_t *flows[SERVERS * FLOWS];
+    struct timeval deadline;
+    int i, ms;
+
+    // servers are probed by the first request, others wait for its response
+    new_flows(ctx, flows);
+    pcp_process(ctx, PCP_EV_TIMER);
+    TEST(test_sans_io_serve(&peer, ctx, 0) == SERVERS);
+    TEST(test_sans_io_serve(&peer, ctx, 0) == 0);
+
+    // unanswered probes are sent again at the deadline
+    ms=pcp_get_deadline(ctx, &deadline);
+    printf("retransmission in %d ms\n", ms);
+    TEST((ms >= 0) && (ms < 10000));
+    usleep((ms + 10) * 1000);
+    pcp_process(ctx, PCP_EV_TIMER);
+    TEST(test_sans_io_serve(&peer, ctx, 1) >= SERVERS);
+    for (i=0; (count_succeeded(flows) < SERVERS * FLOWS) && (i < 10); ++i) {
+        pcp_process(ctx, PCP_EV_TIMER);
+        test_sans_io_serve(&peer, ctx, 1);
+    }
+    TEST(count_succeeded(flows) == SERVERS * FLOWS);
+
+    pcp_terminate(ctx, 0);
+    free(ctx);
+}
+
+static uint8_t server_byte(struct sockaddr *addr)
+{
+    return ntohl(((struct sockaddr_in *)addr)->sin_addr.s_addr) & 0xff;
+}
+
+static void test_probe(void)
+{
+    pcp_ctx_t *ctx;
+    pcp_flow_t *f;
+    pcp_flow_info_t *info;
+    pcp_io_stats_t st;
+    struct sockaddr_in src;
+    size_t cnt;
+    int i;
+
+    ctx=pcp_init(DISABLE_AUTODISCOVERY | PCP_INIT_SANS_IO, NULL);
+    TEST(ctx);
+    test_sans_io_init(&peer);
+    for (i=0; i < PROBED; ++i) {
+        char addr[32];
+
+        snprintf(addr, sizeof(addr), "127.0.0.%d:5351", i + 1);
+        TEST(pcp_add_server(ctx, Sock_pton(addr), 2) == i);
+    }
+
+    // all servers are probed at once, without any flow
+    pcp_process(ctx, PCP_EV_TIMER);
+    TEST(test_sans_io_poll(&peer, ctx) == PROBED);
+    for (i=0; i < PROBED; ++i) {
+        TEST(peer.msgs[i].len == PCP_HDR_LEN);
+        TEST((peer.bufs[i][1] & 0x7f) == PCP_OPCODE_ANNOUNCE);
+    }
+
+    // the third server responds first, the second one not at all
+    test_sans_io_answer(&peer, ctx, 2, NULL);
+    usleep(20000);
+    test_sans_io_answer(&peer, ctx, 0, NULL);
+    pcp_process(ctx, PCP_EV_TIMER);
+    TEST(test_sans_io_poll(&peer, ctx) == 0);
+    TEST(pcp_get_io_stats(ctx, 2, &st) == PCP_ERR_SUCCESS);
+    TEST(st.rtt_samples == 1);
+    TEST(pcp_get_io_stats(ctx, 0, &st) == PCP_ERR_SUCCESS);
+    TEST(st.rtt_samples == 1);
+
+    // new flow is sent right away to responding servers, the fastest one
+    // heads the chain
+    memset(&src, 0, sizeof(src));
+    src.sin_family=AF_INET;
+    src.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    src.sin_port=htons(PORT_BASE);
+    f=pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL, IPPROTO_TCP,
+            3600, NULL);
+    TEST(f);
+    info=pcp_flow_get_info(f, &cnt);
+    TEST((info) && (cnt == PROBED));
+    TEST((ntohl(S6_ADDR32(&info[0].pcp_server_ip)[3]) & 0xff) == 3);
+    TEST((ntohl(S6_ADDR32(&info[1].pcp_server_ip)[3]) & 0xff) == 1);
+    free(info);
+
+    pcp_process(ctx, PCP_EV_TIMER);
+    TEST(test_sans_io_poll(&peer, ctx) == 2);
+    TEST(server_byte(peer.msgs[0].addr) + server_byte(peer.msgs[1].addr)
+            == 1 + 3);
+    test_sans_io_answer(&peer, ctx, 0, NULL);
+    test_sans_io_answer(&peer, ctx, 1, NULL);
+    info=pcp_flow_get_info(f, &cnt);
+    TEST((info) && (cnt == PROBED));
+    TEST(info[0].result == pcp_state_succeeded);
+    TEST(info[1].result == pcp_state_succeeded);
+    TEST(info[2].result != pcp_state_succeeded);
+    free(info);
+
+    pcp_terminate(ctx, 0);
+    free(ctx);
+}
+
+static void test_args(void)
+{
+    pcp_ctx_t *ctx=init();
+    pcp_flow_t *flows[SERVERS * FLOWS];
+    struct sockaddr_in from;
+    char small[8];
+    pcp_sock_msg_t m;
+
+    new_flows(ctx, flows);
+    pcp_process(ctx, PCP_EV_TIMER);
+    memset(&m, 0, sizeof(m));
+    m.buf=small;
+    m.len=sizeof(small);
+    TEST(pcp_ctx_poll_transmit(ctx, &m, 1) == PCP_ERR_MAX_SIZE);
+    TEST(pcp_ctx_poll_transmit(NULL, &m, 1) == PCP_ERR_BAD_ARGS);
+    TEST(pcp_wait(flows[0], 10, 0) == pcp_state_failed);
+
+    // datagram of unknown server is ignored
+    memset(&from, 0, sizeof(from));
+    from.sin_family=AF_INET;
+    from.sin_addr.s_addr=htonl(0x7f000063);
+    TEST(test_sans_io_poll(&peer, ctx) > 0);
+    test_sans_io_answer(&peer, ctx, 0, (struct sockaddr *)&from);
+    TEST(count_succeeded(flows) == 0);
+    TEST(pcp_ctx_input(ctx, peer.msgs[0].buf, PCP_MAX_LEN + 1,
+            (struct sockaddr *)&from, NULL) == PCP_ERR_MAX_SIZE);
+    pcp_terminate(ctx, 0);
+    free(ctx);
+
+    // context with sockets has no transmit queue
+    ctx=pcp_init(DISABLE_AUTODISCOVERY, NULL);
+    TEST(ctx);
+    TEST(pcp_ctx_poll_transmit(ctx, &m, 1) == PCP_ERR_NOT_FOUND);
+    pcp_terminate(ctx, 0);
+    free(ctx);
+}
+
+int main(int argc, char *argv[] UNUSED)
+{
+    pcp_log_level=argc > 1 ? PCP_LOGLVL_DEBUG : PCP_LOGLVL_NONE;
+
+    test_flows();
+    test_args();
+    test_retransmit();
+    test_probe();
+
+    printf("Test of sans-I/O context passed.\n");
+    return 0;
+}
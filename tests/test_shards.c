@@ -0,0 +1,148 @@
+/*
+ *------------------------------------------------------------------
+ * test_shards.c
+ *
+ * Test of sharded contexts manager - flows are spread over shards by key,
+ * results come through one serialized callback.
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pcp.h"
+#include "pcp_socket.h"
+#include "pcp_client_db.h"
+#include "unp.h"
+#include "pcp_utils.h"
+#include "test_macro.h"
+
+#ifdef PCP_USE_THREADS
+
+#define SHARDS 4
+#define FLOWS 40
+
+static int succeeded_cnt;
+static int in_cb;
+
+static void notify_cb(pcp_flow_t *f UNUSED, struct sockaddr *src_addr UNUSED,
+        struct sockaddr *ext_addr UNUSED, pcp_fstate_e s, void *cb_arg)
+{
+    TEST(cb_arg == &succeeded_cnt);
+    // calls from different shard threads must not overlap
+    TEST(__atomic_add_fetch(&in_cb, 1, __ATOMIC_SEQ_CST) == 1);
+    if (s == pcp_state_succeeded) {
+        ++succeeded_cnt;
+    }
+    usleep(100);
+    __atomic_sub_fetch(&in_cb, 1, __ATOMIC_SEQ_CST);
+}
+
+static void make_src(struct sockaddr_in *src, int i)
+{
+    memset(src, 0, sizeof(*src));
+    src->sin_family=AF_INET;
+    src->sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    src->sin_port=htons(3000 + i);
+}
+
+int main(int argc, char *argv[] UNUSED)
+{
+    pcp_shards_t *sh;
+    pcp_flow_t *flows[FLOWS];
+    int per_shard[SHARDS];
+    int i, j;
+
+    pcp_log_level=argc > 1 ? PCP_LOGLVL_DEBUG : 1;
+
+    // one shard per CPU by default
+    sh=pcp_shards_init(0, DISABLE_AUTODISCOVERY, NULL);
+    TEST(sh);
+    TEST(pcp_shards_count(sh) == sysconf(_SC_NPROCESSORS_ONLN));
+    pcp_shards_terminate(sh, 0);
+
+    // gateways found by shard 0 are copied to the rest
+    sh=pcp_shards_init(2, ENABLE_AUTODISCOVERY, NULL);
+    TEST(sh);
+    pcp_shards_terminate(sh, 0);
+
+    sh=pcp_shards_init(SHARDS, DISABLE_AUTODISCOVERY, NULL);
+    TEST(sh);
+    TEST(pcp_shards_count(sh) == SHARDS);
+    TEST(pcp_shards_get_ctx(sh, SHARDS) == NULL);
+
+    // each shard has its own socket
+    for (i=0; i < SHARDS; ++i) {
+        for (j=i + 1; j < SHARDS; ++j) {
+            TEST(pcp_get_socket(pcp_shards_get_ctx(sh, i))
+                    != pcp_get_socket(pcp_shards_get_ctx(sh, j)));
+        }
+    }
+
+    TEST(pcp_shards_add_server(sh, Sock_pton("127.0.0.1:5351"), 2) == 0);
+    pcp_shards_set_flow_change_cb(sh, notify_cb, &succeeded_cnt);
+
+    memset(per_shard, 0, sizeof(per_shard));
+    for (i=0; i < FLOWS; ++i) {
+        struct sockaddr_in src;
+
+        make_src(&src, i);
+        flows[i]=pcp_shards_new_flow(sh, (struct sockaddr *)&src, NULL, NULL,
+                IPPROTO_TCP, 100, NULL);
+        TEST(flows[i]);
+
+        for (j=0; j < SHARDS; ++j) {
+            if (flows[i]->ctx == pcp_shards_get_ctx(sh, j)) {
+                ++per_shard[j];
+            }
+        }
+    }
+    // key always maps to the same shard
+    {
+        struct sockaddr_in src;
+
+        make_src(&src, 0);
+        TEST(pcp_shards_new_flow(sh, (struct sockaddr *)&src, NULL, NULL,
+                IPPROTO_TCP, 100, NULL)->ctx == flows[0]->ctx);
+    }
+    for (j=0; j < SHARDS; ++j) {
+        printf("shard %d: %d flows\n", j, per_shard[j]);
+        TEST(per_shard[j] > 0);
+    }
+
+    for (i=0; i < FLOWS; ++i) {
+        TEST(pcp_wait(flows[i], 5000, 0) == pcp_state_succeeded);
+    }
+
+    pcp_shards_terminate(sh, 1);
+    TEST(succeeded_cnt >= FLOWS);
+
+    printf("Test of PCP shards passed.\n");
+    return 0;
+}
+
+#else
+
+int main(void)
+{
+    printf("Built without thread support, skipping.\n");
+    return 0;
+}
+
+#endif
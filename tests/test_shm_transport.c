@@ -0,0 +1,261 @@
+/*
+ *------------------------------------------------------------------
+ * test_shm_transport.c
+ *
+ * Test of in-process shared-memory transport and simulated PCP server:
+ * request checks shared with pcp-server, flows of two servers going through
+ * rings smaller than number of flows, result code forced by server info and
+ * pollable socket of notifying transport.
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pcp.h"
+#include "pcp_msg_structs.h"
+#include "unp.h"
+#include "pcp_utils.h"
+#include "pcp_shm_transport.h"
+#include "test_macro.h"
+
+#define SERVERS 2   //with the same source address, flows are mapped by both
+#define FLOWS 100
+#define SLOTS 32
+#define PORT_BASE 10000
+
+static void test_check_request(void)
+{
+    char req[PCP_MAX_LEN];
+    pcp_request_t *r=(pcp_request_t *)req;
+    pcp_options_hdr_t *opt;
+    int len=sizeof(pcp_request_t) + sizeof(pcp_map_v2_t);
+
+    memset(req, 0, sizeof(req));
+    r->ver=2;
+    r->r_opcode=PCP_OPCODE_MAP;
+    TEST(pcp_server_check_request(req, len, 2) == PCP_RES_SUCCESS);
+    TEST(pcp_server_check_request(req, len - 2, 2)
+            == PCP_RES_MALFORMED_REQUEST);
+    TEST(pcp_server_check_request(req, len - 4, 2)
+            == PCP_RES_MALFORMED_OPTION);
+    TEST(pcp_server_check_request(req, len, 1) == PCP_RES_UNSUPP_VERSION);
+
+    // third party option may occur once
+    opt=(pcp_options_hdr_t *)(req + len);
+    opt->code=PCP_OPTION_3RD_PARTY;
+    opt->len=htons(16);
+    memcpy(req + len + 20, opt, sizeof(*opt));
+    TEST(pcp_server_check_request(req, len + 20, 2) == PCP_RES_SUCCESS);
+    TEST(pcp_server_check_request(req, len + 40, 2)
+            == PCP_RES_MALFORMED_OPTION);
+
+    // prefer failure is MAP only
+    r->r_opcode=PCP_OPCODE_PEER;
+    len=sizeof(pcp_request_t) + sizeof(pcp_peer_v2_t);
+    opt=(pcp_options_hdr_t *)(req + len);
+    opt->code=PCP_OPTION_PREF_FAIL;
+    opt->len=0;
+    TEST(pcp_server_check_request(req, len, 2) == PCP_RES_SUCCESS);
+    TEST(pcp_server_check_request(req, len + 4, 2)
+            == PCP_RES_MALFORMED_REQUEST);
+}
+
+static void new_flows(pcp_ctx_t *ctx, pcp_flow_t **flows)
+{
+    int i;
+
+    for (i=0; i < FLOWS; ++i) {
+        struct sockaddr_in src;
+
+        memset(&src, 0, sizeof(src));
+        src.sin_family=AF_INET;
+        src.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+        src.sin_port=htons(PORT_BASE + i);
+        flows[i]=pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL,
+                IPPROTO_TCP, 3600, NULL);
+        TEST(flows[i]);
+    }
+}
+
+static int count_flows(pcp_flow_t **flows, pcp_fstate_e state)
+{
+    int i, cnt=0;
+
+    for (i=0; i < FLOWS; ++i) {
+        pcp_fstate_e st;
+
+        pcp_eval_flow_state(flows[i], &st);
+        cnt+=st == state;
+    }
+    return cnt;
+}
+
+/* requests of all servers are sent in budgeted pulses, so they fit in ring */
+static int run(pcp_shm_t *shm, const server_info_t *info,
+        pcp_fstate_e state)
+{
+    pcp_ctx_t *ctx;
+    pcp_flow_t *flows[FLOWS];
+    pcp_budget_t budget={SLOTS / (2 * SERVERS), 0};
+    int i, cnt=0;
+
+    ctx=pcp_init(DISABLE_AUTODISCOVERY | PCP_INIT_SOCKET_VT_EXT,
+            pcp_shm_socket_vt(shm));
+    TEST(ctx);
+    TEST(pcp_add_server(ctx, Sock_pton("127.0.0.1:5351"), 2) == 0);
+    TEST(pcp_add_server(ctx, Sock_pton("127.0.0.2:5351"), 2) == 1);
+    new_flows(ctx, flows);
+
+    for (i=0; (cnt < FLOWS) && (i < 1000); ++i) {
+        struct timeval tv={0, 0};
+
+        pcp_pulse_budget(ctx, &budget, &tv, NULL);
+        pcp_shm_serve(shm, info, 0);
+        cnt=count_flows(flows, state);
+    }
+    printf("%d flows in state %d after %d pulses\n", cnt, state, i);
+
+    pcp_terminate(ctx, 0);
+    free(ctx);
+
+    return cnt;
+}
+
+static void test_flows(void)
+{
+    pcp_shm_t *shm=pcp_shm_create(SLOTS, 0);
+    pcp_shm_stats_t st;
+    server_info_t info;
+
+    TEST(shm);
+    TEST(run(shm, NULL, pcp_state_succeeded) == FLOWS);
+    pcp_shm_get_stats(shm, &st);
+    TEST(st.requests >= SERVERS * FLOWS);
+    TEST(st.rx_msgs == st.requests);
+
+    // forced result code
+    memset(&info, 0, sizeof(info));
+    info.server_version=2;
+    info.default_result_code=PCP_RES_NOT_AUTHORIZED;
+    info.epoch_time_start=time(NULL);
+    TEST(run(shm, &info, pcp_state_failed) == FLOWS);
+
+    pcp_shm_destroy(shm);
+}
+
+static void test_full_ring(void)
+{
+    pcp_shm_t *shm=pcp_shm_create(SLOTS, 0);
+    pcp_socket_vt_ext_t *vt=(pcp_socket_vt_ext_t *)pcp_shm_socket_vt(shm);
+    pcp_sock_msg_t msgs[SLOTS + 1];
+    pcp_shm_stats_t st;
+    char req[sizeof(pcp_request_t)];
+    struct sockaddr_in dst;
+    PCP_SOCKET s;
+    int i;
+
+    memset(req, 0, sizeof(req));
+    req[0]=2;
+    memset(&dst, 0, sizeof(dst));
+    dst.sin_family=AF_INET;
+    memset(msgs, 0, sizeof(msgs));
+    for (i=0; i < SLOTS + 1; ++i) {
+        msgs[i].buf=req;
+        msgs[i].len=sizeof(req);
+        msgs[i].addr=(struct sockaddr *)&dst;
+        msgs[i].addrlen=sizeof(dst);
+    }
+
+    s=vt->base.sock_create(AF_INET, SOCK_DGRAM, 0);
+    TEST(s != PCP_INVALID_SOCKET);
+    TEST(vt->sock_sendmmsg(s, msgs, SLOTS + 1, 0) == SLOTS);
+    TEST(vt->sock_sendmmsg(s, msgs, 1, 0) == PCP_ERR_WOULDBLOCK);
+    TEST(vt->base.sock_sendto(s, req, sizeof(req), 0,
+            (struct sockaddr *)&dst, sizeof(dst)) == PCP_ERR_WOULDBLOCK);
+    pcp_shm_get_stats(shm, &st);
+    TEST(st.tx_full == 3);
+
+    // served requests free the request ring
+    TEST(pcp_shm_serve(shm, NULL, 4) == 4);
+    TEST(vt->sock_sendmmsg(s, msgs, SLOTS + 1, 0) == 4);
+    vt->base.sock_close(s);
+
+    pcp_shm_destroy(shm);
+}
+
+#ifdef __linux__
+static void test_notify(void)
+{
+    pcp_shm_t *shm=pcp_shm_create(SLOTS, 1);
+    pcp_ctx_t *ctx;
+    pcp_flow_t *f;
+    struct sockaddr_in src;
+    struct pollfd pfd;
+    pcp_fstate_e st;
+
+    TEST(shm);
+    ctx=pcp_init(DISABLE_AUTODISCOVERY | PCP_INIT_SOCKET_VT_EXT,
+            pcp_shm_socket_vt(shm));
+    TEST(ctx);
+    TEST(pcp_add_server(ctx, Sock_pton("127.0.0.1:5351"), 2) == 0);
+    pfd.fd=pcp_get_socket(ctx);
+    pfd.events=POLLIN;
+
+    memset(&src, 0, sizeof(src));
+    src.sin_family=AF_INET;
+    src.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    src.sin_port=htons(PORT_BASE);
+    f=pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL, IPPROTO_TCP,
+            3600, NULL);
+    TEST(f);
+
+    // socket is readable only while responses wait in the ring
+    do {
+        pcp_process(ctx, PCP_EV_TIMER);
+        TEST(poll(&pfd, 1, 0) == 0);
+        TEST(pcp_shm_serve(shm, NULL, 0) > 0);
+        TEST(poll(&pfd, 1, 0) == 1);
+        pcp_process(ctx, PCP_EV_READ);
+        pcp_eval_flow_state(f, &st);
+    } while (st != pcp_state_succeeded);
+    TEST(poll(&pfd, 1, 0) == 0);
+
+    pcp_terminate(ctx, 0);
+    free(ctx);
+    pcp_shm_destroy(shm);
+}
+#endif
+
+int main(int argc, char *argv[] UNUSED)
+{
+    pcp_log_level=argc > 1 ? PCP_LOGLVL_DEBUG : PCP_LOGLVL_NONE;
+
+    test_check_request();
+    test_flows();
+    test_full_ring();
+#ifdef __linux__
+    test_notify();
+#endif
+
+    printf("Test of shared-memory transport passed.\n");
+    return 0;
+}
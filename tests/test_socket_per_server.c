@@ -0,0 +1,243 @@
+/*
+ *------------------------------------------------------------------
+ * test_socket_per_server.c
+ *
+ * Test of PCP_INIT_SOCKET_PER_SERVER - each server is talked to through its
+ * own socket, all of them are returned by pcp_get_pollfds and read by
+ * pcp_process; receive buffer of each socket is set separately.
+ * With PCP_INIT_SOCKET_CONNECTED the sockets are connected to servers and
+ * datagrams from other senders don't reach the library.
+ * Servers are simulated by in-process responders on UDP sockets.
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pcp.h"
+#include "pcp_socket.h"
+#include "unp.h"
+#include "pcp_utils.h"
+#include "test_macro.h"
+#include "test_responder.h"
+
+#define SERVERS 2
+#define FLOWS 10
+#define PORT_BASE 10000
+#define RESP_PORT_BASE 15351
+#define RCVBUF 65536
+
+static test_udp_responder_t resp[SERVERS];
+
+static uint16_t sock_port(PCP_SOCKET s)
+{
+    struct sockaddr_storage ss;
+    socklen_t len=sizeof(ss);
+
+    TEST(getsockname(s, (struct sockaddr *)&ss, &len) == 0);
+    return ss.ss_family == AF_INET6 ? ((struct sockaddr_in6 *)&ss)->sin6_port :
+            ((struct sockaddr_in *)&ss)->sin_port;
+}
+
+/* sends datagram to sock from another socket, returns count of datagrams
+ * library received from it */
+static uint64_t stray_datagram(pcp_ctx_t *ctx, PCP_SOCKET sock)
+{
+    struct sockaddr_in dst;
+    pcp_io_stats_t st;
+    uint64_t rx_msgs;
+    char buf[PCP_HDR_LEN];
+    int s;
+
+    TEST(pcp_get_io_stats(ctx, -1, &st) == PCP_ERR_SUCCESS);
+    rx_msgs=st.rx_msgs;
+
+    memset(&dst, 0, sizeof(dst));
+    dst.sin_family=AF_INET;
+    dst.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    dst.sin_port=sock_port(sock);
+    s=socket(AF_INET, SOCK_DGRAM, 0);
+    TEST(s >= 0);
+    memset(buf, 0, sizeof(buf));
+    TEST(sendto(s, buf, sizeof(buf), 0, (struct sockaddr *)&dst,
+            sizeof(dst)) == sizeof(buf));
+    close(s);
+
+    usleep(1000);
+    pcp_process(ctx, PCP_EV_READ);
+    TEST(pcp_get_io_stats(ctx, -1, &st) == PCP_ERR_SUCCESS);
+
+    return st.rx_msgs - rx_msgs;
+}
+
+static void test_per_server(int connected)
+{
+    pcp_ctx_t *ctx;
+    pcp_flow_t *flows[FLOWS];
+    pcp_pollfd_t pfds[SERVERS + 1];
+    struct pollfd fds[SERVERS + 1];
+    int i, n, tout, val, succeeded=0;
+    socklen_t val_len=sizeof(val);
+
+    ctx=pcp_init(DISABLE_AUTODISCOVERY | (connected ?
+            PCP_INIT_SOCKET_CONNECTED : PCP_INIT_SOCKET_PER_SERVER), NULL);
+    TEST(ctx);
+    TEST(pcp_get_pollfds(ctx, NULL, 0) == 1);
+
+    for (i=0; i < SERVERS; ++i) {
+        char addr[32];
+
+        TEST(test_udp_resp_open(resp + i, AF_INET, INADDR_LOOPBACK + i,
+                RESP_PORT_BASE + i));
+        snprintf(addr, sizeof(addr), "127.0.0.%d:%d", i + 1,
+                RESP_PORT_BASE + i);
+        TEST(pcp_add_server(ctx, Sock_pton(addr), 2) == i);
+    }
+
+    // context socket followed by sockets of servers in order of their IDs
+    n=pcp_get_pollfds(ctx, pfds, SERVERS + 1);
+    TEST(n == SERVERS + 1);
+    TEST(pfds[0].fd == pcp_get_socket(ctx));
+    for (i=0; i < n; ++i) {
+        TEST(pfds[i].events == PCP_EV_READ);
+        TEST((i == 0) || (pfds[i].fd != pfds[i - 1].fd));
+        fds[i].fd=pfds[i].fd;
+        fds[i].events=POLLIN;
+    }
+
+    // receive buffers are sized per socket
+    TEST(pcp_set_rcvbuf(ctx, SERVERS, RCVBUF) == PCP_ERR_BAD_ARGS);
+    TEST(pcp_set_rcvbuf(ctx, 0, 0) == PCP_ERR_BAD_ARGS);
+    TEST(pcp_set_rcvbuf(ctx, 0, RCVBUF) == PCP_ERR_SUCCESS);
+    TEST(pcp_set_rcvbuf(ctx, -1, RCVBUF * 2) == PCP_ERR_SUCCESS);
+    TEST(getsockopt(pfds[1].fd, SOL_SOCKET, SO_RCVBUF, &val, &val_len) == 0);
+    TEST((val >= RCVBUF) && (val < RCVBUF * 4));
+    TEST(getsockopt(pfds[0].fd, SOL_SOCKET, SO_RCVBUF, &val, &val_len) == 0);
+    TEST(val >= RCVBUF * 2);
+
+    // flows are created for both servers, which have the same source address
+    for (i=0; i < FLOWS; ++i) {
+        struct sockaddr_in src;
+
+        memset(&src, 0, sizeof(src));
+        src.sin_family=AF_INET;
+        src.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+        src.sin_port=htons(PORT_BASE + i);
+        flows[i]=pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL,
+                IPPROTO_TCP, 3600, NULL);
+        TEST(flows[i]);
+    }
+
+    tout=pcp_process(ctx, 0);
+    for (i=0; (succeeded < FLOWS) && (i < 100); ++i) {
+        int j, events=PCP_EV_TIMER;
+
+        for (j=0; j < SERVERS; ++j) {
+            test_udp_resp_run(resp + j);
+        }
+        TEST(poll(fds, n, tout < 0 || tout > 100 ? 100 : tout) >= 0);
+        for (j=0; j < n; ++j) {
+            if (fds[j].revents & POLLIN) {
+                events|=pfds[j].events;
+            }
+        }
+        tout=pcp_process(ctx, events);
+
+        // flow succeeds when all servers answered
+        succeeded=0;
+        for (j=0; j < FLOWS; ++j) {
+            pcp_fstate_e st;
+
+            pcp_eval_flow_state(flows[j], &st);
+            succeeded+=st == pcp_state_succeeded;
+        }
+    }
+    printf("%d flows succeeded, requests per server:", succeeded);
+    for (i=0; i < SERVERS; ++i) {
+        printf(" %d", resp[i].requests);
+    }
+    printf("\n");
+    TEST(succeeded == FLOWS);
+
+    // each server was sent requests from its own socket only
+    for (i=0; i < SERVERS; ++i) {
+        TEST(resp[i].requests >= FLOWS);
+        TEST(resp[i].last_src_port == sock_port(pfds[i + 1].fd));
+        TEST(resp[i].last_src_port != sock_port(pfds[0].fd));
+    }
+
+    for (i=0; i < SERVERS; ++i) {
+        struct sockaddr_storage peer;
+        socklen_t len=sizeof(peer);
+        int ret=getpeername(pfds[i + 1].fd, (struct sockaddr *)&peer, &len);
+
+        if (connected) {
+            TEST(ret == 0);
+            TEST(sock_port(resp[i].fd) == (peer.ss_family == AF_INET6 ?
+                    ((struct sockaddr_in6 *)&peer)->sin6_port :
+                    ((struct sockaddr_in *)&peer)->sin_port));
+        } else {
+            TEST(ret != 0);
+        }
+        TEST(stray_datagram(ctx, pfds[i + 1].fd) == (connected ? 0 : 1));
+    }
+
+    // source addresses didn't change, sockets are kept
+    TEST(pcp_routes_changed(ctx) == 0);
+    TEST(pcp_get_pollfds(ctx, pfds, SERVERS + 1) == SERVERS + 1);
+    for (i=0; i < n; ++i) {
+        TEST(pfds[i].fd == fds[i].fd);
+    }
+
+    pcp_terminate(ctx, 0);
+    free(ctx);
+    for (i=0; i < SERVERS; ++i) {
+        close(resp[i].fd);
+    }
+}
+
+static void test_shared(void)
+{
+    pcp_ctx_t *ctx;
+
+    ctx=pcp_init(DISABLE_AUTODISCOVERY, NULL);
+    TEST(ctx);
+    TEST(pcp_add_server(ctx, Sock_pton("127.0.0.1:5351"), 2) == 0);
+    TEST(pcp_get_pollfds(ctx, NULL, 0) == 1);
+    TEST(pcp_set_rcvbuf(ctx, 0, RCVBUF) == PCP_ERR_NOT_FOUND);
+    TEST(pcp_set_rcvbuf(ctx, -1, RCVBUF) == PCP_ERR_SUCCESS);
+
+    pcp_terminate(ctx, 0);
+    free(ctx);
+}
+
+int main(int argc, char *argv[] UNUSED)
+{
+    pcp_log_level=argc > 1 ? PCP_LOGLVL_DEBUG : PCP_LOGLVL_NONE;
+
+    test_per_server(0);
+    test_per_server(1);
+    test_shared();
+
+    printf("Test of socket per PCP server passed.\n");
+    return 0;
+}
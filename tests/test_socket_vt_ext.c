@@ -0,0 +1,235 @@
+/*
+ *------------------------------------------------------------------
+ * test_socket_vt_ext.c
+ *
+ * Test of extended socket virtual table - requests sent by server sweep and
+ * responses drained by pcp_process go through batch functions, contexts
+ * with plain table or table without batch functions use sendto/recvfrom.
+ * Context talks to in-process responder.
+ *
+ * Copyright (c) 2014 by cisco Systems, Inc.
+ * All rights reserved.
+ *
+ *------------------------------------------------------------------
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#else
+#include "default_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pcp.h"
+#include "pcp_socket.h"
+#include "unp.h"
+#include "pcp_utils.h"
+#include "test_macro.h"
+#include "test_responder.h"
+
+#define FLOWS 100
+#define PORT_BASE 10000
+
+static test_responder_t responder;
+
+static int sendto_calls, recvfrom_calls;
+static int sendmmsg_calls, recvmmsg_calls;
+static unsigned sendmmsg_max, recvmmsg_max;
+
+static ssize_t resp_sendto(PCP_SOCKET sockfd UNUSED, const void *buf,
+        size_t len, int flags UNUSED, struct sockaddr *dest_addr UNUSED,
+        socklen_t addrlen UNUSED)
+{
+    ++sendto_calls;
+    test_resp_request(&responder, buf, len);
+    return len;
+}
+
+static ssize_t resp_recvfrom(PCP_SOCKET sockfd UNUSED, void *buf, size_t len,
+        int flags UNUSED, struct sockaddr *src_addr, socklen_t *addrlen)
+{
+    ++recvfrom_calls;
+    if (!test_resp_next(&responder, buf, &len, src_addr, addrlen, NULL)) {
+        return PCP_ERR_WOULDBLOCK;
+    }
+    return len;
+}
+
+static int resp_sendmmsg(PCP_SOCKET sockfd UNUSED, pcp_sock_msg_t *msgs,
+        unsigned cnt, int flags UNUSED)
+{
+    unsigned i;
+
+    ++sendmmsg_calls;
+    if (cnt > sendmmsg_max) {
+        sendmmsg_max=cnt;
+    }
+    for (i=0; i < cnt; ++i) {
+        TEST(msgs[i].addr && msgs[i].addrlen);
+        test_resp_request(&responder, msgs[i].buf, msgs[i].len);
+    }
+    return (int)cnt;
+}
+
+static int resp_recvmmsg(PCP_SOCKET sockfd UNUSED, pcp_sock_msg_t *msgs,
+        unsigned cnt, int flags UNUSED)
+{
+    unsigned i;
+
+    ++recvmmsg_calls;
+    for (i=0; i < cnt; ++i) {
+        if (!test_resp_next(&responder, msgs[i].buf, &msgs[i].len,
+                msgs[i].addr, &msgs[i].addrlen, NULL)) {
+            break;
+        }
+        msgs[i].controllen=0;
+        msgs[i].flags=0;
+    }
+    if (i > recvmmsg_max) {
+        recvmmsg_max=i;
+    }
+    return i ? (int)i : PCP_ERR_WOULDBLOCK;
+}
+
+static pcp_socket_vt_ext_t responder_vt={
+        {
+            test_resp_create,
+            resp_recvfrom,
+            resp_sendto,
+            test_resp_close
+        },
+        PCP_SOCKET_VT_EXT_VERSION,
+        resp_sendmmsg,
+        resp_recvmmsg
+};
+
+static pcp_socket_vt_ext_t responder_vt_nobatch={
+        {
+            test_resp_create,
+            resp_recvfrom,
+            resp_sendto,
+            test_resp_close
+        },
+        PCP_SOCKET_VT_EXT_VERSION,
+        NULL,
+        NULL
+};
+
+static int succeeded;
+
+static void notify_cb(pcp_flow_t *f UNUSED, struct sockaddr *src_addr UNUSED,
+        struct sockaddr *ext_addr UNUSED, pcp_fstate_e s, void *cb_arg UNUSED)
+{
+    if (s == pcp_state_succeeded) {
+        ++succeeded;
+    }
+}
+
+static void run(pcp_socket_vt_ext_t *vt, uint32_t flags)
+{
+    pcp_ctx_t *ctx;
+    int i;
+
+    test_resp_init(&responder);
+    responder.announce=1;
+    succeeded=0;
+    sendto_calls=recvfrom_calls=sendmmsg_calls=recvmmsg_calls=0;
+    sendmmsg_max=recvmmsg_max=0;
+
+    ctx=pcp_init(DISABLE_AUTODISCOVERY | flags, &vt->base);
+    TEST(ctx);
+    pcp_set_flow_change_cb(ctx, notify_cb, NULL);
+    TEST(pcp_add_server(ctx, Sock_pton("127.0.0.1:5351"), 2) == 0);
+
+    // flows wait for server, which is pinged first
+    for (i=0; i < FLOWS; ++i) {
+        struct sockaddr_in src;
+
+        memset(&src, 0, sizeof(src));
+        src.sin_family=AF_INET;
+        src.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+        src.sin_port=htons(PORT_BASE + i);
+        TEST(pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL,
+                IPPROTO_TCP, 3600, NULL));
+    }
+
+    for (i=0; (succeeded < FLOWS) && (i < 100); ++i) {
+        pcp_process(ctx, PCP_EV_READ | PCP_EV_TIMER);
+    }
+    TEST(succeeded == FLOWS);
+    TEST(responder.dropped == 0);
+
+    pcp_terminate(ctx, 0);
+    free(ctx);
+}
+
+/* response of server probe is read by closing pulse of pcp_terminate, which
+ * drops the probe while flows are closed */
+static void test_terminate(void)
+{
+    pcp_ctx_t *ctx;
+    int i;
+
+    test_resp_init(&responder);
+    responder.announce=1;
+    ctx=pcp_init(DISABLE_AUTODISCOVERY | PCP_INIT_SOCKET_VT_EXT,
+            &responder_vt.base);
+    TEST(ctx);
+    TEST(pcp_add_server(ctx, Sock_pton("127.0.0.1:5351"), 2) == 0);
+    pcp_process(ctx, PCP_EV_TIMER);
+    TEST(responder.tail - responder.head == 1);
+
+    for (i=0; i < FLOWS; ++i) {
+        struct sockaddr_in src;
+
+        memset(&src, 0, sizeof(src));
+        src.sin_family=AF_INET;
+        src.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+        src.sin_port=htons(PORT_BASE + i);
+        TEST(pcp_new_flow(ctx, (struct sockaddr *)&src, NULL, NULL,
+                IPPROTO_TCP, 3600, NULL));
+    }
+    pcp_terminate(ctx, 1);
+    // flows closed before server answered aren't requested by its answer
+    TEST(responder.head == 1);
+    free(ctx);
+}
+
+int main(int argc, char *argv[] UNUSED)
+{
+    pcp_log_level=argc > 1 ? PCP_LOGLVL_DEBUG : PCP_LOGLVL_NONE;
+
+    // ping and all requests of the sweep through batch functions
+    run(&responder_vt, PCP_INIT_SOCKET_VT_EXT);
+    printf("extended table: %d sendmmsg calls (max %u msgs), "
+            "%d recvmmsg calls (max %u msgs)\n", sendmmsg_calls, sendmmsg_max,
+            recvmmsg_calls, recvmmsg_max);
+    TEST((sendto_calls == 0) && (recvfrom_calls == 0));
+    TEST(sendmmsg_max > 1);
+    TEST(recvmmsg_max > 1);
+    TEST(sendmmsg_calls < FLOWS);
+
+    // without the flag table is used as plain one; first flow is the ping
+    run(&responder_vt, 0);
+    TEST((sendmmsg_calls == 0) && (recvmmsg_calls == 0));
+    TEST(sendto_calls == FLOWS);
+
+    // missing batch functions are emulated
+    run(&responder_vt_nobatch, PCP_INIT_SOCKET_VT_EXT);
+    TEST(sendto_calls == FLOWS);
+    TEST(recvfrom_calls > FLOWS);
+
+    test_terminate();
+
+    printf("Test of extended socket virtual table passed.\n");
+    return 0;
+}